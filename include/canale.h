@@ -33,7 +33,53 @@ typedef enum CAlogLevel
 /// An handler for CANale log messages.
 typedef void(*CAlogHandler)(CAlogLevel level, const char *message);
 
+/// A stage of the CANnuccia protocol, i.e. a command sent to a device that
+/// CANale waits for the device to respond to.
+typedef enum CAstage
+{
+    CA_STAGE_PROG_REQ,      ///< PROG_REQ -> PROG_REQ_RESP
+    CA_STAGE_UNLOCK,        ///< UNLOCK -> UNLOCKED
+    CA_STAGE_SELECT_PAGE,   ///< SELECT_PAGE -> PAGE_SELECTED
+    CA_STAGE_CHECK_WRITES,  ///< WRITE... + CHECK_WRITES -> WRITES_CHECKED
+    CA_STAGE_COMMIT_WRITES, ///< COMMIT_WRITES -> WRITES_COMMITTED
+    CA_STAGE_PROG_DONE,     ///< PROG_DONE -> PROG_DONE_ACK
+
+    CA_NUM_STAGES
+
+} CAstage;
+
+/// The errors that can make a CANale operation fail.
+/// Progress handlers are passed `progress=-error` when an error occurs.
+typedef enum CAerror
+{
+    CA_ERR_GENERIC = 1,             ///< Invalid arguments, invalid ELF, etc.
+    CA_ERR_ELF_MACHINE = 2,         ///< The ELF is for a different machine than the device.
+    CA_ERR_TIMEOUT = 3,             ///< A device did not respond in time; the error is
+                                    ///< `CA_ERR_TIMEOUT + stage`, where `stage` is
+                                    ///< the `CAstage` that timed out.
+    CA_ERR_PAGE_RETRIES = CA_ERR_TIMEOUT + CA_NUM_STAGES, ///< A page failed to flash too many times in a row.
+    CA_ERR_DEVICE_RETRIES,          ///< Too many pages failed to flash on a device.
+    CA_ERR_CANCELLED,               ///< The operation was cancelled.
+
+} CAerror;
+
+/// The format of an image to flash (see `caFlashImage()`).
+typedef enum CAimageFormat
+{
+    CA_IMAGE_AUTO,  ///< Guess it from the contents (and the extension of the file, if any;
+                    ///< `.bin` files are raw binaries).
+    CA_IMAGE_ELF,   ///< An ELF file; its loadable segments are flashed at their physical address.
+    CA_IMAGE_IHEX,  ///< An Intel HEX file.
+    CA_IMAGE_SREC,  ///< A Motorola S-record file (S19, S28 or S37).
+    CA_IMAGE_BIN,   ///< A raw binary, flashed at a given base address.
+
+} CAimageFormat;
+
 /// Configuration flags for creating a CANale instance.
+///
+/// Always zero-initialize it (ex. `CAconfig config = {0};` in C, or
+/// `CAconfig config = {};` in C++) before setting the fields you need: new
+/// fields are added over time, and for all of them zero means "default".
 typedef struct CA_API CAconfig
 {
     /// The CAN backend to use to connect to the CANnuccia network.
@@ -48,9 +94,107 @@ typedef struct CA_API CAconfig
     /// Set to null to disable logging.
     CAlogHandler logHandler;
 
+    /// The maximum number of devices that enqueued operations may be acting on
+    /// at the same time. Operations on different devices run concurrently, while
+    /// operations on the same device always run in the order they are enqueued in.
+    /// Set to 0 for no limit, or to 1 to run all operations one after the other.
+    unsigned maxConcurrentDevices;
+
+    /// The directory where to store a manifest of what was flashed to each device.
+    /// If set, flashing an ELF only sends the pages that are not already on the
+    /// device according to its manifest (if any), then updates the manifest.
+    /// Set to null to disable manifests.
+    const char *manifestDir;
+
+    /// The bitrate of the CAN bus, in bits/s (ex. 500000).
+    /// Only used to enforce `maxBusLoad` and to report bus time; set to 0 if unknown.
+    unsigned long canBitrate;
+
+    /// The maximum percentage (1 to 100) of the bus bandwidth CANale may use,
+    /// so that other nodes on the bus can still communicate while flashing.
+    /// Set to 0 for no limit; ignored if `canBitrate` is 0.
+    unsigned maxBusLoad;
+
+    /// Set to non-zero to use CAN FD. WRITE commands to devices that advertise
+    /// CAN FD support are then sent as FD frames with up to 64 bytes of payload
+    /// and bitrate switching; other devices keep using classic CAN frames.
+    int canFd;
+
+    /// The bitrate of the data phase of CAN FD frames, in bits/s (ex. 2000000).
+    /// Set to 0 to leave the CAN interface's default.
+    unsigned long canDataBitrate;
+
+    /// How long to wait for a device to respond in each `CAstage`, in milliseconds.
+    /// Set an entry to 0 to use the default for that stage.
+    unsigned stageTimeoutsMs[CA_NUM_STAGES];
+
+    /// How many times a stage's command is re-sent to a device that does not
+    /// respond in time (waiting twice as long each time) before failing with
+    /// `CA_ERR_TIMEOUT + stage`. Set to 0 to use the default.
+    unsigned maxStageRetries;
+
+    /// How many times in a row a page is re-flashed after a CRC mismatch
+    /// before failing with `CA_ERR_PAGE_RETRIES`. Set to 0 to use the default.
+    unsigned maxPageRetries;
+
+    /// How many page re-flashes are allowed in total when flashing a device
+    /// before failing with `CA_ERR_DEVICE_RETRIES`. Set to 0 to use the default.
+    unsigned maxDeviceRetries;
+
+    /// Set to non-zero to drive the instance from an external event loop (ex.
+    /// epoll or libuv) instead of a Qt one: poll the file descriptor returned by
+    /// `caGetFd()` and call `caProcessEvents()` when it is readable.
+    /// Only supported on Linux, in threads without a Qt event loop (i.e. with
+    /// no `QCoreApplication`); `caInit()` fails otherwise.
+    int externalEventLoop;
+
+    /// Set to non-zero to run the CAN link and the protocol with the devices on
+    /// a dedicated I/O thread, so that slow progress/log handlers (or anything
+    /// else the calling thread is busy with) do not delay communication.
+    /// Progress, log and scan handlers are still only called from the thread
+    /// that created the instance, from its event loop; if the application falls
+    /// too far behind, intermediate progress updates and debug messages are
+    /// dropped (see `caNumDroppedEvents()`).
+    int ioThread;
+
+    /// Messages below this level are discarded before they are even formatted.
+    /// Defaults to `CA_DEBUG` (log everything); see also `caSetLogLevel()`.
+    /// Note that debug messages are compiled out of release builds of CANale.
+    CAlogLevel logLevel;
+
+    /// Set to non-zero to call `logHandler` from a background thread, so that a
+    /// slow handler (ex. one writing to a file or a terminal) never delays
+    /// CANale. Messages are then truncated to 247 bytes, and dropped if the
+    /// handler falls too far behind.
+    int asyncLog;
+
+    /// The maximum total size, in bytes, of the flash maps (pages to flash and
+    /// their CRCs) the instance keeps in memory so that flashing the same ELF
+    /// again skips all host-side preparation. Least recently used maps are
+    /// evicted first. Set to 0 to use the default (16 MiB).
+    unsigned long imageCacheSize;
+
+    /// The value (0x00 to 0xFF) that the parts of flash pages not covered by
+    /// the image are filled with, usually the erased value of the devices'
+    /// flash, OR'ed with `CA_PAGE_FILL_SET`. Set to 0 to use the default (0xFF).
+    unsigned pageFill;
+
+    /// Set to non-zero to always send pages raw. Otherwise, pages are sent to
+    /// devices that advertise support for it as compressed (LZ4) WRITE streams
+    /// whenever that takes less bus time.
+    int noCompression;
+
+    /// Set to non-zero to collect per-stage latencies and protocol counters
+    /// (see `caGetMetrics()`). Collecting them costs nothing when this is 0.
+    int metrics;
+
 } CAconfig;
 
-/// Creates a new instance of CANale given its configuration parameters.
+/// Marks `CAconfig::pageFill` as set (ex. `CA_PAGE_FILL_SET | 0x00`).
+#define CA_PAGE_FILL_SET 0x100u
+
+/// Creates a new instance of CANale given its configuration parameters
+/// (which must have been zero-initialized; see `CAconfig`).
 /// Returns null on error; if `config->logHandler` is set, it is invoked
 /// with a description of the error.
 CA_API CAinst *caInit(const CAconfig *config);
@@ -66,7 +210,7 @@ typedef uint8_t CAdevId;
 /// An handler for CANale progress events.
 /// `progress` is usually 0 to 100. Unless an error occurs, the handler is
 /// guaranteed to be called with `progress=100` when the operation completes;
-/// a negative progress value is passed whenever an error occurs.
+/// a negative progress value (`-CAerror`) is passed whenever an error occurs.
 typedef void(*CAprogressHandler)(const char *message, int progress, void *userData);
 
 /// Sends PROG_START commands to all devices in `devIds`, followed by UNLOCKs as
@@ -89,10 +233,258 @@ CA_API void caFlashELF(CAinst *ca, CAdevId devId,
                        unsigned long elfLen, const char elf[elfLen],
                        CAprogressHandler onProgress, void *onProgressUserData);
 
+/// Flashes an ELF file (whose contents are in `elf`) to all devices in `devIds`.
+/// The ELF is copied and parsed only once, and its flash pages are shared by all
+/// devices with the same page size; this is much cheaper than calling
+/// `caFlashELF()` for each device.
+/// Calls the log handler and given progress handler (if any) as appropriate;
+/// the progress handler is called separately for each device.
+/// If `nDevIds` is 0, nothing is flashed and the progress handler is called
+/// once, before this function returns, with a progress of 100.
+///
+/// Sends a PROG_START to the devices, but not a PROG_DONE!
+CA_API void caFlashELFMulti(CAinst *ca, unsigned long nDevIds, const CAdevId devIds[nDevIds],
+                            unsigned long elfLen, const char elf[elfLen],
+                            CAprogressHandler onProgress, void *onProgressUserData);
+
+/// Like `caFlashELFMulti()`, but reads the ELF file at `elfPath` by
+/// memory-mapping it, so that its contents are never copied. The file must not
+/// be modified or truncated until all devices are done flashing.
+CA_API void caFlashELFFile(CAinst *ca, unsigned long nDevIds, const CAdevId devIds[nDevIds],
+                           const char *elfPath,
+                           CAprogressHandler onProgress, void *onProgressUserData);
+
+/// A handler called when CANale is done with a buffer it borrowed.
+typedef void(*CAreleaseHandler)(const char *data, void *userData);
+
+/// Like `caFlashELFMulti()`, but borrows `elf` instead of copying it.
+///
+/// The buffer must stay valid and unchanged until CANale calls
+/// `onRelease(elf, onReleaseUserData)`, which it does exactly once: when all
+/// operations enqueued by this call are over (successfully or not) or were
+/// destroyed by `caHalt()`, or right away on invalid arguments. `onRelease` may
+/// be called from the thread that runs operations (see `CAconfig::ioThread`).
+CA_API void caFlashELFBorrowed(CAinst *ca, unsigned long nDevIds, const CAdevId devIds[nDevIds],
+                               unsigned long elfLen, const char elf[elfLen],
+                               CAreleaseHandler onRelease, void *onReleaseUserData,
+                               CAprogressHandler onProgress, void *onProgressUserData);
+
+/// Like `caFlashELFMulti()`, but for an image in any of the supported formats.
+/// Intel HEX and S-record files are parsed straight into flash pages, without
+/// converting them to a full binary image first. Raw binaries are flashed at
+/// `baseAddr` (which should be page-aligned); it is ignored for other formats.
+/// The ELF machine check is only done for ELF images.
+CA_API void caFlashImage(CAinst *ca, unsigned long nDevIds, const CAdevId devIds[nDevIds],
+                         CAimageFormat format, unsigned long baseAddr,
+                         unsigned long imageLen, const char image[imageLen],
+                         CAprogressHandler onProgress, void *onProgressUserData);
+
+/// Like `caFlashImage()`, but memory-maps the image file at `imagePath` like
+/// `caFlashELFFile()` does.
+CA_API void caFlashImageFile(CAinst *ca, unsigned long nDevIds, const CAdevId devIds[nDevIds],
+                             const char *imagePath, CAimageFormat format, unsigned long baseAddr,
+                             CAprogressHandler onProgress, void *onProgressUserData);
+
+
+/// Flashes an ELF file (whose contents are in `elf`) to the device board with
+/// id `devId`, knowing that another ELF file (whose contents are in `baseElf`)
+/// is already flashed to it: only pages that differ from `baseElf`'s are sent.
+/// Calls the log handler and given progress handler (if any) as appropriate.
+///
+/// Sends a PROG_START to the device, but not a PROG_DONE!
+CA_API void caFlashELFDelta(CAinst *ca, CAdevId devId,
+                            unsigned long elfLen, const char elf[elfLen],
+                            unsigned long baseElfLen, const char baseElf[baseElfLen],
+                            CAprogressHandler onProgress, void *onProgressUserData);
+
+
+/// Information about a device that responded to a scan (see `caScan()`).
+typedef struct CA_API CAscanResult
+{
+    /// The id of the device.
+    CAdevId devId;
+
+    /// The size of a flash page of the device, in bytes.
+    unsigned long pageSize;
+
+    /// The number of flash pages of the device.
+    unsigned nFlashPages;
+
+    /// The ELF machine type (`e_machine`) of the device.
+    unsigned elfMachine;
+
+    /// The time between the PROG_REQ being sent to the device and its response
+    /// being received, in nanoseconds.
+    long long latencyNs;
+
+} CAscanResult;
+
+/// An handler for devices found by a scan.
+typedef void(*CAscanHandler)(const CAscanResult *result, void *userData);
+
+/// Sends a PROG_REQ to every possible device id at once (paced like any other
+/// command) and collects the responses that arrive within `windowMs`
+/// milliseconds of each PROG_REQ being sent (0 = default, 100ms).
+/// Devices that respond are not unlocked.
+/// Calls `onDevice` (if any) for every device that responded, then the progress
+/// handler (if any) with `progress=100` and a summary including the scan's
+/// wall time.
+///
+/// The scan acts on all devices: it waits for all operations enqueued before
+/// it to complete, and all operations enqueued after it wait for it.
+CA_API void caScan(CAinst *ca, unsigned windowMs,
+                   CAscanHandler onDevice, void *onDeviceUserData,
+                   CAprogressHandler onProgress, void *onProgressUserData);
+
+
+/// Returns a file descriptor that becomes readable when there are events for
+/// `caProcessEvents()` to process, or -1 if the instance was not created with
+/// `CAconfig::externalEventLoop`.
+/// The same descriptor is shared by all instances created in the same thread.
+/// Do not read from or write to it; only poll it (ex. via epoll) for input.
+CA_API int caGetFd(CAinst *ca);
+
+/// Processes pending events of all instances in the current thread, waiting
+/// up to `timeoutMs` milliseconds for some if there are none (0 = don't wait,
+/// -1 = wait indefinitely).
+/// With `CAconfig::externalEventLoop`, CANale does nothing in the background
+/// (unless `CAconfig::ioThread` is also set): operations only make progress,
+/// and their progress/log handlers are only called, from within this function.
+/// Returns a positive value if any event was processed, 0 if none was or -1
+/// on error.
+CA_API int caProcessEvents(CAinst *ca, int timeoutMs);
+
 
 /// Returns the number of operations still enqueued into a CANale instance.
 CA_API unsigned caNumEnqueued(CAinst *ca);
 
+/// Sets the minimum level of the messages passed to the log handler of a
+/// CANale instance (see `CAconfig::logLevel`).
+CA_API void caSetLogLevel(CAinst *ca, CAlogLevel level);
+
+/// Returns how many progress updates and log messages were dropped so far
+/// because the application was not keeping up with a `CAconfig::ioThread`
+/// instance. Final progress updates (100% or errors) are never dropped.
+CA_API unsigned long long caNumDroppedEvents(CAinst *ca);
+
+/// Sets the maximum number of devices that enqueued operations may be acting on
+/// at the same time (see `CAconfig::maxConcurrentDevices`).
+CA_API void caSetMaxConcurrentDevices(CAinst *ca, unsigned maxConcurrentDevices);
+
+
+/// Cancels all operations enqueued into a CANale instance, both ongoing and not
+/// started yet. Their progress handlers are called with `-CA_ERR_CANCELLED`.
+CA_API void caCancel(CAinst *ca);
+
+/// Cancels all operations enqueued into a CANale instance that act on the
+/// device with id `devId`, both ongoing and not started yet.
+/// Their progress handlers are called with `-CA_ERR_CANCELLED`.
+CA_API void caCancelDevice(CAinst *ca, CAdevId devId);
+
+
+/// Statistics about the frames CANale queued to be sent to a device.
+typedef struct CA_API CAtxStats
+{
+    /// The number of frames currently queued to be sent to the device.
+    unsigned long queueDepth;
+
+    /// The total number of frames sent to the device.
+    unsigned long long framesSent;
+
+    /// The total time no frames were queued for the device, in nanoseconds.
+    long long idleNs;
+
+} CAtxStats;
+
+/// Gets statistics about the frames queued to be sent to the device with id `devId`.
+/// Returns 0 on success or -1 on error (invalid arguments).
+CA_API int caGetTxStats(CAinst *ca, CAdevId devId, CAtxStats *outStats);
+
+
+/// Statistics about the cache of flash maps of a CANale instance
+/// (see `CAconfig::imageCacheSize`).
+typedef struct CA_API CAimageCacheStats
+{
+    /// The number of times a flash map was found in the cache.
+    unsigned long long hits;
+
+    /// The number of times a flash map had to be built.
+    unsigned long long misses;
+
+    /// The number of flash maps currently in the cache.
+    unsigned long nEntries;
+
+    /// The (approximate) memory used by the flash maps in the cache, in bytes.
+    unsigned long bytes;
+
+} CAimageCacheStats;
+
+/// Gets statistics about the cache of flash maps of a CANale instance.
+/// Returns 0 on success or -1 on error (invalid arguments).
+CA_API int caGetImageCacheStats(CAinst *ca, CAimageCacheStats *outStats);
+
+
+/// Statistics about how long devices took to respond in a `CAstage` (see `CAmetrics`).
+/// Percentiles are accurate to within ~6%.
+typedef struct CA_API CAlatencyStats
+{
+    /// The number of latencies recorded.
+    unsigned long long count;
+
+    /// The min., mean and max. latency, in nanoseconds.
+    long long minNs, meanNs, maxNs;
+
+    /// The 50th, 90th, 99th and 99.9th percentiles of the latencies, in nanoseconds.
+    long long p50Ns, p90Ns, p99Ns, p999Ns;
+
+} CAlatencyStats;
+
+/// Latencies and counters of the CANnuccia protocol, for a single device or
+/// for all of them (see `CAconfig::metrics`).
+typedef struct CA_API CAmetrics
+{
+    /// For each `CAstage`, the time from its command being handed to the CAN
+    /// interface to the response being received (as timestamped by the CAN
+    /// interface, if it does that): bus time plus the device's processing time.
+    /// For `CA_STAGE_CHECK_WRITES`, it is counted from the last WRITE.
+    CAlatencyStats stages[CA_NUM_STAGES];
+
+    /// The time from responses being received by the CAN interface to them
+    /// being handled by CANale, i.e. how far behind the host is. Only recorded
+    /// if the CAN interface timestamps received frames.
+    CAlatencyStats rxHostDelay;
+
+    /// Frames sent to devices.
+    unsigned long long framesSent;
+
+    /// Frames received from devices.
+    unsigned long long framesReceived;
+
+    /// Commands re-sent because the device did not respond in time.
+    unsigned long long stageRetries;
+
+    /// Commands given up on after all retries.
+    unsigned long long stageTimeouts;
+
+    /// Pages whose CRC did not match after being written.
+    unsigned long long crcMismatches;
+
+} CAmetrics;
+
+/// Starts (from scratch, if `enabled` is non-zero) or stops collecting metrics;
+/// see `CAconfig::metrics`.
+CA_API void caSetMetricsEnabled(CAinst *ca, int enabled);
+
+/// Gets the metrics collected for all devices together (all zero if not
+/// collecting them).
+/// Returns 0 on success or -1 on error (invalid arguments).
+CA_API int caGetMetrics(CAinst *ca, CAmetrics *outMetrics);
+
+/// Gets the metrics collected for the device with id `devId` (all zero if not
+/// collecting them).
+/// Returns 0 on success or -1 on error (invalid arguments).
+CA_API int caGetDeviceMetrics(CAinst *ca, CAdevId devId, CAmetrics *outMetrics);
+
 
 #ifndef __cplusplus
 }
@@ -0,0 +1,130 @@
+// CANale/src/bench/alloc_bench.cc - Counts the heap allocations done while flashing pages
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// Flashes pages to an emulated CANnuccia device via `ca::Comms` and counts the
+// heap allocations done in the process. Flashing should not allocate in steady
+// state, i.e. flashing N pages should take the same number of allocations
+// whatever N is; exits with a nonzero status if it does not.
+//
+// Both with a CAN link that reports frames as written later on and with one
+// that does so from within `writeFrame()` (like Qt's SocketCAN backend); with
+// either, all frames handed to the link must be accounted as written when done.
+// Then with one that never reports frames as written (as if it lost them), with
+// which flashing must still go through, albeit slowly.
+#include <cstdio>
+#include <QCoreApplication>
+#include "alloc_counter.hh"
+#include "sim_flasher.hh"
+
+namespace
+{
+
+using ca::bench::Flasher;
+
+/// Flashes `n` pages, returns the number of allocations done in the process
+/// (or -1 on failure).
+long countFlashAllocs(Flasher &flasher, unsigned long n)
+{
+    ca::bench::startCountingAllocs();
+    bool ok = flasher.flash(n);
+    unsigned long nAllocs = ca::bench::stopCountingAllocs();
+    return ok ? long(nAllocs) : -1;
+}
+
+/// Flashes pages with a `Flasher` (see `Flasher::Flasher()` for `writtenReports`),
+/// checking that flashing does not allocate in steady state and that the TX
+/// window drains. Returns false on failure.
+bool checkFlashing(ca::SimWrittenReports writtenReports)
+{
+    std::printf("Frames reported as written %s:\n",
+                writtenReports == ca::SimWrittenReports::InWriteFrame ? "from within writeFrame()" : "later on");
+
+    Flasher flasher(writtenReports);
+    if(!flasher.start())
+    {
+        std::fprintf(stderr, "Failed to start programming the emulated device\n");
+        return false;
+    }
+
+    // Warm up: let all per-device buffers reach their steady-state size
+    if(countFlashAllocs(flasher, 2 * flasher.pages.size()) < 0)
+    {
+        std::fprintf(stderr, "Flashing failed while warming up\n");
+        return false;
+    }
+
+    const unsigned long nPagesRuns[] = {16, 256};
+    long nAllocsRuns[2];
+    for(int i = 0; i < 2; i ++)
+    {
+        nAllocsRuns[i] = countFlashAllocs(flasher, nPagesRuns[i]);
+        if(nAllocsRuns[i] < 0)
+        {
+            std::fprintf(stderr, "Flashing %lu pages failed\n", nPagesRuns[i]);
+            return false;
+        }
+        std::printf("%4lu pages: %6ld allocations (%.2f per page)\n",
+                    nPagesRuns[i], nAllocsRuns[i], double(nAllocsRuns[i]) / nPagesRuns[i]);
+    }
+
+    if(nAllocsRuns[1] > nAllocsRuns[0])
+    {
+        std::fprintf(stderr, "FAIL: allocations grow with the number of pages flashed\n");
+        return false;
+    }
+    if(flasher.comms.txInFlight() != 0)
+    {
+        std::fprintf(stderr, "FAIL: %zu frames still in flight after all were written\n",
+                     flasher.comms.txInFlight());
+        return false;
+    }
+    return true;
+}
+
+/// Flashes pages with a link that never reports frames as written, checking
+/// that `ca::Comms` does not stall once its TX window is full.
+/// (Allocations are not counted: waiting for `ca::Comms` to resync runs the
+/// event loop.) Returns false on failure.
+bool checkFlashingLostWrites()
+{
+    std::printf("Frames never reported as written:\n");
+
+    Flasher flasher(ca::SimWrittenReports::Never);
+    if(!flasher.start())
+    {
+        std::fprintf(stderr, "Failed to start programming the emulated device\n");
+        return false;
+    }
+
+    const unsigned long nPages = flasher.pages.size();
+    if(!flasher.flash(nPages))
+    {
+        std::fprintf(stderr, "FAIL: flashing stalled after frames were lost (%lu of %lu pages flashed)\n",
+                     flasher.nFlashed, nPages);
+        return false;
+    }
+    std::printf("%4lu pages flashed\n", nPages);
+    return true;
+}
+
+}
+
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    if(!checkFlashing(ca::SimWrittenReports::OnBus)
+       || !checkFlashing(ca::SimWrittenReports::InWriteFrame)
+       || !checkFlashingLostWrites())
+    {
+        return 1;
+    }
+    std::printf("OK: flashing does not allocate in steady state\n");
+    return 0;
+}
@@ -0,0 +1,114 @@
+// CANale/src/bench/alloc_counter.hh - Counts heap allocations in benchmarks
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// Replaces the malloc family (or, where that is not possible, `operator new`)
+// to count allocations: include it in exactly one translation unit of a
+// benchmark executable.
+#ifndef ALLOC_COUNTER_HH
+#define ALLOC_COUNTER_HH
+
+#include <cstdlib>
+#include <atomic>
+#include <new>
+
+namespace ca
+{
+namespace bench
+{
+
+static std::atomic<unsigned long> g_nAllocs{0};
+static std::atomic<bool> g_countingAllocs{false};
+
+inline void countAlloc()
+{
+    if(g_countingAllocs.load(std::memory_order_relaxed))
+    {
+        g_nAllocs.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+/// Starts counting allocations (from 0).
+inline void startCountingAllocs()
+{
+    g_nAllocs = 0;
+    g_countingAllocs = true;
+}
+
+/// Stops counting allocations; returns how many were done since
+/// `startCountingAllocs()`.
+inline unsigned long stopCountingAllocs()
+{
+    g_countingAllocs = false;
+    return g_nAllocs.load();
+}
+
+}
+}
+
+#ifdef __GLIBC__
+
+// Interpose the malloc family, so that allocations done by Qt (ex. for the
+// buffers of `QByteArray`s, which are `malloc()`ed) are counted too.
+// (`operator new` allocates via `malloc()`, so it is counted as well)
+extern "C"
+{
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+    ca::bench::countAlloc();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    ca::bench::countAlloc();
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    ca::bench::countAlloc();
+    return __libc_realloc(ptr, size);
+}
+}
+
+#else
+
+// (Can only count `operator new`s here)
+void *operator new(size_t size)
+{
+    ca::bench::countAlloc();
+    void *ptr = std::malloc(size > 0 ? size : 1);
+    if(!ptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+#endif
+
+#endif // ALLOC_COUNTER_HH
@@ -0,0 +1,109 @@
+// CANale/src/bench/crc_bench.cc - Microbenchmark of the CRC16/XMODEM implementations
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include <cstdio>
+#include <cstdint>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "crc.hh"
+
+namespace
+{
+
+using Crc16Fn = uint16_t (*)(unsigned long, const uint8_t *, uint16_t);
+
+/// Wraps `ca::crc16Bitwise()` (which is inline) so it can be passed around.
+uint16_t crc16BitwiseFn(unsigned long len, const uint8_t data[], uint16_t crc)
+{
+    return ca::crc16Bitwise(len, data, crc);
+}
+
+struct Impl
+{
+    const char *name;
+    Crc16Fn fn;
+};
+
+/// Runs `fn` on `len` bytes of `data` for at least ~200ms; returns the
+/// throughput in MiB/s. `outCrc` is set to the computed CRC.
+double measure(Crc16Fn fn, const uint8_t *data, unsigned long len, uint16_t &outCrc)
+{
+    using Clock = std::chrono::steady_clock;
+
+    uint16_t crc = 0;
+    unsigned long nRuns = 0;
+    unsigned long batch = 1;
+    auto start = Clock::now();
+    std::chrono::duration<double> elapsed{0};
+    while(elapsed.count() < 0.2)
+    {
+        for(unsigned long i = 0; i < batch; i ++)
+        {
+            crc ^= fn(len, data, 0);
+        }
+        nRuns += batch;
+        batch *= 2;
+        elapsed = Clock::now() - start;
+    }
+    outCrc = fn(len, data, 0);
+
+    // (Keep the compiler from optimizing the runs away)
+    volatile uint16_t sink = crc;
+    (void)sink;
+
+    return double(len) * double(nRuns) / elapsed.count() / (1024.0 * 1024.0);
+}
+
+}
+
+int main()
+{
+    const Impl impls[] = {
+        {"bitwise", &crc16BitwiseFn},
+        {"slice-by-8", &ca::crc16SliceBy8},
+        {"clmul", &ca::crc16Clmul},
+        {"crc16 (dispatch)", &ca::crc16},
+    };
+    const unsigned long sizes[] = {64, 256, 1024, 2048, 64 * 1024, 16 * 1024 * 1024};
+
+    std::vector<uint8_t> data(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+    std::mt19937 rng(1234);
+    for(uint8_t &byte : data)
+    {
+        byte = static_cast<uint8_t>(rng());
+    }
+
+    std::printf("carry-less multiplication %s\n",
+                ca::crc16ClmulSupported() ? "supported" : "NOT supported (clmul = slice-by-8)");
+    std::printf("%-18s %10s %12s %8s\n", "impl", "bytes", "MiB/s", "vs bitwise");
+
+    int nMismatches = 0;
+    for(unsigned long size : sizes)
+    {
+        double bitwiseMiBs = 0.0;
+        uint16_t bitwiseCrc = 0;
+        for(const Impl &impl : impls)
+        {
+            uint16_t crc;
+            double mibs = measure(impl.fn, data.data(), size, crc);
+            if(impl.fn == &crc16BitwiseFn)
+            {
+                bitwiseMiBs = mibs;
+                bitwiseCrc = crc;
+            }
+            else if(crc != bitwiseCrc)
+            {
+                std::printf("!! %s: CRC mismatch (0x%04X, expected 0x%04X)\n", impl.name, crc, bitwiseCrc);
+                nMismatches ++;
+            }
+            std::printf("%-18s %10lu %12.1f %7.1fx\n", impl.name, size, mibs, mibs / bitwiseMiBs);
+        }
+    }
+
+    return nMismatches == 0 ? 0 : 1;
+}
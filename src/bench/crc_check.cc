@@ -0,0 +1,89 @@
+// CANale/src/bench/crc_check.cc - Checks the CRC16/XMODEM implementations against each other
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// Compares the CRCs computed by the fast implementations to the ones computed
+// by `ca::crc16Bitwise()`, for all lengths up to a bit more than the blocks they
+// fold at a time (so that every tail length is covered), with several seeds and
+// (mis)alignments of the data. Exits with a nonzero status on any mismatch.
+#include <cstdio>
+#include <cstdint>
+#include <random>
+#include <vector>
+#include "crc.hh"
+
+namespace
+{
+
+using Crc16Fn = uint16_t (*)(unsigned long, const uint8_t *, uint16_t);
+
+struct Impl
+{
+    const char *name;
+    Crc16Fn fn;
+};
+
+/// Max. data length checked (inclusive).
+constexpr unsigned long MAX_LEN = 1100;
+
+/// Max. offset of the data from an 8-byte-aligned address checked (inclusive).
+constexpr unsigned long MAX_MISALIGN = 7;
+
+}
+
+int main()
+{
+    const Impl impls[] = {
+        {"slice-by-8", &ca::crc16SliceBy8},
+        {"clmul", &ca::crc16Clmul},
+        {"crc16 (dispatch)", &ca::crc16},
+    };
+    // (Zero is XMODEM's initial value; nonzero ones are what is passed in when
+    // computing a CRC piece by piece)
+    const uint16_t seeds[] = {0x0000, 0xFFFF, 0x1D0F, 0x8408, 0x1234};
+
+    // (`std::vector` storage is at least 8-byte aligned)
+    std::vector<uint8_t> data(MAX_LEN + MAX_MISALIGN);
+    std::mt19937 rng(1234);
+    for(uint8_t &byte : data)
+    {
+        byte = static_cast<uint8_t>(rng());
+    }
+
+    std::printf("clmul: %s\n", ca::crc16ClmulSupported() ? "supported" : "unsupported, falls back to slice-by-8");
+
+    unsigned long nChecked = 0, nMismatches = 0;
+    for(unsigned long misalign = 0; misalign <= MAX_MISALIGN; misalign ++)
+    {
+        const uint8_t *begin = data.data() + misalign;
+        for(unsigned long len = 0; len <= MAX_LEN; len ++)
+        {
+            for(uint16_t seed : seeds)
+            {
+                uint16_t expected = ca::crc16Bitwise(len, begin, seed);
+                for(const Impl &impl : impls)
+                {
+                    uint16_t crc = impl.fn(len, begin, seed);
+                    nChecked ++;
+                    if(crc != expected && nMismatches ++ < 20)
+                    {
+                        std::fprintf(stderr, "FAIL: %s: length %lu at +%lu, seed 0x%04X: 0x%04X, expected 0x%04X\n",
+                                     impl.name, len, misalign, seed, crc, expected);
+                    }
+                }
+            }
+        }
+    }
+
+    if(nMismatches > 0)
+    {
+        std::fprintf(stderr, "FAIL: %lu of %lu CRCs mismatched\n", nMismatches, nChecked);
+        return 1;
+    }
+    std::printf("OK: %lu CRCs match the bitwise implementation\n", nChecked);
+    return 0;
+}
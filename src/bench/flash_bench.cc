@@ -0,0 +1,580 @@
+// CANale/src/bench/flash_bench.cc - Measures end-to-end flashing throughput on a simulated bus
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// Flashes raw images to devices emulated by a `ca::SimCanBus`, via `CAinst` and
+// `ca::FlashElfOp` like an application would, for a matrix of image sizes, page
+// sizes, bitrates (classic CAN and CAN FD), device counts and frame loss rates
+// (which make commands time out and pages be re-flashed). By default, each
+// parameter is varied on its own around a baseline case; pass `--full` to run
+// all of their combinations instead.
+//
+// For each case, reports:
+// - the wall time and the host CPU time (of the whole process, simulator included);
+// - the time on the simulated clock, i.e. how long flashing would take on a
+//   real bus, and the payload throughput that works out to;
+// - the bus efficiency: bits of image payload over all bits on the bus
+//   (framing, stuffing, commands and retries included).
+//
+// Results are printed as a table, or as CSV or JSON (`--format csv|json`).
+// Pass `--baseline <file.csv>` (the output of an earlier `--format csv` run) to
+// compare against it: exits with a nonzero status if any case failed, or if its
+// throughput or bus efficiency dropped by more than `--tolerance` percent (5 by
+// default) or its CPU time grew by more than `--cpu-tolerance` percent (50 by
+// default; 0 = don't check).
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QSharedPointer>
+#include <QTimer>
+#include "canale.hh"
+#include "comm_op.hh"
+#include "elf.hh"
+#include "sim_can_bus.hh"
+
+namespace
+{
+
+/// The id of the first emulated device; the others follow.
+constexpr CAdevId FIRST_DEV_ID = 0x10;
+
+/// How long a case may take (in wall time) before it is considered failed.
+constexpr int CASE_TIMEOUT_MS = 10 * 60 * 1000;
+
+/// A point of the parameter matrix.
+struct BenchCase
+{
+    unsigned imageSize; ///< Bytes in the image flashed to each device.
+    uint8_t pageSizePow2; ///< log2(page size of the devices).
+    unsigned long bitrate; ///< Nominal bitrate of the bus.
+    unsigned long dataBitrate; ///< CAN FD data phase bitrate (0 = classic CAN).
+    unsigned nDevices; ///< Devices flashed at the same time.
+    double lossRate; ///< Probability of any frame being lost.
+
+    /// Returns a name identifying the case (ex. "img64k-pg1024-500k-n1-loss0").
+    std::string name() const
+    {
+        char bitrateStr[32];
+        if(dataBitrate > 0)
+        {
+            std::snprintf(bitrateStr, sizeof(bitrateStr), "%luk/%lukfd", bitrate / 1000, dataBitrate / 1000);
+        }
+        else
+        {
+            std::snprintf(bitrateStr, sizeof(bitrateStr), "%luk", bitrate / 1000);
+        }
+        char name[128];
+        std::snprintf(name, sizeof(name), "img%uk-pg%u-%s-n%u-loss%g",
+                      imageSize / 1024, 1u << pageSizePow2, bitrateStr, nDevices, lossRate);
+        return name;
+    }
+};
+
+/// The measurements of a case.
+struct BenchResult
+{
+    bool ok; ///< Were all devices flashed (with the right contents)?
+    std::string error; ///< Why not, if not `ok`.
+    double wallMs; ///< Wall time.
+    double simMs; ///< Time on the simulated clock.
+    double cpuMs; ///< Host CPU time.
+    double payloadBps; ///< Image bytes flashed (to all devices) per simulated second.
+    double busEfficiency; ///< Image bits over all bits on the bus.
+    uint64_t framesLost;
+};
+
+/// Returns a pseudo-random image of `size` bytes that looks a bit like firmware:
+/// mostly incompressible, with some runs of erased (0xFF) and zero bytes.
+QByteArray makeImage(unsigned size)
+{
+    QByteArray image(int(size), '\0');
+    char *data = image.data();
+    uint32_t rand = 0x2545F491u;
+    for(unsigned i = 0; i < size; i ++)
+    {
+        rand = rand * 1103515245u + 12345u;
+        switch((i / 256) % 8)
+        {
+        case 3:
+            data[i] = '\0';
+            break;
+        case 6:
+            data[i] = char(0xFF);
+            break;
+        default:
+            data[i] = char(rand >> 24);
+            break;
+        }
+    }
+    return image;
+}
+
+/// Flashes an image to `benchCase.nDevices` emulated devices; returns the measurements.
+BenchResult runCase(const BenchCase &benchCase, bool compress)
+{
+    BenchResult result{false, std::string(), 0.0, 0.0, 0.0, 0.0, 0.0, 0};
+
+    const uint32_t pageSize = 1u << benchCase.pageSizePow2;
+    const QByteArray imageData = makeImage(benchCase.imageSize);
+
+    ca::SimBusConfig busConfig;
+    busConfig.bitrate = benchCase.bitrate;
+    busConfig.dataBitrate = benchCase.dataBitrate;
+    busConfig.frameLossRate = benchCase.lossRate;
+    QSharedPointer<ca::SimCanBus> bus(new ca::SimCanBus(busConfig));
+    if(benchCase.dataBitrate > 0)
+    {
+        bus->setConfigurationParameter(QCanBusDevice::CanFdKey, true);
+    }
+
+    ca::SimDeviceConfig devConfig;
+    devConfig.pageSizePow2 = benchCase.pageSizePow2;
+    devConfig.nFlashPages = static_cast<uint16_t>((benchCase.imageSize + pageSize - 1) / pageSize);
+    devConfig.features = ca::DEVICE_FEATURE_TEMP_PAGE_FILL;
+    if(benchCase.dataBitrate > 0)
+    {
+        devConfig.features |= ca::DEVICE_FEATURE_CAN_FD;
+    }
+    if(compress)
+    {
+        devConfig.features |= ca::DEVICE_FEATURE_COMPRESSED_WRITES;
+    }
+    for(unsigned i = 0; i < benchCase.nDevices; i ++)
+    {
+        bus->addDevice(CAdevId(FIRST_DEV_ID + i), devConfig);
+    }
+
+    CAinst inst;
+    if(!inst.init(bus))
+    {
+        result.error = "failed to connect to the simulated bus";
+        return result;
+    }
+    inst.comms()->setBusLoadLimit(benchCase.bitrate, 0, benchCase.dataBitrate);
+
+    auto image = QSharedPointer<ca::FlashImage>::create(imageData);
+    image->setFormat(ca::ImageFormat::Binary, 0);
+
+    QEventLoop loop;
+    unsigned nDone = 0;
+    ca::ProgressHandler onProgress([&](const char *message, int progress, void *)
+    {
+        if(progress < 0 && result.error.empty())
+        {
+            result.error = message;
+        }
+        if((progress >= 100 || progress < 0) && ++ nDone == benchCase.nDevices)
+        {
+            loop.quit();
+        }
+    });
+
+    const ca::SimBusStats statsBefore = bus->stats();
+    QElapsedTimer wallTimer;
+    wallTimer.start();
+    const std::clock_t cpuStart = std::clock();
+
+    for(unsigned i = 0; i < benchCase.nDevices; i ++)
+    {
+        inst.addOperation(new ca::FlashElfOp(onProgress, CAdevId(FIRST_DEV_ID + i), image));
+    }
+    QTimer::singleShot(CASE_TIMEOUT_MS, &loop, &QEventLoop::quit);
+    if(nDone < benchCase.nDevices)
+    {
+        loop.exec();
+    }
+
+    const std::clock_t cpuEnd = std::clock();
+    result.wallMs = double(wallTimer.nsecsElapsed()) / 1e6;
+    const ca::SimBusStats statsAfter = bus->stats();
+
+    result.cpuMs = double(cpuEnd - cpuStart) * 1000.0 / CLOCKS_PER_SEC;
+    result.simMs = double(statsAfter.elapsedNs - statsBefore.elapsedNs) / 1e6;
+    double payloadBytes = double(benchCase.imageSize) * benchCase.nDevices;
+    result.payloadBps = (result.simMs > 0.0) ? payloadBytes / (result.simMs / 1000.0) : 0.0;
+    double busBits = statsAfter.busBits - statsBefore.busBits;
+    result.busEfficiency = (busBits > 0.0) ? payloadBytes * 8.0 / busBits : 0.0;
+    result.framesLost = statsAfter.framesLost - statsBefore.framesLost;
+
+    if(nDone < benchCase.nDevices)
+    {
+        result.error = "timed out";
+        return result;
+    }
+    if(!result.error.empty())
+    {
+        return result;
+    }
+    for(unsigned i = 0; i < benchCase.nDevices; i ++)
+    {
+        if(bus->deviceFlash(CAdevId(FIRST_DEV_ID + i)).left(imageData.size()) != imageData)
+        {
+            result.error = "flash contents do not match the image";
+            return result;
+        }
+    }
+    result.ok = true;
+    return result;
+}
+
+/// Returns the cases to run: each parameter varied on its own around a
+/// baseline case, or (if `full`) all combinations of them.
+std::vector<BenchCase> benchCases(bool full)
+{
+    struct Bitrates
+    {
+        unsigned long bitrate, dataBitrate;
+    };
+    const unsigned imageSizes[] = {16 * 1024, 64 * 1024, 256 * 1024};
+    const uint8_t pageSizePow2s[] = {8, 10, 12}; // (256B, 1KiB, 4KiB)
+    const Bitrates bitrates[] = {{125000, 0}, {250000, 0}, {500000, 0}, {1000000, 0}, {500000, 2000000}};
+    const unsigned deviceCounts[] = {1, 8, 64};
+    const double lossRates[] = {0.0, 0.0005, 0.002};
+
+    std::vector<BenchCase> cases;
+    if(full)
+    {
+        for(unsigned imageSize : imageSizes)
+        for(uint8_t pageSizePow2 : pageSizePow2s)
+        for(const Bitrates &bitrate : bitrates)
+        for(unsigned nDevices : deviceCounts)
+        for(double lossRate : lossRates)
+        {
+            cases.push_back({imageSize, pageSizePow2, bitrate.bitrate, bitrate.dataBitrate, nDevices, lossRate});
+        }
+        return cases;
+    }
+
+    const BenchCase baseline{64 * 1024, 10, 500000, 0, 1, 0.0};
+    cases.push_back(baseline);
+    auto addVariant = [&cases, &baseline](const BenchCase &variant)
+    {
+        if(variant.name() != baseline.name())
+        {
+            cases.push_back(variant);
+        }
+    };
+    for(unsigned imageSize : imageSizes)
+    {
+        BenchCase variant = baseline;
+        variant.imageSize = imageSize;
+        addVariant(variant);
+    }
+    for(uint8_t pageSizePow2 : pageSizePow2s)
+    {
+        BenchCase variant = baseline;
+        variant.pageSizePow2 = pageSizePow2;
+        addVariant(variant);
+    }
+    for(const Bitrates &bitrate : bitrates)
+    {
+        BenchCase variant = baseline;
+        variant.bitrate = bitrate.bitrate;
+        variant.dataBitrate = bitrate.dataBitrate;
+        addVariant(variant);
+    }
+    for(unsigned nDevices : deviceCounts)
+    {
+        BenchCase variant = baseline;
+        variant.nDevices = nDevices;
+        addVariant(variant);
+    }
+    for(double lossRate : lossRates)
+    {
+        BenchCase variant = baseline;
+        variant.lossRate = lossRate;
+        addVariant(variant);
+    }
+    return cases;
+}
+
+enum class OutputFormat
+{
+    Text,
+    Csv,
+    Json,
+};
+
+const char CSV_HEADER[] = "case,image_bytes,page_bytes,bitrate,data_bitrate,devices,loss_rate,"
+                          "ok,wall_ms,sim_ms,cpu_ms,payload_Bps,bus_efficiency,frames_lost";
+
+void printResult(OutputFormat format, const BenchCase &benchCase, const BenchResult &result, bool first)
+{
+    const std::string name = benchCase.name();
+    switch(format)
+    {
+    case OutputFormat::Text:
+        std::printf("%-36s %10.1f %10.1f %10.1f %12.0f %7.1f%% %8llu%s%s\n", name.c_str(),
+                    result.wallMs, result.simMs, result.cpuMs, result.payloadBps, result.busEfficiency * 100.0,
+                    static_cast<unsigned long long>(result.framesLost),
+                    result.ok ? "" : "  FAILED: ", result.error.c_str());
+        break;
+
+    case OutputFormat::Csv:
+        std::printf("%s,%u,%u,%lu,%lu,%u,%g,%d,%.3f,%.3f,%.3f,%.1f,%.5f,%llu\n", name.c_str(),
+                    benchCase.imageSize, 1u << benchCase.pageSizePow2, benchCase.bitrate, benchCase.dataBitrate,
+                    benchCase.nDevices, benchCase.lossRate, int(result.ok),
+                    result.wallMs, result.simMs, result.cpuMs, result.payloadBps, result.busEfficiency,
+                    static_cast<unsigned long long>(result.framesLost));
+        break;
+
+    case OutputFormat::Json:
+        std::printf("%s\n  {\"case\": \"%s\", \"image_bytes\": %u, \"page_bytes\": %u, \"bitrate\": %lu, "
+                    "\"data_bitrate\": %lu, \"devices\": %u, \"loss_rate\": %g, \"ok\": %s, \"wall_ms\": %.3f, "
+                    "\"sim_ms\": %.3f, \"cpu_ms\": %.3f, \"payload_Bps\": %.1f, \"bus_efficiency\": %.5f, "
+                    "\"frames_lost\": %llu}",
+                    first ? "" : ",", name.c_str(),
+                    benchCase.imageSize, 1u << benchCase.pageSizePow2, benchCase.bitrate, benchCase.dataBitrate,
+                    benchCase.nDevices, benchCase.lossRate, result.ok ? "true" : "false",
+                    result.wallMs, result.simMs, result.cpuMs, result.payloadBps, result.busEfficiency,
+                    static_cast<unsigned long long>(result.framesLost));
+        break;
+    }
+    std::fflush(stdout);
+}
+
+/// A case read from a baseline CSV file.
+struct BaselineEntry
+{
+    std::string name;
+    double cpuMs, payloadBps, busEfficiency;
+};
+
+/// Splits a CSV line (without quoting) into its fields.
+std::vector<std::string> splitCsv(const std::string &line)
+{
+    std::vector<std::string> fields;
+    size_t start = 0;
+    for(;;)
+    {
+        size_t comma = line.find(',', start);
+        fields.push_back(line.substr(start, comma - start));
+        if(comma == std::string::npos)
+        {
+            return fields;
+        }
+        start = comma + 1;
+    }
+}
+
+/// Reads the results of an earlier `--format csv` run from `path`.
+/// Returns false if it can't be read.
+bool readBaseline(const char *path, std::vector<BaselineEntry> &outEntries)
+{
+    FILE *file = std::fopen(path, "r");
+    if(!file)
+    {
+        return false;
+    }
+
+    int nameCol = -1, cpuCol = -1, payloadCol = -1, efficiencyCol = -1;
+    bool header = true;
+    char lineBuf[1024];
+    while(std::fgets(lineBuf, sizeof(lineBuf), file))
+    {
+        std::string line(lineBuf);
+        while(!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+        {
+            line.pop_back();
+        }
+        if(line.empty())
+        {
+            continue;
+        }
+        std::vector<std::string> fields = splitCsv(line);
+        if(header)
+        {
+            for(int i = 0; i < int(fields.size()); i ++)
+            {
+                nameCol = (fields[i] == "case") ? i : nameCol;
+                cpuCol = (fields[i] == "cpu_ms") ? i : cpuCol;
+                payloadCol = (fields[i] == "payload_Bps") ? i : payloadCol;
+                efficiencyCol = (fields[i] == "bus_efficiency") ? i : efficiencyCol;
+            }
+            header = false;
+            continue;
+        }
+        int maxCol = std::max(std::max(nameCol, cpuCol), std::max(payloadCol, efficiencyCol));
+        if(nameCol < 0 || cpuCol < 0 || payloadCol < 0 || efficiencyCol < 0 || int(fields.size()) <= maxCol)
+        {
+            std::fclose(file);
+            return false;
+        }
+        outEntries.push_back({fields[nameCol], std::atof(fields[cpuCol].c_str()),
+                              std::atof(fields[payloadCol].c_str()), std::atof(fields[efficiencyCol].c_str())});
+    }
+    std::fclose(file);
+    return !header;
+}
+
+/// Compares `result` against the baseline entry for its case (if any); prints
+/// and returns false if it regressed.
+bool checkAgainstBaseline(const std::vector<BaselineEntry> &baseline, const BenchCase &benchCase,
+                          const BenchResult &result, double tolerance, double cpuTolerance)
+{
+    const std::string name = benchCase.name();
+    if(!result.ok)
+    {
+        std::fprintf(stderr, "REGRESSION %s: failed (%s)\n", name.c_str(), result.error.c_str());
+        return false;
+    }
+    for(const BaselineEntry &entry : baseline)
+    {
+        if(entry.name != name)
+        {
+            continue;
+        }
+        bool ok = true;
+        if(result.payloadBps < entry.payloadBps * (1.0 - tolerance / 100.0))
+        {
+            std::fprintf(stderr, "REGRESSION %s: throughput %.0f B/s, was %.0f B/s\n",
+                         name.c_str(), result.payloadBps, entry.payloadBps);
+            ok = false;
+        }
+        if(result.busEfficiency < entry.busEfficiency * (1.0 - tolerance / 100.0))
+        {
+            std::fprintf(stderr, "REGRESSION %s: bus efficiency %.1f%%, was %.1f%%\n",
+                         name.c_str(), result.busEfficiency * 100.0, entry.busEfficiency * 100.0);
+            ok = false;
+        }
+        if(cpuTolerance > 0.0 && result.cpuMs > entry.cpuMs * (1.0 + cpuTolerance / 100.0))
+        {
+            std::fprintf(stderr, "REGRESSION %s: CPU time %.1f ms, was %.1f ms\n",
+                         name.c_str(), result.cpuMs, entry.cpuMs);
+            ok = false;
+        }
+        return ok;
+    }
+    std::fprintf(stderr, "note: %s is not in the baseline\n", name.c_str());
+    return true;
+}
+
+void printUsage(const char *argv0)
+{
+    std::fprintf(stderr,
+                 "Usage: %s [--full] [--compress] [--format text|csv|json]\n"
+                 "       [--baseline <file.csv>] [--tolerance <percent>] [--cpu-tolerance <percent>]\n",
+                 argv0);
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    bool full = false, compress = false;
+    OutputFormat format = OutputFormat::Text;
+    const char *baselinePath = nullptr;
+    double tolerance = 5.0, cpuTolerance = 50.0;
+    for(int i = 1; i < argc; i ++)
+    {
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        if(std::strcmp(arg, "--full") == 0)
+        {
+            full = true;
+        }
+        else if(std::strcmp(arg, "--compress") == 0)
+        {
+            compress = true;
+        }
+        else if(std::strcmp(arg, "--format") == 0 && value)
+        {
+            if(std::strcmp(value, "text") == 0)
+            {
+                format = OutputFormat::Text;
+            }
+            else if(std::strcmp(value, "csv") == 0)
+            {
+                format = OutputFormat::Csv;
+            }
+            else if(std::strcmp(value, "json") == 0)
+            {
+                format = OutputFormat::Json;
+            }
+            else
+            {
+                printUsage(argv[0]);
+                return 2;
+            }
+            i ++;
+        }
+        else if(std::strcmp(arg, "--baseline") == 0 && value)
+        {
+            baselinePath = value;
+            i ++;
+        }
+        else if(std::strcmp(arg, "--tolerance") == 0 && value)
+        {
+            tolerance = std::atof(value);
+            i ++;
+        }
+        else if(std::strcmp(arg, "--cpu-tolerance") == 0 && value)
+        {
+            cpuTolerance = std::atof(value);
+            i ++;
+        }
+        else
+        {
+            printUsage(argv[0]);
+            return 2;
+        }
+    }
+
+    std::vector<BaselineEntry> baseline;
+    if(baselinePath && !readBaseline(baselinePath, baseline))
+    {
+        std::fprintf(stderr, "Failed to read baseline results from %s\n", baselinePath);
+        return 2;
+    }
+
+    switch(format)
+    {
+    case OutputFormat::Text:
+        std::printf("%-36s %10s %10s %10s %12s %8s %8s\n",
+                    "case", "wall ms", "sim ms", "cpu ms", "payload B/s", "bus eff", "lost");
+        break;
+    case OutputFormat::Csv:
+        std::printf("%s\n", CSV_HEADER);
+        break;
+    case OutputFormat::Json:
+        std::printf("[");
+        break;
+    }
+
+    const std::vector<BenchCase> cases = benchCases(full);
+    bool allOk = true;
+    for(size_t i = 0; i < cases.size(); i ++)
+    {
+        std::fprintf(stderr, "[%zu/%zu] %s\n", i + 1, cases.size(), cases[i].name().c_str());
+        BenchResult result = runCase(cases[i], compress);
+        printResult(format, cases[i], result, i == 0);
+
+        if(baselinePath)
+        {
+            allOk = checkAgainstBaseline(baseline, cases[i], result, tolerance, cpuTolerance) && allOk;
+        }
+        else
+        {
+            allOk = result.ok && allOk;
+        }
+    }
+
+    if(format == OutputFormat::Json)
+    {
+        std::printf("\n]\n");
+    }
+    return allOk ? 0 : 1;
+}
@@ -0,0 +1,134 @@
+// CANale/src/bench/log_bench.cc - Measures the per-page cost of logging
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// Runs what an operation logs for each page it flashes (a progress update,
+// logged at CA_INFO, plus a CA_DEBUG trace) with no logger, a synchronous one
+// and an `ca::AsyncLogSink`, for each minimum log level; prints the time it
+// takes per page. Messages are written to the null device.
+#include <cstdio>
+#include <chrono>
+#include <QCoreApplication>
+#include <QSharedPointer>
+#include "comm_op.hh"
+#include "comms.hh"
+#include "log.hh"
+#include "util.hh"
+
+namespace
+{
+
+/// An operation that does nothing but report per-page progress on demand.
+class PageLogOp : public ca::Operation
+{
+public:
+    PageLogOp() : ca::Operation(ca::ProgressHandler())
+    {
+    }
+
+    QSet<CAdevId> devices() const override
+    {
+        return {};
+    }
+
+    /// Reports progress like `ca::FlashElfOp` does when a page was flashed.
+    void pageFlashed(unsigned nPagesFlashed, unsigned nPagesToFlash)
+    {
+        uint32_t pageAddr = 0x08000000u + nPagesFlashed * 2048u;
+        CA_LOG_DEBUG(loggerSafe(),
+                     QStringLiteral("0x42: page at %1 flashed, CRC %2")
+                     .arg(ca::hexStr(pageAddr, 8)).arg(ca::hexStr(nPagesFlashed & 0xFFFF, 4)));
+        progress(QStringLiteral("Flashed %2 of %3 to %1")
+                 .arg(ca::hexStr(CAdevId(0x42), 2)).arg(nPagesFlashed).arg(nPagesToFlash),
+                 15 + static_cast<int>(84ul * nPagesFlashed / nPagesToFlash));
+    }
+
+protected:
+    void started() override
+    {
+    }
+};
+
+/// Reports `nPages` pages flashed via `op`; returns the time per page in ns.
+double measure(PageLogOp &op, unsigned nPages)
+{
+    using Clock = std::chrono::steady_clock;
+
+    auto start = Clock::now();
+    for(unsigned i = 1; i <= nPages; i ++)
+    {
+        op.pageFlashed(i, nPages + 1);
+    }
+    std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+    return elapsed.count() / nPages;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+#ifdef _WIN32
+    FILE *nullFile = std::fopen("NUL", "w");
+#else
+    FILE *nullFile = std::fopen("/dev/null", "w");
+#endif
+    if(!nullFile)
+    {
+        std::fprintf(stderr, "Failed to open the null device\n");
+        return 1;
+    }
+    ca::AsyncLogSink::Writer writer = [nullFile](CAlogLevel level, const char *message)
+    {
+        std::fprintf(nullFile, "%d - %s\n", int(level), message);
+    };
+
+    const unsigned nPages = 20000;
+    const char *levelNames[] = {"debug", "info", "warning", "error"};
+    QSharedPointer<ca::Comms> comms(new ca::Comms());
+
+    std::printf("debug logs %s\n", CA_DEBUG_LOGS ? "compiled in" : "compiled out");
+    std::printf("%-8s %12s %12s %12s\n", "level", "none", "sync", "async");
+    for(int level = CA_DEBUG; level <= CA_ERROR; level ++)
+    {
+        double nsPerPage[3];
+
+        PageLogOp noLogOp;
+        noLogOp.start(comms, nullptr);
+        nsPerPage[0] = measure(noLogOp, nPages);
+
+        ca::LogHandler syncLogger(writer);
+        syncLogger.setMinLevel(static_cast<CAlogLevel>(level));
+        PageLogOp syncOp;
+        syncOp.start(comms, &syncLogger);
+        nsPerPage[1] = measure(syncOp, nPages);
+
+        unsigned long long nDropped;
+        {
+            ca::AsyncLogSink sink(writer);
+            ca::LogHandler asyncLogger = sink.handler();
+            asyncLogger.setMinLevel(static_cast<CAlogLevel>(level));
+            PageLogOp asyncOp;
+            asyncOp.start(comms, &asyncLogger);
+            nsPerPage[2] = measure(asyncOp, nPages);
+            sink.flush();
+            nDropped = sink.numDropped();
+        }
+
+        std::printf("%-8s %9.1f ns %9.1f ns %9.1f ns", levelNames[level],
+                    nsPerPage[0], nsPerPage[1], nsPerPage[2]);
+        if(nDropped > 0)
+        {
+            std::printf(" (async: %llu messages dropped)", nDropped);
+        }
+        std::printf("\n");
+    }
+
+    std::fclose(nullFile);
+    return 0;
+}
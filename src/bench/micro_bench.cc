@@ -0,0 +1,285 @@
+// CANale/src/bench/micro_bench.cc - Microbenchmarks of the host-side hot paths
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// Measures the host-side kernels that run for every page or frame, one by one:
+// CRC16, building flash maps, dispatching received frames in `ca::Comms`,
+// flashing a page (building and queuing its WRITEs/SEEKs, against an emulated
+// device that responds instantly), `ca::parseInt()` and invoking progress and
+// log handlers. Prints the time and the number of heap allocations per
+// operation of each.
+//
+// Pass a substring as the first argument to only run the kernels whose name
+// contains it.
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+#include <QCoreApplication>
+#include <QString>
+#include "common/can_msgs.h"
+#include "alloc_counter.hh"
+#include "crc.hh"
+#include "elf.hh"
+#include "log.hh"
+#include "sim_flasher.hh"
+#include "types.hh"
+#include "util.hh"
+
+namespace
+{
+
+/// How many times a kernel is run (after it was timed) to count its allocations.
+constexpr unsigned long ALLOC_COUNT_RUNS = 100;
+
+/// (Keeps the compiler from optimizing the kernels away)
+volatile unsigned long g_sink;
+
+struct Measurement
+{
+    double nsPerOp;
+    double allocsPerOp;
+};
+
+/// Runs `op`, which does `opsPerCall` operations per call, for at least
+/// ~200ms, then `ALLOC_COUNT_RUNS` more times counting allocations.
+template<typename Op>
+Measurement measure(Op &&op, unsigned opsPerCall=1)
+{
+    using Clock = std::chrono::steady_clock;
+
+    op(); // (Warm up)
+
+    unsigned long nCalls = 0;
+    unsigned long batch = 1;
+    auto start = Clock::now();
+    std::chrono::duration<double, std::nano> elapsed{0};
+    while(elapsed.count() < 200e6)
+    {
+        for(unsigned long i = 0; i < batch; i ++)
+        {
+            op();
+        }
+        nCalls += batch;
+        batch *= 2;
+        elapsed = Clock::now() - start;
+    }
+
+    ca::bench::startCountingAllocs();
+    for(unsigned long i = 0; i < ALLOC_COUNT_RUNS; i ++)
+    {
+        op();
+    }
+    unsigned long nAllocs = ca::bench::stopCountingAllocs();
+
+    return {elapsed.count() / (double(nCalls) * opsPerCall),
+            double(nAllocs) / (double(ALLOC_COUNT_RUNS) * opsPerCall)};
+}
+
+/// The substring that kernel names must contain to be run (empty = all).
+std::string g_filter;
+
+/// Measures and reports `op` (see `measure()`), if `name` matches the filter.
+template<typename Op>
+void run(const std::string &name, Op &&op, unsigned opsPerCall=1)
+{
+    if(!g_filter.empty() && name.find(g_filter) == std::string::npos)
+    {
+        return;
+    }
+    Measurement m = measure(std::forward<Op>(op), opsPerCall);
+    std::printf("%-52s %12.1f %10.2f\n", name.c_str(), m.nsPerOp, m.allocsPerOp);
+    std::fflush(stdout);
+}
+
+/// A range of data to flash, for building flash maps.
+struct Segment
+{
+    uint32_t addr;
+    std::vector<uint8_t> data;
+};
+
+/// Returns `n` segments of 16B..8KiB of pseudo-random data, spread over 1MiB
+/// with gaps between them; every fourth one overlaps the one before it.
+std::vector<Segment> makeSegments(unsigned n)
+{
+    std::vector<Segment> segments;
+    uint32_t rand = 0x9E3779B9u;
+    auto next = [&rand]()
+    {
+        rand = rand * 1103515245u + 12345u;
+        return rand >> 8;
+    };
+
+    uint32_t addr = 0x08000000u;
+    for(unsigned i = 0; i < n; i ++)
+    {
+        Segment segment;
+        size_t size = 16 + next() % 8192;
+        if(i % 4 == 3 && !segments.empty())
+        {
+            segment.addr = segments.back().addr + static_cast<uint32_t>(segments.back().data.size() / 2);
+        }
+        else
+        {
+            segment.addr = addr + next() % 4096;
+        }
+        segment.data.resize(size);
+        for(uint8_t &byte : segment.data)
+        {
+            byte = static_cast<uint8_t>(next());
+        }
+        addr = segment.addr + static_cast<uint32_t>(size) + next() % 8192;
+        segments.push_back(std::move(segment));
+    }
+    return segments;
+}
+
+/// Returns a mix of frames that a host sees on a busy bus: responses from
+/// CANnuccia devices (to `claimedDevId`, that are not waiting for them, and to
+/// devices nobody claimed) and frames of other protocols, standard and extended.
+QVector<QCanBusFrame> makeReceivedFrames(CAdevId claimedDevId)
+{
+    QVector<QCanBusFrame> frames;
+    const QByteArray payload8(8, '\x55');
+    for(int i = 0; i < 16; i ++)
+    {
+        QCanBusFrame pageSelected(cnCANDevMask(CN_CAN_MSG_PAGE_SELECTED, claimedDevId) >> 3, QByteArray(4, '\0'));
+        pageSelected.setExtendedFrameFormat(true);
+        frames.append(pageSelected);
+
+        QCanBusFrame writesChecked(cnCANDevMask(CN_CAN_MSG_WRITES_CHECKED, CAdevId(0x10 + i)) >> 3,
+                                   QByteArray(2, '\0'));
+        writesChecked.setExtendedFrameFormat(true);
+        frames.append(writesChecked);
+
+        QCanBusFrame foreignExt(0x0CF00400u + quint32(i), payload8); // (ex. J1939)
+        foreignExt.setExtendedFrameFormat(true);
+        frames.append(foreignExt);
+
+        QCanBusFrame foreignStd(0x100u + quint32(i), payload8);
+        frames.append(foreignStd);
+    }
+    return frames;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    if(argc > 1)
+    {
+        g_filter = argv[1];
+    }
+
+    std::printf("%-52s %12s %10s\n", "kernel", "ns/op", "allocs/op");
+
+    // CRC16 of a page
+    std::vector<uint8_t> crcData(4096);
+    for(size_t i = 0; i < crcData.size(); i ++)
+    {
+        crcData[i] = static_cast<uint8_t>(i * 31 + 7);
+    }
+    for(unsigned long size : {256ul, 1024ul, 4096ul})
+    {
+        run("crc16 (" + std::to_string(size) + " B)", [&crcData, size]()
+        {
+            g_sink = g_sink ^ ca::crc16(size, crcData.data());
+        });
+    }
+
+    // Building flash maps
+    const std::vector<Segment> segments = makeSegments(64);
+    ca::FlashMap::RecordSource source = [&segments](const ca::RecordHandler &onRecord)
+    {
+        for(const Segment &segment : segments)
+        {
+            onRecord(segment.addr, segment.data.data(), segment.data.size());
+        }
+        return true;
+    };
+    for(size_t pageSize : {size_t(256), size_t(1024), size_t(4096)})
+    {
+        run("FlashMap::build (64 segments, " + std::to_string(pageSize) + " B pages)", [&source, pageSize]()
+        {
+            ca::FlashMap map;
+            ca::FlashMap::build(source, pageSize, ca::FlashMap::DEFAULT_FILL, map);
+            g_sink = g_sink + map.numPages();
+        });
+    }
+
+    // Dispatching received frames and flashing pages, against an emulated device
+    ca::bench::Flasher flasher;
+    if(!flasher.start())
+    {
+        std::fprintf(stderr, "Failed to start programming the emulated device\n");
+        return 1;
+    }
+
+    const QVector<QCanBusFrame> frames = makeReceivedFrames(ca::bench::Flasher::DEV_ID);
+    run("Comms::framesReceived (per frame, CANnuccia + foreign)", [&flasher, &frames]()
+    {
+        flasher.can->deliver(frames);
+    }, static_cast<unsigned>(frames.size()));
+
+    bool flashFailed = false;
+    const unsigned nPages = static_cast<unsigned>(flasher.pages.size());
+    run("Comms::flashPage (per 1 KiB page, round trip)", [&flasher, &flashFailed, nPages]()
+    {
+        flashFailed = !flasher.flash(nPages) || flashFailed;
+    }, nPages);
+    if(flashFailed)
+    {
+        std::fprintf(stderr, "Flashing pages to the emulated device failed\n");
+        return 1;
+    }
+
+    // Parsing integers (ex. device ids on the command line)
+    for(const char *str : {"170", "0xAA", "0b10101010", "-0x7F", "bogus"})
+    {
+        const QString qStr = QString::fromLatin1(str);
+        run(std::string("parseInt(\"") + str + "\")", [&qStr]()
+        {
+            long num = 0;
+            g_sink = g_sink + (ca::parseInt(qStr, num) ? static_cast<unsigned long>(num) : 1ul);
+        });
+    }
+
+    // Invoking progress and log handlers
+    const QString message = QStringLiteral("Flashed 42 of 128 pages to 0xAA");
+    ca::ProgressHandler onProgress([](const char *msg, int progress, void *)
+    {
+        g_sink = g_sink + static_cast<unsigned long>(progress) + static_cast<unsigned char>(msg[0]);
+    });
+    run("ProgressHandler (QString message)", [&onProgress, &message]()
+    {
+        onProgress(message, 42);
+    });
+
+    ca::LogHandler logger([](CAlogLevel level, const char *msg)
+    {
+        g_sink = g_sink + static_cast<unsigned long>(level) + static_cast<unsigned char>(msg[0]);
+    });
+    logger.setMinLevel(CA_INFO);
+    run("LogHandler (CA_LOG, below min. level)", [&logger, &message]()
+    {
+        CA_LOG(logger, CA_DEBUG, message);
+    });
+    run("LogHandler (const char * message)", [&logger]()
+    {
+        logger(CA_INFO, "Flashed 42 of 128 pages to 0xAA");
+    });
+    run("LogHandler (QString message)", [&logger, &message]()
+    {
+        logger(CA_INFO, message);
+    });
+
+    return 0;
+}
@@ -0,0 +1,154 @@
+// CANale/src/bench/sim_flasher.hh - Flashes pages to a simulated CANnuccia device, without an event loop
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#ifndef SIM_FLASHER_HH
+#define SIM_FLASHER_HH
+
+#include <vector>
+#include <QByteArray>
+#include <QCanBusFrame>
+#include <QCoreApplication>
+#include <QSharedPointer>
+#include <QThread>
+#include <QVector>
+#include "comms.hh"
+#include "sim_can_bus.hh"
+
+namespace ca
+{
+namespace bench
+{
+
+/// A `SimCanBus` that can also be fed arbitrary frames.
+class BenchCanBus : public ca::SimCanBus
+{
+public:
+    using SimCanBus::SimCanBus;
+
+    /// Delivers `frames` as if they were received from the bus.
+    inline void deliver(const QVector<QCanBusFrame> &frames)
+    {
+        enqueueReceivedFrames(frames);
+    }
+};
+
+
+/// Flashes pages to a device emulated by a `BenchCanBus` via `ca::Comms`.
+///
+/// Nothing happens on its own: the bus is stepped by hand (see
+/// `SimBusConfig::manualStep`) until it is idle, so that no event loop is
+/// needed.
+struct Flasher : public ca::DeviceListener
+{
+    static constexpr ca::Comms::DevId DEV_ID = 0x42;
+
+    /// Max. time to wait for `comms` to resume on its own when it is stuck
+    /// waiting for the link to report frames as written.
+    static constexpr unsigned long MAX_STALL_MS = 5000;
+    static constexpr unsigned long STALL_POLL_MS = 5;
+
+    ca::SimDeviceConfig devConfig;
+    QSharedPointer<BenchCanBus> can;
+    ca::Comms comms;
+    std::vector<QByteArray> pages;
+    unsigned long nFlashed = 0;
+    unsigned long nErrored = 0;
+    bool started = false;
+
+    /// See `SimBusConfig::writtenReports` for `writtenReports`.
+    Flasher(ca::SimWrittenReports writtenReports=ca::SimWrittenReports::OnBus,
+            const ca::SimDeviceConfig &deviceConfig=ca::SimDeviceConfig())
+        : devConfig(deviceConfig)
+    {
+        ca::SimBusConfig busConfig;
+        busConfig.writtenReports = writtenReports;
+        busConfig.manualStep = true;
+        can.reset(new BenchCanBus(busConfig));
+        can->addDevice(DEV_ID, devConfig);
+        can->connectDevice();
+        comms.setCan(can);
+        comms.claim(DEV_ID, this);
+
+        // Pages of pseudo-random data, with some runs of fill to be SEEKed over
+        const int pageSize = 1 << devConfig.pageSizePow2;
+        uint32_t rand = 0x12345678u;
+        for(int p = 0; p < 8; p ++)
+        {
+            QByteArray page(pageSize, '\0');
+            char *pageData = page.data();
+            for(int i = 0; i < pageSize; i ++)
+            {
+                rand = rand * 1103515245u + 12345u;
+                pageData[i] = ((i / 64) % 3 == p % 3) ? char(devConfig.tempPageFill) : char(rand >> 24);
+            }
+            pages.push_back(page);
+        }
+    }
+
+    void onProgStarted(CAdevId, const ca::DeviceStats &) override
+    {
+        started = true;
+    }
+
+    void onPageFlashed(CAdevId, uint32_t) override
+    {
+        nFlashed ++;
+    }
+
+    void onPageFlashErrored(CAdevId, uint32_t, uint16_t, uint16_t) override
+    {
+        nErrored ++;
+    }
+
+    void pump()
+    {
+        while(can->step())
+        {
+        }
+    }
+
+    bool start()
+    {
+        comms.progStart(DEV_ID);
+        pump();
+        return started;
+    }
+
+    /// Flashes `n` pages, one at a time. Returns false on failure.
+    bool flash(unsigned long n)
+    {
+        const uint32_t pageSize = 1u << devConfig.pageSizePow2;
+        for(unsigned long i = 0; i < n; i ++)
+        {
+            unsigned long expected = nFlashed + 1;
+            const QByteArray &page = pages[i % pages.size()];
+            uint32_t addr = devConfig.baseAddr + uint32_t(i % devConfig.nFlashPages) * pageSize;
+            comms.flashPage(DEV_ID, addr, page);
+            pump();
+            for(unsigned long stallMs = 0; nFlashed != expected && nErrored == 0 && stallMs < MAX_STALL_MS;
+                stallMs += STALL_POLL_MS)
+            {
+                // Frames were not reported as written; let the timers of
+                // `comms` fire so that it notices and resumes on its own
+                // (never happens unless `SimWrittenReports::Never`)
+                QThread::msleep(STALL_POLL_MS);
+                QCoreApplication::processEvents();
+                pump();
+            }
+            if(nFlashed != expected || nErrored > 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+}
+}
+
+#endif // SIM_FLASHER_HH
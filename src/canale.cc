@@ -9,22 +9,48 @@
 
 #include <cstdio>
 #include <algorithm>
+#include <iterator>
 #include <QtGlobal>
 #include <QCanBus>
 #include <QCanBusDevice>
+#include <QCoreApplication>
+#include <QAbstractEventDispatcher>
+#include <QMetaObject>
+#include <QThread>
 #include <elfio/elf_types.hpp>
 #include "util.hh"
 #include "moc_canale.cpp"
 
 CAinst::CAinst(QObject *parent)
     : QObject(parent),
-      m_logHandler(nullptr), m_can(nullptr), m_canConnected(false), m_comms(new ca::Comms(this))
+      m_logHandler(nullptr), m_logSink(), m_can(nullptr), m_canConnected(false), m_comms(new ca::Comms(this)),
+      m_maxConcurrentDevices(0), m_pageFill(ca::FlashMap::DEFAULT_FILL), m_scheduling(false), m_dispatcher(nullptr), m_numEnqueued(0),
+      m_ioThread(nullptr), m_ioLogHandler(nullptr), m_appEvents(APP_EVENTS_CAPACITY),
+      m_appOverflowing(false), m_appDrainPending(false), m_numDroppedEvents(0)
 {
 }
 
 CAinst::~CAinst()
 {
-    if(m_can && m_canConnected)
+    if(m_ioThread)
+    {
+        // Tear down everything that lives on the I/O thread from there, then
+        // stop it (events that were not delivered yet are discarded)
+        invokeBlocking([this]()
+        {
+            qDeleteAll(m_operations);
+            m_operations.clear();
+            if(m_can && m_canConnected)
+            {
+                m_can->disconnectDevice();
+            }
+            m_comms.reset();
+            m_can.reset();
+        });
+        m_ioThread->quit();
+        m_ioThread->wait();
+    }
+    else if(m_can && m_canConnected)
     {
         m_can->disconnectDevice();
     }
@@ -33,7 +59,60 @@ CAinst::~CAinst()
 
 bool CAinst::init(const CAconfig &config)
 {
-    m_logHandler = {config.logHandler};
+    if(config.asyncLog && config.logHandler)
+    {
+        m_logSink.reset(new ca::AsyncLogSink(config.logHandler));
+        m_logHandler = m_logSink->handler();
+    }
+    else
+    {
+        m_logHandler = {config.logHandler};
+    }
+    setLogLevel(config.logLevel);
+
+    if(config.ioThread && !m_ioThread && !useIoThread())
+    {
+        m_logHandler(CA_ERROR, "Failed to start the I/O thread");
+        return false;
+    }
+
+    m_maxConcurrentDevices = config.maxConcurrentDevices;
+    m_manifestDir = config.manifestDir ? QString(config.manifestDir) : QString();
+    if(config.imageCacheSize > 0)
+    {
+        m_imageCache.setMaxBytes(config.imageCacheSize);
+    }
+    m_pageFill = (config.pageFill & CA_PAGE_FILL_SET) ? static_cast<uint8_t>(config.pageFill & 0xFF)
+                                                      : ca::FlashMap::DEFAULT_FILL;
+
+    ca::RetryPolicy retryPolicy = ca::RetryPolicy::defaults();
+    for(int stage = 0; stage < CA_NUM_STAGES; stage ++)
+    {
+        if(config.stageTimeoutsMs[stage] > 0)
+        {
+            retryPolicy.stageTimeoutsMs[stage] = static_cast<int>(config.stageTimeoutsMs[stage]);
+        }
+    }
+    if(config.maxStageRetries > 0)
+    {
+        retryPolicy.maxStageRetries = config.maxStageRetries;
+    }
+    if(config.maxPageRetries > 0)
+    {
+        retryPolicy.maxPageRetries = config.maxPageRetries;
+    }
+    if(config.maxDeviceRetries > 0)
+    {
+        retryPolicy.maxDeviceRetries = config.maxDeviceRetries;
+    }
+    invokeBlocking([this, &config, &retryPolicy]()
+    {
+        m_comms->setBusLoadLimit(config.canBitrate, config.maxBusLoad, config.canDataBitrate);
+        m_comms->setWriteCompression(!config.noCompression);
+        m_comms->setMetricsEnabled(config.metrics != 0);
+        m_comms->setRetryPolicy(retryPolicy);
+        m_comms->setLogger(m_ioThread ? &m_ioLogHandler : &m_logHandler);
+    });
 
     m_logHandler(CA_INFO, "CANale init");
 
@@ -60,6 +139,17 @@ bool CAinst::init(const CAconfig &config)
         return false;
     }
 
+    if(config.canFd)
+    {
+        m_logHandler(CA_INFO, "Enabling CAN FD");
+        canDev->setConfigurationParameter(QCanBusDevice::CanFdKey, true);
+        if(config.canDataBitrate > 0)
+        {
+            canDev->setConfigurationParameter(QCanBusDevice::DataBitRateKey,
+                                              static_cast<quint32>(config.canDataBitrate));
+        }
+    }
+
     return init(canDev);
 }
 
@@ -72,7 +162,14 @@ bool CAinst::init(QSharedPointer<QCanBusDevice> can)
     }
 
     m_logHandler(CA_INFO, "Connecting to CAN link...");
-    if(!can->connectDevice())
+    if(m_ioThread && can->thread() != m_ioThread)
+    {
+        // (Its socket notifiers are created on connection, in its thread)
+        can->moveToThread(m_ioThread);
+    }
+    bool connected = false;
+    invokeBlocking([&can, &connected]() { connected = can->connectDevice(); });
+    if(!connected)
     {
         m_logHandler(CA_ERROR,
                      QStringLiteral("Failed to connect to CAN link. Error [%1]: %2")
@@ -82,7 +179,8 @@ bool CAinst::init(QSharedPointer<QCanBusDevice> can)
 
     m_logHandler(CA_INFO, "CAN link estabilished");
     m_can = can;
-    m_comms->setCan(m_can);
+    m_canConnected = true;
+    invokeBlocking([this]() { m_comms->setCan(m_can); });
     return true;
 }
 
@@ -94,48 +192,417 @@ void CAinst::addOperation(ca::Operation *operation)
         return;
     }
 
-    // Reparent the operation to us; we will be the ones destroying it
-    operation->setParent(this);
+    ca::Operation *op = operation;
+    m_numEnqueued ++;
+    if(m_ioThread)
+    {
+        // The operation will run on the I/O thread (and be destroyed by us);
+        // hand its progress updates over to this thread
+        op->setParent(nullptr);
+        op->moveToThread(m_ioThread);
+        op->onProgress().moveToThread(m_ioThread);
+
+        ca::ProgressHandler &onProgress = op->onProgress();
+        auto handler = std::make_shared<decltype(onProgress.handler)>(std::move(onProgress.handler));
+        onProgress.handler = [this, handler](const char *message, int progress, void *userData)
+        {
+            bool final = (progress < 0 || progress >= 100);
+            QByteArray messageCopy(message);
+            postAppEvent({[this, handler, messageCopy, progress, userData, final]()
+            {
+                if(*handler)
+                {
+                    (*handler)(messageCopy.constData(), progress, userData);
+                }
+                if(final)
+                {
+                    m_numEnqueued --;
+                }
+            }, !final});
+        };
+    }
+    else
+    {
+        // Reparent the operation to us; we will be the ones destroying it
+        op->setParent(this);
+    }
 
-    m_operations.emplace_back(operation);
-    ca::Operation *op = m_operations.back();
+    invoke([this, op]()
+    {
+        m_operations.emplace_back(op);
+
+        // When the operation is done remove it from the queue and start all
+        // enqueued operations that were waiting on it, if any
+        connect(&op->onProgress(), &ca::ProgressHandler::done, [op, this]()
+        {
+            // Erase all references to this operation in the queue
+            m_operations.erase(std::remove(m_operations.begin(), m_operations.end(), op),
+                               m_operations.end());
+            if(!m_ioThread)
+            {
+                m_numEnqueued --;
+            }
+
+            // Mark the operation as "to be deleted"; let Qt delete it ASAP
+            op->deleteLater();
 
-    // When the operation is done remove it from the queue and start the first
-    // enqueued operation that is still to be started, if any
-    connect(&op->onProgress(), &ca::ProgressHandler::done, [op, this]()
+            scheduleOperations();
+        });
+
+        // Start this operation right away if it does not depend on any other
+        scheduleOperations();
+    });
+}
+
+ca::Operation *CAinst::nextOperationToStart() const
+{
+    // Devices acted upon by started operations
+    QSet<CAdevId> runningDevices;
+    for(ca::Operation *op : m_operations)
     {
-        // Erase all references to this operation in the queue
-        m_operations.erase(std::remove(m_operations.begin(), m_operations.end(), op),
-                           m_operations.end());
+        if(op->isStarted())
+        {
+            runningDevices.unite(op->devices());
+        }
+    }
 
-        // Mark the operation as "to be deleted"; let Qt delete it ASAP
-        op->deleteLater();
+    // Devices acted upon by any operation before the current one in the queue
+    QSet<CAdevId> claimedDevices;
+    for(ca::Operation *op : m_operations)
+    {
+        QSet<CAdevId> opDevices = op->devices();
 
-        for(auto it = m_operations.begin(); it != m_operations.end(); it ++)
+        if(!op->isStarted() && !opDevices.intersects(claimedDevices))
         {
-            ca::Operation *nextOp = *it;
-            if(!nextOp->isStarted())
+            // All operations this one depends on are done; check the device
+            // cap (always let an operation run alone, even if it exceeds the cap)
+            bool capOk = m_maxConcurrentDevices == 0
+                         || runningDevices.isEmpty()
+                         || size_t(runningDevices.size() + opDevices.size()) <= m_maxConcurrentDevices;
+            if(capOk)
+            {
+                return op;
+            }
+            else
             {
-                nextOp->start(m_comms, &m_logHandler);
-                break;
+                // Don't let any operation after this one overtake it
+                return nullptr;
             }
         }
+
+        claimedDevices.unite(opDevices);
+    }
+    return nullptr;
+}
+
+void CAinst::scheduleOperations()
+{
+    if(m_scheduling)
+    {
+        // Called back by an operation that completed in `start()`; the loop
+        // below will pick up any change to the queue anyways
+        return;
+    }
+
+    m_scheduling = true;
+    ca::Operation *op;
+    while((op = nextOperationToStart()))
+    {
+        op->start(m_comms, m_ioThread ? &m_ioLogHandler : &m_logHandler);
+    }
+    m_scheduling = false;
+}
+
+void CAinst::cancel()
+{
+    invoke([this]()
+    {
+        cancelIf([](ca::Operation *) { return true; });
     });
+}
 
-    // Start this operation if it's the first one
-    if(m_operations.size() == 1)
+void CAinst::cancel(CAdevId devId)
+{
+    invoke([this, devId]()
+    {
+        cancelIf([devId](ca::Operation *op) { return op->devices().contains(devId); });
+    });
+}
+
+void CAinst::invoke(std::function<void()> func)
+{
+    if(m_ioThread)
+    {
+        QMetaObject::invokeMethod(m_comms.data(), std::move(func), Qt::QueuedConnection);
+    }
+    else if(m_dispatcher)
     {
-        op->start(m_comms, &m_logHandler);
+        QMetaObject::invokeMethod(this, std::move(func), Qt::QueuedConnection);
+    }
+    else
+    {
+        func();
+    }
+}
+
+void CAinst::invokeBlocking(std::function<void()> func)
+{
+    if(m_ioThread && QThread::currentThread() != m_ioThread)
+    {
+        QMetaObject::invokeMethod(m_comms.data(), std::move(func), Qt::BlockingQueuedConnection);
+    }
+    else
+    {
+        func();
+    }
+}
+
+bool CAinst::useIoThread()
+{
+    Q_ASSERT(!m_ioThread && !m_can);
+    if(m_ioThread || m_can)
+    {
+        return false;
+    }
+
+    auto ioThread = new QThread(this);
+    ioThread->setObjectName(QStringLiteral("CANale I/O"));
+    ioThread->start(QThread::TimeCriticalPriority);
+    if(!ioThread->isRunning())
+    {
+        delete ioThread;
+        return false;
+    }
+    m_ioThread = ioThread;
+
+    // (`m_comms` is owned by its shared pointer; it can't have a parent in
+    // another thread)
+    m_comms->setParent(nullptr);
+    m_comms->moveToThread(m_ioThread);
+
+    m_ioLogHandler.handler = [this](CAlogLevel level, const char *message)
+    {
+        if(m_logSink)
+        {
+            // (Thread-safe; no need to go through this thread)
+            m_logSink->write(level, message);
+            return;
+        }
+
+        QByteArray messageCopy(message);
+        postAppEvent({[this, level, messageCopy]()
+        {
+            if(m_logHandler)
+            {
+                m_logHandler.handler(level, messageCopy.constData());
+            }
+        }, level == CA_DEBUG});
+    };
+    return true;
+}
+
+void CAinst::setLogLevel(CAlogLevel level)
+{
+    m_logHandler.setMinLevel(level);
+    m_ioLogHandler.setMinLevel(level);
+}
+
+void CAinst::callInAppThread(std::function<void()> func)
+{
+    if(m_ioThread && QThread::currentThread() == m_ioThread)
+    {
+        postAppEvent({std::move(func), false});
+    }
+    else
+    {
+        func();
+    }
+}
+
+void CAinst::postAppEvent(AppEvent event)
+{
+    // Non-droppable events that don't fit in the ring go to the (locked)
+    // overflow queue; events after them follow until it is drained, to keep
+    // them in order
+    if(m_appOverflowing.load(std::memory_order_acquire) || !m_appEvents.tryPush(event))
+    {
+        if(event.droppable)
+        {
+            m_numDroppedEvents ++;
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m_appOverflowMutex);
+        m_appOverflow.push_back(std::move(event));
+        m_appOverflowing.store(true, std::memory_order_release);
+    }
+
+    if(!m_appDrainPending.exchange(true))
+    {
+        QMetaObject::invokeMethod(this, [this]() { drainAppEvents(); }, Qt::QueuedConnection);
     }
 }
 
+void CAinst::drainAppEvents()
+{
+    // (Cleared first, so that events posted while draining queue another drain)
+    m_appDrainPending.store(false);
+
+    AppEvent event;
+    while(m_appEvents.tryPop(event))
+    {
+        event.func();
+    }
+
+    if(m_appOverflowing.load(std::memory_order_acquire))
+    {
+        // (The I/O thread does not push to the ring while overflowing, so
+        // whatever is left in it is older than the overflowed events)
+        std::deque<AppEvent> events;
+        {
+            std::lock_guard<std::mutex> lock(m_appOverflowMutex);
+            while(m_appEvents.tryPop(event))
+            {
+                events.push_back(std::move(event));
+            }
+            std::move(m_appOverflow.begin(), m_appOverflow.end(), std::back_inserter(events));
+            m_appOverflow.clear();
+            m_appOverflowing.store(false, std::memory_order_release);
+        }
+        for(AppEvent &overflowEvent : events)
+        {
+            overflowEvent.func();
+        }
+    }
+}
+
+bool CAinst::useExternalEventLoop()
+{
+#ifdef CA_HAVE_EPOLL_DISPATCHER
+    m_dispatcher = ca::EpollEventDispatcher::install();
+    if(!m_dispatcher || m_dispatcher->fd() < 0)
+    {
+        m_dispatcher = nullptr;
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+int CAinst::eventFd() const
+{
+#ifdef CA_HAVE_EPOLL_DISPATCHER
+    return m_dispatcher ? m_dispatcher->fd() : -1;
+#else
+    return -1;
+#endif
+}
+
+int CAinst::processEvents(int timeoutMs)
+{
+    bool processed;
+#ifdef CA_HAVE_EPOLL_DISPATCHER
+    if(m_dispatcher)
+    {
+        processed = m_dispatcher->processEventsFor(timeoutMs);
+    }
+    else
+#endif
+    {
+        // (Can't wait with a timeout on other dispatchers)
+        QAbstractEventDispatcher *dispatcher = QAbstractEventDispatcher::instance();
+        if(!dispatcher)
+        {
+            return -1;
+        }
+        processed = dispatcher->processEvents(QEventLoop::AllEvents);
+    }
+
+    // Delete finished operations (`deleteLater()` is only honored by event
+    // loops otherwise)
+    QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+    return processed ? 1 : 0;
+}
+
+void CAinst::cancelIf(const std::function<bool(ca::Operation *)> &pred)
+{
+    // (Cancelled operations remove themselves from `m_operations`; iterate on a
+    // copy and hold off starting operations until all are cancelled)
+    std::deque<ca::Operation *> operations = m_operations;
+    bool wasScheduling = m_scheduling;
+    m_scheduling = true;
+    for(ca::Operation *op : operations)
+    {
+        if(pred(op))
+        {
+            op->cancel();
+        }
+    }
+    m_scheduling = wasScheduling;
+
+    scheduleOperations();
+}
+
 // ---- C API to implement for include/canale.h --------------------------------
 
-#define EXPECT_C(expr, message) do { Q_ASSERT(expr); \
+#define EXPECT_C(expr, message) do { Q_ASSERT(expr); if(!(expr)) { \
     if(ca) { ca->logHandler()(CA_ERROR, message); } \
-    if(onProgress) { onProgress(message, -1, onProgressUserData); } \
+    if(onProgress) { onProgress(message, -CA_ERR_GENERIC, onProgressUserData); } \
     return; \
-    } while(0)
+    } } while(0)
+
+/// Logs `message` as an error and reports it to `onProgress` (if any) as a
+/// failure, for files passed to the C API that could not be opened.
+static void failOpenFile(CAinst *ca, const QString &message,
+                         CAprogressHandler onProgress, void *onProgressUserData)
+{
+    QByteArray messageStr = message.toLocal8Bit();
+    ca->logHandler()(CA_ERROR, messageStr.constData());
+    if(onProgress)
+    {
+        onProgress(messageStr.constData(), -CA_ERR_GENERIC, onProgressUserData);
+    }
+}
+
+/// Enqueues a `ca::FlashElfOp` flashing `image` for each device in `devIds`.
+/// With no devices, nothing is enqueued and `onProgress` (if any) is called
+/// once, right away, to report success.
+static void flashImageMulti(CAinst *ca, unsigned long nDevIds, const CAdevId devIds[],
+                            QSharedPointer<ca::FlashImage> image,
+                            CAprogressHandler onProgress, void *onProgressUserData)
+{
+    if(nDevIds == 0)
+    {
+        if(onProgress)
+        {
+            onProgress("Nothing to flash", 100, onProgressUserData);
+        }
+        return;
+    }
+
+    image->setPageFill(ca->pageFill());
+
+    QSet<CAdevId> devIdsSet;
+    devIdsSet.reserve(static_cast<int>(nDevIds));
+    for(auto *it = devIds; it != (devIds + nDevIds); it ++)
+    {
+        if(!devIdsSet.contains(*it))
+        {
+            devIdsSet.insert(*it);
+            auto op = new ca::FlashElfOp(ca::ProgressHandler{onProgress, onProgressUserData}, *it, image);
+            op->setManifestDir(ca->manifestDir());
+            op->setImageCache(&ca->imageCache());
+            ca->addOperation(op);
+        }
+    }
+}
+
+static_assert(int(ca::ImageFormat::Auto) == CA_IMAGE_AUTO && int(ca::ImageFormat::Elf) == CA_IMAGE_ELF
+              && int(ca::ImageFormat::IntelHex) == CA_IMAGE_IHEX && int(ca::ImageFormat::SRecord) == CA_IMAGE_SREC
+              && int(ca::ImageFormat::Binary) == CA_IMAGE_BIN,
+              "ca::ImageFormat and CAimageFormat must match");
 
 CAinst *caInit(const CAconfig *config)
 {
@@ -145,6 +612,15 @@ CAinst *caInit(const CAconfig *config)
     }
 
     auto inst = new CAinst();
+    if(config->externalEventLoop && !inst->useExternalEventLoop())
+    {
+        if(config->logHandler)
+        {
+            config->logHandler(CA_ERROR, "Cannot use an external event loop: not supported, or a Qt event loop exists");
+        }
+        delete inst;
+        return nullptr;
+    }
     if(inst->init(*config))
     {
         return inst;
@@ -200,9 +676,161 @@ void caFlashELF(CAinst *ca, CAdevId devId,
     EXPECT_C(ca, "Invalid arguments");
 
     QByteArray elfDataArr(elf, static_cast<int>(elfLen)); // (copies the data)
+    auto image = QSharedPointer<ca::FlashImage>::create(elfDataArr);
+    image->setPageFill(ca->pageFill());
+
+    auto op = new ca::FlashElfOp(ca::ProgressHandler{onProgress, onProgressUserData}, devId, image);
+    op->setManifestDir(ca->manifestDir());
+    op->setImageCache(&ca->imageCache());
+    ca->addOperation(op);
+}
+
+void caFlashELFDelta(CAinst *ca, CAdevId devId,
+                     unsigned long elfLen, const char *elf,
+                     unsigned long baseElfLen, const char *baseElf,
+                     CAprogressHandler onProgress, void *onProgressUserData)
+{
+    EXPECT_C(ca && (baseElf || baseElfLen == 0), "Invalid arguments");
+
+    QByteArray elfDataArr(elf, static_cast<int>(elfLen)); // (copies the data)
+    QByteArray baseElfDataArr(baseElf, static_cast<int>(baseElfLen)); // (copies the data)
+
+    auto image = QSharedPointer<ca::FlashImage>::create(elfDataArr);
+    image->setPageFill(ca->pageFill());
+    auto baseImage = QSharedPointer<ca::FlashImage>::create(baseElfDataArr);
+    baseImage->setPageFill(ca->pageFill());
+
+    auto op = new ca::FlashElfOp(ca::ProgressHandler{onProgress, onProgressUserData}, devId, image);
+    op->setManifestDir(ca->manifestDir());
+    op->setImageCache(&ca->imageCache());
+    op->setBaseImage(baseImage);
+    ca->addOperation(op);
+}
+
+void caFlashELFMulti(CAinst *ca, unsigned long nDevIds, const CAdevId devIds[],
+                     unsigned long elfLen, const char *elf,
+                     CAprogressHandler onProgress, void *onProgressUserData)
+{
+    EXPECT_C(ca && (devIds || nDevIds == 0), "Invalid arguments");
+
+    QByteArray elfDataArr(elf, static_cast<int>(elfLen)); // (copies the data, once)
+    auto image = QSharedPointer<ca::FlashImage>::create(elfDataArr);
+    flashImageMulti(ca, nDevIds, devIds, image, onProgress, onProgressUserData);
+}
+
+void caFlashELFFile(CAinst *ca, unsigned long nDevIds, const CAdevId devIds[],
+                    const char *elfPath,
+                    CAprogressHandler onProgress, void *onProgressUserData)
+{
+    EXPECT_C(ca && (devIds || nDevIds == 0) && elfPath, "Invalid arguments");
+
+    QString error;
+    QSharedPointer<ca::FlashImage> image = ca::FlashImage::mapFile(QString::fromLocal8Bit(elfPath), &error);
+    if(!image)
+    {
+        // (Not an invalid argument: the file may just not exist)
+        failOpenFile(ca, QStringLiteral("Failed to open ELF file '%1': %2")
+                         .arg(QString::fromLocal8Bit(elfPath)).arg(error),
+                     onProgress, onProgressUserData);
+        return;
+    }
+    image->setFormat(ca::ImageFormat::Elf);
+
+    flashImageMulti(ca, nDevIds, devIds, image, onProgress, onProgressUserData);
+}
+
+void caFlashELFBorrowed(CAinst *ca, unsigned long nDevIds, const CAdevId devIds[],
+                        unsigned long elfLen, const char *elf,
+                        CAreleaseHandler onRelease, void *onReleaseUserData,
+                        CAprogressHandler onProgress, void *onProgressUserData)
+{
+    // (Released when the last operation flashing it drops it, or at the end
+    // of this function if there are none)
+    QSharedPointer<ca::FlashImage> image = ca::FlashImage::borrow(elf, elfLen, [elf, onRelease, onReleaseUserData]()
+    {
+        if(onRelease)
+        {
+            onRelease(elf, onReleaseUserData);
+        }
+    });
+    EXPECT_C(ca && (devIds || nDevIds == 0) && (elf || elfLen == 0), "Invalid arguments");
+
+    flashImageMulti(ca, nDevIds, devIds, image, onProgress, onProgressUserData);
+}
+
+void caFlashImage(CAinst *ca, unsigned long nDevIds, const CAdevId devIds[],
+                  CAimageFormat format, unsigned long baseAddr,
+                  unsigned long imageLen, const char *image,
+                  CAprogressHandler onProgress, void *onProgressUserData)
+{
+    EXPECT_C(ca && (devIds || nDevIds == 0) && (image || imageLen == 0)
+             && format >= CA_IMAGE_AUTO && format <= CA_IMAGE_BIN, "Invalid arguments");
+
+    QByteArray imageDataArr(image, static_cast<int>(imageLen)); // (copies the data, once)
+    auto flashImage = QSharedPointer<ca::FlashImage>::create(imageDataArr);
+    flashImage->setFormat(static_cast<ca::ImageFormat>(format), static_cast<uint32_t>(baseAddr));
+    flashImageMulti(ca, nDevIds, devIds, flashImage, onProgress, onProgressUserData);
+}
+
+void caFlashImageFile(CAinst *ca, unsigned long nDevIds, const CAdevId devIds[],
+                      const char *imagePath, CAimageFormat format, unsigned long baseAddr,
+                      CAprogressHandler onProgress, void *onProgressUserData)
+{
+    EXPECT_C(ca && (devIds || nDevIds == 0) && imagePath
+             && format >= CA_IMAGE_AUTO && format <= CA_IMAGE_BIN, "Invalid arguments");
+
+    QString error;
+    QSharedPointer<ca::FlashImage> image = ca::FlashImage::mapFile(QString::fromLocal8Bit(imagePath), &error);
+    if(!image)
+    {
+        // (Not an invalid argument: the file may just not exist)
+        failOpenFile(ca, QStringLiteral("Failed to open image file '%1': %2")
+                         .arg(QString::fromLocal8Bit(imagePath)).arg(error),
+                     onProgress, onProgressUserData);
+        return;
+    }
+    image->setFormat(static_cast<ca::ImageFormat>(format), static_cast<uint32_t>(baseAddr));
+
+    flashImageMulti(ca, nDevIds, devIds, image, onProgress, onProgressUserData);
+}
+
+void caScan(CAinst *ca, unsigned windowMs,
+            CAscanHandler onDevice, void *onDeviceUserData,
+            CAprogressHandler onProgress, void *onProgressUserData)
+{
+    EXPECT_C(ca, "Invalid arguments");
+
+    auto op = new ca::ScanOp(ca::ProgressHandler{onProgress, onProgressUserData},
+                             ca::ScanOp::allDevices(), static_cast<int>(windowMs));
+    if(onDevice)
+    {
+        op->setResultHandler([ca, onDevice, onDeviceUserData](const CAscanResult &result)
+        {
+            ca->callInAppThread([onDevice, onDeviceUserData, result]()
+            {
+                onDevice(&result, onDeviceUserData);
+            });
+        });
+    }
+    ca->addOperation(op);
+}
 
-    ca->addOperation(new ca::FlashElfOp(
-                         ca::ProgressHandler{onProgress, onProgressUserData}, devId, elfDataArr));
+int caGetFd(CAinst *ca)
+{
+    if(!ca)
+    {
+        return -1;
+    }
+    return ca->eventFd();
+}
+
+int caProcessEvents(CAinst *ca, int timeoutMs)
+{
+    if(!ca)
+    {
+        return -1;
+    }
+    return ca->processEvents(timeoutMs);
 }
 
 unsigned caNumEnqueued(CAinst *ca)
@@ -213,3 +841,141 @@ unsigned caNumEnqueued(CAinst *ca)
     }
     return static_cast<unsigned>(ca->numEnqueued());
 }
+
+void caSetLogLevel(CAinst *ca, CAlogLevel level)
+{
+    if(!ca)
+    {
+        return;
+    }
+    ca->setLogLevel(level);
+}
+
+unsigned long long caNumDroppedEvents(CAinst *ca)
+{
+    if(!ca)
+    {
+        return 0;
+    }
+    return ca->numDroppedEvents();
+}
+
+void caSetMaxConcurrentDevices(CAinst *ca, unsigned maxConcurrentDevices)
+{
+    if(!ca)
+    {
+        return;
+    }
+    ca->setMaxConcurrentDevices(maxConcurrentDevices);
+}
+
+void caCancel(CAinst *ca)
+{
+    if(!ca)
+    {
+        return;
+    }
+    ca->cancel();
+}
+
+void caCancelDevice(CAinst *ca, CAdevId devId)
+{
+    if(!ca)
+    {
+        return;
+    }
+    ca->cancel(devId);
+}
+
+int caGetTxStats(CAinst *ca, CAdevId devId, CAtxStats *outStats)
+{
+    if(!ca || !outStats)
+    {
+        return -1;
+    }
+
+    ca::TxQueueStats stats;
+    ca->invokeBlocking([ca, devId, &stats]() { stats = ca->comms()->txQueueStats(devId); });
+    outStats->queueDepth = static_cast<unsigned long>(stats.queueDepth);
+    outStats->framesSent = stats.framesSent;
+    outStats->idleNs = stats.idleNs;
+    return 0;
+}
+
+int caGetImageCacheStats(CAinst *ca, CAimageCacheStats *outStats)
+{
+    if(!ca || !outStats)
+    {
+        return -1;
+    }
+
+    ca::ImageCache::Stats stats = ca->imageCache().stats();
+    outStats->hits = stats.hits;
+    outStats->misses = stats.misses;
+    outStats->nEntries = static_cast<unsigned long>(stats.nEntries);
+    outStats->bytes = static_cast<unsigned long>(stats.bytes);
+    return 0;
+}
+
+void caSetMetricsEnabled(CAinst *ca, int enabled)
+{
+    if(!ca)
+    {
+        return;
+    }
+    ca->invokeBlocking([ca, enabled]() { ca->comms()->setMetricsEnabled(enabled != 0); });
+}
+
+/// Fills `outStats` with the statistics of `histogram`.
+static void fillLatencyStats(const ca::LatencyHistogram &histogram, CAlatencyStats &outStats)
+{
+    outStats.count = histogram.count();
+    outStats.minNs = histogram.minNs();
+    outStats.meanNs = histogram.meanNs();
+    outStats.maxNs = histogram.maxNs();
+    outStats.p50Ns = histogram.percentileNs(50.0);
+    outStats.p90Ns = histogram.percentileNs(90.0);
+    outStats.p99Ns = histogram.percentileNs(99.0);
+    outStats.p999Ns = histogram.percentileNs(99.9);
+}
+
+/// Fills `outMetrics` with `metrics`.
+static void fillMetrics(const ca::ProtocolMetrics &metrics, CAmetrics &outMetrics)
+{
+    for(int stage = 0; stage < CA_NUM_STAGES; stage ++)
+    {
+        fillLatencyStats(metrics.stageLatencies[stage], outMetrics.stages[stage]);
+    }
+    fillLatencyStats(metrics.rxHostDelays, outMetrics.rxHostDelay);
+    outMetrics.framesSent = metrics.framesSent;
+    outMetrics.framesReceived = metrics.framesReceived;
+    outMetrics.stageRetries = metrics.stageRetries;
+    outMetrics.stageTimeouts = metrics.stageTimeouts;
+    outMetrics.crcMismatches = metrics.crcMismatches;
+}
+
+int caGetMetrics(CAinst *ca, CAmetrics *outMetrics)
+{
+    if(!ca || !outMetrics)
+    {
+        return -1;
+    }
+
+    ca::ProtocolMetrics metrics;
+    ca->invokeBlocking([ca, &metrics]() { metrics = ca->comms()->metrics(); });
+    fillMetrics(metrics, *outMetrics);
+    return 0;
+}
+
+int caGetDeviceMetrics(CAinst *ca, CAdevId devId, CAmetrics *outMetrics)
+{
+    if(!ca || !outMetrics)
+    {
+        return -1;
+    }
+
+    ca::ProtocolMetrics metrics;
+    ca->invokeBlocking([ca, devId, &metrics]() { metrics = ca->comms()->metrics(devId); });
+    fillMetrics(metrics, *outMetrics);
+    return 0;
+}
@@ -11,20 +11,32 @@
 #include "canale.h"
 
 #include <memory>
+#include <atomic>
 #include <deque>
+#include <mutex>
+#include <functional>
 #include <QObject>
 #include <QSharedPointer>
 #include <QCanBusDevice>
 #include <QByteArray>
 #include <QList>
-#include <elfio/elfio.hpp>
 #include "comms.hh"
 #include "types.hh"
 #include "comm_op.hh"
+#include "event_dispatcher.hh"
+#include "spsc_ring.hh"
+#include "log.hh"
+#include "image_cache.hh"
+
+class QThread;
 
 namespace ca
 {
     using Inst = ::CAinst;
+
+#ifndef CA_HAVE_EPOLL_DISPATCHER
+    class EpollEventDispatcher; // (Not supported on this platform)
+#endif
 }
 
 struct CA_API CAinst : public QObject
@@ -60,12 +72,123 @@ public:
         m_logHandler = logHandler;
     }
 
+    /// Sets the minimum level of the messages that are logged (see
+    /// `ca::LogHandler::setMinLevel()`).
+    void setLogLevel(CAlogLevel level);
+
     /// Returns the number of operations enqueued into this CAinst.
+    /// With `useIoThread()`, an operation counts as enqueued until its final
+    /// progress update has been delivered to this instance's thread.
     inline size_t numEnqueued() const
     {
-        return m_operations.size();
+        return m_numEnqueued;
     }
 
+    /// Returns how many progress updates and log messages were dropped because
+    /// this instance's thread was not keeping up with the I/O thread.
+    inline unsigned long long numDroppedEvents() const
+    {
+        return m_numDroppedEvents;
+    }
+
+    /// Returns the directory where device manifests are stored (empty = none).
+    /// See `ca::FlashElfOp::setManifestDir()`.
+    inline const QString &manifestDir() const
+    {
+        return m_manifestDir;
+    }
+
+    /// Sets the directory where device manifests are stored (empty = none).
+    inline void setManifestDir(QString manifestDir)
+    {
+        m_manifestDir = manifestDir;
+    }
+
+    /// Returns the byte that the parts of flash pages not covered by images are
+    /// filled with (see `ca::FlashImage::setPageFill()`).
+    inline uint8_t pageFill() const
+    {
+        return m_pageFill;
+    }
+
+    /// Sets the byte that the parts of flash pages not covered by images are
+    /// filled with. Only affects images created afterwards.
+    inline void setPageFill(uint8_t pageFill)
+    {
+        m_pageFill = pageFill;
+    }
+
+    /// Returns the cache of flash maps shared by all operations enqueued into
+    /// this instance. See `ca::FlashElfOp::setImageCache()`.
+    inline ca::ImageCache &imageCache()
+    {
+        return m_imageCache;
+    }
+
+    /// Returns the maximum number of devices that operations may be acting
+    /// on concurrently (0 = no limit).
+    inline size_t maxConcurrentDevices() const
+    {
+        return m_maxConcurrentDevices;
+    }
+
+    /// Sets the maximum number of devices that operations may be acting on
+    /// concurrently (0 = no limit).
+    /// Operations that were already started are not affected.
+    inline void setMaxConcurrentDevices(size_t maxConcurrentDevices)
+    {
+        invoke([this, maxConcurrentDevices]()
+        {
+            m_maxConcurrentDevices = maxConcurrentDevices;
+            scheduleOperations();
+        });
+    }
+
+    /// Makes this instance run inside an external event loop instead of a Qt
+    /// one: installs an `ca::EpollEventDispatcher` in the current thread (if it
+    /// has no event dispatcher yet) and defers all work started by calls to this
+    /// instance to `processEvents()`, so that progress and log callbacks are
+    /// only ever called from there.
+    /// Returns false if the current thread already has another event dispatcher
+    /// (ex. because a `QCoreApplication` exists) or if it is not supported on
+    /// this platform.
+    bool useExternalEventLoop();
+
+    /// Returns a file descriptor that becomes readable when `processEvents()`
+    /// has something to do, or -1 if not `useExternalEventLoop()`.
+    /// The descriptor is shared by all instances in the same thread.
+    int eventFd() const;
+
+    /// Processes pending events of all instances in the current thread, waiting
+    /// up to `timeoutMs` milliseconds for some if there are none (0 = don't
+    /// wait, -1 = wait indefinitely).
+    /// Returns the number of events processed (0 or 1 if not known), or -1 on error.
+    int processEvents(int timeoutMs);
+
+    /// Makes this instance run the CAN link, `comms()` and all operations on a
+    /// dedicated I/O thread; must be called before `init()`.
+    /// Progress and log handlers are still called from this instance's thread
+    /// (by its event loop): events are handed over to it via a bounded queue.
+    /// When the queue is full, intermediate progress updates and debug
+    /// messages are dropped (see `numDroppedEvents()`); others are never lost.
+    /// Returns false if the thread could not be started.
+    bool useIoThread();
+
+    /// Returns the dedicated I/O thread, or null if not `useIoThread()`.
+    inline QThread *ioThread() const
+    {
+        return m_ioThread;
+    }
+
+    /// Calls `func` from this instance's thread: right away if it is the
+    /// current one, or else as soon as its event loop picks it up.
+    /// Used to hand results computed on the I/O thread over to the application.
+    void callInAppThread(std::function<void()> func);
+
+    /// Calls `func` from the thread that `comms()` lives in, waiting for it
+    /// to return.
+    void invokeBlocking(std::function<void()> func);
+
 public slots:
     /// Initializes this CANale instance given its init configuration.
     /// Returns true on success or false otherwise.
@@ -80,19 +203,85 @@ public slots:
     /// Enqueues an operation to be performed on this `CAinst`.
     /// The `CAinst` will take ownership of the pointer.
     ///
-    /// Operations are started in FIFO order; check the operation's progress
-    /// handler for its status.
+    /// An operation is started as soon as all operations enqueued before it
+    /// that act on any of its devices are done; operations on disjoint sets of
+    /// devices run concurrently, up to `maxConcurrentDevices()` devices at a time.
+    /// Check the operation's progress handler for its status.
     void addOperation(ca::Operation *operation);
 
+    /// Cancels all enqueued operations, both started and not (see
+    /// `ca::Operation::cancel()`).
+    void cancel();
+
+    /// Cancels all enqueued operations that act on the device with id `devId`,
+    /// both started and not.
+    void cancel(CAdevId devId);
+
 
 private:
     ca::LogHandler m_logHandler; ///< The log handler associated to this CAinst.
+    std::unique_ptr<ca::AsyncLogSink> m_logSink; ///< Where `m_logHandler` writes to if `CAconfig::asyncLog`.
     QSharedPointer<QCanBusDevice> m_can; ///< The link to the CAN network.
     bool m_canConnected; ///< Did `m_can->connectDevice()` succeed?
     QSharedPointer<ca::Comms> m_comms; ///< The CANnuccia protocol interface.
 
 
     std::deque<ca::Operation *> m_operations; ///< All currently-ongoing operations.
+    size_t m_maxConcurrentDevices; ///< Max. devices being operated on at once (0 = no limit).
+    QString m_manifestDir; ///< Where device manifests are stored (empty = none).
+    uint8_t m_pageFill; ///< See `pageFill()`.
+    ca::ImageCache m_imageCache; ///< See `imageCache()`.
+    bool m_scheduling; ///< Is `scheduleOperations()` currently running?
+    ca::EpollEventDispatcher *m_dispatcher; ///< The external event loop's dispatcher (see `useExternalEventLoop()`).
+    std::atomic<size_t> m_numEnqueued; ///< See `numEnqueued()`.
+
+    /// How many events `m_appEvents` can hold before the I/O thread starts
+    /// dropping (or, if not droppable, overflowing) them.
+    static constexpr size_t APP_EVENTS_CAPACITY = 1024;
+
+    /// An event to be handed over from the I/O thread to this instance's thread.
+    struct AppEvent
+    {
+        std::function<void()> func; ///< What to call on this instance's thread.
+        bool droppable; ///< Can the event be dropped if the queue is full?
+    };
+
+    QThread *m_ioThread; ///< The dedicated I/O thread (see `useIoThread()`), or null.
+    ca::LogHandler m_ioLogHandler; ///< Hands log messages from the I/O thread over to `m_logHandler`.
+    ca::SpscRing<AppEvent> m_appEvents; ///< Events from the I/O thread, waiting to be called.
+    std::mutex m_appOverflowMutex; ///< Guards `m_appOverflow`.
+    std::deque<AppEvent> m_appOverflow; ///< Non-droppable events that did not fit in `m_appEvents`.
+    std::atomic<bool> m_appOverflowing; ///< Are events going to `m_appOverflow` instead of `m_appEvents`?
+    std::atomic<bool> m_appDrainPending; ///< Was `drainAppEvents()` already queued on this instance's thread?
+    std::atomic<unsigned long long> m_numDroppedEvents; ///< See `numDroppedEvents()`.
+
+    /// Calls `func` now, or from the event loop of the thread that `comms()`
+    /// lives in if using an I/O thread or an external event loop.
+    void invoke(std::function<void()> func);
+
+    /// Hands `event` over to this instance's thread (or drops it if it is
+    /// droppable and the application is falling behind).
+    /// Only to be called on the I/O thread.
+    void postAppEvent(AppEvent event);
+
+    /// Calls all events handed over by `postAppEvent()`, in order.
+    void drainAppEvents();
+
+    /// Returns the first enqueued operation that is not started yet and that
+    /// can be started now, or null if there is none.
+    ///
+    /// An operation can be started if no operation before it in the queue
+    /// acts on any of its devices, and if starting it would not exceed
+    /// `m_maxConcurrentDevices`. To keep the queue fair, no operation is
+    /// allowed to overtake one that is only waiting for the device cap.
+    ca::Operation *nextOperationToStart() const;
+
+    /// Starts all enqueued operations that can be started now.
+    void scheduleOperations();
+
+    /// Cancels all enqueued operations for which `pred(op)` is true, then starts
+    /// the ones that can be started after that.
+    void cancelIf(const std::function<bool(ca::Operation *)> &pred);
 };
 
 #endif // CANALE_HH
@@ -11,7 +11,6 @@
 #include <QCommandLineParser>
 #include <QRegularExpression>
 #include <QDebug>
-#include <QFile>
 #include "canale.hh"
 #include "util.hh"
 
@@ -37,16 +36,75 @@ void initArgParser(QCommandLineParser &argParser)
          tr("The CAN backend to use (ex. 'socketcan')."), "backend"},
         {{"interface", "i"},
          tr("The CAN interface to use (ex. 'vcan0')."), "interface"},
+        {{"max-devices", "j"},
+         tr("The maximum number of devices to operate on concurrently (0 = no limit)."), "n", "0"},
+        {{"manifest-dir", "m"},
+         tr("The directory where to store manifests of what was flashed to devices; "
+            "if set, only pages that changed since the last flash are sent."), "dir"},
+        {{"bitrate", "r"},
+         tr("The bitrate of the CAN bus in bits/s (only used to enforce --max-bus-load and report bus time)."), "bitrate", "0"},
+        {{"max-bus-load", "l"},
+         tr("The maximum percentage of the bus bandwidth to use (0 = no limit)."), "percent", "0"},
+        {{"fd", "f"},
+         tr("Use CAN FD for devices that support it.")},
+        {"no-compress",
+         tr("Never send compressed pages, even to devices that support it.")},
+        {{"data-bitrate", "d"},
+         tr("The bitrate of the data phase of CAN FD frames in bits/s (0 = interface default)."), "bitrate", "0"},
+        {{"timeout", "t"},
+         tr("How long to wait for a device to respond to each command in ms, before retrying it (0 = defaults)."), "ms", "0"},
+        {{"io-thread", "T"},
+         tr("Talk to devices from a dedicated I/O thread.")},
+        {{"log-level", "L"},
+         tr("The minimum level of messages to log: 'debug', 'info', 'warning' or 'error'."), "level", "debug"},
+        {{"fill", "F"},
+         tr("The value to fill the parts of flash pages not covered by the image with (usually the erased value)."),
+         "byte", "0xFF"},
+        {{"metrics", "M"},
+         tr("Collect per-stage latencies and protocol counters, and print them when done.")},
     });
     argParser.addPositionalArgument("operations",
                                     tr("The operations to perform, in order."), "operations...");
 }
 
-/// Returns an operation as parsed from a string description.
-/// The operation will be created to use the given progress handler.
+/// Prints a summary of the latencies and counters in `metrics`.
+void printMetrics(const ca::ProtocolMetrics &metrics)
+{
+    static const char *const STAGE_NAMES[CA_NUM_STAGES] = {
+        "PROG_REQ", "UNLOCK", "SELECT_PAGE", "CHECK_WRITES", "COMMIT_WRITES", "PROG_DONE",
+    };
+
+    auto printLatencies = [](const QString &name, const ca::LatencyHistogram &hist)
+    {
+        if(hist.count() == 0)
+        {
+            return;
+        }
+        qWarning().noquote()
+            << QStringLiteral("%1: %2 samples, min %3 / p50 %4 / p99 %5 / max %6 ms")
+               .arg(name, -14).arg(hist.count())
+               .arg(hist.minNs() / 1e6, 0, 'f', 3).arg(hist.percentileNs(50.0) / 1e6, 0, 'f', 3)
+               .arg(hist.percentileNs(99.0) / 1e6, 0, 'f', 3).arg(hist.maxNs() / 1e6, 0, 'f', 3);
+    };
+
+    for(unsigned stage = 0; stage < CA_NUM_STAGES; stage ++)
+    {
+        printLatencies(QString::fromLatin1(STAGE_NAMES[stage]), metrics.stageLatencies[stage]);
+    }
+    printLatencies(QStringLiteral("host delay"), metrics.rxHostDelays);
+
+    qWarning().noquote()
+        << QStringLiteral("Frames sent: %1, received: %2; retries: %3, timeouts: %4, CRC mismatches: %5")
+           .arg(metrics.framesSent).arg(metrics.framesReceived).arg(metrics.stageRetries)
+           .arg(metrics.stageTimeouts).arg(metrics.crcMismatches);
+}
+
+/// Appends to `outOps` the operation(s) parsed from a string description.
+/// The operations will be created to use the given progress handler.
 /// Returns true if successful or false otherwise (parsing error).
 /// Logs any errors to the given log handler.
-ca::Operation *parseOperation(QString opDescr, ca::ProgressHandler &onProgress, ca::LogHandler &log)
+bool parseOperation(QString opDescr, CAinst &inst, ca::ProgressHandler &onProgress, ca::LogHandler &log,
+                    QList<ca::Operation *> &outOps)
 {
     QStringList tokens = opDescr.split("+");
 
@@ -55,6 +113,7 @@ ca::Operation *parseOperation(QString opDescr, ca::ProgressHandler &onProgress,
         StartDevices,
         StopDevices,
         FlashElf,
+        Scan,
 
     } opType;
 
@@ -71,10 +130,14 @@ ca::Operation *parseOperation(QString opDescr, ca::ProgressHandler &onProgress,
     {
         opType = OpType::FlashElf;
     }
+    else if(opTypeName == "scan")
+    {
+        opType = OpType::Scan;
+    }
     else
     {
         log(CA_ERROR, tr("Unrecognized operation: \"%1\"").arg(opDescr));
-        return nullptr;
+        return false;
     }
 
     auto parseDevId = [](const QString &str, CAdevId &outDevId) -> bool
@@ -125,48 +188,128 @@ ca::Operation *parseOperation(QString opDescr, ca::ProgressHandler &onProgress,
         if(tokens.length() != 2)
         {
             log(CA_ERROR, tr("Invalid format for start/stop operation: \"%1\"").arg(opDescr));
-            return nullptr;
+            return false;
         }
 
         QSet<CAdevId> devices;
         if(!parseDevList(tokens[1], devices))
         {
-            return nullptr;
+            return false;
         }
 
         if(opType == OpType::StartDevices)
         {
-            return new ca::StartDevicesOp(onProgress, devices);
+            outOps.push_back(new ca::StartDevicesOp(onProgress, devices));
         }
         else
         {
-            return new ca::StopDevicesOp(onProgress, devices);
+            outOps.push_back(new ca::StopDevicesOp(onProgress, devices));
         }
+        return true;
     }
 
     case OpType::FlashElf:
     {
-        if(tokens.length() != 3)
+        if(tokens.length() != 3 && tokens.length() != 4)
         {
             log(CA_ERROR, tr("Invalid format for flash operation: \"%1\"").arg(opDescr));
-            return nullptr;
+            return false;
+        }
+
+        QSet<CAdevId> devices;
+        if(!parseDevList(tokens[1], devices))
+        {
+            return false;
+        }
+
+        // Opens `<path>[@<baseaddr>]`; the address makes it a raw binary
+        auto openImage = [&inst, &log](const QString &spec, const QString &what) -> QSharedPointer<ca::FlashImage>
+        {
+            QString path = spec;
+            long baseAddr = -1;
+            int atIndex = spec.lastIndexOf('@');
+            if(atIndex >= 0)
+            {
+                path = spec.left(atIndex);
+                if(!ca::parseInt(spec.mid(atIndex + 1), baseAddr)
+                   || baseAddr < 0 || baseAddr > long(std::numeric_limits<uint32_t>::max()))
+                {
+                    log(CA_ERROR, tr("Invalid base address for %1: '%2'").arg(what).arg(spec));
+                    return {};
+                }
+            }
+
+            QString error;
+            QSharedPointer<ca::FlashImage> image = ca::FlashImage::mapFile(path, &error);
+            if(!image)
+            {
+                log(CA_ERROR, tr("Failed to open %1: '%2' (%3)").arg(what).arg(path).arg(error));
+                return {};
+            }
+            if(baseAddr >= 0)
+            {
+                image->setFormat(ca::ImageFormat::Binary, static_cast<uint32_t>(baseAddr));
+            }
+            image->setPageFill(inst.pageFill());
+            return image;
+        };
+
+        // Map the image once and share it between all target devices
+        QSharedPointer<ca::FlashImage> image = openImage(tokens[2], tr("image file"));
+        if(!image)
+        {
+            return false;
+        }
+
+        QSharedPointer<ca::FlashImage> baseImage;
+        if(tokens.length() == 4)
+        {
+            baseImage = openImage(tokens[3], tr("base image file"));
+            if(!baseImage)
+            {
+                return false;
+            }
+        }
+
+        for(CAdevId devId : devices)
+        {
+            auto op = new ca::FlashElfOp(onProgress, devId, image);
+            op->setManifestDir(inst.manifestDir());
+            op->setImageCache(&inst.imageCache());
+            op->setBaseImage(baseImage);
+            outOps.push_back(op);
         }
+        return true;
+    }
 
-        CAdevId devId;
-        if(!parseDevId(tokens[1], devId))
+    case OpType::Scan:
+    {
+        if(tokens.length() > 2)
         {
-            log(CA_ERROR, tr("Invalid device id: %1").arg(tokens[1]));
-            return nullptr;
+            log(CA_ERROR, tr("Invalid format for scan operation: \"%1\"").arg(opDescr));
+            return false;
         }
 
-        QFile elfFile(tokens[2]);
-        if(!elfFile.open(QFile::ReadOnly))
+        long windowMs = 0;
+        if(tokens.length() == 2 && (!ca::parseInt(tokens[1], windowMs) || windowMs <= 0))
         {
-            log(CA_ERROR, tr("Failed to open ELF file: '%1'").arg(tokens[2]));
-            return nullptr;
+            log(CA_ERROR, tr("Invalid scan window: \"%1\"").arg(tokens[1]));
+            return false;
         }
 
-        return new ca::FlashElfOp(onProgress, devId, elfFile.readAll());
+        auto op = new ca::ScanOp(onProgress, ca::ScanOp::allDevices(), static_cast<int>(windowMs));
+        op->setResultHandler([&inst](const CAscanResult &result)
+        {
+            inst.callInAppThread([result]()
+            {
+                qWarning().noquote()
+                    << QStringLiteral("Found device %1: page size %2B, %3 pages, ELF machine %4, latency %5 ms")
+                       .arg(ca::hexStr(result.devId, sizeof(CAdevId) * 2)).arg(result.pageSize)
+                       .arg(result.nFlashPages).arg(result.elfMachine).arg(result.latencyNs / 1e6, 0, 'f', 2);
+            });
+        });
+        outOps.push_back(op);
+        return true;
     }
 
     }
@@ -185,14 +328,76 @@ int main(int argc, char **argv)
 
     std::string backendStr(qPrintable(argParser.value("backend")));
     std::string interfaceStr(qPrintable(argParser.value("interface")));
+    std::string manifestDirStr(qPrintable(argParser.value("manifest-dir")));
+
+    long maxDevices;
+    if(!ca::parseInt(argParser.value("max-devices"), maxDevices) || maxDevices < 0)
+    {
+        qCritical() << "Invalid maximum number of devices:" << argParser.value("max-devices");
+        return 2;
+    }
+
+    long bitrate, dataBitrate, maxBusLoad, timeoutMs;
+    if(!ca::parseInt(argParser.value("bitrate"), bitrate) || bitrate < 0)
+    {
+        qCritical() << "Invalid bitrate:" << argParser.value("bitrate");
+        return 2;
+    }
+    if(!ca::parseInt(argParser.value("data-bitrate"), dataBitrate) || dataBitrate < 0)
+    {
+        qCritical() << "Invalid data bitrate:" << argParser.value("data-bitrate");
+        return 2;
+    }
+    if(!ca::parseInt(argParser.value("max-bus-load"), maxBusLoad) || maxBusLoad < 0 || maxBusLoad > 100)
+    {
+        qCritical() << "Invalid maximum bus load:" << argParser.value("max-bus-load");
+        return 2;
+    }
+
+    if(!ca::parseInt(argParser.value("timeout"), timeoutMs) || timeoutMs < 0)
+    {
+        qCritical() << "Invalid timeout:" << argParser.value("timeout");
+        return 2;
+    }
+
+    long pageFill;
+    if(!ca::parseInt(argParser.value("fill"), pageFill) || pageFill < 0 || pageFill > 0xFF)
+    {
+        qCritical() << "Invalid fill byte:" << argParser.value("fill");
+        return 2;
+    }
 
-    CAconfig config;
+    const QString logLevelStr = argParser.value("log-level").toLower();
+    const QStringList logLevelNames = {"debug", "info", "warning", "error"};
+    int logLevel = logLevelNames.indexOf(logLevelStr);
+    if(logLevel < 0)
+    {
+        qCritical() << "Invalid log level:" << argParser.value("log-level");
+        return 2;
+    }
+
+    CAconfig config = {};
     config.canBackend = backendStr.c_str();
     config.canInterface = interfaceStr.c_str();
     config.logHandler = [](CAlogLevel level, const char *msg)
     {
         qWarning() << level << "-" << msg;
     };
+    config.maxConcurrentDevices = static_cast<unsigned>(maxDevices);
+    config.manifestDir = argParser.isSet("manifest-dir") ? manifestDirStr.c_str() : nullptr;
+    config.canBitrate = static_cast<unsigned long>(bitrate);
+    config.maxBusLoad = static_cast<unsigned>(maxBusLoad);
+    config.canFd = argParser.isSet("fd") ? 1 : 0;
+    config.noCompression = argParser.isSet("no-compress") ? 1 : 0;
+    config.canDataBitrate = static_cast<unsigned long>(dataBitrate);
+    config.ioThread = argParser.isSet("io-thread") ? 1 : 0;
+    config.logLevel = static_cast<CAlogLevel>(CA_DEBUG + logLevel);
+    config.pageFill = CA_PAGE_FILL_SET | static_cast<unsigned>(pageFill);
+    config.metrics = argParser.isSet("metrics") ? 1 : 0;
+    for(unsigned &stageTimeoutMs : config.stageTimeoutsMs)
+    {
+        stageTimeoutMs = static_cast<unsigned>(timeoutMs);
+    }
 
     CAinst inst;
     if(!inst.init(config))
@@ -228,12 +433,10 @@ int main(int argc, char **argv)
     QList<ca::Operation *> operations;
     for(const QString &opDescr : argParser.positionalArguments())
     {
-        ca::Operation *op = parseOperation(opDescr, onProgress, inst.logHandler());
-        if(!op)
+        if(!parseOperation(opDescr, inst, onProgress, inst.logHandler(), operations))
         {
             return 2;
         }
-        operations.push_back(op);
     }
 
     // Start them only if they could all be parsed
@@ -242,5 +445,16 @@ int main(int argc, char **argv)
         inst.addOperation(op);
     }
 
-    return app.exec();
+    int result = app.exec();
+
+    if(argParser.isSet("metrics"))
+    {
+        ca::ProtocolMetrics metrics;
+        inst.invokeBlocking([&inst, &metrics]()
+        {
+            metrics = inst.comms()->metrics();
+        });
+        printMetrics(metrics);
+    }
+    return result;
 }
@@ -7,9 +7,13 @@
 // file, You can obtain one at http://mozilla.org/MPL/2.0/.
 #include "comm_op.hh"
 
+#include <algorithm>
+#include <QTimer>
 #include "comms.hh"
 #include "util.hh"
 #include "elf.hh"
+#include "manifest.hh"
+#include "log.hh"
 #include "moc_comm_op.cpp"
 
 namespace ca
@@ -21,14 +25,31 @@ inline QString devIdStr(CAdevId devId)
     return hexStr(devId, sizeof(CAdevId) * 2);
 }
 
+/// Returns the name of the command sent in a protocol stage.
+inline QString stageStr(CAstage stage)
+{
+    switch(stage)
+    {
+    case CA_STAGE_PROG_REQ: return QStringLiteral("PROG_REQ");
+    case CA_STAGE_UNLOCK: return QStringLiteral("UNLOCK");
+    case CA_STAGE_SELECT_PAGE: return QStringLiteral("SELECT_PAGE");
+    case CA_STAGE_CHECK_WRITES: return QStringLiteral("CHECK_WRITES");
+    case CA_STAGE_COMMIT_WRITES: return QStringLiteral("COMMIT_WRITES");
+    case CA_STAGE_PROG_DONE: return QStringLiteral("PROG_DONE");
+    default: return QStringLiteral("?");
+    }
+}
+
 
 Operation::Operation(ProgressHandler onProgress, QObject *parent)
-    : QObject(parent), m_onProgress(std::move(onProgress)), m_started(false)
+    : QObject(parent), m_onProgress(std::move(onProgress)), m_started(false), m_finished(false),
+      m_logger(nullptr)
 {
 }
 
 Operation::~Operation()
 {
+    releaseDevices();
 }
 
 void Operation::start(QSharedPointer<Comms> comms, LogHandler *logger)
@@ -36,13 +57,71 @@ void Operation::start(QSharedPointer<Comms> comms, LogHandler *logger)
     m_comms = comms;
     m_logger = logger;
     m_started = true;
+
+    // Become the only receiver of our devices' events
+    for(CAdevId devId : devices())
+    {
+        if(!m_comms->claim(devId, this))
+        {
+            progress(QStringLiteral("%1 is in use by another operation").arg(devIdStr(devId)),
+                     -CA_ERR_GENERIC);
+            return;
+        }
+        m_claimedDevices.insert(devId);
+    }
+
     started();
 }
 
+void Operation::cancel()
+{
+    progress(QStringLiteral("Operation cancelled"), -CA_ERR_CANCELLED);
+}
+
+void Operation::finish(bool failed)
+{
+    m_finished = true;
+    if(!m_comms)
+    {
+        // Never started
+        return;
+    }
+
+    if(failed)
+    {
+        // Tear down whatever was still going on with our devices
+        for(CAdevId devId : m_claimedDevices)
+        {
+            m_comms->abort(devId);
+        }
+    }
+
+    // IMPORTANT: stop receiving any future events
+    releaseDevices();
+}
+
+void Operation::releaseDevices()
+{
+    if(m_comms)
+    {
+        for(CAdevId devId : m_claimedDevices)
+        {
+            m_comms->release(devId, this);
+        }
+    }
+    m_claimedDevices.clear();
+}
+
+void Operation::onStageTimedOut(CAdevId devId, CAstage stage)
+{
+    progress(QStringLiteral("%1 did not respond to %2").arg(devIdStr(devId)).arg(stageStr(stage)),
+             -(CA_ERR_TIMEOUT + stage));
+}
+
 StartDevicesOp::StartDevicesOp(ProgressHandler onProgress,
                                QSet<CAdevId> devices, QObject *parent)
     : Operation(onProgress, parent),
-      m_devices(devices), m_nDevices(devices.size())
+      m_targetDevices(devices), m_devices(devices), m_nDevices(devices.size())
 {
 }
 
@@ -54,9 +133,6 @@ void StartDevicesOp::started()
         return;
     }
 
-    // Listen for when a device gets started
-    connect(comms().get(), &ca::Comms::progStarted, this, &StartDevicesOp::onProgStarted);
-
     // Send start command to all devices
     for(CAdevId devId : m_devices)
     {
@@ -64,11 +140,11 @@ void StartDevicesOp::started()
     }
 }
 
-void StartDevicesOp::onProgStarted(CAdevId devId)
+void StartDevicesOp::onProgStarted(CAdevId devId, const DeviceStats &)
 {
     if(!m_devices.remove(devId))
     {
-        // Not one of our devices
+        // Already started
         return;
     }
 
@@ -79,9 +155,6 @@ void StartDevicesOp::onProgStarted(CAdevId devId)
 
     if(m_devices.empty())
     {
-        // IMPORTANT: disconnect ourselves from any future events
-        disconnect(comms().get(), &ca::Comms::progStarted, this, &StartDevicesOp::onProgStarted);
-
         // Done!
         progress(QStringLiteral("Unlocked %1 device[s]").arg(m_nDevices), 100);
     }
@@ -91,7 +164,7 @@ void StartDevicesOp::onProgStarted(CAdevId devId)
 StopDevicesOp::StopDevicesOp(ProgressHandler onProgress,
                              QSet<CAdevId> devices, QObject *parent)
     : Operation(onProgress, parent),
-      m_devices(devices), m_nDevices(devices.size())
+      m_targetDevices(devices), m_devices(devices), m_nDevices(devices.size())
 {
 }
 
@@ -103,9 +176,6 @@ void StopDevicesOp::started()
         return;
     }
 
-    // Listen for when a device gets stopped
-    connect(comms().get(), &ca::Comms::progEnded, this, &StopDevicesOp::onProgEnd);
-
     // Send stop command to all devices
     for(CAdevId devId : m_devices)
     {
@@ -113,11 +183,11 @@ void StopDevicesOp::started()
     }
 }
 
-void StopDevicesOp::onProgEnd(CAdevId devId)
+void StopDevicesOp::onProgEnded(CAdevId devId)
 {
     if(!m_devices.remove(devId))
     {
-        // Not one of our devices
+        // Already stopped
         return;
     }
 
@@ -128,157 +198,428 @@ void StopDevicesOp::onProgEnd(CAdevId devId)
 
     if(m_devices.empty())
     {
-        // IMPORTANT: disconnect ourselves from any future events
-        disconnect(comms().get(), &ca::Comms::progEnded, this, &StopDevicesOp::onProgEnd);
-
         // Done!
         progress(QStringLiteral("Locked %1 device[s]").arg(m_nDevices), 100);
     }
 }
 
 
+constexpr int ScanOp::DEFAULT_WINDOW_MS;
+
+ScanOp::ScanOp(ProgressHandler onProgress,
+               QSet<CAdevId> devices, int windowMs, QObject *parent)
+    : Operation(onProgress, parent),
+      m_targetDevices(devices), m_windowMs(windowMs > 0 ? windowMs : DEFAULT_WINDOW_MS),
+      m_nPending(0)
+{
+}
+
+QSet<CAdevId> ScanOp::allDevices()
+{
+    QSet<CAdevId> devices;
+    devices.reserve(256);
+    for(unsigned devId = 0; devId < 256; devId ++)
+    {
+        devices.insert(static_cast<CAdevId>(devId));
+    }
+    return devices;
+}
+
+void ScanOp::started()
+{
+    m_wallTimer.start();
+    m_results.clear();
+    m_nPending = m_targetDevices.size();
+    if(m_nPending == 0)
+    {
+        progress(QStringLiteral("No devices to scan"), 100);
+        return;
+    }
+
+    progress(QStringLiteral("Scanning %1 device id[s] (%2 ms window)")
+             .arg(m_nPending).arg(m_windowMs), 0);
+
+    // Send all PROG_REQs at once; `Comms` paces them on the bus
+    // (Scan in id order, for predictable results on the bus)
+    QList<CAdevId> devIds = m_targetDevices.values();
+    std::sort(devIds.begin(), devIds.end());
+    for(CAdevId devId : devIds)
+    {
+        comms()->probe(devId, m_windowMs);
+    }
+
+    // Wait for `onProbed()` or `onProbeTimedOut()` for each device
+}
+
+void ScanOp::deviceDone()
+{
+    m_nPending --;
+    if(m_nPending > 0)
+    {
+        int nTargets = m_targetDevices.size();
+        int progr = std::min(static_cast<int>(100.0f * (nTargets - m_nPending) / nTargets), 99);
+        progress(QStringLiteral("Scanned %1 of %2 device id[s]").arg(nTargets - m_nPending).arg(nTargets),
+                 progr, false);
+        return;
+    }
+
+    double wallMs = m_wallTimer.nsecsElapsed() / 1e6;
+    progress(QStringLiteral("Found %1 device[s] in %2 ms").arg(m_results.size()).arg(wallMs, 0, 'f', 1),
+             100);
+}
+
+void ScanOp::onProbed(CAdevId devId, const DeviceStats &devStats, int64_t latencyNs)
+{
+    CAscanResult result;
+    result.devId = devId;
+    result.pageSize = devStats.pageSize;
+    result.nFlashPages = devStats.nFlashPages;
+    result.elfMachine = devStats.elfMachine;
+    result.latencyNs = latencyNs;
+    m_results.push_back(result);
+
+    CA_LOG_DEBUG(loggerSafe(),
+                 QStringLiteral("Found %1: %2 pages of %3B, ELF machine %4 (responded in %5 ms)")
+                 .arg(devIdStr(devId)).arg(devStats.nFlashPages).arg(devStats.pageSize)
+                 .arg(devStats.elfMachine).arg(latencyNs / 1e6, 0, 'f', 2));
+    if(m_onResult)
+    {
+        m_onResult(result);
+    }
+
+    deviceDone();
+}
+
+void ScanOp::onProbeTimedOut(CAdevId devId)
+{
+    (void)devId;
+    deviceDone();
+}
+
+
 FlashElfOp::FlashElfOp(ProgressHandler onProgress,
                        CAdevId devId, QByteArray elfData, QObject *parent)
+    : FlashElfOp(onProgress, devId, QSharedPointer<FlashImage>::create(elfData), parent)
+{
+}
+
+FlashElfOp::FlashElfOp(ProgressHandler onProgress,
+                       CAdevId devId, QSharedPointer<FlashImage> image, QObject *parent)
     : Operation(onProgress, parent),
-      m_devId(devId), m_elfData(elfData)
+      m_devId(devId), m_image(image), m_imageCache(nullptr),
+      m_nPagesElided(0), m_elidedBusBits(0.0), m_nPagesFlashed(0), m_pageRetries(0), m_deviceRetries(0)
 {
 }
 
+FlashElfOp::~FlashElfOp() = default;
+
 void FlashElfOp::started()
 {
     QString devIdS = devIdStr(m_devId);
 
-    if(m_elfData.isNull() || m_elfData.isEmpty())
+    if(!m_image)
     {
-        progress(QStringLiteral("No ELF supplied for %1").arg(devIdS), -1);
+        progress(QStringLiteral("No ELF supplied for %1").arg(devIdS), -CA_ERR_GENERIC);
         return;
     }
 
 
-    // [0..4%]: Load ELF
+    // [0..4%]: Load ELF (only parsed once if shared with other operations)
     progress(QStringLiteral("Loading ELF for %1").arg(devIdS), 0);
 
-    MemIStream elfFileStream(reinterpret_cast<const uint8_t *>(m_elfData.data()),
-                             static_cast<size_t>(m_elfData.size()));
-    m_elf = std::make_unique<ELFIO::elfio>();
-    if(!m_elf->load(elfFileStream))
+    if(!m_image->load(loggerSafe(), m_imageCache))
     {
-        progress(QStringLiteral("Failed to load ELF for %1").arg(devIdS), -1);
+        progress(QStringLiteral("Failed to load ELF for %1").arg(devIdS), -CA_ERR_GENERIC);
         return;
     }
     progress(QStringLiteral("ELF loaded for %1").arg(devIdS), 4);
 
-    elfInfo(*m_elf, loggerSafe());
-
     // [5..9%]: Send PROG_REQ and UNLOCK
     progress(QStringLiteral("Unlocking %1 to flash ELF").arg(devIdS), 5);
 
-    connect(comms().get(), &Comms::progStarted, this, &FlashElfOp::onProgStarted);
     comms()->progStart(m_devId);
 
     // Wait for `onProgStarted()`
 }
 
-void FlashElfOp::onProgStarted(CAdevId devId, DeviceStats devStats)
+void FlashElfOp::onProgStarted(CAdevId devId, const DeviceStats &devStats)
 {
-    if(devId != m_devId)
+    if(m_flashMap)
     {
-        // Not the device we want to flash
+        // Make sure we only start flashing once
         return;
     }
     QString devIdS = devIdStr(m_devId);
 
-    // Make sure we only start flashing once
-    disconnect(comms().get(), &Comms::progStarted, this, &FlashElfOp::onProgStarted);
-
     // [9%]: PROG_REQ and UNLOCK done
     progress(QStringLiteral("%1 unlocked").arg(devIdS), 9);
 
     // [10..14%]: Check device stats, list segments, build flash map
     progress(QStringLiteral("Checking if %1 is compatibile with ELF").arg(devIdS), 10);
-    if(devStats.elfMachine != m_elf->get_machine())
+    if(m_image->hasMachine() && devStats.elfMachine != m_image->machine())
     {
-        progress(QStringLiteral("%1 ELF machine mismatch").arg(devIdS), -2);
+        progress(QStringLiteral("%1 ELF machine mismatch").arg(devIdS), -CA_ERR_ELF_MACHINE);
         log(CA_ERROR,
             QStringLiteral("%1 has machine type %2 but ELF e_machine is %3")
-            .arg(devIdS).arg(devStats.elfMachine).arg(m_elf->get_machine()));
+            .arg(devIdS).arg(devStats.elfMachine).arg(m_image->machine()));
         return;
     }
 
-    progress(QStringLiteral("Listing ELF segments to flash to %1").arg(devIdS), 11);
-    ElfioSegments segments;
-    listElfSegmentsToFlash(*m_elf, segments, loggerSafe());
-
+    // (Only built once per page size if the image is shared with other operations,
+    // and not at all if the image cache already holds it)
     progress(QStringLiteral("Building ELF flash map for %1").arg(devIdS), 12);
-    m_flashMap = FlashMap(segments, devStats.pageSize);
+    m_flashMap = m_image->flashMap(devStats.pageSize, loggerSafe(), m_imageCache);
+    if(!m_flashMap)
+    {
+        progress(QStringLiteral("Failed to build ELF flash map for %1").arg(devIdS), -CA_ERR_GENERIC);
+        return;
+    }
 
     progress(QStringLiteral("ELF flash map for %1 built").arg(devIdS), 13);
-    log(CA_DEBUG,
-        QStringLiteral("%1: %3 pages of size %2B to be flashed")
-        .arg(devIdS).arg(devStats.pageSize).arg(m_flashMap.numPages()));
+    CA_LOG_DEBUG(loggerSafe(),
+                 QStringLiteral("%1: %3 pages of size %2B to be flashed")
+                 .arg(devIdS).arg(devStats.pageSize).arg(m_flashMap->numPages()));
 
-    if(m_flashMap.pages().size() == 0)
+    if(m_flashMap->pages().size() == 0)
     {
         progress(QStringLiteral("Nothing to flash to %1; ELF flash map is empty").arg(devIdS),
                  100);
         return;
     }
 
-    // [15..100%]: Send page flash commands for pages in flash map
+    listPagesToFlash(devStats);
+    size_t nPagesSkipped = m_flashMap->numPages() - m_pagesToFlash.size() - m_nPagesElided;
+    if(m_pagesToFlash.empty())
+    {
+        updateManifest();
+        progress(QStringLiteral("Nothing to flash to %1; all %2 pages are already on the device (%3)")
+                 .arg(devIdS).arg(m_flashMap->numPages()).arg(pageCountsStr()),
+                 100);
+        return;
+    }
+    if(nPagesSkipped > 0)
+    {
+        log(CA_INFO,
+            QStringLiteral("%1: %2 of %3 pages are already on the device and will be skipped")
+            .arg(devIdS).arg(nPagesSkipped).arg(m_flashMap->numPages()));
+    }
+
+    // [15..100%]: Send page flash commands for pages to be flashed
     progress(QStringLiteral("Flashing pages to %1").arg(devIdS), 15);
+    invalidateManifest();
 
-    auto firstPage = m_flashMap.pages().begin();
-    connect(comms().get(), &Comms::pageFlashed, this, &FlashElfOp::onPageFlashed);
-    connect(comms().get(), &Comms::pageFlashErrored, this, &FlashElfOp::onPageFlashErrored);
-    comms()->flashPage(devId, firstPage->first, firstPage->second);
+    m_nPagesFlashed = 0;
+    m_pageRetries = 0;
+    m_deviceRetries = 0;
+    auto firstPage = m_pagesToFlash.front();
+    comms()->flashPage(devId, firstPage->first, firstPage->second.data, firstPage->second.crc);
 
     // Asked to flash the first page; wait for `onPageFlashed()` or `onPageFlashErrored()`
 }
 
+void FlashElfOp::listPagesToFlash(const DeviceStats &devStats)
+{
+    QString devIdS = devIdStr(m_devId);
+
+    // (A device that erased its flash on unlock has none of the pages on it anymore,
+    // but writing a page that is all its erased value would be a no-op)
+    bool erasedOnUnlock = (devStats.features & DEVICE_FEATURE_ERASED_ON_UNLOCK) != 0;
+    if(erasedOnUnlock && (!m_manifestDir.isEmpty() || m_baseImage))
+    {
+        log(CA_INFO,
+            QStringLiteral("%1: device erases its flash on unlock; ignoring manifest/base ELF")
+            .arg(devIdS));
+    }
+
+    if(!m_manifestDir.isEmpty())
+    {
+        m_manifest = std::make_unique<FlashManifest>(m_devId, devStats);
+
+        FlashManifest prevManifest;
+        if(!erasedOnUnlock && prevManifest.load(m_manifestDir, m_devId))
+        {
+            if(prevManifest.matches(devStats))
+            {
+                *m_manifest = prevManifest;
+            }
+            else
+            {
+                log(CA_WARNING,
+                    QStringLiteral("%1: device does not match its manifest anymore; flashing all pages")
+                    .arg(devIdS));
+            }
+        }
+    }
+
+    QSharedPointer<const FlashMap> baseFlashMap;
+    if(m_baseImage && !erasedOnUnlock)
+    {
+        if(m_baseImage->load(loggerSafe(), m_imageCache)
+           && (!m_baseImage->hasMachine() || m_baseImage->machine() == devStats.elfMachine))
+        {
+            baseFlashMap = m_baseImage->flashMap(devStats.pageSize, loggerSafe(), m_imageCache);
+        }
+        if(!baseFlashMap)
+        {
+            log(CA_WARNING,
+                QStringLiteral("%1: base ELF is invalid or for another machine; ignoring it")
+                .arg(devIdS));
+        }
+    }
+
+    m_pagesToFlash.clear();
+    m_pagesToFlash.reserve(m_flashMap->numPages());
+    m_nPagesElided = 0;
+    m_elidedBusBits = 0.0;
+    for(auto it = m_flashMap->pages().begin(); it != m_flashMap->pages().end(); it ++)
+    {
+        if(erasedOnUnlock && it->second.blankValue == devStats.erasedValue)
+        {
+            // Already blank on the device
+            m_nPagesElided ++;
+            m_elidedBusBits += comms()->pageFlashBusBits(m_devId, it->second.data);
+            continue;
+        }
+        if(m_manifest && m_manifest->hasPage(it->first, it->second.data, it->second.crc))
+        {
+            // Same contents committed to the device in a previous run
+            continue;
+        }
+        if(baseFlashMap)
+        {
+            auto basePage = baseFlashMap->findPage(it->first);
+            if(basePage != baseFlashMap->pages().end()
+               && basePage->second.crc == it->second.crc && basePage->second.data == it->second.data)
+            {
+                // Same contents as in the image already on the device
+                continue;
+            }
+        }
+        m_pagesToFlash.push_back(it);
+    }
+
+    if(m_nPagesElided > 0)
+    {
+        log(CA_INFO,
+            QStringLiteral("%1: %2 of %3 pages are blank and will not be flashed")
+            .arg(devIdS).arg(m_nPagesElided).arg(m_flashMap->numPages()));
+    }
+}
+
+QString FlashElfOp::pageCountsStr()
+{
+    size_t nPagesSkipped = m_flashMap->numPages() - m_pagesToFlash.size() - m_nPagesElided;
+    QString str = QStringLiteral("%1 pages flashed, %2 skipped")
+                  .arg(m_pagesToFlash.size()).arg(nPagesSkipped);
+    if(m_nPagesElided > 0)
+    {
+        unsigned long bitrate = comms()->busBitrate();
+        if(bitrate > 0)
+        {
+            str += QStringLiteral(", %1 blank elided saving ~%2ms of bus time")
+                   .arg(m_nPagesElided).arg(m_elidedBusBits * 1000.0 / bitrate, 0, 'f', 1);
+        }
+        else
+        {
+            str += QStringLiteral(", %1 blank elided saving ~%2kbit of bus traffic")
+                   .arg(m_nPagesElided).arg(m_elidedBusBits / 1000.0, 0, 'f', 1);
+        }
+    }
+    return str;
+}
+
+void FlashElfOp::invalidateManifest()
+{
+    if(!m_manifest)
+    {
+        return;
+    }
+
+    for(auto page : m_pagesToFlash)
+    {
+        m_manifest->removePage(page->first);
+    }
+    if(!m_manifest->save(m_manifestDir))
+    {
+        log(CA_WARNING,
+            QStringLiteral("%1: failed to save manifest to %2")
+            .arg(devIdStr(m_devId)).arg(FlashManifest::path(m_manifestDir, m_devId)));
+    }
+}
+
+void FlashElfOp::updateManifest()
+{
+    if(!m_manifest)
+    {
+        return;
+    }
+
+    // All pages in the flash map are now on the device (either flashed now or before)
+    for(auto it = m_flashMap->pages().begin(); it != m_flashMap->pages().end(); it ++)
+    {
+        m_manifest->setPage(it->first, it->second.data, it->second.crc);
+    }
+    if(!m_manifest->save(m_manifestDir))
+    {
+        log(CA_WARNING,
+            QStringLiteral("%1: failed to save manifest to %2")
+            .arg(devIdStr(m_devId)).arg(FlashManifest::path(m_manifestDir, m_devId)));
+    }
+}
+
 void FlashElfOp::onPageFlashed(CAdevId devId, uint32_t pageAddr)
 {
-    if(devId != m_devId)
+    if(m_nPagesFlashed >= m_pagesToFlash.size())
     {
-        // Not the device we are flashing
+        // Not flashing pages (yet / anymore)
         return;
     }
     QString devIdS = devIdStr(m_devId);
 
+    auto curPage = m_pagesToFlash[m_nPagesFlashed];
+    if(pageAddr != curPage->first)
+    {
+        log(CA_WARNING,
+            QStringLiteral("%1: page at %2 was flashed, but wasn't the page being flashed")
+            .arg(devIdS).arg(hexStr(pageAddr, sizeof(pageAddr) * 2)));
+        return;
+    }
+
     // [15..100%]: Page flashing
-    m_flashMap.pages().erase(pageAddr);
+    m_nPagesFlashed ++;
+    m_pageRetries = 0;
+    size_t nPagesToFlash = m_pagesToFlash.size();
 
-    size_t nPagesFlashed = m_flashMap.numPages() - m_flashMap.pages().size();
     constexpr int prevProgress = 15;
-    int progr = std::min(prevProgress + static_cast<int>(float(100 - prevProgress) * nPagesFlashed / m_flashMap.numPages()), 99);
+    int progr = std::min(prevProgress + static_cast<int>(float(100 - prevProgress) * m_nPagesFlashed / nPagesToFlash), 99);
     progress(QStringLiteral("Flashed %2 of %3 to %1")
-             .arg(devIdS).arg(nPagesFlashed).arg(m_flashMap.numPages()), progr);
+             .arg(devIdS).arg(m_nPagesFlashed).arg(nPagesToFlash), progr);
 
-    if(m_flashMap.pages().empty())
+    if(m_nPagesFlashed == nPagesToFlash)
     {
-        // IMPORTANT: Make sure to disconnect ourselves from all future events
-        disconnect(comms().get(), &Comms::pageFlashed, this, &FlashElfOp::onPageFlashed);
-        disconnect(comms().get(), &Comms::pageFlashErrored, this, &FlashElfOp::onPageFlashErrored);
+        updateManifest();
 
-        progress(QStringLiteral("Done flashing %1").arg(devIdS), 100);
+        progress(QStringLiteral("Done flashing %1 (%2)").arg(devIdS).arg(pageCountsStr()), 100);
         return;
     }
 
-    auto nextPage = m_flashMap.pages().begin();
-    comms()->flashPage(devId, nextPage->first, nextPage->second);
+    auto nextPage = m_pagesToFlash[m_nPagesFlashed];
+    comms()->flashPage(devId, nextPage->first, nextPage->second.data, nextPage->second.crc);
 
     // Asked to flash the next page; wait for `onPageFlashed()` or `onPageFlashErrored()`
 }
 
 void FlashElfOp::onPageFlashErrored(CAdevId devId, uint32_t pageAddr, uint16_t expectedCrc, uint16_t recvdCrc)
 {
-    if(devId != m_devId)
+    (void)devId;
+    if(m_nPagesFlashed >= m_pagesToFlash.size())
     {
-        // Not the device we are flashing
+        // Not flashing pages (yet / anymore)
         return;
     }
 
-    auto failedPage = m_flashMap.pages().find(pageAddr);
-    if(failedPage == m_flashMap.pages().end())
+    auto curPage = m_pagesToFlash[m_nPagesFlashed];
+    if(pageAddr != curPage->first)
     {
         log(CA_WARNING,
             QStringLiteral("%1: page at %2 failed to flash, but wasn't supposed to be flashed anyways")
@@ -286,13 +627,40 @@ void FlashElfOp::onPageFlashErrored(CAdevId devId, uint32_t pageAddr, uint16_t e
         return;
     }
 
+    QString devIdS = devIdStr(m_devId);
+    QString pageAddrS = hexStr(pageAddr, sizeof(pageAddr) * 2);
     log(CA_WARNING,
         QStringLiteral("%1: flashing failed for page at %2 (expected CRC: %3, received: %4)")
-        .arg(devIdStr(m_devId)).arg(hexStr(pageAddr, sizeof(pageAddr) * 2))
-        .arg(hexStr(expectedCrc)).arg(hexStr(recvdCrc)));
+        .arg(devIdS).arg(pageAddrS).arg(hexStr(expectedCrc)).arg(hexStr(recvdCrc)));
 
-    // Retry flashing the page (potentially forever!)
-    comms()->flashPage(m_devId, failedPage->first, failedPage->second);
+    const RetryPolicy &policy = comms()->retryPolicy();
+    if(m_pageRetries >= policy.maxPageRetries)
+    {
+        progress(QStringLiteral("%1: page at %2 failed to flash %3 times in a row")
+                 .arg(devIdS).arg(pageAddrS).arg(m_pageRetries + 1),
+                 -CA_ERR_PAGE_RETRIES);
+        return;
+    }
+    if(m_deviceRetries >= policy.maxDeviceRetries)
+    {
+        progress(QStringLiteral("%1: too many pages failed to flash (%2 retries)")
+                 .arg(devIdS).arg(m_deviceRetries),
+                 -CA_ERR_DEVICE_RETRIES);
+        return;
+    }
+
+    // Retry flashing the page after a backoff (the link or the device may be
+    // having a bad time)
+    int backoffMs = policy.pageRetryBackoffMs << std::min(m_pageRetries, 4u);
+    m_pageRetries ++;
+    m_deviceRetries ++;
+    QTimer::singleShot(backoffMs, this, [this, curPage]()
+    {
+        if(!isFinished())
+        {
+            comms()->flashPage(m_devId, curPage->first, curPage->second.data, curPage->second.crc);
+        }
+    });
 }
 
 }
@@ -10,26 +10,30 @@
 
 #include <functional>
 #include <memory>
+#include <vector>
 #include <QObject>
 #include <QString>
 #include <QSet>
 #include <QByteArray>
 #include <QSharedPointer>
-#include <elfio/elfio.hpp>
+#include <QElapsedTimer>
 #include "api.h"
 #include "types.hh"
+#include "comms.hh"
 #include "elf.hh"
 
 
 namespace ca
 {
 
-class Comms; // (#include "comms.hh")
-struct DeviceStats; // (#include "comms.hh")
+class FlashManifest; // (#include "manifest.hh")
 
 /// An operation involving `Comms`; it sends and receives messages/ACKs and keeps
 /// track of its own progress.
-class CA_API Operation : public QObject
+///
+/// While it runs, the operation `Comms::claim()`s all of its `devices()`, so that
+/// it is the only receiver of their events.
+class CA_API Operation : public QObject, public DeviceListener
 {
     Q_OBJECT
 
@@ -50,12 +54,30 @@ public:
         return m_started;
     }
 
+    /// Returns whether the operation is over, either because it completed or
+    /// because it failed (or was cancelled).
+    inline bool isFinished() const
+    {
+        return m_finished;
+    }
+
+    /// Returns the set of devices this operation acts on.
+    /// Operations on disjoint sets of devices can run concurrently; the set
+    /// must not change during the lifetime of the operation.
+    virtual QSet<CAdevId> devices() const = 0;
+
 public slots:
     /// Starts the operation.
     /// It will use `Comms` to communicate from/to devices and `logger` (if any)
     /// to log information about the ongoing operation.
+    /// Fails if any of its devices is claimed by another operation.
     void start(QSharedPointer<Comms> comms, ca::LogHandler *logger);
 
+    /// Cancels the operation, whether it was started or not. If it was, all
+    /// of its devices are `Comms::abort()`ed.
+    /// The progress handler is called with `-CA_ERR_CANCELLED`.
+    void cancel();
+
 protected:
     /// Invoked when the operation is `start()`ed.
     virtual void started() = 0;
@@ -82,28 +104,46 @@ protected:
     /// Calls `onProgress(message, progress)`. If `doLog` is `true` also logs the
     /// progress message (as CA_INFO or CA_ERROR depending on if `progress` is
     /// negative).
+    ///
+    /// A `progress` of 100 or a negative one (`-CAerror`) finishes the operation;
+    /// progress reported after that is ignored.
     inline void progress(QString message, int progress, bool doLog=true)
     {
+        if(m_finished)
+        {
+            return;
+        }
+        if(progress >= 100 || progress < 0)
+        {
+            finish(progress < 0);
+        }
+
         m_onProgress(message, progress);
-        if(doLog)
+        CAlogLevel logLevel = (progress >= 0) ? CA_INFO : CA_ERROR;
+        if(doLog && isLogEnabled(logLevel))
         {
-            CAlogLevel logLevel;
             QString logMsg;
             if(progress >= 0)
             {
-                logLevel = CA_INFO;
                 logMsg = QStringLiteral("[%2%] %1").arg(message).arg(progress, 3);
             }
             else
             {
-                logLevel = CA_ERROR;
                 logMsg = QStringLiteral("%1 [error %2]").arg(message).arg(-progress);
             }
-            log(logLevel, logMsg);
+            m_logger->call(logLevel, logMsg);
         }
     }
 
+    /// Returns whether a message of the given level would be logged (i.e.
+    /// `logger()` is non-null and `LogHandler::isEnabled()` for it).
+    inline bool isLogEnabled(CAlogLevel level) const
+    {
+        return m_logger && m_logger->isEnabled(level);
+    }
+
     /// Convenience function to call `logger()` only if it is non-null.
+    /// Prefer `CA_LOG(loggerSafe(), ...)` where the message is expensive to format.
     inline void log(CAlogLevel level, QString message)
     {
         if(m_logger)
@@ -115,8 +155,19 @@ protected:
 private:
     ProgressHandler m_onProgress;
     bool m_started;
+    bool m_finished;
     QSharedPointer<Comms> m_comms;
     ca::LogHandler *m_logger;
+    QSet<CAdevId> m_claimedDevices; ///< Devices `Comms::claim()`ed by this operation.
+
+    /// Marks the operation as finished and `Comms::release()`s its devices.
+    /// If `failed`, also `Comms::abort()`s all of them.
+    void finish(bool failed);
+
+    /// Releases all devices in `m_claimedDevices`.
+    void releaseDevices();
+
+    void onStageTimedOut(CAdevId devId, CAstage stage) override;
 };
 
 /// An `Operation` that sends PROG_REQ + UNLOCK commands to a list of devices
@@ -131,14 +182,19 @@ public:
                    QObject *parent=nullptr);
     ~StartDevicesOp() override = default;
 
+    QSet<CAdevId> devices() const override
+    {
+        return m_targetDevices;
+    }
+
 private:
-    QSet<CAdevId> m_devices;
+    QSet<CAdevId> m_targetDevices; ///< All devices to start.
+    QSet<CAdevId> m_devices; ///< Devices still to be started.
     int m_nDevices;
 
     void started() override;
 
-private slots:
-    void onProgStarted(CAdevId devId);
+    void onProgStarted(CAdevId devId, const DeviceStats &devStats) override;
 };
 
 /// An `Operation` that sends PROG_DONE commands to a list of devices (and
@@ -153,42 +209,171 @@ public:
                   QObject *parent=nullptr);
     ~StopDevicesOp() override = default;
 
+    QSet<CAdevId> devices() const override
+    {
+        return m_targetDevices;
+    }
+
 private:
-    QSet<CAdevId> m_devices;
+    QSet<CAdevId> m_targetDevices; ///< All devices to stop.
+    QSet<CAdevId> m_devices; ///< Devices still to be stopped.
     int m_nDevices;
 
     void started() override;
 
-private slots:
-    void onProgEnd(CAdevId devId);
+    void onProgEnded(CAdevId devId) override;
 };
 
-/// An `Operation` that unlocks a target and flashes an ELF file to it.
+/// An `Operation` that finds out which devices are present by sending PROG_REQs
+/// to all of them at once (see `Comms::probe()`); devices are not unlocked.
+class CA_API ScanOp : public Operation
+{
+    Q_OBJECT
+
+public:
+    /// The default time to wait for each device to respond, in milliseconds.
+    static constexpr int DEFAULT_WINDOW_MS = 100;
+
+    /// Called for each device that responds to the scan.
+    using ResultHandler = std::function<void(const CAscanResult &result)>;
+
+    /// Scans `devices`, waiting up to `windowMs` milliseconds for each one to
+    /// respond (0 = `DEFAULT_WINDOW_MS`).
+    ScanOp(ProgressHandler onProgress,
+           QSet<CAdevId> devices, int windowMs=0,
+           QObject *parent=nullptr);
+    ~ScanOp() override = default;
+
+    /// Returns all 256 device ids.
+    static QSet<CAdevId> allDevices();
+
+    QSet<CAdevId> devices() const override
+    {
+        return m_targetDevices;
+    }
+
+    /// Sets the handler to call for each device that responds (null = none).
+    inline void setResultHandler(ResultHandler onResult)
+    {
+        m_onResult = std::move(onResult);
+    }
+
+    /// Returns the devices that responded so far, in the order they responded.
+    inline const std::vector<CAscanResult> &results() const
+    {
+        return m_results;
+    }
+
+private:
+    QSet<CAdevId> m_targetDevices; ///< All devices to scan.
+    int m_windowMs;
+    ResultHandler m_onResult;
+    std::vector<CAscanResult> m_results;
+    int m_nPending; ///< Devices that neither responded nor timed out yet.
+    QElapsedTimer m_wallTimer; ///< Started when the scan starts.
+
+    void started() override;
+
+    /// Reports progress, finishing the scan if no devices are pending anymore.
+    void deviceDone();
+
+    void onProbed(CAdevId devId, const DeviceStats &devStats, int64_t latencyNs) override;
+    void onProbeTimedOut(CAdevId devId) override;
+};
+
+/// An `Operation` that unlocks a target and flashes an ELF file to it (or any
+/// other `FlashImage`; the ELF machine check is skipped for non-ELF formats).
 ///
-/// Retries flashing a page until it succeeds (CRC matching); potentially
-/// retries forever!
+/// Re-flashes pages whose CRC does not match after a backoff, within the
+/// page and device retry budgets of `Comms::retryPolicy()`.
+///
+/// In delta mode (see `setManifestDir()` and `setBaseImage()`), only pages
+/// whose contents are not already known to be on the device are flashed.
+/// Devices that erase their flash on unlock (see `DEVICE_FEATURE_ERASED_ON_UNLOCK`)
+/// are never flashed in delta mode, but blank pages are not sent to them.
 class CA_API FlashElfOp : public Operation
 {
     Q_OBJECT
 
 public:
+    /// Flashes the ELF file whose contents are `elfData` to the device with id `devId`.
     FlashElfOp(ProgressHandler onProgress,
                CAdevId devId, QByteArray elfData,
                QObject *parent=nullptr);
-    ~FlashElfOp() override = default;
+
+    /// Flashes `image` to the device with id `devId`.
+    /// Pass the same `image` to multiple operations to have the ELF parsed and
+    /// paged only once for all of them (see `FlashImage`).
+    FlashElfOp(ProgressHandler onProgress,
+               CAdevId devId, QSharedPointer<FlashImage> image,
+               QObject *parent=nullptr);
+    ~FlashElfOp() override;
+
+    QSet<CAdevId> devices() const override
+    {
+        return {m_devId};
+    }
+
+    /// Sets the directory where the `FlashManifest`s of devices are stored
+    /// (empty = none). If set, pages recorded in the device's manifest as
+    /// having the same contents are not flashed, and the manifest is updated
+    /// after flashing succeeds.
+    /// A manifest is ignored if the device's stats do not match it anymore.
+    inline void setManifestDir(QString manifestDir)
+    {
+        m_manifestDir = manifestDir;
+    }
+
+    /// Sets the image that is known to be flashed to the device already (null
+    /// = none). Pages with the same contents in `baseImage` are not flashed.
+    inline void setBaseImage(QSharedPointer<FlashImage> baseImage)
+    {
+        m_baseImage = baseImage;
+    }
+
+    /// Sets the cache to look up (and add) the flash maps of the image and base
+    /// image in (null = none). It must outlive the operation.
+    inline void setImageCache(ImageCache *imageCache)
+    {
+        m_imageCache = imageCache;
+    }
 
 private:
     CAdevId m_devId;
-    QByteArray m_elfData;
-    std::unique_ptr<ELFIO::elfio> m_elf;
-    FlashMap m_flashMap;
+    QSharedPointer<FlashImage> m_image; ///< The (possibly shared) image to flash.
+    QSharedPointer<const FlashMap> m_flashMap; ///< The (possibly shared) flash map of `m_image`.
+    QString m_manifestDir; ///< See `setManifestDir()`.
+    QSharedPointer<FlashImage> m_baseImage; ///< See `setBaseImage()`.
+    ImageCache *m_imageCache; ///< See `setImageCache()`.
+    std::unique_ptr<FlashManifest> m_manifest; ///< The device's manifest (if `m_manifestDir` is set).
+    std::vector<FlashMap::PageMap::const_iterator> m_pagesToFlash; ///< Pages in `m_flashMap` that actually need flashing.
+    size_t m_nPagesElided; ///< Blank pages in `m_flashMap` not flashed because the device erased them already.
+    double m_elidedBusBits; ///< Bus time not spent flashing the elided pages, in nominal bits.
+    size_t m_nPagesFlashed; ///< The number of pages in `m_pagesToFlash` flashed so far.
+    unsigned m_pageRetries; ///< Consecutive re-flashes of the page being flashed.
+    unsigned m_deviceRetries; ///< Total re-flashes of pages.
 
     void started() override;
 
-private slots:
-    void onProgStarted(CAdevId devId, DeviceStats devStats);
-    void onPageFlashed(CAdevId devId, uint32_t pageAddr);
-    void onPageFlashErrored(CAdevId devId, uint32_t pageAddr, uint16_t expectedCrc, uint16_t recvdCrc);
+    /// Fills `m_pagesToFlash` with all pages in `m_flashMap`, except for the
+    /// ones that are already on the device according to the manifest/base image
+    /// and blank pages that the device erased already.
+    void listPagesToFlash(const DeviceStats &devStats);
+
+    /// Returns a summary of how many pages were flashed, skipped and elided.
+    QString pageCountsStr();
+
+    /// Removes the pages in `m_pagesToFlash` from the device's manifest (if any)
+    /// and saves it, so that the manifest never vouches for a page that a flash
+    /// that did not complete may have overwritten.
+    void invalidateManifest();
+
+    /// Updates the device's manifest (if any) after the flash map was flashed.
+    void updateManifest();
+
+    void onProgStarted(CAdevId devId, const DeviceStats &devStats) override;
+    void onPageFlashed(CAdevId devId, uint32_t pageAddr) override;
+    void onPageFlashErrored(CAdevId devId, uint32_t pageAddr, uint16_t expectedCrc, uint16_t recvdCrc) override;
 };
 
 }
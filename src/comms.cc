@@ -7,6 +7,11 @@
 // file, You can obtain one at http://mozilla.org/MPL/2.0/.
 #include "comms.hh"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <utility>
+#include <vector>
 #include <QFuture>
 
 extern "C"
@@ -14,6 +19,8 @@ extern "C"
 #include "common/can_msgs.h"
 }
 #include "util.hh"
+#include "log.hh"
+#include "lz4.hh"
 #include "moc_comms.cpp"
 
 namespace ca
@@ -41,56 +48,1028 @@ inline static std::tuple<uint32_t, uint8_t> untranslateEID(const quint32 qtAddr)
     return {eid, (eid & 0x00000FF0u) >> 4};
 }
 
+/// Returns the id of a device as it appears in log messages.
+inline static QString devIdStr(CAdevId devId)
+{
+    return hexStr(devId, sizeof(CAdevId) * 2);
+}
+
+/// Returns the largest valid CAN FD payload size that is <= `len` (max. 64).
+inline static int fdPayloadSize(int len)
+{
+    static constexpr int FD_PAYLOAD_SIZES[] = {64, 48, 32, 24, 20, 16, 12};
+    if(len < 12)
+    {
+        // (9..11 are not valid sizes; the controller would pad them)
+        return std::min(len, 8);
+    }
+    for(int size : FD_PAYLOAD_SIZES)
+    {
+        if(size <= len)
+        {
+            return size;
+        }
+    }
+    Q_UNREACHABLE();
+}
+
+/// Returns the payload size of the next WRITE when `len` bytes are left to
+/// write, in frames of up to `maxPayload` bytes (8, or 64 for CAN FD).
+inline static int writeBlockSize(int len, int maxPayload)
+{
+    return maxPayload > 8 ? fdPayloadSize(len) : std::min(len, maxPayload);
+}
+
+/// Returns the number of bits on the bus taken by WRITEs of `len` contiguous
+/// bytes, in frames of up to `maxPayload` bytes; `frameCost(payloadSize)` is
+/// the number of bits taken by a single frame.
+template <typename FrameCost>
+static double writeBits(int len, int maxPayload, FrameCost &&frameCost)
+{
+    double bits = (len / maxPayload) * frameCost(maxPayload);
+    int blockSize;
+    for(int i = len - len % maxPayload; i < len; i += blockSize)
+    {
+        blockSize = writeBlockSize(len - i, maxPayload);
+        bits += frameCost(blockSize);
+    }
+    return bits;
+}
+
+/// Sets the payload of `frame` to the `len` bytes at `data`, reusing the buffer
+/// of its current payload if nothing else references it anymore (so that
+/// refilling the same frame over and over does not allocate).
+static void setFramePayload(QCanBusFrame &frame, const char *data, int len)
+{
+    // (Take over the payload, so that the frame does not keep it shared)
+    QByteArray payload = frame.payload();
+    frame.setPayload(QByteArray());
+    if(payload.capacity() < 64)
+    {
+        // (Reserve the biggest CAN FD payload size once, so that the buffer is
+        // never reallocated nor squeezed by `resize()`)
+        payload.reserve(64);
+    }
+    payload.resize(len);
+    std::memcpy(payload.data(), data, static_cast<size_t>(len));
+    frame.setPayload(payload);
+}
+
+/// A range of bytes in a page, `[begin, end)`, to be written contiguously.
+struct WriteSpan
+{
+    int begin;
+    int end;
+};
+
+/// Splits a page into the spans of it that actually have to be written,
+/// assuming the temporary page on the device is initially filled with `fill`:
+/// - Runs of `fill` at the end of the page are never written;
+/// - Other runs of `fill` are skipped over via a SEEK only if the SEEK takes
+///   less bus time than writing the run would.
+/// WRITEs carry up to `maxPayload` bytes each, and one with `n` bytes of payload
+/// takes `frameCost(n)` bits on the bus (see `writeBits()`); SEEKs are always
+/// classic CAN frames.
+/// Calls `onSpan(span)` for each span, in order.
+template <typename FrameCost, typename OnSpan>
+static void planPageWrites(const uint8_t *data, int len, uint8_t fill,
+                           int maxPayload, FrameCost &&frameCost, OnSpan &&onSpan)
+{
+    auto skipFill = [&](int i) { while(i < len && data[i] == fill) { i ++; } return i; };
+    auto skipData = [&](int i) { while(i < len && data[i] != fill) { i ++; } return i; };
+    auto spanBits = [&](int spanLen) { return writeBits(spanLen, maxPayload, frameCost); };
+    const double seekBits = frameBusBits(4); // (SEEK payload: offset, U32 LE)
+
+    int dataBegin = skipFill(0);
+    if(dataBegin >= len)
+    {
+        // All fill, nothing to write
+        return;
+    }
+    int dataEnd = skipData(dataBegin);
+
+    // Write the leading run of fill (if any) or SEEK past it?
+    WriteSpan span{dataBegin, dataEnd};
+    if(dataBegin > 0 && spanBits(dataEnd) <= seekBits + spanBits(dataEnd - dataBegin))
+    {
+        span.begin = 0;
+    }
+
+    while((dataBegin = skipFill(span.end)) < len)
+    {
+        dataEnd = skipData(dataBegin);
+
+        // Extend the current span over the run of fill, or SEEK past it?
+        double mergedBits = spanBits(dataEnd - span.begin);
+        double splitBits = spanBits(span.end - span.begin) + seekBits + spanBits(dataEnd - dataBegin);
+        if(mergedBits <= splitBits)
+        {
+            span.end = dataEnd;
+        }
+        else
+        {
+            onSpan(span);
+            span = {dataBegin, dataEnd};
+        }
+    }
+    onSpan(span);
+}
+
+/// Calls `onSpan(span)` for each span of the page at `data` that has to be
+/// written to a device with stats `devStats` (see `planPageWrites()`).
+template <typename FrameCost, typename OnSpan>
+static void planDevicePageWrites(const DeviceStats &devStats, const char *data, int len,
+                                 int maxPayload, FrameCost &&frameCost, OnSpan &&onSpan)
+{
+    if(devStats.features & DEVICE_FEATURE_TEMP_PAGE_FILL)
+    {
+        planPageWrites(reinterpret_cast<const uint8_t *>(data), len, devStats.tempPageFill,
+                       maxPayload, std::forward<FrameCost>(frameCost), std::forward<OnSpan>(onSpan));
+    }
+    else
+    {
+        // Don't know what the temporary page contains, write all of it
+        onSpan(WriteSpan{0, len});
+    }
+}
+
+
 #define EXPECT_CAN() do { Q_ASSERT(*this); if(!*this) { return; } } while(false)
 
 
+/// The number of consecutive times writing a frame to the CAN link is retried
+/// before giving up on it.
+static constexpr unsigned MAX_WRITE_ATTEMPTS = 8;
+
+/// How long to wait before retrying to write a frame to the CAN link for the
+/// first time, in milliseconds; doubled at each subsequent attempt.
+static constexpr int WRITE_RETRY_BACKOFF_MS = 1;
+
+/// The max. factor a stage's deadline grows by after being retried.
+static constexpr unsigned MAX_STAGE_BACKOFF_SHIFT = 4;
+
+/// How often stage deadlines are checked, in milliseconds.
+static constexpr int DEADLINE_TICK_MS = 10;
+
+/// The write mode byte of a SELECT_PAGE, sent to devices that compressed WRITEs
+/// were negotiated with (see `DEVICE_FEATURE_COMPRESSED_WRITES`).
+static constexpr uint8_t WRITE_MODE_RAW = 0; ///< WRITEs (and SEEKs) are raw page data.
+static constexpr uint8_t WRITE_MODE_LZ4 = 1; ///< WRITEs are a single LZ4 block.
+
+/// How much the estimated offset between the timestamps of received frames and
+/// the host's clock may grow per frame, in nanoseconds (see `Comms::frameRxNs()`).
+static constexpr int64_t RX_CLOCK_OFFSET_CREEP_NS = 100;
+
+/// Returns whether `msg` is one of the messages CANnuccia devices send to the host.
+inline static bool isResponseMsg(uint32_t msg)
+{
+    switch(msg)
+    {
+    case CN_CAN_MSG_PROG_REQ_RESP:
+    case CN_CAN_MSG_UNLOCKED:
+    case CN_CAN_MSG_PAGE_SELECTED:
+    case CN_CAN_MSG_WRITES_CHECKED:
+    case CN_CAN_MSG_WRITES_COMMITTED:
+    case CN_CAN_MSG_PROG_DONE_ACK:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+void DeviceListener::onProgStarted(CAdevId, const DeviceStats &)
+{
+}
+
+void DeviceListener::onProgEnded(CAdevId)
+{
+}
+
+void DeviceListener::onPageFlashed(CAdevId, uint32_t)
+{
+}
+
+void DeviceListener::onPageFlashErrored(CAdevId, uint32_t, uint16_t, uint16_t)
+{
+}
+
+void DeviceListener::onStageTimedOut(CAdevId, CAstage)
+{
+}
+
+void DeviceListener::onProbed(CAdevId, const DeviceStats &, int64_t)
+{
+}
+
+void DeviceListener::onProbeTimedOut(CAdevId)
+{
+}
+
+
+RetryPolicy RetryPolicy::defaults()
+{
+    RetryPolicy policy;
+    policy.stageTimeoutsMs[CA_STAGE_PROG_REQ] = 100;
+    policy.stageTimeoutsMs[CA_STAGE_UNLOCK] = 100;
+    policy.stageTimeoutsMs[CA_STAGE_SELECT_PAGE] = 100;
+    policy.stageTimeoutsMs[CA_STAGE_CHECK_WRITES] = 500; // (Receiving the WRITEs + computing the CRC)
+    policy.stageTimeoutsMs[CA_STAGE_COMMIT_WRITES] = 1000; // (Erasing + programming a flash page)
+    policy.stageTimeoutsMs[CA_STAGE_PROG_DONE] = 100;
+    policy.maxStageRetries = 5;
+    policy.maxPageRetries = 5;
+    policy.maxDeviceRetries = 50;
+    policy.pageRetryBackoffMs = 10;
+    return policy;
+}
+
+
 Comms::Comms(QObject *parent)
-    : QObject(parent), m_can(nullptr)
+    : QObject(parent), m_can(nullptr), m_canFd(false), m_writeCompression(true),
+      m_txWindow(16), m_txInFlight(0), m_txWrittenInTick(false), m_txPumping(false), m_txIdleNs(0),
+      m_txTimer(new QTimer(this)), m_txWriteAttempts(0), m_txWriteRetries(0), m_txFramesDropped(0),
+      m_busBitrate(0), m_txBudgetRate(0.0), m_txDataBitTime(1.0), m_txBudget(0.0), m_txBudgetMax(0.0), m_txBudgetNs(0),
+      m_retryPolicy(RetryPolicy::defaults()), m_logger(nullptr), m_deadlineTimer(new QTimer(this)), m_metrics()
 {
+    m_txTimer->setSingleShot(true);
+    m_txTimer->setTimerType(Qt::PreciseTimer);
+    connect(m_txTimer, &QTimer::timeout, this, &Comms::pumpTx);
+
+    m_deadlineTimer->setInterval(DEADLINE_TICK_MS);
+    connect(m_deadlineTimer, &QTimer::timeout, this, &Comms::deadlinesExpired);
+    m_deadlineClock.start();
 }
 
 Comms::~Comms() = default;
 
 
+unsigned Comms::txWeight(DevId devId) const
+{
+    return m_deviceStates[devId].txWeight;
+}
+
+void Comms::setTxWeight(DevId devId, unsigned weight)
+{
+    Q_ASSERT(weight > 0);
+    m_deviceStates[devId].txWeight = weight > 0 ? weight : 1;
+}
+
+TxQueueStats Comms::txQueueStats(DevId devId) const
+{
+    const DeviceState &devState = m_deviceStates[devId];
+
+    int64_t idleNs = devState.txIdleNs;
+    if(devState.txIdleTimer.isValid())
+    {
+        // Currently idle
+        idleNs += devState.txIdleTimer.nsecsElapsed();
+    }
+    return {devState.txQueue.size(), devState.txFramesSent, idleNs};
+}
+
+int64_t Comms::txIdleNs() const
+{
+    int64_t idleNs = m_txIdleNs;
+    if(m_txIdleTimer.isValid())
+    {
+        idleNs += m_txIdleTimer.nsecsElapsed();
+    }
+    return idleNs;
+}
+
+void Comms::setBusLoadLimit(unsigned long bitrate, unsigned maxLoadPercent,
+                            unsigned long dataBitrate)
+{
+    maxLoadPercent = std::min(maxLoadPercent, 100u);
+    m_busBitrate = bitrate;
+    m_txBudgetRate = double(bitrate) * maxLoadPercent / 100.0;
+    m_txDataBitTime = (bitrate > 0 && dataBitrate > 0) ? double(bitrate) / double(dataBitrate) : 1.0;
+
+    // Allow bursts of up to 2ms worth of budget (or of one frame, if bigger)
+    m_txBudgetMax = std::max(m_txBudgetRate * 0.002, fdFrameBusBits(64, m_txDataBitTime));
+    m_txBudget = m_txBudgetMax;
+    m_txBudgetClock.start();
+    m_txBudgetNs = 0;
+
+    pumpTx();
+}
+
+double Comms::frameBusBitsOf(const QCanBusFrame &frame) const
+{
+    auto payloadSize = static_cast<unsigned long>(frame.payload().size());
+    return frame.hasFlexibleDataRateFormat() ? fdFrameBusBits(payloadSize, m_txDataBitTime)
+                                             : double(frameBusBits(payloadSize));
+}
+
+void Comms::setRetryPolicy(const RetryPolicy &retryPolicy)
+{
+    m_retryPolicy = retryPolicy;
+}
+
+LogHandler &Comms::loggerSafe()
+{
+    static LogHandler nullLogger = {};
+    return m_logger ? *m_logger : nullLogger;
+}
+
+void Comms::setMetricsEnabled(bool enabled)
+{
+    m_metrics.reset(enabled ? new MetricsState() : nullptr);
+}
+
+ProtocolMetrics Comms::metrics(DevId devId) const
+{
+    if(m_metrics && m_metrics->devices[devId])
+    {
+        return *m_metrics->devices[devId];
+    }
+    return ProtocolMetrics();
+}
+
+ProtocolMetrics Comms::metrics() const
+{
+    ProtocolMetrics total;
+    if(m_metrics)
+    {
+        for(const auto &devMetrics : m_metrics->devices)
+        {
+            if(devMetrics)
+            {
+                total.merge(*devMetrics);
+            }
+        }
+    }
+    return total;
+}
+
+ProtocolMetrics &Comms::deviceMetrics(DevId devId)
+{
+    std::unique_ptr<ProtocolMetrics> &devMetrics = m_metrics->devices[devId];
+    if(!devMetrics)
+    {
+        devMetrics.reset(new ProtocolMetrics());
+    }
+    return *devMetrics;
+}
+
+int64_t Comms::frameRxNs(const QCanBusFrame &frame, DevId devId)
+{
+    int64_t nowNs = m_deadlineClock.nsecsElapsed();
+    QCanBusFrame::TimeStamp timeStamp = frame.timeStamp();
+    if(timeStamp.seconds() == 0 && timeStamp.microSeconds() == 0)
+    {
+        // Not timestamped by the CAN link; all we know is that it was received by now
+        return nowNs;
+    }
+
+    // Timestamps come from another clock (ex. the kernel's real-time one). Map
+    // them to ours by assuming that the frame that took the least to be handled
+    // was handled right away; let the estimate creep up, to follow the clocks
+    // drifting apart
+    int64_t timeStampNs = (int64_t(timeStamp.seconds()) * 1000000 + timeStamp.microSeconds()) * 1000;
+    int64_t offsetNs = nowNs - timeStampNs;
+    if(m_metrics->rxTimestamped)
+    {
+        m_metrics->rxClockOffsetNs = std::min(m_metrics->rxClockOffsetNs + RX_CLOCK_OFFSET_CREEP_NS, offsetNs);
+    }
+    else
+    {
+        m_metrics->rxClockOffsetNs = offsetNs;
+        m_metrics->rxTimestamped = true;
+    }
+
+    int64_t rxNs = timeStampNs + m_metrics->rxClockOffsetNs;
+    deviceMetrics(devId).rxHostDelays.record(nowNs - rxNs);
+    return rxNs;
+}
+
+void Comms::recordStageLatency(DevId devId, int64_t rxNs)
+{
+    const DeviceState &devState = m_deviceStates[devId];
+    if(!devState.inStage || devState.deadlineNs < 0)
+    {
+        // (The response beat the link reporting the command as handed to it)
+        return;
+    }
+    deviceMetrics(devId).stageLatencies[devState.stage].record(rxNs - devState.stageSentNs);
+}
+
+bool Comms::claim(DevId devId, DeviceListener *listener)
+{
+    DeviceState &devState = m_deviceStates[devId];
+    if(devState.listener && devState.listener != listener)
+    {
+        return false;
+    }
+    devState.listener = listener;
+    return true;
+}
+
+void Comms::release(DevId devId, DeviceListener *listener)
+{
+    DeviceState &devState = m_deviceStates[devId];
+    if(devState.listener == listener)
+    {
+        devState.listener = nullptr;
+    }
+}
+
+void Comms::abort(DevId devId)
+{
+    DeviceState &devState = m_deviceStates[devId];
+
+    devState.pagesToFlash.clear();
+    devState.selPageAddr = DeviceState::NO_PAGE;
+    devState.inStage = false;
+    devState.deadlineNs = -1;
+    devState.probing = false;
+
+    if(!devState.txQueue.empty())
+    {
+        // Drop the frames still queued and take the device out of the round-robin
+        // (a frame of it being retried is dropped too)
+        if(!m_txRing.empty() && m_txRing.front() == devId)
+        {
+            m_txWriteAttempts = 0;
+        }
+        m_txRing.remove(devId);
+        devState.txFramesDone += devState.txQueue.size();
+        devState.txQueue.clear();
+        devState.txIdleTimer.start();
+        if(m_txRing.empty() && !m_txIdleTimer.isValid())
+        {
+            m_txIdleTimer.start();
+        }
+    }
+
+    scheduleDeadlines();
+}
+
+void Comms::enterStage(DevId devId, CAstage stage, unsigned attempts)
+{
+    DeviceState &devState = m_deviceStates[devId];
+    devState.stageAttempts = attempts;
+    devState.inStage = true;
+    devState.stage = stage;
+    devState.stageArmSeq = devState.txFramesQueued;
+    devState.deadlineNs = -1;
+    armDeadline(devState);
+    scheduleDeadlines();
+}
+
+void Comms::leaveStage(DevId devId)
+{
+    DeviceState &devState = m_deviceStates[devId];
+    devState.inStage = false;
+    devState.stageAttempts = 0;
+    devState.deadlineNs = -1;
+    devState.probing = false;
+}
+
+void Comms::armDeadline(DeviceState &devState)
+{
+    if(!devState.inStage || devState.deadlineNs >= 0
+       || devState.txFramesDone < devState.stageArmSeq)
+    {
+        // Not waiting for a response, already armed, or the command is still queued
+        return;
+    }
+
+    int64_t timeoutNs;
+    if(devState.probing)
+    {
+        timeoutNs = int64_t(devState.probeTimeoutMs) * 1000000;
+    }
+    else
+    {
+        unsigned shift = std::min(devState.stageAttempts, MAX_STAGE_BACKOFF_SHIFT);
+        timeoutNs = int64_t(m_retryPolicy.stageTimeoutsMs[devState.stage]) * 1000000 << shift;
+    }
+    devState.stageSentNs = m_deadlineClock.nsecsElapsed();
+    devState.deadlineNs = devState.stageSentNs + timeoutNs;
+}
+
+void Comms::scheduleDeadlines()
+{
+    if(m_deadlineTimer->isActive())
+    {
+        // (`deadlinesExpired()` will stop it when no deadlines are left)
+        return;
+    }
+
+    if(m_txInFlight > 0)
+    {
+        // (Ticks also check that the CAN link did not lose these)
+        m_txWrittenInTick = false;
+        m_deadlineTimer->start();
+        return;
+    }
+    for(const DeviceState &devState : m_deviceStates)
+    {
+        if(devState.deadlineNs >= 0)
+        {
+            m_deadlineTimer->start();
+            return;
+        }
+    }
+}
+
+void Comms::resendStageCmd(DevId devId)
+{
+    DeviceState &devState = m_deviceStates[devId];
+    CAstage stage = devState.stage;
+    switch(stage)
+    {
+    case CA_STAGE_PROG_REQ:
+        sendFrame(devId, QCanBusFrame(translateEID(CN_CAN_MSG_PROG_REQ, devId), {}));
+        break;
+
+    case CA_STAGE_UNLOCK:
+        sendUnlockCmd(devId);
+        break;
+
+    case CA_STAGE_SELECT_PAGE:
+    case CA_STAGE_CHECK_WRITES:
+        // The WRITEs may have been lost too; start over from selecting the page
+        // (which also resets the device's temporary page)
+        sendSelectPageCmd(devId, devState.stagePageAddr);
+        stage = CA_STAGE_SELECT_PAGE;
+        break;
+
+    case CA_STAGE_COMMIT_WRITES:
+        sendFrame(devId, QCanBusFrame(translateEID(CN_CAN_MSG_COMMIT_WRITES, devId), {}));
+        break;
+
+    case CA_STAGE_PROG_DONE:
+        sendFrame(devId, QCanBusFrame(translateEID(CN_CAN_MSG_PROG_DONE, devId), {}));
+        break;
+
+    default:
+        break;
+    }
+    enterStage(devId, stage, devState.stageAttempts);
+}
+
+void Comms::deadlinesExpired()
+{
+    if(m_txInFlight > 0 && !m_txWrittenInTick)
+    {
+        // No frames were reported as written for a whole tick; maybe the link
+        // lost some of them
+        resyncTxInFlight();
+    }
+    m_txWrittenInTick = false;
+
+    int64_t nowNs = m_deadlineClock.nsecsElapsed();
+
+    for(size_t i = 0; i < m_deviceStates.size(); i ++)
+    {
+        auto devId = static_cast<DevId>(i);
+        DeviceState &devState = m_deviceStates[i];
+        if(devState.deadlineNs < 0 || devState.deadlineNs > nowNs)
+        {
+            // Not armed or not expired yet
+            continue;
+        }
+
+        if(devState.probing)
+        {
+            // (Probes are never retried: the device is just not there)
+            leaveStage(devId);
+            if(devState.listener)
+            {
+                devState.listener->onProbeTimedOut(devId);
+            }
+            continue;
+        }
+
+        if(devState.stageAttempts < m_retryPolicy.maxStageRetries)
+        {
+            // Maybe the command or its response got lost; try again
+            // (waiting longer, in case the device is just slow)
+            devState.stageAttempts ++;
+            if(m_metrics)
+            {
+                deviceMetrics(devId).stageRetries ++;
+            }
+            resendStageCmd(devId);
+        }
+        else
+        {
+            CAstage stage = devState.stage;
+            abort(devId);
+            if(m_metrics)
+            {
+                deviceMetrics(devId).stageTimeouts ++;
+            }
+            if(devState.listener)
+            {
+                devState.listener->onStageTimedOut(devId, stage);
+            }
+        }
+    }
+
+    // Stop ticking if no deadlines are left and no frames are in flight
+    bool anyArmed = std::any_of(m_deviceStates.begin(), m_deviceStates.end(),
+                                [](const DeviceState &devState) { return devState.deadlineNs >= 0; });
+    if(!anyArmed && m_txInFlight == 0)
+    {
+        m_deadlineTimer->stop();
+    }
+}
+
+int Comms::takeTxBudget(double bits)
+{
+    if(m_txBudgetRate <= 0.0)
+    {
+        // No bus load limit
+        return 0;
+    }
+
+    // Refill the budget for the time elapsed since the last refill
+    int64_t nowNs = m_txBudgetClock.nsecsElapsed();
+    m_txBudget = std::min(m_txBudget + m_txBudgetRate * double(nowNs - m_txBudgetNs) * 1e-9,
+                          m_txBudgetMax);
+    m_txBudgetNs = nowNs;
+
+    if(m_txBudget >= bits)
+    {
+        m_txBudget -= bits;
+        return 0;
+    }
+    else
+    {
+        double waitSecs = (bits - m_txBudget) / m_txBudgetRate;
+        return std::max(1, static_cast<int>(std::ceil(waitSecs * 1000.0)));
+    }
+}
+
+void Comms::resumeTxIn(int msecs)
+{
+    if(!m_txTimer->isActive() || m_txTimer->remainingTime() > msecs)
+    {
+        m_txTimer->start(msecs);
+    }
+}
+
+void Comms::sendFrame(DevId devId, const QCanBusFrame &frame)
+{
+    DeviceState &devState = m_deviceStates[devId];
+    if(devState.txQueue.empty())
+    {
+        // The device gets back into the round-robin; stop counting idle time
+        if(devState.txIdleTimer.isValid())
+        {
+            devState.txIdleNs += devState.txIdleTimer.nsecsElapsed();
+            devState.txIdleTimer.invalidate();
+        }
+        if(m_txRing.empty() && m_txIdleTimer.isValid())
+        {
+            m_txIdleNs += m_txIdleTimer.nsecsElapsed();
+            m_txIdleTimer.invalidate();
+        }
+        m_txRing.push_back(devId);
+        devState.txCredit = devState.txWeight;
+    }
+    devState.txQueue.push_back(frame);
+    devState.txFramesQueued ++;
+
+    pumpTx();
+}
+
+void Comms::pumpTx()
+{
+    if(m_txPumping || !*this)
+    {
+        // (`framesWritten()` may be emitted synchronously by `writeFrame()`;
+        // the loop below will keep going anyways)
+        return;
+    }
+    m_txPumping = true;
+    bool deadlinesArmed = false;
+
+    while(!m_txRing.empty() && m_txInFlight < m_txWindow)
+    {
+        DevId devId = m_txRing.front();
+        DeviceState &devState = m_deviceStates[devId];
+        const QCanBusFrame &frame = devState.txQueue.front();
+
+        if(m_txWriteAttempts == 0)
+        {
+            // (Frames being retried already took their share of the budget)
+            int waitMs = takeTxBudget(frameBusBitsOf(frame));
+            if(waitMs > 0)
+            {
+                // Sending this frame now would exceed the bus load limit
+                resumeTxIn(waitMs);
+                break;
+            }
+        }
+
+        // Hand the next frame for this device to the CAN link
+        // (Count it as in flight first: backends such as SocketCAN emit
+        // `framesWritten()` from within `writeFrame()`)
+        m_txInFlight ++;
+        bool written = m_can->writeFrame(frame);
+        if(!written && m_txInFlight > 0)
+        {
+            // (It never made it to the link)
+            m_txInFlight --;
+        }
+
+        if(written)
+        {
+            devState.txFramesSent ++;
+            m_txWriteAttempts = 0;
+            if(m_metrics)
+            {
+                deviceMetrics(devId).framesSent ++;
+            }
+        }
+        else if(++ m_txWriteAttempts < MAX_WRITE_ATTEMPTS)
+        {
+            // Likely a transient error (ex. the link's TX queue being full);
+            // retry the same frame after a backoff
+            m_txWriteRetries ++;
+            resumeTxIn(WRITE_RETRY_BACKOFF_MS << (m_txWriteAttempts - 1));
+            break;
+        }
+        else
+        {
+            // The link keeps failing; give up on this frame, the protocol will
+            // have to recover from its loss (ex. via a CRC mismatch)
+            m_txFramesDropped ++;
+            m_txWriteAttempts = 0;
+        }
+        devState.txQueue.pop_front();
+        devState.txCredit --;
+        devState.txFramesDone ++;
+
+        if(devState.inStage && devState.deadlineNs < 0)
+        {
+            // The stage's command may have just been handed to the link
+            armDeadline(devState);
+            deadlinesArmed = deadlinesArmed || devState.deadlineNs >= 0;
+        }
+
+        if(devState.txQueue.empty())
+        {
+            // Nothing more to send to this device for now
+            m_txRing.pop_front();
+            devState.txIdleTimer.start();
+        }
+        else if(devState.txCredit == 0)
+        {
+            // This device's turn is over; move on to the next one
+            m_txRing.pop_front();
+            m_txRing.push_back(devId);
+            devState.txCredit = devState.txWeight;
+        }
+    }
+
+    if(m_txRing.empty() && !m_txIdleTimer.isValid())
+    {
+        m_txIdleTimer.start();
+    }
+
+    m_txPumping = false;
+
+    if(deadlinesArmed || m_txInFlight > 0)
+    {
+        scheduleDeadlines();
+    }
+}
+
+void Comms::resyncTxInFlight()
+{
+    if(!*this)
+    {
+        return;
+    }
+
+    // (Frames still queued in the link may be written yet; all others either
+    // were, and were reported as such, or never will be)
+    auto queued = static_cast<size_t>(std::max<qint64>(m_can->framesToWrite(), 0));
+    if(queued < m_txInFlight)
+    {
+        CA_LOG(loggerSafe(), CA_WARNING,
+               QStringLiteral("CAN link lost %1 frames; resuming transmission")
+               .arg(m_txInFlight - queued));
+        m_txInFlight = queued;
+        pumpTx();
+    }
+}
+
+
+void Comms::sendUnlockCmd(DevId devId)
+{
+    // Opt into the features that change what is sent to the device
+    // (devices that did not advertise any get an empty UNLOCK, as always)
+    QByteArray payload;
+    if(m_deviceStates[devId].compressedWrites)
+    {
+        payload.append(static_cast<char>(DEVICE_FEATURE_COMPRESSED_WRITES));
+    }
+    sendFrame(devId, QCanBusFrame(translateEID(CN_CAN_MSG_UNLOCK, devId), payload));
+}
+
 void Comms::sendSelectPageCmd(DevId devId, uint32_t pageAddr)
 {
-    quint32 msgId = translateEID(CN_CAN_MSG_SELECT_PAGE, devId);
-    QByteArray payload(4, 0);
-    writeU32LE(reinterpret_cast<uint8_t *>(payload.data()), pageAddr);
-    m_can->writeFrame(QCanBusFrame(msgId, payload));
+    DeviceState &devState = m_deviceStates[devId];
+
+    uint8_t payload[5];
+    writeU32LE(payload, pageAddr);
+    int payloadSize = 4;
+    if(devState.compressedWrites)
+    {
+        // Tell the device whether the WRITEs that follow are a compressed stream
+        // (If the page changes before they are sent, the CRC check fails and the page is retried)
+        const PageWrite *page = findPageToFlash(devState, pageAddr);
+        if(page)
+        {
+            buildWriteBatch(devId, *page);
+        }
+        payload[4] = (page && devState.writeBatch.compressed) ? WRITE_MODE_LZ4 : WRITE_MODE_RAW;
+        payloadSize = 5;
+    }
+    devState.selectPageFrame.setFrameId(translateEID(CN_CAN_MSG_SELECT_PAGE, devId));
+    setFramePayload(devState.selectPageFrame, reinterpret_cast<const char *>(payload), payloadSize);
+    sendFrame(devId, devState.selectPageFrame);
+
+    devState.stagePageAddr = pageAddr;
+}
+
+void Comms::buildWriteBatch(DevId devId, const PageWrite &page)
+{
+    DeviceState &devState = m_deviceStates[devId];
+    WriteBatch &batch = devState.writeBatch;
+    if(batch.valid && batch.pageAddr == page.addr && batch.pageData == page.data.constData()
+       && batch.pageSize == page.data.size() && batch.pageCrc == page.crc)
+    {
+        // Same page as last time (ex. flashing it is being retried)
+        return;
+    }
+
+    planWriteBatch(devId, page.data.constData(), page.data.size(), batch);
+
+    batch.valid = true;
+    batch.pageAddr = page.addr;
+    batch.pageData = page.data.constData();
+    batch.pageSize = page.data.size();
+    batch.pageCrc = page.crc;
 }
 
-void Comms::sendPageWriteCmds(DevId devId, QByteArray pageData)
+double Comms::planWriteBatch(DevId devId, const char *pageData, int pageSize, WriteBatch &batch) const
 {
-    quint32 msgId = translateEID(CN_CAN_MSG_WRITE, devId);
+    const DeviceState &devState = m_deviceStates[devId];
+    const DeviceStats &devStats = devState.stats;
+    bool fd = m_canFd && (devStats.features & DEVICE_FEATURE_CAN_FD);
+    const int maxPayload = fd ? 64 : 8;
+    auto writeFrameCost = [this, fd](int payloadSize)
+    {
+        auto size = static_cast<unsigned long>(payloadSize);
+        return fd ? fdFrameBusBits(size, m_txDataBitTime) : double(frameBusBits(size));
+    };
 
-    // Send writes in blocks of 8 bytes
-    int i;
-    for(i = 0; i < pageData.size(); i += 8)
+    // (Reuse the frame slots, and their payload buffers, of the previous page)
+    batch.nFrames = 0;
+    batch.compressed = false;
+    double bits = 0.0;
+    auto addFrame = [&](quint32 msgId, bool fdFrame, const char *payload, int payloadSize)
     {
-        m_can->writeFrame(QCanBusFrame(msgId, pageData.mid(i, 8)));
+        if(batch.nFrames == batch.frames.size())
+        {
+            batch.frames.emplace_back();
+        }
+        QCanBusFrame &frame = batch.frames[batch.nFrames ++];
+        frame.setFrameId(msgId);
+        frame.setFlexibleDataRateFormat(fdFrame);
+        frame.setBitrateSwitch(fdFrame);
+        setFramePayload(frame, payload, payloadSize);
+        bits += frameBusBitsOf(frame);
+    };
+
+    // Send writes in blocks of <=8 bytes (or <=64 bytes, of valid CAN FD sizes)
+    quint32 writeMsgId = translateEID(CN_CAN_MSG_WRITE, devId);
+    auto addWrites = [&](const char *data, int len)
+    {
+        int blockSize;
+        for(int i = 0; i < len; i += blockSize)
+        {
+            blockSize = writeBlockSize(len - i, maxPayload);
+            addFrame(writeMsgId, fd, data + i, blockSize);
+        }
+    };
+
+    quint32 seekMsgId = translateEID(CN_CAN_MSG_SEEK, devId);
+    int writeOffset = 0; // (SELECT_PAGE resets the write offset)
+    planDevicePageWrites(devStats, pageData, pageSize, maxPayload, writeFrameCost, [&](const WriteSpan &span)
+    {
+        if(span.begin != writeOffset)
+        {
+            uint8_t seekPayload[4];
+            writeU32LE(seekPayload, static_cast<uint32_t>(span.begin));
+            addFrame(seekMsgId, false, reinterpret_cast<const char *>(seekPayload), sizeof(seekPayload));
+        }
+        addWrites(pageData + span.begin, span.end - span.begin);
+        writeOffset = span.end;
+    });
+
+    if(devState.compressedWrites)
+    {
+        // Would a compressed WRITE stream take less bus time?
+        // (If the device fills its temporary page, trailing fill is left out of the stream)
+        int streamSize = pageSize;
+        if(devStats.features & DEVICE_FEATURE_TEMP_PAGE_FILL)
+        {
+            auto fill = static_cast<char>(devStats.tempPageFill);
+            while(streamSize > 0 && pageData[streamSize - 1] == fill)
+            {
+                streamSize --;
+            }
+        }
+        if(streamSize == 0)
+        {
+            return bits;
+        }
+
+        std::vector<uint8_t> &stream = batch.compressedStream;
+        stream.resize(lz4CompressBound(static_cast<size_t>(streamSize)));
+        auto compressedSize = static_cast<int>(lz4Compress(reinterpret_cast<const uint8_t *>(pageData),
+                                                           static_cast<size_t>(streamSize), stream.data()));
+        double compressedBits = writeBits(compressedSize, maxPayload, writeFrameCost);
+        if(compressedBits < bits)
+        {
+            batch.nFrames = 0;
+            batch.compressed = true;
+            bits = 0.0;
+            addWrites(reinterpret_cast<const char *>(stream.data()), compressedSize);
+        }
     }
+    return bits;
+}
+
+double Comms::pageFlashBusBits(DevId devId, const QByteArray &pageData) const
+{
+    // SELECT_PAGE/PAGE_SELECTED (page address [+ write mode]), CHECK_WRITES/WRITES_CHECKED (CRC),
+    // COMMIT_WRITES/WRITES_COMMITTED (page address)
+    unsigned long selectPageSize = m_deviceStates[devId].compressedWrites ? 5 : 4;
+    double bits = frameBusBits(selectPageSize) + frameBusBits(4) + frameBusBits(0) + frameBusBits(2)
+                  + frameBusBits(0) + frameBusBits(4);
 
-    // Send any leftovers
-    int left = pageData.size() - i;
-    if(left > 0)
+    // SEEKs and WRITEs, as `buildWriteBatch()` would send them
+    WriteBatch batch;
+    bits += planWriteBatch(devId, pageData.constData(), pageData.size(), batch);
+    return bits;
+}
+
+void Comms::sendPageWriteCmds(DevId devId, const PageWrite &page)
+{
+    buildWriteBatch(devId, page);
+
+    const WriteBatch &batch = m_deviceStates[devId].writeBatch;
+    for(size_t i = 0; i < batch.nFrames; i ++)
     {
-        m_can->writeFrame(QCanBusFrame(msgId, pageData.mid(i, left)));
+        sendFrame(devId, batch.frames[i]);
     }
 }
 
+Comms::PageWrite *Comms::findPageToFlash(DeviceState &devState, uint32_t pageAddr)
+{
+    for(PageWrite &page : devState.pagesToFlash)
+    {
+        if(page.addr == pageAddr)
+        {
+            return &page;
+        }
+    }
+    return nullptr;
+}
+
+void Comms::erasePageToFlash(DeviceState &devState, uint32_t pageAddr)
+{
+    auto &pages = devState.pagesToFlash;
+    pages.erase(std::remove_if(pages.begin(), pages.end(),
+                               [pageAddr](const PageWrite &page) { return page.addr == pageAddr; }),
+                pages.end());
+}
+
 void Comms::selectNextPageToFlash(DevId devId)
 {
     DeviceState &devState = m_deviceStates[devId];
-    for(auto it = devState.pageFlashData.begin(); it != devState.pageFlashData.end(); it ++)
+    for(const PageWrite &page : devState.pagesToFlash)
     {
-        uint32_t nextPageAddr = it->first;
-        if(nextPageAddr != devState.selPageAddr)
+        if(page.addr != devState.selPageAddr)
         {
-            sendSelectPageCmd(devId, nextPageAddr);
-            break;
+            sendSelectPageCmd(devId, page.addr);
+            enterStage(devId, CA_STAGE_SELECT_PAGE);
+            return;
         }
     }
+
+    // Nothing left to flash
+    devState.selPageAddr = DeviceState::NO_PAGE;
+    leaveStage(devId);
 }
 
 
@@ -100,7 +1079,22 @@ void Comms::progStart(DevId devId)
 
     // progStart(): [PROG_REQ] -> PROG_REQ_RESP -> UNLOCK -> UNLOCKED
     quint32 msgId = translateEID(CN_CAN_MSG_PROG_REQ, devId);
-    m_can->writeFrame(QCanBusFrame(msgId, {}));
+    sendFrame(devId, QCanBusFrame(msgId, {}));
+    m_deviceStates[devId].probing = false;
+    enterStage(devId, CA_STAGE_PROG_REQ);
+}
+
+void Comms::probe(DevId devId, int timeoutMs)
+{
+    EXPECT_CAN();
+
+    // probe(): [PROG_REQ] -> PROG_REQ_RESP (no UNLOCK)
+    quint32 msgId = translateEID(CN_CAN_MSG_PROG_REQ, devId);
+    sendFrame(devId, QCanBusFrame(msgId, {}));
+    DeviceState &devState = m_deviceStates[devId];
+    devState.probing = true;
+    devState.probeTimeoutMs = std::max(timeoutMs, 0);
+    enterStage(devId, CA_STAGE_PROG_REQ);
 }
 
 void Comms::progEnd(DevId devId)
@@ -109,23 +1103,42 @@ void Comms::progEnd(DevId devId)
 
     // progEnd(): [PROG_DONE] -> PROG_DONE_ACK
     quint32 msgId = translateEID(CN_CAN_MSG_PROG_DONE, devId);
-    m_can->writeFrame(QCanBusFrame(msgId, {}));
+    sendFrame(devId, QCanBusFrame(msgId, {}));
+    enterStage(devId, CA_STAGE_PROG_DONE);
 }
 
 void Comms::flashPage(DevId devId, uint32_t pageAddr, QByteArray pageData)
+{
+    uint16_t pageCrc = crc16(static_cast<unsigned long>(pageData.size()),
+                             reinterpret_cast<const uint8_t *>(pageData.constData()));
+    flashPage(devId, pageAddr, pageData, pageCrc);
+}
+
+void Comms::flashPage(DevId devId, uint32_t pageAddr, QByteArray pageData, uint16_t pageCrc)
 {
     Q_ASSERT(pageAddr != DeviceState::NO_PAGE); // (reserved value)
 
     // Add/replace the writes to this flash page on this device
+    // (`pagesToFlash` keeps its capacity, so this does not allocate in steady state)
     DeviceState &devState = m_deviceStates[devId];
-    devState.pageFlashData[pageAddr] = pageData;
+    PageWrite *page = findPageToFlash(devState, pageAddr);
+    if(page)
+    {
+        page->data = pageData;
+        page->crc = pageCrc;
+    }
+    else
+    {
+        devState.pagesToFlash.push_back({pageAddr, pageData, pageCrc});
+    }
 
     // If no page is currently being flashed, select the page to be written now
-    if(devState.selPageAddr == DeviceState::NO_PAGE)
+    if(devState.selPageAddr == DeviceState::NO_PAGE && !devState.inStage)
     {
         // flashPage(): [SELECT_PAGE] -> PAGE_SELECTED -> WRITE... & CHECK_WRITES
         //              -> WRITES_CHECKED -> COMMIT_WRITES -> WRITES_COMMITTED
         sendSelectPageCmd(devId, pageAddr);
+        enterStage(devId, CA_STAGE_SELECT_PAGE);
     }
 
     // When any page is selected a `PAGE_SELECTED` message will be received and
@@ -145,6 +1158,16 @@ void Comms::framesReceived()
         DevId devId = std::get<1>(eidPair);
         DeviceState &devState = m_deviceStates[devId];
 
+        // (Keep a reference to the payload alive while reading from it)
+        const QByteArray payloadData = frame.payload();
+
+        int64_t rxNs = 0;
+        if(m_metrics && isResponseMsg(msg))
+        {
+            deviceMetrics(devId).framesReceived ++;
+            rxNs = frameRxNs(frame, devId);
+        }
+
         switch(msg)
         {
 
@@ -156,34 +1179,102 @@ void Comms::framesReceived()
             // - pageSizePow2: U8
             // - pageCount: U16 LE
             // - elfMachine: U16 LE
-            if(frame.payload().size() != 5)
+            // Optionally followed by (for devices that advertise extra features):
+            // - features: U8 (`DeviceFeature` flags)
+            // - tempPageFill: U8
+            // - erasedValue: U8 (optional; 0xFF if missing)
+            if(!isInStage(devState, CA_STAGE_PROG_REQ))
+            {
+                // Unsolicited or duplicate response (ex. to a retried PROG_REQ)
+                break;
+            }
+            if(payloadData.size() != 5 && payloadData.size() != 7 && payloadData.size() != 8)
             {
-                // Broken payload!
-                // TODO: Log this as an error?
+                // Broken payload, ignore it (the PROG_REQ is re-sent if no
+                // valid response comes in time)
+                CA_LOG(loggerSafe(), CA_ERROR,
+                       QStringLiteral("%1: malformed PROG_REQ_RESP (%2 bytes of payload)")
+                       .arg(devIdStr(devId)).arg(payloadData.size()));
                 break;
             }
-            auto payload = reinterpret_cast<uint8_t *>(frame.payload().data());
+            auto payload = reinterpret_cast<const uint8_t *>(payloadData.constData());
+            if(m_metrics)
+            {
+                recordStageLatency(devId, rxNs);
+            }
 
             devState.stats.pageSize = (1 << uint32_t(payload[0]));
             devState.stats.nFlashPages = readU16LE(&payload[1]);
             devState.stats.elfMachine = readU16LE(&payload[3]);
+            devState.stats.features = 0;
+            devState.stats.tempPageFill = 0;
+            devState.stats.erasedValue = 0xFF;
+            if(payloadData.size() >= 7)
+            {
+                devState.stats.features = payload[5];
+                devState.stats.tempPageFill = payload[6];
+            }
+            if(payloadData.size() >= 8)
+            {
+                devState.stats.erasedValue = payload[7];
+            }
+            devState.compressedWrites = m_writeCompression
+                                        && (devState.stats.features & DEVICE_FEATURE_COMPRESSED_WRITES);
+            devState.writeBatch.valid = false; // (Its frames depend on the stats)
 
-            uint32_t unlockMsgId = translateEID(CN_CAN_MSG_UNLOCK, devId);
-            m_can->writeFrame(QCanBusFrame(unlockMsgId, {}));
+            if(devState.probing)
+            {
+                // probe(): PROG_REQ -> [PROG_REQ_RESP]; don't unlock the device
+                // (The response can beat the link reporting the PROG_REQ as written)
+                int64_t latencyNs = devState.deadlineNs >= 0
+                                    ? m_deadlineClock.nsecsElapsed() - devState.stageSentNs : 0;
+                leaveStage(devId);
+                if(devState.listener)
+                {
+                    devState.listener->onProbed(devId, devState.stats, latencyNs);
+                }
+                break;
+            }
+
+            sendUnlockCmd(devId);
+            enterStage(devId, CA_STAGE_UNLOCK);
 
         } break;
 
         case CN_CAN_MSG_UNLOCKED:
             // progStart(): PROG_REQ -> PROG_REQ_RESP -> UNLOCK -> [UNLOCKED]
-            //
+            if(!isInStage(devState, CA_STAGE_UNLOCK))
+            {
+                break;
+            }
+            if(m_metrics)
+            {
+                recordStageLatency(devId, rxNs);
+            }
+            leaveStage(devId);
+
             // Send out the device stats gathered at step 2/4
-            // (They will be zero-initialized if no state was present for this device)
-            emit progStarted(devId, devState.stats);
+            if(devState.listener)
+            {
+                devState.listener->onProgStarted(devId, devState.stats);
+            }
             break;
 
         case CN_CAN_MSG_PROG_DONE_ACK:
             // progEnd(): PROG_DONE -> [PROG_DONE_ACK]
-            emit progEnded(devId);
+            if(!isInStage(devState, CA_STAGE_PROG_DONE))
+            {
+                break;
+            }
+            if(m_metrics)
+            {
+                recordStageLatency(devId, rxNs);
+            }
+            leaveStage(devId);
+            if(devState.listener)
+            {
+                devState.listener->onProgEnded(devId);
+            }
             break;
 
         case CN_CAN_MSG_PAGE_SELECTED:
@@ -193,35 +1284,59 @@ void Comms::framesReceived()
             //
             // Expected payload format:
             // - pageAddr: U32 LE
-            if(frame.payload().size() != 4)
+            if(!isInStage(devState, CA_STAGE_SELECT_PAGE))
+            {
+                // Unsolicited or duplicate response, ignore it
+                break;
+            }
+            if(payloadData.size() != 4)
+            {
+                // Broken payload, ignore it (the SELECT_PAGE is re-sent if no
+                // valid response comes in time)
+                CA_LOG(loggerSafe(), CA_ERROR,
+                       QStringLiteral("%1: malformed PAGE_SELECTED (%2 bytes of payload)")
+                       .arg(devIdStr(devId)).arg(payloadData.size()));
+                break;
+            }
+            auto payload = reinterpret_cast<const uint8_t *>(payloadData.constData());
+            uint32_t selPageAddr = readU32LE(payload);
+            if(selPageAddr != devState.stagePageAddr)
             {
-                // Broken payload, abort.
-                // TODO: Log this as an error?
+                // Response to an earlier SELECT_PAGE
                 break;
             }
-            auto payload = reinterpret_cast<uint8_t *>(frame.payload().data());
+            if(m_metrics)
+            {
+                recordStageLatency(devId, rxNs);
+            }
 
             // Confirm the address of the page that is now selected
-            devState.selPageAddr = readU32LE(payload);
+            devState.selPageAddr = selPageAddr;
 
-            auto pageDataIt = devState.pageFlashData.find(devState.selPageAddr);
-            if(pageDataIt != devState.pageFlashData.end())
+            const PageWrite *page = findPageToFlash(devState, devState.selPageAddr);
+            if(page)
             {
                 // There is some data to be flashed to the currently-selected page;
                 // send the WRITE commands
-                sendPageWriteCmds(devId, pageDataIt->second);
+                sendPageWriteCmds(devId, *page);
 
                 // Ask for a CRC16 of the WRITEs that were just sent. The device
                 // should repond  with a WRITES_CHECKED when it's done computing
                 // it
                 uint32_t checkWritesMsg = translateEID(CN_CAN_MSG_CHECK_WRITES, devId);
-                m_can->writeFrame(QCanBusFrame(checkWritesMsg, {}));
+                sendFrame(devId, QCanBusFrame(checkWritesMsg, {}));
+
+                // (Keep counting retries: if CHECK_WRITES times out, the page
+                // is selected again)
+                enterStage(devId, CA_STAGE_CHECK_WRITES, devState.stageAttempts);
             }
             else
             {
                 // A page was selected, but no data is to be written to it.
                 // Just select the next page that is actually to be flashed
-                // TODO: Log this as a warning?
+                CA_LOG(loggerSafe(), CA_WARNING,
+                       QStringLiteral("%1: page %2 was selected, but is not to be flashed")
+                       .arg(devIdStr(devId)).arg(hexStr(selPageAddr, sizeof(selPageAddr) * 2)));
                 selectNextPageToFlash(devId);
             }
 
@@ -231,14 +1346,24 @@ void Comms::framesReceived()
         {
             // flashPage(): SELECT_PAGE -> PAGE_SELECTED -> WRITE... & CHECK_WRITES
             //              -> [WRITES_CHECKED -> COMMIT_WRITES] -> WRITES_COMMITTED
-            auto pageDataIt = devState.pageFlashData.find(devState.selPageAddr);
-            if(pageDataIt == devState.pageFlashData.end())
+            if(!isInStage(devState, CA_STAGE_CHECK_WRITES))
+            {
+                break;
+            }
+            if(m_metrics)
+            {
+                recordStageLatency(devId, rxNs);
+            }
+            const PageWrite *page = findPageToFlash(devState, devState.selPageAddr);
+            if(!page)
             {
                 // We received a CRC16 for a page but we don't think we have
                 // asked for it to be flashed - otherwise we would have its data
-                // at `pageFlashData[selPageAddr]`. This should likely never happen.
-                // TODO: Log this as a warning?
+                // in `pagesToFlash`. This should likely never happen.
                 // Just select a page is actually to be flashed (if any)
+                CA_LOG(loggerSafe(), CA_WARNING,
+                       QStringLiteral("%1: got the CRC of page %2, which is not being flashed")
+                       .arg(devIdStr(devId)).arg(hexStr(devState.selPageAddr, sizeof(devState.selPageAddr) * 2)));
                 selectNextPageToFlash(devId);
                 break;
             }
@@ -246,9 +1371,9 @@ void Comms::framesReceived()
             // Get the CRC16 of the writes from the device. Expected payload format:
             // - crc16: U16 LE
             uint16_t recvdCRC;
-            if(frame.payload().size() == 2)
+            if(payloadData.size() == 2)
             {
-                auto payload = reinterpret_cast<uint8_t *>(frame.payload().data());
+                auto payload = reinterpret_cast<const uint8_t *>(payloadData.constData());
                 recvdCRC = readU16LE(payload);
             }
             else
@@ -256,31 +1381,39 @@ void Comms::framesReceived()
                 // Broken payload, this should never happen.
                 // Set the "received" CRC to a weird value so that it hopefully
                 // will never match with the locally-computed one
-                // TODO: Log this as a warning?
+                CA_LOG(loggerSafe(), CA_ERROR,
+                       QStringLiteral("%1: malformed WRITES_CHECKED (%2 bytes of payload)")
+                       .arg(devIdStr(devId)).arg(payloadData.size()));
                 recvdCRC = 0xFFFFu;
             }
 
-            // Calculate the CRC16 of the writes locally
-            auto writtenData = reinterpret_cast<const uint8_t *>(pageDataIt->second.data());
-            auto writtenDataLen = static_cast<unsigned long>(pageDataIt->second.size());
-            uint16_t expectedCRC = crc16(writtenDataLen, writtenData);
+            // (The CRC16 of the writes was computed when the page was queued)
+            uint16_t expectedCRC = page->crc;
 
             if(recvdCRC == expectedCRC)
             {
                 // CRC matches, commit the writes to the page
                 uint32_t commitWritesMsg = translateEID(CN_CAN_MSG_COMMIT_WRITES, devId);
-                m_can->writeFrame(QCanBusFrame(commitWritesMsg, {}));
+                sendFrame(devId, QCanBusFrame(commitWritesMsg, {}));
+                enterStage(devId, CA_STAGE_COMMIT_WRITES);
             }
             else
             {
-                // CRC mismatch, don't commit writes
-                emit pageFlashErrored(devId, devState.selPageAddr, expectedCRC, recvdCRC);
-
-                // Give up on writing this page and SELECT_PAGE the next one to
-                // be flashed (if any)
-                devState.pageFlashData.erase(devState.selPageAddr);
+                // CRC mismatch, don't commit writes. Give up on writing this
+                // page and SELECT_PAGE the next one to be flashed (if any)
+                if(m_metrics)
+                {
+                    deviceMetrics(devId).crcMismatches ++;
+                }
+                uint32_t pageAddr = devState.selPageAddr;
+                erasePageToFlash(devState, pageAddr);
                 devState.selPageAddr = DeviceState::NO_PAGE;
                 selectNextPageToFlash(devId);
+
+                if(devState.listener)
+                {
+                    devState.listener->onPageFlashErrored(devId, pageAddr, expectedCRC, recvdCRC);
+                }
             }
 
         } break;
@@ -289,37 +1422,41 @@ void Comms::framesReceived()
         {
             // flashPage(): SELECT_PAGE -> PAGE_SELECTED -> WRITE... & CHECK_WRITES
             //              -> WRITES_CHECKED -> COMMIT_WRITES -> [WRITES_COMMITTED]
-            //
+            if(!isInStage(devState, CA_STAGE_COMMIT_WRITES))
+            {
+                break;
+            }
+
             // Get the address of the committed page. Expected payload format:
             // - pageAddr: U32 LE
-            uint32_t pageAddr;
-            if(frame.payload().size() == 4)
+            if(payloadData.size() != 4)
             {
-                auto payload = reinterpret_cast<uint8_t *>(frame.payload().data());
-                pageAddr = readU32LE(payload);
+                // Broken payload: we can't tell what page the writes were
+                // committed to, so ignore it (the COMMIT_WRITES is re-sent if
+                // no valid response comes in time)
+                CA_LOG(loggerSafe(), CA_ERROR,
+                       QStringLiteral("%1: malformed WRITES_COMMITTED (%2 bytes of payload)")
+                       .arg(devIdStr(devId)).arg(payloadData.size()));
+                break;
             }
-            else
+            if(m_metrics)
             {
-                // Broken payload, this should definitely never happen.
-                // FIXME IMPORTANT: Handle this situation better and at least log an error
-                Q_ASSERT(false && "Broken WRITES_COMMITTED payload");
-
-                // We don't know what page the writes were committed to, so we
-                // guess we have committed writes to the currently-selected page.
-                // !! If this assumption is wrong flashing will likely fail /   !!
-                // !! never end for two pages - the currently-selected page and !!
-                // !! the page that writes were actually committed to!          !!
-                pageAddr = devState.selPageAddr;
+                recordStageLatency(devId, rxNs);
             }
-
-            emit pageFlashed(devId, pageAddr);
+            auto payload = reinterpret_cast<const uint8_t *>(payloadData.constData());
+            uint32_t pageAddr = readU32LE(payload);
 
             // This page has now be written to; remove it from queue of pages to
             // write and SELECT_PAGE the next one to be flashed (if any)
-            devState.pageFlashData.erase(devState.selPageAddr);
+            erasePageToFlash(devState, devState.selPageAddr);
             devState.selPageAddr = DeviceState::NO_PAGE;
             selectNextPageToFlash(devId);
 
+            if(devState.listener)
+            {
+                devState.listener->onPageFlashed(devId, pageAddr);
+            }
+
         } break;
 
         default:
@@ -329,5 +1466,37 @@ void Comms::framesReceived()
     }
 }
 
+void Comms::framesWritten(qint64 nFrames)
+{
+    // Frames left the TX window, make room for more
+    m_txInFlight -= std::min(m_txInFlight, static_cast<size_t>(nFrames));
+    m_txWrittenInTick = true;
+    pumpTx();
+}
+
+void Comms::canErrorOccurred(QCanBusDevice::CanBusError error)
+{
+    if(error == QCanBusDevice::WriteError && !m_txPumping)
+    {
+        // The frame(s) that failed will never be reported as written
+        // (`pumpTx()` rolls back its own failed writes)
+        resyncTxInFlight();
+    }
+}
+
+void Comms::canStateChanged(QCanBusDevice::CanBusDeviceState state)
+{
+    if(state == QCanBusDevice::ConnectedState)
+    {
+        // (Send whatever piled up while disconnected)
+        pumpTx();
+    }
+    else
+    {
+        // Frames handed to the link are gone with its connection
+        m_txInFlight = 0;
+    }
+}
+
 
 }
@@ -9,25 +9,157 @@
 #define COMMS_HH
 
 #include <utility>
-#include <unordered_map>
+#include <array>
+#include <memory>
+#include <vector>
 #include <QObject>
+#include <QTimer>
+#include <QElapsedTimer>
 #include <QByteArray>
 #include <QCanBusDevice>
 #include <QSharedPointer>
 #include "types.hh"
+#include "metrics.hh"
+#include "ring_queue.hh"
 
 namespace ca
 {
 
+/// Optional protocol features a CANnuccia device can advertise in its
+/// PROG_REQ_RESP (see `DeviceStats::features`).
+enum DeviceFeature : uint8_t
+{
+    /// The temporary page is filled with `DeviceStats::tempPageFill` on
+    /// SELECT_PAGE, so runs of that value do not need to be written.
+    DEVICE_FEATURE_TEMP_PAGE_FILL = (1u << 0),
+
+    /// The device accepts CAN FD WRITE frames (with up to 64 bytes of payload
+    /// and bitrate switching).
+    DEVICE_FEATURE_CAN_FD = (1u << 1),
+
+    /// The device erases its whole application flash on UNLOCK, leaving every
+    /// byte set to `DeviceStats::erasedValue`; pages that are entirely that
+    /// value do not need to be flashed at all.
+    DEVICE_FEATURE_ERASED_ON_UNLOCK = (1u << 2),
+
+    /// The device can decompress the WRITEs for a page from a single LZ4 block
+    /// into its temporary page (CHECK_WRITES still checks the decompressed page).
+    /// It is only used if the host opts into it by sending this flag as the
+    /// (otherwise empty) payload of UNLOCK; SELECT_PAGE then has a fifth payload
+    /// byte telling whether the WRITEs for that page are raw (0) or compressed (1).
+    DEVICE_FEATURE_COMPRESSED_WRITES = (1u << 3),
+};
+
 /// Statistics about a CANnuccia device.
 struct DeviceStats
 {
     uint32_t pageSize; ///< The size of a flash page in bytes.
     uint16_t nFlashPages; ///< The total number of `pageSize`d flash pages.
     uint16_t elfMachine; ///< The ELF machine type (`e_machine`).
+    uint8_t features; ///< `DeviceFeature` flags (0 for devices that don't advertise any).
+    uint8_t tempPageFill; ///< See `DEVICE_FEATURE_TEMP_PAGE_FILL`.
+    uint8_t erasedValue; ///< See `DEVICE_FEATURE_ERASED_ON_UNLOCK`.
+};
+
+/// Statistics about the outbound frame queue of a CANnuccia device.
+struct TxQueueStats
+{
+    size_t queueDepth; ///< The number of frames currently queued to be sent to the device.
+    uint64_t framesSent; ///< The total number of frames sent to the device.
+    int64_t idleNs; ///< The total time the queue was empty (i.e. the device had
+                    ///< nothing to receive), in nanoseconds, since the first frame
+                    ///< was queued to it.
+};
+
+/// How long `Comms` waits for devices to respond and how many times failed
+/// steps are retried before giving up.
+struct RetryPolicy
+{
+    /// How long to wait for the response to each `CAstage`'s command, in
+    /// milliseconds (counted from when the command is handed to the CAN link).
+    int stageTimeoutsMs[CA_NUM_STAGES];
+
+    /// How many times a stage's command is re-sent to a device that did not
+    /// respond in time; the deadline doubles at each retry (up to 16x).
+    unsigned maxStageRetries;
+
+    /// How many times in a row a page is re-flashed after a CRC mismatch.
+    unsigned maxPageRetries;
+
+    /// How many page re-flashes are allowed in total per device per operation.
+    unsigned maxDeviceRetries;
+
+    /// How long to wait before re-flashing a page the first time, in
+    /// milliseconds; doubled at each consecutive retry of the same page.
+    int pageRetryBackoffMs;
+
+    /// Returns the default retry policy.
+    static RetryPolicy defaults();
+};
+
+/// Receives the events of the CANnuccia devices it claimed (see `Comms::claim()`).
+///
+/// All functions are called synchronously by `Comms` while it handles frames,
+/// so they can issue more commands right away.
+class DeviceListener
+{
+public:
+    virtual ~DeviceListener() = default;
+
+    /// Called after programming a device is started (PROG_REQ_RESP + UNLOCKED).
+    /// Outputs the stats obtained from the PROG_REQ_RESP.
+    virtual void onProgStarted(CAdevId devId, const DeviceStats &devStats);
+
+    /// Called after a device exits programming mode (PROG_DONE_ACK).
+    virtual void onProgEnded(CAdevId devId);
+
+    /// Called after a device has sent the CRC16/XMODEM of a page after it being
+    /// written, it matched the expected value, and it successfully committed
+    /// the writes to flash.
+    virtual void onPageFlashed(CAdevId devId, uint32_t pageAddr);
+
+    /// Called after a device has sent the CRC16/XMODEM of a page after it being
+    /// written, it did not match the expected value, and so no writes were
+    /// committed to that page.
+    virtual void onPageFlashErrored(CAdevId devId, uint32_t pageAddr,
+                                    uint16_t expectedCrc, uint16_t recvdCrc);
+
+    /// Called when a device did not respond to the command of `stage` even
+    /// after `RetryPolicy::maxStageRetries` retries. The device was `abort()`ed.
+    virtual void onStageTimedOut(CAdevId devId, CAstage stage);
+
+    /// Called when a device responded to a `Comms::probe()`, `latencyNs`
+    /// nanoseconds after the PROG_REQ was handed to the CAN link.
+    /// Outputs the stats obtained from the PROG_REQ_RESP.
+    virtual void onProbed(CAdevId devId, const DeviceStats &devStats, int64_t latencyNs);
+
+    /// Called when a device did not respond to a `Comms::probe()` in time.
+    virtual void onProbeTimedOut(CAdevId devId);
 };
 
 /// Implementation of the CANnuccia protocol over `QCanBusDevice`.
+///
+/// Outbound frames are kept in per-device queues and interleaved on the bus by
+/// a weighted round-robin arbiter, so that frames for one device can be sent
+/// while another one is busy (computing a CRC, committing a page...).
+///
+/// The frames to write a page (WRITEs and SEEKs) are
+/// built once per page and kept until another page is flashed, so retries just
+/// re-send them; frames, their payloads and the per-device state are all reused
+/// across pages, so that flashing does not allocate in steady state.
+///
+/// Frames are handed to the CAN link at a controlled pace: at most `txWindow()`
+/// at a time, without exceeding the bus load set via `setBusLoadLimit()`, and
+/// frames that fail to be written (ex. because the link's TX queue is full) are
+/// retried after a backoff instead of being lost.
+///
+/// Each command that expects a response from a device has a deadline (see
+/// `RetryPolicy`); commands that time out are re-sent, and the device's
+/// listener is notified when it does not respond after all retries.
+///
+/// Events about a device are only delivered to the `DeviceListener` that
+/// `claim()`ed it (via a device id -> listener table), so that dispatching them
+/// does not depend on how many devices or operations are active.
 class Comms : public QObject
 {
     Q_OBJECT
@@ -54,12 +186,26 @@ public:
         {
             disconnect(m_can.get(), &QCanBusDevice::framesReceived,
                        this, &Comms::framesReceived);
+            disconnect(m_can.get(), &QCanBusDevice::framesWritten,
+                       this, &Comms::framesWritten);
+            disconnect(m_can.get(), &QCanBusDevice::errorOccurred,
+                       this, &Comms::canErrorOccurred);
+            disconnect(m_can.get(), &QCanBusDevice::stateChanged,
+                       this, &Comms::canStateChanged);
         }
         m_can = can;
+        m_canFd = can && can->configurationParameter(QCanBusDevice::CanFdKey).toBool();
+        m_txInFlight = 0;
         if(can)
         {
             connect(m_can.get(), &QCanBusDevice::framesReceived,
                     this, &Comms::framesReceived);
+            connect(m_can.get(), &QCanBusDevice::framesWritten,
+                    this, &Comms::framesWritten);
+            connect(m_can.get(), &QCanBusDevice::errorOccurred,
+                    this, &Comms::canErrorOccurred);
+            connect(m_can.get(), &QCanBusDevice::stateChanged,
+                    this, &Comms::canStateChanged);
         }
     }
 
@@ -69,65 +215,411 @@ public:
         return bool(m_can);
     }
 
+    /// Returns the maximum number of frames handed to the CAN link that it did
+    /// not report as written yet. Frames past this window are kept in the
+    /// per-device queues, where they can be interleaved with other devices'.
+    inline size_t txWindow() const
+    {
+        return m_txWindow;
+    }
+
+    /// Returns the number of frames handed to the CAN link that it did not
+    /// report as written yet.
+    ///
+    /// Frames the link fails to write or drops (ex. on bus-off) are never
+    /// reported as written; this count is resynced with the link's own TX queue
+    /// on write errors, and whenever no frames were reported as written for a
+    /// whole deadline tick. It is reset if the link disconnects.
+    inline size_t txInFlight() const
+    {
+        return m_txInFlight;
+    }
+
+    /// Sets the maximum number of frames handed to the CAN link that it did not
+    /// report as written yet (must be at least 1).
+    inline void setTxWindow(size_t txWindow)
+    {
+        Q_ASSERT(txWindow > 0);
+        m_txWindow = txWindow > 0 ? txWindow : 1;
+        pumpTx();
+    }
+
+    /// Returns whether the CAN link is configured for CAN FD; if so, WRITEs to
+    /// devices that advertise `DEVICE_FEATURE_CAN_FD` are sent as FD frames.
+    inline bool isCanFd() const
+    {
+        return m_canFd;
+    }
+
+    /// Sets the maximum percentage (1..100) of the bandwidth of the bus, whose
+    /// bitrate is `bitrate` bits/s, that may be used by CANale, so that other
+    /// nodes on the bus can still communicate while flashing.
+    /// `dataBitrate` is the bitrate of the data phase of CAN FD frames sent with
+    /// bitrate switching (0 = same as `bitrate`).
+    /// Set `bitrate` or `maxLoadPercent` to 0 to disable the limit (default).
+    void setBusLoadLimit(unsigned long bitrate, unsigned maxLoadPercent,
+                         unsigned long dataBitrate=0);
+
+    /// Returns whether WRITEs are sent compressed to devices that support it
+    /// (see `DEVICE_FEATURE_COMPRESSED_WRITES`), whenever that takes less bus
+    /// time than sending them raw.
+    inline bool writeCompression() const
+    {
+        return m_writeCompression;
+    }
+
+    /// Enables (default) or disables compressed WRITEs. Only affects devices
+    /// that are unlocked from now on.
+    inline void setWriteCompression(bool writeCompression)
+    {
+        m_writeCompression = writeCompression;
+    }
+
+    /// Returns the bitrate of the bus given to `setBusLoadLimit()`, in bits/s
+    /// (0 = unknown).
+    inline unsigned long busBitrate() const
+    {
+        return m_busBitrate;
+    }
+
+    /// Returns the max. number of (nominal) bits on the bus that flashing
+    /// `pageData` to the device with id `devId` takes, counting all frames of
+    /// the SELECT_PAGE -> WRITE... -> CHECK_WRITES -> COMMIT_WRITES exchange.
+    /// Only valid after the device's PROG_REQ_RESP was received.
+    double pageFlashBusBits(DevId devId, const QByteArray &pageData) const;
+
+    /// Returns the total number of times handing a frame to the CAN link
+    /// failed and was retried.
+    inline uint64_t txWriteRetries() const
+    {
+        return m_txWriteRetries;
+    }
+
+    /// Returns the total number of frames that were dropped because the CAN
+    /// link kept failing to write them.
+    inline uint64_t txFramesDropped() const
+    {
+        return m_txFramesDropped;
+    }
+
+    /// Returns the arbitration weight of a device (1 by default).
+    /// A device of weight N gets to send up to N frames each time its turn in
+    /// the round-robin comes.
+    unsigned txWeight(DevId devId) const;
+
+    /// Sets the arbitration weight of a device (must be at least 1).
+    void setTxWeight(DevId devId, unsigned weight);
+
+    /// Returns statistics about the outbound frame queue of a device.
+    TxQueueStats txQueueStats(DevId devId) const;
+
+    /// Returns the total time no frames were queued to any device, in
+    /// nanoseconds, since the first frame was queued.
+    int64_t txIdleNs() const;
+
+    /// Returns the deadlines and retry budgets in use.
+    inline const RetryPolicy &retryPolicy() const
+    {
+        return m_retryPolicy;
+    }
+
+    /// Sets the deadlines and retry budgets to use from now on.
+    void setRetryPolicy(const RetryPolicy &retryPolicy);
+
+    /// Returns the log handler that protocol errors (ex. malformed responses)
+    /// are logged to, if any.
+    inline LogHandler *logger() const
+    {
+        return m_logger;
+    }
+
+    /// Sets the log handler that protocol errors are logged to (null = none).
+    /// It must outlive this object, and is called from the thread it lives in.
+    inline void setLogger(LogHandler *logger)
+    {
+        m_logger = logger;
+    }
+
+    /// Makes `listener` the only receiver of the events of the device with id
+    /// `devId`, until it `release()`s it.
+    /// Returns false (and does nothing) if another listener claimed the device.
+    bool claim(DevId devId, DeviceListener *listener);
+
+    /// Stops delivering events of the device with id `devId` to `listener`
+    /// (does nothing if `listener` did not claim it).
+    void release(DevId devId, DeviceListener *listener);
+
+    /// Returns the listener that claimed the device with id `devId` (if any).
+    inline DeviceListener *listener(DevId devId) const
+    {
+        return m_deviceStates[devId].listener;
+    }
+
+    /// Returns whether `ProtocolMetrics` are being collected.
+    inline bool metricsEnabled() const
+    {
+        return bool(m_metrics);
+    }
+
+    /// Starts (from scratch) or stops collecting `ProtocolMetrics` for each
+    /// device. Disabled by default; while disabled, nothing is timestamped or
+    /// counted.
+    void setMetricsEnabled(bool enabled);
+
+    /// Returns the metrics collected for the device with id `devId` (all empty
+    /// if metrics are disabled).
+    ProtocolMetrics metrics(DevId devId) const;
+
+    /// Returns the metrics collected for all devices together (all empty if
+    /// metrics are disabled).
+    ProtocolMetrics metrics() const;
+
+    /// Abandons whatever is being done with the device with id `devId`: frames
+    /// still queued for it are dropped, pending deadlines are disarmed and all
+    /// pages still to be flashed are forgotten. Responses to commands sent
+    /// before this call are ignored.
+    void abort(DevId devId);
+
 public slots:
     /// Sends a PROG_REQ to the device with id `devId`. If and when the PROG_REQ_RESP
     /// is received, sends an UNLOCK command. Finally, if and when UNLOCKED is
-    /// received, emits `progStarted()`.
+    /// received, calls `DeviceListener::onProgStarted()`.
     void progStart(DevId devId);
 
+    /// Sends a PROG_REQ to the device with id `devId` to find out whether it is
+    /// present, without unlocking it. Calls `DeviceListener::onProbed()` if a
+    /// PROG_REQ_RESP is received within `timeoutMs` milliseconds of the PROG_REQ
+    /// being handed to the CAN link, or `DeviceListener::onProbeTimedOut()`
+    /// otherwise; the PROG_REQ is never retried.
+    void probe(DevId devId, int timeoutMs);
+
     /// Sends a PROG_DONE to the device with id `devId`.
-    /// Emits `progEnded()` if and when PROG_DONE_ACK is received.
+    /// Calls `DeviceListener::onProgEnded()` if and when PROG_DONE_ACK is received.
     void progEnd(DevId devId);
 
     /// Writes to the flash page at `pageAddr` in the device with id `devId`.
-    /// Calculates the CRC16/XMODEM of the writes and compares it with the target;
-    /// emits `pageFlashed()` if and when the checksum reponse is received from the
-    /// device.
-    void flashPage(DevId devId, uint32_t pageAddr, QByteArray pageData);
-
-signals:
-    /// Emitted after programming a device is started (PROG_REQ_RESP + UNLOCKED).
-    /// Outputs the stats obtained from the PROG_REQ_RESP.
-    void progStarted(DevId devId, DeviceStats outDeviceStats);
-
-    /// Emitted after a device exits programming mode (PROG_DONE_ACK).
-    void progEnded(DevId devId);
+    /// Compares `pageCrc`, the CRC16/XMODEM of `pageData`, with the one computed
+    /// by the device; calls `DeviceListener::onPageFlashed()` (or
+    /// `onPageFlashErrored()`) if and when the checksum reponse is received
+    /// from the device.
+    void flashPage(DevId devId, uint32_t pageAddr, QByteArray pageData, uint16_t pageCrc);
 
-    /// Emitted after a device has sent the CRC16/XMODEM of a page after it being
-    /// written, it matched the expected value, and it successfully committed
-    /// the writes to flash.
-    void pageFlashed(DevId devId, uint32_t pageAddr);
-
-    /// Emitted after a device has sent the CRC16/XMODEM of a page after it being
-    /// written, it did not match the expected value, and so no writes were
-    /// committed to that page.
-    void pageFlashErrored(DevId devId, uint32_t pageAddr, uint16_t expectedCrc, uint16_t recvdCrc);
+    /// Like above, but calculates the CRC16/XMODEM of `pageData` itself.
+    void flashPage(DevId devId, uint32_t pageAddr, QByteArray pageData);
 
 
 private:
     QSharedPointer<QCanBusDevice> m_can;
+    bool m_canFd; ///< See `isCanFd()`.
+    bool m_writeCompression; ///< See `writeCompression()`.
+
+    /// A page to be flashed.
+    struct PageWrite
+    {
+        uint32_t addr; ///< The address of the page.
+        QByteArray data; ///< The data to flash.
+        uint16_t crc; ///< CRC16/XMODEM of `data`.
+    };
+
+    /// The frames that write a page to a device (see `buildWriteBatch()`).
+    struct WriteBatch
+    {
+        bool valid{false}; ///< Do `frames` hold the frames for the page below?
+        uint32_t pageAddr{0}; ///< The page the frames write.
+        const char *pageData{nullptr}; ///< The data of the page (compared by identity).
+        int pageSize{0};
+        uint16_t pageCrc{0};
+        std::vector<QCanBusFrame> frames{}; ///< Frame slots (only the first `nFrames` are in use).
+        size_t nFrames{0};
+        bool compressed{false}; ///< Are the WRITEs a compressed stream (see `DEVICE_FEATURE_COMPRESSED_WRITES`)?
+        std::vector<uint8_t> compressedStream{}; ///< Reused for compressing pages.
+    };
 
     struct DeviceState
     {
         static constexpr uint32_t NO_PAGE = static_cast<uint32_t>(-1);
 
+        DeviceListener *listener{nullptr}; ///< Receives the events of this device (see `claim()`)
         DeviceStats stats{0, 0, 0}; ///< Stats about this device
-        std::unordered_map<uint32_t, QByteArray> pageFlashData{}; ///< page address -> data to flash there
+        std::vector<PageWrite> pagesToFlash{}; ///< Pages to flash, in the order they were queued
         uint32_t selPageAddr{NO_PAGE}; ///< Currently-selected page (as indicated by PAGE_SELECTED)
                                        ///< or NO_PAGE if no page is being flashed currently
+        bool compressedWrites{false}; ///< Was `DEVICE_FEATURE_COMPRESSED_WRITES` opted into on UNLOCK?
+        WriteBatch writeBatch{}; ///< The frames that write the last page selected
+        QCanBusFrame selectPageFrame{}; ///< Reused for all SELECT_PAGEs
+
+        RingQueue<QCanBusFrame> txQueue{}; ///< Frames still to be sent to this device
+        unsigned txWeight{1}; ///< Arbitration weight (see `setTxWeight()`)
+        unsigned txCredit{0}; ///< Frames this device can still send in its current round-robin turn
+        uint64_t txFramesSent{0}; ///< Total frames sent to this device
+        int64_t txIdleNs{0}; ///< Total time `txQueue` was empty (not counting the current idle period)
+        QElapsedTimer txIdleTimer{}; ///< Started when `txQueue` becomes empty
+        uint64_t txFramesQueued{0}; ///< Total frames queued for this device
+        uint64_t txFramesDone{0}; ///< Total frames taken off `txQueue` (sent, dropped or aborted)
+
+        bool inStage{false}; ///< Waiting for the response to the command of `stage`?
+        CAstage stage{CA_STAGE_PROG_REQ}; ///< The stage the device is in (if `inStage`)
+        uint32_t stagePageAddr{NO_PAGE}; ///< The page the stage's command refers to (if any)
+        unsigned stageAttempts{0}; ///< Times the stage's command was re-sent
+        uint64_t stageArmSeq{0}; ///< The deadline is armed when `txFramesDone` reaches this
+        int64_t deadlineNs{-1}; ///< When the stage times out (on `m_deadlineClock`), or -1 if not armed
+        int64_t stageSentNs{-1}; ///< When the stage's command was handed to the link (if the deadline is armed)
+        bool probing{false}; ///< Is the PROG_REQ stage a `probe()`?
+        int probeTimeoutMs{0}; ///< The timeout of the `probe()` (if `probing`)
+    };
+    /// Device id -> state. Flat, so that looking a device up is a plain index.
+    std::array<DeviceState, 256> m_deviceStates;
+    static_assert(sizeof(DevId) == 1, "m_deviceStates must have an entry per device id");
+
+    RingQueue<DevId> m_txRing; ///< Devices with a non-empty `txQueue`, in round-robin order.
+    size_t m_txWindow; ///< See `txWindow()`.
+    size_t m_txInFlight; ///< Frames handed to `m_can` but not reported as written yet.
+    bool m_txWrittenInTick; ///< Were any frames reported as written since the last deadline tick?
+    bool m_txPumping; ///< Is `pumpTx()` currently running?
+    int64_t m_txIdleNs; ///< Total time `m_txRing` was empty (not counting the current idle period).
+    QElapsedTimer m_txIdleTimer; ///< Started when `m_txRing` becomes empty.
+
+    QTimer *m_txTimer; ///< Resumes `pumpTx()` after waiting for bus load budget or a write retry.
+    unsigned m_txWriteAttempts; ///< Failed attempts at writing the frame at the head of the ring.
+    uint64_t m_txWriteRetries; ///< See `txWriteRetries()`.
+    uint64_t m_txFramesDropped; ///< See `txFramesDropped()`.
+    unsigned long m_busBitrate; ///< See `busBitrate()`.
+    double m_txBudgetRate; ///< Bus load budget, in bits/s (0 = unlimited).
+    double m_txDataBitTime; ///< Duration of a CAN FD data phase bit, in nominal bits.
+    double m_txBudget; ///< Bits that can be sent right now without exceeding `m_txBudgetRate`.
+    double m_txBudgetMax; ///< Cap for `m_txBudget` (i.e. the max. burst size in bits).
+    int64_t m_txBudgetNs; ///< When `m_txBudget` was last refilled (on `m_txBudgetClock`).
+    QElapsedTimer m_txBudgetClock;
+
+    RetryPolicy m_retryPolicy; ///< See `retryPolicy()`.
+    LogHandler *m_logger; ///< See `logger()`.
+    QTimer *m_deadlineTimer; ///< Ticks while any stage deadline is armed or any frame is in flight.
+    QElapsedTimer m_deadlineClock;
+
+    /// Returns `m_logger` if present or a no-op logger if it is not.
+    LogHandler &loggerSafe();
+
+    /// What is kept while metrics are enabled (see `setMetricsEnabled()`).
+    struct MetricsState
+    {
+        std::array<std::unique_ptr<ProtocolMetrics>, 256> devices{}; ///< Per device (allocated when first needed).
+        bool rxTimestamped{false}; ///< Has the CAN link timestamped any received frame yet?
+        int64_t rxClockOffsetNs{0}; ///< Estimated `m_deadlineClock` time minus frame timestamp.
     };
-    std::unordered_map<DevId, DeviceState> m_deviceStates;
+    std::unique_ptr<MetricsState> m_metrics; ///< Null while metrics are disabled.
+
+    /// Returns the metrics of the device at `devId`, allocating them if needed.
+    /// Only valid while metrics are enabled.
+    ProtocolMetrics &deviceMetrics(DevId devId);
+
+    /// Returns when `frame` was received, on `m_deadlineClock`; uses its
+    /// timestamp if the CAN link set one. Records how long it took the host
+    /// to get to it in the metrics of the device at `devId`.
+    /// Only valid while metrics are enabled.
+    int64_t frameRxNs(const QCanBusFrame &frame, DevId devId);
+
+    /// Records the latency of the current stage of the device at `devId`,
+    /// whose response was received at `rxNs` (see `frameRxNs()`).
+    /// Only valid while metrics are enabled.
+    void recordStageLatency(DevId devId, int64_t rxNs);
+
+    /// Records that the command of `stage` was just queued for the device at
+    /// `devId` and that its response is awaited. The stage's deadline is armed
+    /// as soon as the command is handed to the CAN link; `attempts` is the
+    /// number of retries done so far (the deadline grows with it).
+    void enterStage(DevId devId, CAstage stage, unsigned attempts=0);
+
+    /// Records that the response of the current stage of the device at `devId`
+    /// was received, disarming its deadline.
+    void leaveStage(DevId devId);
+
+    /// Returns whether the device is waiting for the response to `stage`.
+    static inline bool isInStage(const DeviceState &devState, CAstage stage)
+    {
+        return devState.inStage && devState.stage == stage;
+    }
+
+    /// Arms the deadline of the device's current stage if its command was handed
+    /// to the CAN link already.
+    void armDeadline(DeviceState &devState);
+
+    /// Starts `m_deadlineTimer` if any deadline is armed or any frame is in
+    /// flight (and it is not running already).
+    /// The timer keeps ticking instead of being restarted for every deadline, as
+    /// (re)starting a timer allocates.
+    void scheduleDeadlines();
+
+    /// Queues the command of the current stage of the device at `devId` again.
+    void resendStageCmd(DevId devId);
+
+    /// Takes `bits` from the bus load budget, if there are enough.
+    /// Returns 0 on success, or the number of milliseconds to wait for enough
+    /// budget to be available otherwise.
+    int takeTxBudget(double bits);
+
+    /// Makes `m_txTimer` resume `pumpTx()` in `msecs` milliseconds (or earlier,
+    /// if it was already scheduled to).
+    void resumeTxIn(int msecs);
+
+    /// Queues a frame to be sent to the device at `devId`, after all other
+    /// frames queued for it. Frames for different devices are interleaved.
+    void sendFrame(DevId devId, const QCanBusFrame &frame);
+
+    /// Hands queued frames to `m_can`, in weighted round-robin order among
+    /// devices, until either there are no more frames or the TX window is full.
+    void pumpTx();
+
+    /// Lowers `m_txInFlight` to the number of frames still queued in `m_can`,
+    /// for when the link lost some frames without reporting them as written.
+    void resyncTxInFlight();
+
+    /// Returns the max. number of bits on the bus taken by `frame`.
+    double frameBusBitsOf(const QCanBusFrame &frame) const;
+
+    /// Sends an UNLOCK command to the device at `devId` (without entering
+    /// `CA_STAGE_UNLOCK`), opting into the features it supports that are enabled.
+    void sendUnlockCmd(DevId devId);
 
     /// Sends a command to the device at `devId` asking it to SELECT_PAGE
-    /// the flash page at `pageAddr`.
+    /// the flash page at `pageAddr` (without entering `CA_STAGE_SELECT_PAGE`).
+    /// If compressed WRITEs were negotiated, builds the write batch for the
+    /// page first to tell the device whether it is compressed.
     void sendSelectPageCmd(DevId devId, uint32_t pageAddr);
 
-    /// Sends WRITE commands to write `pageData` to the device at `devId`.
-    /// The WRITEs will have <=8 bytes of payload data each.
-    void sendPageWriteCmds(DevId devId, QByteArray pageData);
+    /// Fills `m_deviceStates[devId].writeBatch` with the WRITE commands that
+    /// write `page` to the device at `devId`.
+    /// The WRITEs will have <=8 bytes of payload data each, or <=64 bytes if
+    /// they are sent as CAN FD frames (see `DEVICE_FEATURE_CAN_FD`).
+    ///
+    /// If the device fills its temporary page on SELECT_PAGE, runs of the fill
+    /// value are skipped via SEEK commands whenever that takes less bus time
+    /// than writing them; the resulting temporary page (and so its CRC) is the
+    /// same as if all of the page were written.
+    ///
+    /// If compressed WRITEs were negotiated with the device, the page (minus
+    /// any trailing fill) is sent as an LZ4 block instead whenever that takes
+    /// less bus time.
+    ///
+    /// Does nothing if the batch already holds the frames for `page`.
+    void buildWriteBatch(DevId devId, const PageWrite &page);
+
+    /// Fills `batch` with the frames that write the `pageSize` bytes at
+    /// `pageData` to the device at `devId` (see `buildWriteBatch()`).
+    /// Returns the max. number of bits they take on the bus.
+    double planWriteBatch(DevId devId, const char *pageData, int pageSize, WriteBatch &batch) const;
+
+    /// Sends the WRITE commands for `page` to the device at `devId` (see
+    /// `buildWriteBatch()`).
+    void sendPageWriteCmds(DevId devId, const PageWrite &page);
+
+    /// Returns the page to be flashed at `pageAddr` on a device, or null if none.
+    static PageWrite *findPageToFlash(DeviceState &devState, uint32_t pageAddr);
+
+    /// Removes the page at `pageAddr` from the pages to be flashed on a device.
+    static void erasePageToFlash(DeviceState &devState, uint32_t pageAddr);
 
     /// Sends a SELECT_PAGE command to the device at `devId`, selecting the first
-    /// page in `m_deviceStates[devId].pageFlashData` whose address is NOT
+    /// page in `m_deviceStates[devId].pagesToFlash` whose address is NOT
     /// `m_deviceStats[devId].selPageAddr`.
     /// Does nothing if there are no pages to flash for the device.
     void selectNextPageToFlash(DevId devId);
@@ -135,6 +627,18 @@ private:
 private slots:
     /// Handles CAN frames being received.
     void framesReceived();
+
+    /// Handles CAN frames being written to the bus by `m_can`.
+    void framesWritten(qint64 nFrames);
+
+    /// Handles stage deadlines expiring.
+    void deadlinesExpired();
+
+    /// Handles errors of the CAN link.
+    void canErrorOccurred(QCanBusDevice::CanBusError error);
+
+    /// Handles the CAN link (dis)connecting.
+    void canStateChanged(QCanBusDevice::CanBusDeviceState state);
 };
 
 }
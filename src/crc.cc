@@ -0,0 +1,326 @@
+// CANale/src/crc.cc - Implementation of CANale/src/crc.hh
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include "crc.hh"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#   define CA_CRC16_CLMUL_X86
+#   include <emmintrin.h>
+#   include <tmmintrin.h>
+#   include <wmmintrin.h>
+#   if defined(__GNUC__) || defined(__clang__)
+#       include <cpuid.h>
+#       define CA_TARGET_CLMUL __attribute__((target("pclmul,ssse3")))
+#   else
+#       include <intrin.h>
+#       define CA_TARGET_CLMUL
+#   endif
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES))
+    // (Only when building for a CPU with the crypto extension, ex. -march=armv8-a+crypto)
+#   define CA_CRC16_CLMUL_ARM
+#   include <arm_neon.h>
+#   if defined(__linux__)
+#       include <sys/auxv.h>
+#       include <asm/hwcap.h>
+#   endif
+#   define CA_TARGET_CLMUL
+#endif
+
+namespace ca
+{
+
+/// The CRC16/XMODEM polynomial, including the x^16 term.
+static constexpr uint32_t CRC16_POLY = 0x11021u;
+
+
+/// Lookup tables for `crc16SliceBy8()`.
+/// `t[k][b]` is the CRC of byte `b` followed by `k` zero bytes.
+struct Crc16Tables
+{
+    uint16_t t[8][256];
+
+    Crc16Tables()
+    {
+        for(unsigned b = 0; b < 256; b ++)
+        {
+            uint8_t byte = static_cast<uint8_t>(b);
+            t[0][b] = crc16Bitwise(1, &byte);
+        }
+        for(unsigned k = 1; k < 8; k ++)
+        {
+            for(unsigned b = 0; b < 256; b ++)
+            {
+                uint16_t prev = t[k - 1][b];
+                t[k][b] = static_cast<uint16_t>((prev << 8) ^ t[0][prev >> 8]);
+            }
+        }
+    }
+};
+
+static const Crc16Tables &crc16Tables()
+{
+    static const Crc16Tables tables;
+    return tables;
+}
+
+uint16_t crc16SliceBy8(unsigned long len, const uint8_t data[], uint16_t crc)
+{
+    const Crc16Tables &tables = crc16Tables();
+    const auto &t = tables.t;
+
+    const uint8_t *it = data;
+    const uint8_t *end = data + len;
+    for(; end - it >= 8; it += 8)
+    {
+        // (The CRC so far is XORed into the first two bytes of the block)
+        crc = t[7][it[0] ^ (crc >> 8)] ^ t[6][it[1] ^ (crc & 0xFF)]
+              ^ t[5][it[2]] ^ t[4][it[3]] ^ t[3][it[4]] ^ t[2][it[5]]
+              ^ t[1][it[6]] ^ t[0][it[7]];
+    }
+    for(; it < end; it ++)
+    {
+        crc = static_cast<uint16_t>((crc << 8) ^ t[0][(crc >> 8) ^ *it]);
+    }
+    return crc;
+}
+
+
+/// Returns x^n mod the CRC16/XMODEM polynomial.
+static uint64_t xPowModPoly(unsigned n)
+{
+    uint32_t r = 1;
+    for(unsigned i = 0; i < n; i ++)
+    {
+        r <<= 1;
+        if(r & 0x10000u)
+        {
+            r ^= CRC16_POLY;
+        }
+    }
+    return r;
+}
+
+// Folding with carry-less multiplication
+// --------------------------------------
+// With no bit reflection and a zero initial value, the CRC of a message M(x)
+// is M(x)*x^16 mod P(x); any block of M can so be replaced by a shorter value
+// that is congruent to it mod P(x) without changing the CRC.
+// The data is kept in 128-bit accumulators, byte-swapped so that the first
+// byte is the most significant. An accumulator A = A_hi*x^64 + A_lo followed
+// by D bits of other data is "folded" forward by computing
+//     A_hi*(x^(D+64) mod P) xor A_lo*(x^D mod P)
+// (<80 bits) and XORing it into the block D bits after it.
+// The final accumulator is then handed to `crc16SliceBy8()`, together with
+// the leftover bytes.
+
+/// Messages shorter than this are not worth the setup for folding.
+static constexpr unsigned long CLMUL_MIN_LEN = 128;
+
+/// Folding constants: `{x^D mod P, x^(D+64) mod P}` for D = 128, 256, 384, 512.
+struct Crc16FoldConsts
+{
+    uint64_t k128[2];
+    uint64_t k256[2];
+    uint64_t k384[2];
+    uint64_t k512[2];
+
+    Crc16FoldConsts()
+        : k128{xPowModPoly(128), xPowModPoly(128 + 64)},
+          k256{xPowModPoly(256), xPowModPoly(256 + 64)},
+          k384{xPowModPoly(384), xPowModPoly(384 + 64)},
+          k512{xPowModPoly(512), xPowModPoly(512 + 64)}
+    {
+    }
+};
+
+static const Crc16FoldConsts &crc16FoldConsts()
+{
+    static const Crc16FoldConsts consts;
+    return consts;
+}
+
+#if defined(CA_CRC16_CLMUL_X86)
+
+bool crc16ClmulSupported()
+{
+    static const bool supported = []()
+    {
+        // CPUID leaf 1, ECX: bit 1 = PCLMULQDQ, bit 9 = SSSE3
+        unsigned regs[4] = {0, 0, 0, 0};
+#if defined(__GNUC__) || defined(__clang__)
+        if(!__get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]))
+        {
+            return false;
+        }
+#else
+        __cpuid(reinterpret_cast<int *>(regs), 1);
+#endif
+        return (regs[2] & (1u << 1)) && (regs[2] & (1u << 9));
+    }();
+    return supported;
+}
+
+CA_TARGET_CLMUL static inline __m128i clmulFold(__m128i acc, __m128i k)
+{
+    return _mm_xor_si128(_mm_clmulepi64_si128(acc, k, 0x11),  // A_hi * k[1]
+                         _mm_clmulepi64_si128(acc, k, 0x00)); // A_lo * k[0]
+}
+
+/// Loads 16 bytes, byte-swapped (first byte = most significant).
+CA_TARGET_CLMUL static inline __m128i clmulLoad(const uint8_t *p, __m128i bswap)
+{
+    return _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)), bswap);
+}
+
+/// Loads a pair of folding constants.
+CA_TARGET_CLMUL static inline __m128i clmulLoadK(const uint64_t k[2])
+{
+    return _mm_set_epi64x(static_cast<long long>(k[1]), static_cast<long long>(k[0]));
+}
+
+CA_TARGET_CLMUL static uint16_t crc16ClmulImpl(unsigned long len, const uint8_t data[], uint16_t crc)
+{
+    const Crc16FoldConsts &consts = crc16FoldConsts();
+    const __m128i bswap = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+
+    const uint8_t *it = data;
+    const uint8_t *end = data + len;
+
+    // The CRC so far goes into the first two bytes
+    __m128i x0 = _mm_xor_si128(clmulLoad(it, bswap), _mm_set_epi64x(static_cast<long long>(uint64_t(crc) << 48), 0));
+    __m128i x1 = clmulLoad(it + 16, bswap);
+    __m128i x2 = clmulLoad(it + 32, bswap);
+    __m128i x3 = clmulLoad(it + 48, bswap);
+    it += 64;
+
+    // Fold 4x16 bytes at a time, in 4 independent accumulators
+    const __m128i k512 = clmulLoadK(consts.k512);
+    for(; end - it >= 64; it += 64)
+    {
+        x0 = _mm_xor_si128(clmulFold(x0, k512), clmulLoad(it, bswap));
+        x1 = _mm_xor_si128(clmulFold(x1, k512), clmulLoad(it + 16, bswap));
+        x2 = _mm_xor_si128(clmulFold(x2, k512), clmulLoad(it + 32, bswap));
+        x3 = _mm_xor_si128(clmulFold(x3, k512), clmulLoad(it + 48, bswap));
+    }
+
+    // Fold the accumulators into one, then fold in the rest 16 bytes at a time
+    const __m128i k128 = clmulLoadK(consts.k128);
+    __m128i x = _mm_xor_si128(_mm_xor_si128(clmulFold(x0, clmulLoadK(consts.k384)),
+                                            clmulFold(x1, clmulLoadK(consts.k256))),
+                              _mm_xor_si128(clmulFold(x2, k128), x3));
+    for(; end - it >= 16; it += 16)
+    {
+        x = _mm_xor_si128(clmulFold(x, k128), clmulLoad(it, bswap));
+    }
+
+    alignas(16) uint8_t folded[16];
+    _mm_store_si128(reinterpret_cast<__m128i *>(folded), _mm_shuffle_epi8(x, bswap));
+    crc = crc16SliceBy8(sizeof(folded), folded);
+    return crc16SliceBy8(static_cast<unsigned long>(end - it), it, crc);
+}
+
+#elif defined(CA_CRC16_CLMUL_ARM)
+
+bool crc16ClmulSupported()
+{
+#if defined(__linux__) && defined(HWCAP_PMULL)
+    static const bool supported = (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+    return supported;
+#else
+    // (Built for a CPU with the crypto extension)
+    return true;
+#endif
+}
+
+static inline uint8x16_t clmulFold(uint8x16_t acc, const uint64_t k[2])
+{
+    uint64x2_t acc64 = vreinterpretq_u64_u8(acc);
+    poly128_t hi = vmull_p64(vgetq_lane_u64(acc64, 1), k[1]);
+    poly128_t lo = vmull_p64(vgetq_lane_u64(acc64, 0), k[0]);
+    return veorq_u8(vreinterpretq_u8_p128(hi), vreinterpretq_u8_p128(lo));
+}
+
+static inline uint8x16_t byteSwap(uint8x16_t v)
+{
+    v = vrev64q_u8(v);
+    return vextq_u8(v, v, 8);
+}
+
+static uint16_t crc16ClmulImpl(unsigned long len, const uint8_t data[], uint16_t crc)
+{
+    const Crc16FoldConsts &consts = crc16FoldConsts();
+    auto load = [](const uint8_t *p)
+    {
+        return byteSwap(vld1q_u8(p));
+    };
+
+    const uint8_t *it = data;
+    const uint8_t *end = data + len;
+
+    // The CRC so far goes into the first two bytes
+    uint64x2_t crcV = vcombine_u64(vcreate_u64(0), vcreate_u64(uint64_t(crc) << 48));
+    uint8x16_t x0 = veorq_u8(load(it), vreinterpretq_u8_u64(crcV));
+    uint8x16_t x1 = load(it + 16);
+    uint8x16_t x2 = load(it + 32);
+    uint8x16_t x3 = load(it + 48);
+    it += 64;
+
+    // Fold 4x16 bytes at a time, in 4 independent accumulators
+    for(; end - it >= 64; it += 64)
+    {
+        x0 = veorq_u8(clmulFold(x0, consts.k512), load(it));
+        x1 = veorq_u8(clmulFold(x1, consts.k512), load(it + 16));
+        x2 = veorq_u8(clmulFold(x2, consts.k512), load(it + 32));
+        x3 = veorq_u8(clmulFold(x3, consts.k512), load(it + 48));
+    }
+
+    // Fold the accumulators into one, then fold in the rest 16 bytes at a time
+    uint8x16_t x = veorq_u8(veorq_u8(clmulFold(x0, consts.k384), clmulFold(x1, consts.k256)),
+                            veorq_u8(clmulFold(x2, consts.k128), x3));
+    for(; end - it >= 16; it += 16)
+    {
+        x = veorq_u8(clmulFold(x, consts.k128), load(it));
+    }
+
+    uint8_t folded[16];
+    vst1q_u8(folded, byteSwap(x));
+    crc = crc16SliceBy8(sizeof(folded), folded);
+    return crc16SliceBy8(static_cast<unsigned long>(end - it), it, crc);
+}
+
+#else
+
+bool crc16ClmulSupported()
+{
+    return false;
+}
+
+static uint16_t crc16ClmulImpl(unsigned long len, const uint8_t data[], uint16_t crc)
+{
+    return crc16SliceBy8(len, data, crc);
+}
+
+#endif
+
+uint16_t crc16Clmul(unsigned long len, const uint8_t data[], uint16_t crc)
+{
+    if(len < CLMUL_MIN_LEN || !crc16ClmulSupported())
+    {
+        return crc16SliceBy8(len, data, crc);
+    }
+    return crc16ClmulImpl(len, data, crc);
+}
+
+
+uint16_t crc16(unsigned long len, const uint8_t data[], uint16_t crc)
+{
+    using Crc16Fn = uint16_t (*)(unsigned long, const uint8_t *, uint16_t);
+    static const Crc16Fn impl = crc16ClmulSupported() ? &crc16Clmul : &crc16SliceBy8;
+    return impl(len, data, crc);
+}
+
+}
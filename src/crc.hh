@@ -0,0 +1,66 @@
+// CANale/src/crc.hh - CRC16/XMODEM engine
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#ifndef CRC_HH
+#define CRC_HH
+
+#include <cstdint>
+#include "api.h"
+
+namespace ca
+{
+
+/// Calculates the CRC16/XMODEM of some data, one bit at a time.
+/// Pass the CRC of the preceding data as `crc` to continue calculating it.
+///
+/// This is the reference implementation (the same algorithm CANnuccia runs on
+/// devices); it is slow, use `crc16()` instead.
+///
+/// (Ported from CANnuccia/src/stm32/util.c)
+inline uint16_t crc16Bitwise(unsigned long len, const uint8_t data[], uint16_t crc=0x0000)
+{
+    constexpr uint16_t CRC16_POLYNOMIAL = 0x1021;
+
+    // CRC16/XMODEM. See: http://mdfs.net/Info/Comp/Comms/CRC16.htm
+    // NOTE: int is 32-bit so masking the lowest 16 bits is needed. It also
+    //       likely is faster to work on vs. uint16_t
+    int crcI = crc;
+    for(const uint8_t *it = data; it < (data + len); it ++)
+    {
+        crcI ^= (*it << 8);
+        for(int i = 0; i < 8; i ++)
+        {
+            crcI <<= 1;
+            if(crcI & 0x10000)
+            {
+                crcI = (crcI ^ CRC16_POLYNOMIAL) & 0xFFFF;
+            }
+        }
+    }
+    return uint16_t(crcI);
+}
+
+/// Like `crc16Bitwise()`, but processes 8 bytes at a time via lookup tables
+/// ("slicing-by-8"). Works on any CPU.
+CA_API uint16_t crc16SliceBy8(unsigned long len, const uint8_t data[], uint16_t crc=0x0000);
+
+/// Returns whether `crc16Clmul()` can use carry-less multiplication on this CPU
+/// (PCLMULQDQ on x86, PMULL on ARMv8).
+CA_API bool crc16ClmulSupported();
+
+/// Like `crc16Bitwise()`, but folds 64 bytes at a time via carry-less
+/// multiplication. Falls back to `crc16SliceBy8()` if `!crc16ClmulSupported()`.
+CA_API uint16_t crc16Clmul(unsigned long len, const uint8_t data[], uint16_t crc=0x0000);
+
+/// Calculates the CRC16/XMODEM of some data with the fastest implementation
+/// supported by the CPU (chosen the first time it is called).
+/// Pass the CRC of the preceding data as `crc` to continue calculating it.
+CA_API uint16_t crc16(unsigned long len, const uint8_t data[], uint16_t crc=0x0000);
+
+}
+
+#endif // CRC_HH
@@ -7,111 +7,515 @@
 // file, You can obtain one at http://mozilla.org/MPL/2.0/.
 #include "elf.hh"
 
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <limits>
+#include <QCryptographicHash>
+#include <QFile>
 #include "util.hh"
+#include "log.hh"
+#include "image_cache.hh"
 #include <elfio/elf_types.hpp>
 
 namespace ca
 {
 
-void elfInfo(const ELFIO::elfio &elf, LogHandler &logger)
+/// Describes what `listElfSegmentsToFlash()` does with `segm`, for logging.
+static QString segmentDescr(const ElfSegment &segm)
 {
-    logger(CA_DEBUG,
-           QStringLiteral("ELF machine type: %1").arg(elf.get_machine()));
+    if(segm.type != PT_LOAD)
+    {
+        return QStringLiteral("not loadable, skip");
+    }
+    if(segm.fileSize == 0)
+    {
+        return QStringLiteral("loadable but has fileSize=0B, skip");
+    }
+    return QStringLiteral("loadable, flash fileSize=%1B (out of memSize=%2B) at physAddr=%3")
+           .arg(segm.fileSize)
+           .arg(segm.memSize)
+           .arg(hexStr(segm.physAddr, 8));
+}
 
-    QString abiStr;
-    if(elf.get_os_abi() != ELFOSABI_NONE)
+/// Returns the value of all `size` bytes at `data` if they are all the same,
+/// -1 otherwise (or if `size` is 0).
+static int16_t uniformByteValue(const char *data, size_t size)
+{
+    if(size == 0)
     {
-        abiStr = QStringLiteral("%1 (version %2)").arg(elf.get_os_abi()).arg(elf.get_abi_version());
+        return -1;
     }
-    else
+    auto *bytes = reinterpret_cast<const uint8_t *>(data);
+    const uint64_t pattern = bytes[0] * UINT64_C(0x0101010101010101);
+
+    // Compare 64 bytes at a time, OR-ing together the differences of each word
+    // without branching so that the compiler can vectorize the inner loop
+    constexpr size_t BLOCK_SIZE = 8 * sizeof(uint64_t);
+    size_t i = 0;
+    for(; i + BLOCK_SIZE <= size; i += BLOCK_SIZE)
+    {
+        uint64_t diff = 0;
+        for(size_t j = 0; j < BLOCK_SIZE; j += sizeof(uint64_t))
+        {
+            uint64_t word;
+            std::memcpy(&word, bytes + i + j, sizeof(word)); // (May be unaligned)
+            diff |= word ^ pattern;
+        }
+        if(diff != 0)
+        {
+            return -1;
+        }
+    }
+    for(; i < size; i ++)
     {
-        abiStr = QStringLiteral("none");
+        if(bytes[i] != bytes[0])
+        {
+            return -1;
+        }
     }
-    logger(CA_DEBUG, QStringLiteral("ELF OS ABI: %1").arg(abiStr));
+    return bytes[0];
 }
 
-unsigned listElfSegmentsToFlash(const ELFIO::elfio &elf, std::vector<ELFIO::segment *> &outSegments,
+void elfInfo(const ElfReader &elf, LogHandler &logger)
+{
+    CA_LOG_DEBUG(logger, QStringLiteral("ELF%1 machine type: %2").arg(elf.is64() ? 64 : 32).arg(elf.machine()));
+    CA_LOG_DEBUG(logger, QStringLiteral("ELF OS ABI: %1")
+                 .arg(elf.osAbi() != ELFOSABI_NONE
+                      ? QStringLiteral("%1 (version %2)").arg(elf.osAbi()).arg(elf.abiVersion())
+                      : QStringLiteral("none")));
+}
+
+unsigned listElfSegmentsToFlash(const ElfReader &elf, ElfSegments &outSegments,
                                 LogHandler &logger)
 {
-    logger(CA_DEBUG, QStringLiteral("%1 ELF segments:").arg(elf.segments.size()));
+    CA_LOG_DEBUG(logger, QStringLiteral("%1 ELF segments:").arg(elf.segments().size()));
 
-    QString segmMsg;
     unsigned nOutput = 0;
-    for(unsigned i = 0; i < elf.segments.size(); i ++)
+    for(unsigned i = 0; i < elf.segments().size(); i ++)
     {
-        ELFIO::segment *segm = elf.segments[i];
+        const ElfSegment &segm = elf.segments()[i];
+        if(segm.type == PT_LOAD && segm.fileSize > 0)
+        {
+            outSegments.push_back(&segm);
+            nOutput ++;
+        }
+        CA_LOG_DEBUG(logger, QStringLiteral("> segment %1: %2").arg(i).arg(segmentDescr(segm)));
+    }
 
-        segmMsg = QStringLiteral("> segment %1: ").arg(i);
+    return nOutput;
+}
+
+constexpr uint8_t FlashMap::DEFAULT_FILL;
+
+FlashMap::FlashMap()
+    : m_pageSize(0), m_fill(DEFAULT_FILL), m_arena(), m_pages()
+{
+}
+
+FlashMap::FlashMap(const ElfSegments &segments, size_t pageSize, uint8_t fill)
+    : FlashMap()
+{
+    Q_ASSERT(pageSize != 0);
+    build(segmentsSource(segments), pageSize, fill, *this);
+}
 
-        if(segm->get_type() & PT_LOAD)
+FlashMap::RecordSource FlashMap::segmentsSource(const ElfSegments &segments)
+{
+    // All data for each segment that comes from the ELF file is to be flashed
+    return [&segments](const RecordHandler &onRecord)
+    {
+        for(const ElfSegment *segm : segments)
         {
-            if(segm->get_file_size() > 0)
-            {
-                segmMsg += QStringLiteral("loadable, flash fileSize=%1B (out of memSize=%2B) at physAddr=%3")
-                            .arg(segm->get_file_size())
-                            .arg(segm->get_memory_size())
-                            .arg(hexStr(segm->get_physical_address(), 8));
+            Q_ASSERT(segm->type == PT_LOAD && "Segment not loadable");
+            onRecord(segm->physAddr, segm->data, static_cast<size_t>(segm->fileSize));
+        }
+        return true;
+    };
+}
 
-                outSegments.push_back(segm);
-                nOutput ++;
+FlashMap::~FlashMap() = default;
+
+bool FlashMap::build(const RecordSource &source, size_t pageSize, uint8_t fill,
+                     FlashMap &outMap, QString *outError)
+{
+    Q_ASSERT(pageSize != 0);
+
+    // 1. Find all (page-aligned) pages that are touched by any range
+    constexpr uint64_t ADDR_SPACE_END = uint64_t(1) << 32;
+    std::vector<PageAddr> pageAddrs;
+    bool outOfRange = false;
+    uint64_t outOfRangeAddr = 0;
+    auto listPages = [&pageAddrs, &outOfRange, &outOfRangeAddr, pageSize](uint64_t addr, const uint8_t *, size_t size)
+    {
+        if(size == 0)
+        {
+            return;
+        }
+        if(addr > ADDR_SPACE_END || size > ADDR_SPACE_END - addr)
+        {
+            // (Would be flashed to a wrapped address, or only in part)
+            if(!outOfRange)
+            {
+                outOfRange = true;
+                outOfRangeAddr = addr;
             }
-            else
+            return;
+        }
+        uint64_t end = addr + size;
+        for(uint64_t pageAddr = addr - addr % pageSize; pageAddr < end; pageAddr += pageSize)
+        {
+            // (Consecutive ranges often share pages; skip the obvious duplicates)
+            if(pageAddrs.empty() || pageAddrs.back() != pageAddr)
             {
-                segmMsg += QStringLiteral("loadable but has fileSize=0B, skip");
+                pageAddrs.push_back(static_cast<PageAddr>(pageAddr));
             }
         }
-        else
+    };
+    if(!source(listPages))
+    {
+        return false;
+    }
+    if(outOfRange)
+    {
+        if(outError)
+        {
+            *outError = QStringLiteral("data at %1 extends past the 32-bit address space")
+                        .arg(hexStr(outOfRangeAddr, 8));
+        }
+        return false;
+    }
+    std::sort(pageAddrs.begin(), pageAddrs.end());
+    pageAddrs.erase(std::unique(pageAddrs.begin(), pageAddrs.end()), pageAddrs.end());
+    if(pageAddrs.size() > static_cast<size_t>(std::numeric_limits<int>::max()) / pageSize)
+    {
+        // (The arena is a single `QByteArray`, whose size is an int)
+        if(outError)
         {
-            segmMsg += "not loadable, skip";
+            *outError = QStringLiteral("image spans %1 pages of %2B, too many to fit in memory")
+                        .arg(pageAddrs.size()).arg(pageSize);
         }
-        logger(CA_DEBUG, segmMsg);
+        return false;
     }
 
-    return nOutput;
+    // 2. Lay out all pages in the arena, in address order, and fill it.
+    // The pages a range touches are contiguous in the arena too, as every page
+    // between its first and last one is touched by it
+    FlashMap map;
+    map.m_pageSize = pageSize;
+    map.m_fill = fill;
+    map.m_arena = QByteArray(static_cast<int>(pageAddrs.size() * pageSize), static_cast<char>(fill));
+    char *arena = map.m_arena.data();
+    auto copyToPages = [&pageAddrs, pageSize, arena](uint64_t addr, const uint8_t *data, size_t size)
+    {
+        if(size == 0)
+        {
+            return;
+        }
+        // (All ranges were checked to be within the 32-bit address space above)
+        auto firstPage = std::lower_bound(pageAddrs.begin(), pageAddrs.end(),
+                                          static_cast<PageAddr>(addr - addr % pageSize));
+        Q_ASSERT(firstPage != pageAddrs.end());
+        size_t arenaOffset = static_cast<size_t>(firstPage - pageAddrs.begin()) * pageSize + addr % pageSize;
+        std::memcpy(arena + arenaOffset, data, size);
+    };
+    if(!source(copyToPages))
+    {
+        return false;
+    }
+
+    // 3. Index the pages, computing the CRC (and checking whether the page is
+    // blank) once here instead of every time it is flashed to a device
+    map.m_pages.reserve(pageAddrs.size());
+    for(size_t i = 0; i < pageAddrs.size(); i ++)
+    {
+        const char *pageData = arena + i * pageSize;
+        uint16_t crc = crc16(static_cast<unsigned long>(pageSize), reinterpret_cast<const uint8_t *>(pageData));
+        int16_t blankValue = uniformByteValue(pageData, pageSize);
+        map.m_pages.push_back({pageAddrs[i],
+                               Page{QByteArray::fromRawData(pageData, static_cast<int>(pageSize)), crc, blankValue}});
+    }
+
+    outMap = std::move(map);
+    return true;
 }
 
-FlashMap::FlashMap()
-    : m_pageSize(0), m_numPages(0), m_pages{}
+FlashMap::PageMap::const_iterator FlashMap::findPage(PageAddr pageAddr) const
 {
+    auto it = std::lower_bound(m_pages.begin(), m_pages.end(), pageAddr,
+                               [](const PageMap::value_type &page, PageAddr addr)
+    {
+        return page.first < addr;
+    });
+    return (it != m_pages.end() && it->first == pageAddr) ? it : m_pages.end();
 }
 
-FlashMap::FlashMap(const ElfioSegments &segments, size_t pageSize)
-    : m_pageSize(pageSize)
+
+FlashImage::FlashImage(QByteArray data)
+    : m_file(), m_onRelease(), m_data(data), m_path(), m_format(ImageFormat::Elf), m_baseAddr(0),
+      m_fill(FlashMap::DEFAULT_FILL),
+      m_contentHash(), m_loadState(LoadState::NotLoaded), m_machine(0), m_elf()
 {
-    Q_ASSERT(pageSize != 0);
+}
 
-    for(ELFIO::segment *segm : segments)
+FlashImage::~FlashImage()
+{
+    // Drop all references to the data first, then unmap/release it
+    m_flashMaps.clear();
+    m_elf = ElfReader();
+    m_data.clear();
+    m_file.reset();
+    if(m_onRelease)
     {
-        Q_ASSERT((segm->get_type() & PT_LOAD) && "Segment not loadable");
+        m_onRelease();
+    }
+}
 
-        // All data for the segment that comes from the ELF file is to be flashed
-        auto startAddr = static_cast<PageAddr>(segm->get_physical_address());
-        auto nSegmPages = static_cast<size_t>(segm->get_file_size() / pageSize); // (truncated)
+QSharedPointer<FlashImage> FlashImage::mapFile(const QString &path, QString *outError)
+{
+    std::unique_ptr<QFile> file(new QFile(path));
+    if(!file->open(QFile::ReadOnly))
+    {
+        if(outError)
+        {
+            *outError = file->errorString();
+        }
+        return {};
+    }
 
-        // Reference (do not copy) the data in the ELF segment for all entire pages we can read from it
-        size_t segmOffset = 0;
-        for(size_t i = 0; i < nSegmPages; i ++)
+    // (The mapping stays valid after the file is closed, until `file` is destroyed)
+    qint64 size = file->size();
+    uchar *mapped = (size > 0 && size <= INT_MAX) ? file->map(0, size) : nullptr;
+    QSharedPointer<FlashImage> image;
+    if(mapped)
+    {
+        file->close();
+        image = QSharedPointer<FlashImage>::create(
+                    QByteArray::fromRawData(reinterpret_cast<const char *>(mapped), static_cast<int>(size)));
+        image->m_file = std::move(file);
+    }
+    else
+    {
+        // Not mappable (ex. a pipe); fall back to reading it
+        image = QSharedPointer<FlashImage>::create(file->readAll());
+    }
+    image->m_path = path;
+    image->m_format = ImageFormat::Auto;
+    return image;
+}
+
+QSharedPointer<FlashImage> FlashImage::borrow(const char *data, size_t size,
+                                              std::function<void()> onRelease)
+{
+    auto image = QSharedPointer<FlashImage>::create(
+                     QByteArray::fromRawData(data, static_cast<int>(size)));
+    image->m_onRelease = std::move(onRelease);
+    return image;
+}
+
+void FlashImage::setFormat(ImageFormat format, uint32_t baseAddr)
+{
+    Q_ASSERT(m_loadState == LoadState::NotLoaded);
+    m_format = format;
+    m_baseAddr = baseAddr;
+}
+
+void FlashImage::setPageFill(uint8_t fill)
+{
+    Q_ASSERT(m_flashMaps.empty() && m_contentHash.isEmpty());
+    m_fill = fill;
+}
+
+const QByteArray &FlashImage::contentHash()
+{
+    if(m_contentHash.isEmpty())
+    {
+        m_contentHash = QCryptographicHash::hash(m_data, QCryptographicHash::Sha1);
+
+        // (The same data flashed elsewhere, or padded differently, makes different pages)
+        m_contentHash.append(static_cast<char>(m_fill));
+        if(m_format == ImageFormat::Binary)
         {
-            PageAddr pageAddr = startAddr + static_cast<PageAddr>(segmOffset);
-            m_pages[pageAddr] = QByteArray::fromRawData(segm->get_data() + segmOffset,
-                                                        static_cast<int>(pageSize));
-            segmOffset += pageSize;
+            m_contentHash.append(reinterpret_cast<const char *>(&m_baseAddr), sizeof(m_baseAddr));
         }
+    }
+    return m_contentHash;
+}
 
-        // If any data is left over, copy it to a new page and zero-fill the remaining bytes
-        size_t left = segm->get_file_size() - segmOffset;
-        if(left > 0)
+bool FlashImage::parseRecords(const RecordHandler &onRecord, LogHandler &logger) const
+{
+    QString error;
+    bool ok = (m_format == ImageFormat::IntelHex)
+              ? parseIntelHex(m_data.constData(), static_cast<size_t>(m_data.size()), onRecord, &error)
+              : parseSRecord(m_data.constData(), static_cast<size_t>(m_data.size()), onRecord, &error);
+    if(!ok)
+    {
+        logger(CA_ERROR, QStringLiteral("Invalid %1: %2").arg(imageFormatName(m_format)).arg(error));
+    }
+    return ok;
+}
+
+bool FlashImage::parse(LogHandler &logger)
+{
+    m_loadState = LoadState::Failed;
+    if(m_data.isEmpty())
+    {
+        return false;
+    }
+
+    switch(m_format)
+    {
+    case ImageFormat::Elf:
+    {
+        QString error;
+        if(!m_elf.parse(reinterpret_cast<const uint8_t *>(m_data.constData()),
+                        static_cast<size_t>(m_data.size()), &error))
         {
-            PageAddr pageAddr = startAddr + static_cast<PageAddr>(segmOffset);
-            auto &page = m_pages[pageAddr];
-            page = QByteArray(segm->get_data() + segmOffset, static_cast<int>(left));
-            page.append(static_cast<int>(pageSize - left), 0);
+            logger(CA_ERROR, QStringLiteral("Invalid ELF: %1").arg(error));
+            return false;
         }
+        elfInfo(m_elf, logger);
+        m_machine = m_elf.machine();
+        break;
     }
 
-    m_numPages = m_pages.size();
+    case ImageFormat::IntelHex:
+    case ImageFormat::SRecord:
+        // (Only validate the records here; they are parsed again, straight
+        // into pages, for each flash map built)
+        if(!parseRecords(nullptr, logger))
+        {
+            return false;
+        }
+        break;
+
+    case ImageFormat::Binary:
+    case ImageFormat::Auto:
+        break;
+    }
+
+    CA_LOG_DEBUG(logger, QStringLiteral("Image format: %1").arg(imageFormatName(m_format)));
+    m_loadState = LoadState::Loaded;
+    return true;
 }
 
-FlashMap::~FlashMap() = default;
+bool FlashImage::load(LogHandler &logger, ImageCache *cache)
+{
+    if(m_loadState == LoadState::NotLoaded)
+    {
+        if(m_format == ImageFormat::Auto)
+        {
+            m_format = guessImageFormat(m_data, m_path);
+        }
+
+        if(cache && !m_data.isEmpty() && cache->machine(contentHash(), m_machine))
+        {
+            // An identical image was flashed before; don't parse unless needed
+            CA_LOG_DEBUG(logger, QStringLiteral("%1 found in image cache, machine type: %2")
+                         .arg(imageFormatName(m_format)).arg(m_machine));
+            m_loadState = LoadState::Cached;
+        }
+        else
+        {
+            parse(logger);
+        }
+    }
+    return isLoaded();
+}
+
+bool FlashImage::buildFlashMap(size_t pageSize, LogHandler &logger, FlashMap &outFlashMap)
+{
+    if(m_loadState == LoadState::Cached && !parse(logger))
+    {
+        return false;
+    }
+
+    switch(m_format)
+    {
+    case ImageFormat::Elf:
+    {
+        ElfSegments segments;
+        listElfSegmentsToFlash(m_elf, segments, logger);
+        return buildFlashMap(FlashMap::segmentsSource(segments), pageSize, logger, outFlashMap);
+    }
+
+    case ImageFormat::Binary:
+    {
+        // The whole file, as a single range
+        auto source = [this](const RecordHandler &onRecord)
+        {
+            onRecord(m_baseAddr, reinterpret_cast<const uint8_t *>(m_data.constData()),
+                     static_cast<size_t>(m_data.size()));
+            return true;
+        };
+        return buildFlashMap(source, pageSize, logger, outFlashMap);
+    }
+
+    case ImageFormat::IntelHex:
+    case ImageFormat::SRecord:
+    {
+        // (Records are parsed straight into the pages, twice; see `FlashMap::build()`)
+        auto source = [this, &logger](const RecordHandler &onRecord)
+        {
+            return parseRecords(onRecord, logger);
+        };
+        return buildFlashMap(source, pageSize, logger, outFlashMap);
+    }
+
+    case ImageFormat::Auto:
+        break;
+    }
+    return false;
+}
+
+bool FlashImage::buildFlashMap(const FlashMap::RecordSource &source, size_t pageSize, LogHandler &logger,
+                               FlashMap &outFlashMap)
+{
+    QString error;
+    if(!FlashMap::build(source, pageSize, m_fill, outFlashMap, &error))
+    {
+        if(!error.isEmpty())
+        {
+            logger(CA_ERROR, QStringLiteral("Cannot flash %1: %2").arg(imageFormatName(m_format)).arg(error));
+        }
+        return false;
+    }
+    return true;
+}
+
+QSharedPointer<const FlashMap> FlashImage::flashMap(size_t pageSize, LogHandler &logger,
+                                                    ImageCache *cache)
+{
+    Q_ASSERT(isLoaded());
+
+    auto it = m_flashMaps.find(pageSize);
+    if(it != m_flashMaps.end())
+    {
+        return it->second;
+    }
+
+    QSharedPointer<const FlashMap> flashMap;
+    if(cache)
+    {
+        flashMap = cache->find(contentHash(), pageSize);
+    }
+    if(!flashMap)
+    {
+        QSharedPointer<FlashMap> built(new FlashMap());
+        if(!buildFlashMap(pageSize, logger, *built))
+        {
+            return {};
+        }
+        flashMap = built;
+        if(cache)
+        {
+            // (Prefer an equivalent map already in the cache, so that all users share it)
+            flashMap = cache->insert(contentHash(), m_machine, flashMap);
+        }
+    }
+
+    m_flashMaps[pageSize] = flashMap;
+    return flashMap;
+}
 
 }
@@ -10,18 +10,27 @@
 
 #include <vector>
 #include <map>
+#include <memory>
+#include <functional>
 #include <QByteArray>
-#include <elfio/elfio.hpp>
+#include <QSharedPointer>
+#include <QString>
 #include "types.hh"
+#include "elf_reader.hh"
+#include "image_formats.hh"
+
+class QFile;
 
 namespace ca
 {
 
-using ElfioSegments = std::vector<ELFIO::segment *>;
+class ImageCache;
+
+using ElfSegments = std::vector<const ElfSegment *>;
 
 
 /// Outputs core information about `elf` to `logger`.
-void elfInfo(const ELFIO::elfio &elf, LogHandler &logger);
+void elfInfo(const ElfReader &elf, LogHandler &logger);
 
 /// Appends to `segment` the list of segments in `elf` that will have to be flashed.
 /// Outputs information on ELF segments to `logger`.
@@ -30,11 +39,21 @@ void elfInfo(const ELFIO::elfio &elf, LogHandler &logger);
 /// Segments to be flashed have the PT_LOAD type and a `fileSize` greater
 /// than zero; they will correspond to `fileSize` bytes to be written at
 /// `physAddr` in the target device's flash.
-unsigned listElfSegmentsToFlash(const ELFIO::elfio &elf, ElfioSegments &outSegments,
+unsigned listElfSegmentsToFlash(const ElfReader &elf, ElfSegments &outSegments,
                                 LogHandler &logger);
 
 
-/// A flash map, mapping ELF segments to pages to be flashed.
+/// A flash map, mapping ELF segments (or the data records of other image
+/// formats) to pages to be flashed.
+///
+/// All pages live in a single contiguous arena, in address order; pages are
+/// aligned to the page size, and every segment (or record) that touches a page
+/// is merged into it, with bytes no segment covers set to the fill byte
+/// (usually the flash's erased value).
+///
+/// Flash maps are immutable once built, so that a single map can be shared
+/// between all operations flashing the same image to devices with the same page
+/// size.
 class FlashMap
 {
 public:
@@ -44,19 +63,34 @@ public:
     /// A page's contents.
     using PageData = QByteArray;
 
-    /// Maps page addresses to page contents. Sorted by page address.
-    using PageMap = std::map<PageAddr, PageData>;
+    /// A page to be flashed.
+    struct Page
+    {
+        PageData data; ///< The page's contents (a view on the map's arena).
+        uint16_t crc; ///< CRC16/XMODEM of `data`, computed once when the map is built.
+        int16_t blankValue; ///< The value of all bytes in `data` if they are all the same
+                            ///< (ex. an erased or zero-filled page), -1 otherwise.
+    };
+
+    /// (Page address, page) pairs for all pages in the map. Sorted by page address.
+    using PageMap = std::vector<std::pair<PageAddr, Page>>;
+
+    /// Produces the data to flash by calling the given handler for each
+    /// (address, data) range, in any order; later ranges overwrite earlier ones.
+    /// Returns false on failure.
+    using RecordSource = std::function<bool(const RecordHandler &onRecord)>;
+
+    /// The default fill byte: the value of erased bytes in most flash memories.
+    static constexpr uint8_t DEFAULT_FILL = 0xFF;
 
 
     /// Constructs an empty flash map.
     FlashMap();
 
     /// Builds a flash map from a list of segments to flash and the size of a
-    /// page on the target.
-    ///
-    /// All of the provided segments should be loadable, and they should not be
-    /// destroyed until before `~FlashMap()` is run!
-    FlashMap(const ElfioSegments &segments, size_t pageSize);
+    /// page on the target. All of the provided segments should be loadable.
+    /// The map is left empty if it cannot be built (see `build()`).
+    FlashMap(const ElfSegments &segments, size_t pageSize, uint8_t fill=DEFAULT_FILL);
     ~FlashMap();
 
     FlashMap(const FlashMap &toCopy) = delete;
@@ -64,30 +98,192 @@ public:
     FlashMap(FlashMap &&toMove) = default;
     FlashMap &operator=(FlashMap &&toMove) = default;
 
-    /// The (page address -> data) map for pages still to be flashed.
-    ///
-    /// `erase()` them as they actually get flashed; when `pages()` is empty,
-    /// flashing is done.
-    inline PageMap &pages()
-    {
-        return m_pages;
-    }
+    /// Returns a `RecordSource` producing the data of `segments` (see above),
+    /// which must outlive it.
+    static RecordSource segmentsSource(const ElfSegments &segments);
+
+    /// Builds a flash map from the ranges produced by `source`, which is run
+    /// twice: once to find out which pages are touched, once to fill them.
+    /// Returns false (and leaves `outMap` untouched) if `source` fails, or if
+    /// the pages do not fit in memory (describing why in `outError`, if set).
+    static bool build(const RecordSource &source, size_t pageSize, uint8_t fill,
+                      FlashMap &outMap, QString *outError=nullptr);
+
+    /// The (page address, page) pairs for pages to be flashed.
     inline const PageMap &pages() const
     {
         return m_pages;
     }
 
-    /// Returns the number of pages in the map when the map was initially built.
-    /// `pages().size() / numPages()` is the current flashing progress.
+    /// Returns the page at `pageAddr`, or `pages().end()` if there is none.
+    PageMap::const_iterator findPage(PageAddr pageAddr) const;
+
+    /// Returns the number of pages in the map.
     inline size_t numPages() const
     {
-        return m_numPages;
+        return m_pages.size();
+    }
+
+    /// Returns the size of a single flash page.
+    inline size_t pageSize() const
+    {
+        return m_pageSize;
+    }
+
+    /// Returns the byte that parts of pages not covered by the image are filled with.
+    inline uint8_t fill() const
+    {
+        return m_fill;
     }
 
 private:
     size_t m_pageSize; ///< Size of a single flash page.
-    size_t m_numPages; ///< Total number of pages to flash (at map build time).
-    std::map<PageAddr, PageData> m_pages; ///< Pages still to be flashed.
+    uint8_t m_fill; ///< See `fill()`.
+    QByteArray m_arena; ///< The data of all pages, in `m_pages` order.
+    PageMap m_pages; ///< Pages to be flashed; their data points into `m_arena`.
+};
+
+
+/// An image (an ELF, Intel HEX, S-record or raw binary file) to be flashed to
+/// one or more devices.
+///
+/// The image is parsed only once, and only one `FlashMap` is built for it per
+/// distinct page size; share the image (via `QSharedPointer`) between all
+/// operations flashing it so that they all share its flash maps too.
+///
+/// The image's data is not copied, except into the pages of the flash maps
+/// built from it: ELF segments and raw binaries are read straight from the
+/// `QByteArray`, file mapping or borrowed buffer the image was created from,
+/// while Intel HEX and S-record files are parsed record by record straight
+/// into pages.
+class FlashImage
+{
+public:
+    /// Creates an image given the contents of an image file, by default an
+    /// ELF (see `setFormat()`).
+    /// The image is not parsed until `load()` is called.
+    FlashImage(QByteArray data);
+    ~FlashImage();
+
+    /// Creates an image by memory-mapping the file at `path` (or reading it,
+    /// if it can't be mapped). The file must not be modified or truncated
+    /// while the image exists.
+    /// Its format is guessed from its contents and extension on `load()`,
+    /// unless `setFormat()` is called.
+    /// Returns null (and sets `outError`, if any) if the file can't be opened.
+    static QSharedPointer<FlashImage> mapFile(const QString &path, QString *outError=nullptr);
+
+    /// Creates an image that borrows the `size` bytes of image file at `data`,
+    /// without copying them. They must stay valid and unchanged until the image
+    /// is destroyed, at which point `onRelease` (if any) is called.
+    static QSharedPointer<FlashImage> borrow(const char *data, size_t size,
+                                             std::function<void()> onRelease);
+
+    FlashImage(const FlashImage &toCopy) = delete;
+    FlashImage &operator=(const FlashImage &toCopy) = delete;
+
+    /// Returns the format of the image.
+    inline ImageFormat format() const
+    {
+        return m_format;
+    }
+
+    /// Sets the format of the image (`ImageFormat::Auto` = guess it on
+    /// `load()`) and, for raw binaries, the address to flash them at (which
+    /// should be page-aligned). Only valid before `load()`!
+    void setFormat(ImageFormat format, uint32_t baseAddr=0);
+
+    /// Returns the byte that parts of pages not covered by the image are filled
+    /// with (see `FlashMap::fill()`).
+    inline uint8_t pageFill() const
+    {
+        return m_fill;
+    }
+
+    /// Sets the byte that parts of pages not covered by the image are filled
+    /// with (`FlashMap::DEFAULT_FILL` by default). Only valid before any flash
+    /// map is built!
+    void setPageFill(uint8_t fill);
+
+    /// Returns a hash identifying the image's flash maps (the SHA-1 of its
+    /// contents, plus its fill byte and base address), computing it on first use.
+    const QByteArray &contentHash();
+
+    /// Parses the image (for formats other than ELF, only validates it), if it
+    /// was not already. Outputs information on the image to `logger`.
+    /// If `cache` already holds a flash map of an image with the same contents,
+    /// parsing is skipped altogether (see `flashMap()`).
+    /// Returns true if the ELF was (or had already been) loaded successfully,
+    /// false otherwise.
+    bool load(LogHandler &logger, ImageCache *cache=nullptr);
+
+    /// Returns whether the ELF was loaded successfully by `load()`.
+    inline bool isLoaded() const
+    {
+        return m_loadState == LoadState::Loaded || m_loadState == LoadState::Cached;
+    }
+
+    /// Returns whether the image targets a specific machine; only ELFs do.
+    inline bool hasMachine() const
+    {
+        return m_format == ImageFormat::Elf;
+    }
+
+    /// Returns the ELF's machine (`e_machine`), or 0 if not `hasMachine()`.
+    /// Only valid if `isLoaded()`!
+    inline uint16_t machine() const
+    {
+        Q_ASSERT(isLoaded());
+        return m_machine;
+    }
+
+    /// Returns the flash map for the image given the size of a page on the target,
+    /// building it if no target with the same page size requested it before
+    /// and `cache` (if any) does not hold it either; built maps are added to
+    /// `cache`. Outputs information on ELF segments to `logger` when building
+    /// the map.
+    /// Returns null if the image needed parsing and turned out to be invalid.
+    /// Only valid if `isLoaded()`!
+    QSharedPointer<const FlashMap> flashMap(size_t pageSize, LogHandler &logger,
+                                            ImageCache *cache=nullptr);
+
+private:
+    enum class LoadState
+    {
+        NotLoaded,
+        Loaded,
+        Cached, ///< Found in an `ImageCache`; not parsed (yet).
+        Failed,
+    };
+
+    std::unique_ptr<QFile> m_file; ///< The file `m_data` is mapped from (if `mapFile()`d).
+    std::function<void()> m_onRelease; ///< Called on destruction (if `borrow()`ed).
+    QByteArray m_data; ///< The contents of the image file (possibly a raw view on the mapping/buffer).
+    QString m_path; ///< The path of the file (if `mapFile()`d); used to guess the format.
+    ImageFormat m_format; ///< See `format()`.
+    uint32_t m_baseAddr; ///< See `setFormat()`.
+    uint8_t m_fill; ///< See `pageFill()`.
+    QByteArray m_contentHash; ///< See `contentHash()` (empty until computed).
+    LoadState m_loadState; ///< Was the image parsed?
+    uint16_t m_machine; ///< See `machine()`.
+    ElfReader m_elf; ///< The parsed ELF (if `Loaded` ELF); its segments point into `m_data`.
+    std::map<size_t, QSharedPointer<const FlashMap>> m_flashMaps; ///< Page size -> flash map
+
+    /// Parses (or validates) `m_data`. Returns false on failure.
+    bool parse(LogHandler &logger);
+
+    /// Parses the records in an Intel HEX or S-record `m_data`, passing them to
+    /// `onRecord` (if any). Returns false (and logs why) on failure.
+    bool parseRecords(const RecordHandler &onRecord, LogHandler &logger) const;
+
+    /// Builds the flash map of `m_data` for the given page size.
+    /// Returns false on failure.
+    bool buildFlashMap(size_t pageSize, LogHandler &logger, FlashMap &outFlashMap);
+
+    /// Builds a flash map from `source` (see `FlashMap::build()`), logging why
+    /// if it does not fit. Returns false on failure.
+    bool buildFlashMap(const FlashMap::RecordSource &source, size_t pageSize, LogHandler &logger,
+                       FlashMap &outFlashMap);
 };
 
 }
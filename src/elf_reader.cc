@@ -0,0 +1,151 @@
+// CANale/src/elf_reader.cc - Implementation of CANale/src/elf_reader.hh
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include "elf_reader.hh"
+
+namespace ca
+{
+
+namespace
+{
+
+// (See the System V ABI, "ELF Header" and "Program Header")
+constexpr size_t EI_NIDENT = 16;
+constexpr size_t EI_CLASS = 4;
+constexpr size_t EI_DATA = 5;
+constexpr size_t EI_OSABI = 7;
+constexpr size_t EI_ABIVERSION = 8;
+constexpr uint8_t ELFCLASS32 = 1, ELFCLASS64 = 2;
+constexpr uint8_t ELFDATA2LSB = 1, ELFDATA2MSB = 2;
+constexpr uint16_t PN_XNUM = 0xFFFF;
+
+/// Offsets of the fields CANale needs, for ELF32 and ELF64 respectively.
+struct ElfLayout
+{
+    size_t ehdrSize;
+    size_t eMachine, ePhoff, eShoff, ePhentsize, ePhnum;
+    size_t phdrSize;
+    size_t pType, pOffset, pPaddr, pFilesz, pMemsz;
+    unsigned addrSize; ///< Size of an address/offset field.
+    size_t shInfo; ///< Offset of `sh_info` in a section header.
+};
+
+constexpr ElfLayout ELF32_LAYOUT = {52, 18, 28, 32, 42, 44, 32, 0, 4, 12, 16, 20, 4, 28};
+constexpr ElfLayout ELF64_LAYOUT = {64, 18, 32, 40, 54, 56, 56, 0, 8, 24, 32, 40, 8, 44};
+
+/// Returns `offset + size <= fileSize`, without overflowing.
+inline bool inBounds(uint64_t offset, uint64_t size, size_t fileSize)
+{
+    return offset <= fileSize && size <= fileSize - offset;
+}
+
+}
+
+ElfReader::ElfReader()
+    : m_is64(false), m_bigEndian(false), m_machine(0), m_osAbi(0), m_abiVersion(0), m_segments()
+{
+}
+
+uint64_t ElfReader::read(const uint8_t *ptr, unsigned size) const
+{
+    uint64_t value = 0;
+    for(unsigned i = 0; i < size; i ++)
+    {
+        unsigned shift = m_bigEndian ? (size - 1 - i) * 8 : i * 8;
+        value |= uint64_t(ptr[i]) << shift;
+    }
+    return value;
+}
+
+bool ElfReader::parse(const uint8_t *data, size_t size, QString *outError)
+{
+    auto fail = [outError](const char *error)
+    {
+        if(outError)
+        {
+            *outError = QString::fromLatin1(error);
+        }
+        return false;
+    };
+
+    m_segments.clear();
+    if(!data || size < EI_NIDENT
+       || data[0] != 0x7F || data[1] != 'E' || data[2] != 'L' || data[3] != 'F')
+    {
+        return fail("Not an ELF file");
+    }
+
+    if(data[EI_CLASS] != ELFCLASS32 && data[EI_CLASS] != ELFCLASS64)
+    {
+        return fail("Invalid ELF class");
+    }
+    if(data[EI_DATA] != ELFDATA2LSB && data[EI_DATA] != ELFDATA2MSB)
+    {
+        return fail("Invalid ELF data encoding");
+    }
+    m_is64 = (data[EI_CLASS] == ELFCLASS64);
+    m_bigEndian = (data[EI_DATA] == ELFDATA2MSB);
+    m_osAbi = data[EI_OSABI];
+    m_abiVersion = data[EI_ABIVERSION];
+
+    const ElfLayout &layout = m_is64 ? ELF64_LAYOUT : ELF32_LAYOUT;
+    if(size < layout.ehdrSize)
+    {
+        return fail("Truncated ELF header");
+    }
+    m_machine = static_cast<uint16_t>(read(data + layout.eMachine, 2));
+    uint64_t phoff = read(data + layout.ePhoff, layout.addrSize);
+    uint64_t phentsize = read(data + layout.ePhentsize, 2);
+    uint64_t phnum = read(data + layout.ePhnum, 2);
+
+    if(phnum == PN_XNUM)
+    {
+        // The actual number is in the `sh_info` of the first section header
+        uint64_t shoff = read(data + layout.eShoff, layout.addrSize);
+        if(!inBounds(shoff, layout.shInfo + 4, size))
+        {
+            return fail("Section header 0 out of bounds");
+        }
+        phnum = read(data + shoff + layout.shInfo, 4);
+    }
+    if(phnum == 0)
+    {
+        return true;
+    }
+
+    if(phentsize < layout.phdrSize)
+    {
+        return fail("Invalid program header size");
+    }
+    if(phnum > (size / phentsize) || !inBounds(phoff, phnum * phentsize, size))
+    {
+        return fail("Program headers out of bounds");
+    }
+
+    m_segments.reserve(static_cast<size_t>(phnum));
+    for(uint64_t i = 0; i < phnum; i ++)
+    {
+        const uint8_t *phdr = data + phoff + i * phentsize;
+
+        ElfSegment segment;
+        segment.type = static_cast<uint32_t>(read(phdr + layout.pType, 4));
+        uint64_t offset = read(phdr + layout.pOffset, layout.addrSize);
+        segment.physAddr = read(phdr + layout.pPaddr, layout.addrSize);
+        segment.fileSize = read(phdr + layout.pFilesz, layout.addrSize);
+        segment.memSize = read(phdr + layout.pMemsz, layout.addrSize);
+        if(!inBounds(offset, segment.fileSize, size))
+        {
+            m_segments.clear();
+            return fail("Segment data out of bounds");
+        }
+        segment.data = data + offset;
+        m_segments.push_back(segment);
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,88 @@
+// CANale/src/elf_reader.hh - A minimal, in-place ELF program header reader
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#ifndef ELF_READER_HH
+#define ELF_READER_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <QString>
+
+namespace ca
+{
+
+/// A segment of an ELF file, as described by its program header.
+struct ElfSegment
+{
+    uint32_t type; ///< `p_type` (ex. PT_LOAD).
+    uint64_t physAddr; ///< `p_paddr`.
+    uint64_t fileSize; ///< `p_filesz`; the size of `data`.
+    uint64_t memSize; ///< `p_memsz`.
+    const uint8_t *data; ///< The segment's contents in the file (`p_offset`); not a copy!
+};
+
+/// Reads the ELF header and program headers of an ELF32 or ELF64 file of
+/// either endianness, in place: segments point straight into the file's data,
+/// which is never copied. Section headers are ignored, except to get the
+/// number of program headers when there are more than 65534 of them.
+class ElfReader
+{
+public:
+    ElfReader();
+
+    /// Parses the `size` bytes of ELF file at `data`, which must stay valid
+    /// (and unchanged) for as long as `segments()` are used.
+    /// Returns false (and sets `outError`, if any) if the file is not a valid
+    /// ELF or its program headers point outside of it.
+    bool parse(const uint8_t *data, size_t size, QString *outError=nullptr);
+
+    /// Returns whether the file is an ELF64 (as opposed to an ELF32).
+    inline bool is64() const
+    {
+        return m_is64;
+    }
+
+    /// Returns `e_machine`.
+    inline uint16_t machine() const
+    {
+        return m_machine;
+    }
+
+    /// Returns `e_ident[EI_OSABI]`.
+    inline uint8_t osAbi() const
+    {
+        return m_osAbi;
+    }
+
+    /// Returns `e_ident[EI_ABIVERSION]`.
+    inline uint8_t abiVersion() const
+    {
+        return m_abiVersion;
+    }
+
+    /// Returns all segments in the file, in program header order.
+    inline const std::vector<ElfSegment> &segments() const
+    {
+        return m_segments;
+    }
+
+private:
+    bool m_is64;
+    bool m_bigEndian;
+    uint16_t m_machine;
+    uint8_t m_osAbi;
+    uint8_t m_abiVersion;
+    std::vector<ElfSegment> m_segments;
+
+    /// Reads a `size`-byte unsigned integer in the file's endianness.
+    uint64_t read(const uint8_t *ptr, unsigned size) const;
+};
+
+}
+
+#endif // ELF_READER_HH
@@ -0,0 +1,386 @@
+// CANale/src/event_dispatcher.cc - Implementation of CANale/src/event_dispatcher.hh
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include "event_dispatcher.hh"
+
+#ifdef CA_HAVE_EPOLL_DISPATCHER
+
+#include <algorithm>
+#include <climits>
+#include <ctime>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <QCoreApplication>
+#include <QSocketNotifier>
+#include <QThread>
+#include <QTimerEvent>
+
+namespace ca
+{
+
+EpollEventDispatcher::EpollEventDispatcher(QObject *parent)
+    : QAbstractEventDispatcher(parent),
+      m_epollFd(-1), m_wakeFd(-1), m_timerFd(-1), m_interrupted(false), m_wokenUp(false)
+{
+    m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(m_epollFd < 0 || m_wakeFd < 0 || m_timerFd < 0)
+    {
+        qWarning("EpollEventDispatcher: failed to create file descriptors (errno %d)", errno);
+        return;
+    }
+
+    for(int fd : {m_wakeFd, m_timerFd})
+    {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &event);
+    }
+}
+
+EpollEventDispatcher::~EpollEventDispatcher()
+{
+    for(int fd : {m_timerFd, m_wakeFd, m_epollFd})
+    {
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+    }
+}
+
+EpollEventDispatcher *EpollEventDispatcher::install()
+{
+    QThread *thread = QThread::currentThread();
+    if(!thread->eventDispatcher())
+    {
+        // (The thread takes ownership of the dispatcher)
+        thread->setEventDispatcher(new EpollEventDispatcher());
+    }
+    return dynamic_cast<EpollEventDispatcher *>(thread->eventDispatcher());
+}
+
+int64_t EpollEventDispatcher::nowNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+bool EpollEventDispatcher::processEvents(QEventLoop::ProcessEventsFlags flags)
+{
+    return processEventsFor((flags & QEventLoop::WaitForMoreEvents) ? -1 : 0, flags);
+}
+
+bool EpollEventDispatcher::processEventsFor(int timeoutMs, QEventLoop::ProcessEventsFlags flags)
+{
+    m_interrupted = false;
+    m_wokenUp = false;
+    emit awake();
+
+    // Events posted before we were called
+    QCoreApplication::sendPostedEvents();
+    bool processed = false;
+
+    // Wait for something to happen (but not past the expiry of the next timer)
+    // (Qt calls `wakeUp()` for each event posted to this thread, so if it was
+    // called since we started there may be events left to send)
+    int waitMs = timeoutMs;
+    if(m_interrupted || m_wokenUp)
+    {
+        waitMs = 0;
+    }
+    else if(!m_timers.empty())
+    {
+        int64_t nextNs = std::min_element(m_timers.begin(), m_timers.end(),
+                                          [](const Timer &a, const Timer &b) { return a.nextNs < b.nextNs; })->nextNs;
+        int64_t timerWaitMs = std::max<int64_t>(0, (nextNs - nowNs() + 999999) / 1000000);
+        if(waitMs < 0 || timerWaitMs < waitMs)
+        {
+            waitMs = static_cast<int>(std::min<int64_t>(timerWaitMs, INT_MAX));
+        }
+    }
+
+    if(waitMs != 0)
+    {
+        emit aboutToBlock();
+    }
+    epoll_event events[32];
+    int nEvents = epoll_wait(m_epollFd, events, 32, waitMs);
+    if(waitMs != 0)
+    {
+        emit awake();
+    }
+
+    for(int i = 0; i < nEvents; i ++)
+    {
+        int fd = events[i].data.fd;
+        uint32_t revents = events[i].events;
+        if(fd == m_wakeFd || fd == m_timerFd)
+        {
+            // (Just drain it; what woke us up is handled below)
+            uint64_t value;
+            ssize_t nRead = read(fd, &value, sizeof(value));
+            (void)nRead;
+            continue;
+        }
+        if(flags & QEventLoop::ExcludeSocketNotifiers)
+        {
+            continue;
+        }
+
+        // (Notifiers may be unregistered by the ones activated before them;
+        // look them up again each time)
+        auto notifiers = [this, fd]() -> const SocketNotifiers *
+        {
+            auto it = m_notifiers.find(fd);
+            return it != m_notifiers.end() ? &it->second : nullptr;
+        };
+        if((revents & (EPOLLIN | EPOLLHUP | EPOLLERR)) && notifiers())
+        {
+            processed = activateNotifier(notifiers()->read) || processed;
+        }
+        if((revents & (EPOLLOUT | EPOLLERR)) && notifiers())
+        {
+            processed = activateNotifier(notifiers()->write) || processed;
+        }
+        if((revents & EPOLLPRI) && notifiers())
+        {
+            processed = activateNotifier(notifiers()->exception) || processed;
+        }
+    }
+
+    if(!(flags & QEventLoop::X11ExcludeTimers))
+    {
+        processed = activateTimers() > 0 || processed;
+    }
+
+    // Events posted by the handlers above
+    QCoreApplication::sendPostedEvents();
+
+    armTimerFd();
+    return processed || nEvents > 0;
+}
+
+bool EpollEventDispatcher::hasPendingEvents()
+{
+    return m_wokenUp;
+}
+
+bool EpollEventDispatcher::activateNotifier(QSocketNotifier *notifier)
+{
+    if(!notifier || !notifier->isEnabled())
+    {
+        return false;
+    }
+    QEvent event(QEvent::SockAct);
+    QCoreApplication::sendEvent(notifier, &event);
+    return true;
+}
+
+void EpollEventDispatcher::registerSocketNotifier(QSocketNotifier *notifier)
+{
+    int fd = static_cast<int>(notifier->socket());
+    auto it = m_notifiers.find(fd);
+    bool added = (it == m_notifiers.end());
+    SocketNotifiers &notifiers = m_notifiers[fd];
+    switch(notifier->type())
+    {
+    case QSocketNotifier::Read: notifiers.read = notifier; break;
+    case QSocketNotifier::Write: notifiers.write = notifier; break;
+    case QSocketNotifier::Exception: notifiers.exception = notifier; break;
+    }
+    updateEpoll(fd, added);
+}
+
+void EpollEventDispatcher::unregisterSocketNotifier(QSocketNotifier *notifier)
+{
+    int fd = static_cast<int>(notifier->socket());
+    auto it = m_notifiers.find(fd);
+    if(it == m_notifiers.end())
+    {
+        return;
+    }
+    SocketNotifiers &notifiers = it->second;
+    for(QSocketNotifier **slot : {&notifiers.read, &notifiers.write, &notifiers.exception})
+    {
+        if(*slot == notifier)
+        {
+            *slot = nullptr;
+        }
+    }
+
+    if(!notifiers.read && !notifiers.write && !notifiers.exception)
+    {
+        m_notifiers.erase(it);
+        epoll_ctl(m_epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+    else
+    {
+        updateEpoll(fd, false);
+    }
+}
+
+void EpollEventDispatcher::updateEpoll(int fd, bool added)
+{
+    const SocketNotifiers &notifiers = m_notifiers[fd];
+    epoll_event event = {};
+    event.events = (notifiers.read ? EPOLLIN : 0u)
+                   | (notifiers.write ? EPOLLOUT : 0u)
+                   | (notifiers.exception ? EPOLLPRI : 0u);
+    event.data.fd = fd;
+    epoll_ctl(m_epollFd, added ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event);
+}
+
+void EpollEventDispatcher::registerTimer(int timerId, int interval, Qt::TimerType timerType, QObject *object)
+{
+    m_timers.push_back({timerId, interval, timerType, object, nowNs() + int64_t(interval) * 1000000});
+    armTimerFd();
+}
+
+bool EpollEventDispatcher::unregisterTimer(int timerId)
+{
+    auto it = std::find_if(m_timers.begin(), m_timers.end(),
+                           [timerId](const Timer &timer) { return timer.id == timerId; });
+    if(it == m_timers.end())
+    {
+        return false;
+    }
+    m_timers.erase(it);
+    armTimerFd();
+    return true;
+}
+
+bool EpollEventDispatcher::unregisterTimers(QObject *object)
+{
+    auto newEnd = std::remove_if(m_timers.begin(), m_timers.end(),
+                                 [object](const Timer &timer) { return timer.object == object; });
+    bool any = (newEnd != m_timers.end());
+    m_timers.erase(newEnd, m_timers.end());
+    armTimerFd();
+    return any;
+}
+
+QList<QAbstractEventDispatcher::TimerInfo> EpollEventDispatcher::registeredTimers(QObject *object) const
+{
+    QList<TimerInfo> timers;
+    for(const Timer &timer : m_timers)
+    {
+        if(timer.object == object)
+        {
+            timers.append(TimerInfo(timer.id, timer.intervalMs, timer.type));
+        }
+    }
+    return timers;
+}
+
+int EpollEventDispatcher::remainingTime(int timerId)
+{
+    for(const Timer &timer : m_timers)
+    {
+        if(timer.id == timerId)
+        {
+            return static_cast<int>(std::max<int64_t>(0, (timer.nextNs - nowNs()) / 1000000));
+        }
+    }
+    return -1;
+}
+
+void EpollEventDispatcher::armTimerFd()
+{
+    if(m_timerFd < 0)
+    {
+        return;
+    }
+
+    itimerspec spec = {};
+    if(!m_timers.empty())
+    {
+        int64_t nextNs = m_timers.front().nextNs;
+        for(const Timer &timer : m_timers)
+        {
+            nextNs = std::min(nextNs, timer.nextNs);
+        }
+        // (An all-zero `it_value` would disarm the timer instead)
+        nextNs = std::max<int64_t>(nextNs, 1);
+        spec.it_value.tv_sec = static_cast<time_t>(nextNs / 1000000000);
+        spec.it_value.tv_nsec = static_cast<long>(nextNs % 1000000000);
+    }
+    timerfd_settime(m_timerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+int EpollEventDispatcher::activateTimers()
+{
+    // (Timers may be (un)registered by the timer events; collect the expired
+    // ones first, then look each of them up again before activating it)
+    // (Swapped out in case a timer event processes events recursively)
+    std::vector<int> expiredTimerIds;
+    expiredTimerIds.swap(m_expiredTimerIds);
+    expiredTimerIds.clear();
+
+    int64_t now = nowNs();
+    for(Timer &timer : m_timers)
+    {
+        if(timer.nextNs <= now)
+        {
+            expiredTimerIds.push_back(timer.id);
+
+            // Schedule the next expiry, skipping the ones that were missed
+            int64_t intervalNs = std::max<int64_t>(int64_t(timer.intervalMs) * 1000000, 1);
+            timer.nextNs += intervalNs;
+            if(timer.nextNs <= now)
+            {
+                timer.nextNs = now + intervalNs;
+            }
+        }
+    }
+
+    int nActivated = 0;
+    for(int timerId : expiredTimerIds)
+    {
+        auto it = std::find_if(m_timers.begin(), m_timers.end(),
+                               [timerId](const Timer &timer) { return timer.id == timerId; });
+        if(it == m_timers.end())
+        {
+            continue;
+        }
+        QTimerEvent event(timerId);
+        QCoreApplication::sendEvent(it->object, &event);
+        nActivated ++;
+    }
+
+    m_expiredTimerIds.swap(expiredTimerIds);
+    return nActivated;
+}
+
+void EpollEventDispatcher::wakeUp()
+{
+    // (Thread-safe: may be called by other threads posting events to ours)
+    m_wokenUp = true;
+    uint64_t one = 1;
+    ssize_t nWritten = write(m_wakeFd, &one, sizeof(one));
+    (void)nWritten;
+}
+
+void EpollEventDispatcher::interrupt()
+{
+    m_interrupted = true;
+    wakeUp();
+}
+
+void EpollEventDispatcher::flush()
+{
+}
+
+}
+
+#endif // CA_HAVE_EPOLL_DISPATCHER
@@ -0,0 +1,127 @@
+// CANale/src/event_dispatcher.hh - A Qt event dispatcher that can be driven by an external event loop
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#ifndef EVENT_DISPATCHER_HH
+#define EVENT_DISPATCHER_HH
+
+#include <QtGlobal>
+
+#ifdef Q_OS_LINUX
+#   define CA_HAVE_EPOLL_DISPATCHER 1
+#endif
+
+#ifdef CA_HAVE_EPOLL_DISPATCHER
+
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+#include <QAbstractEventDispatcher>
+#include <QEventLoop>
+
+class QSocketNotifier;
+
+namespace ca
+{
+
+/// A Qt event dispatcher backed by a single epoll file descriptor.
+///
+/// The epoll fd (see `fd()`) becomes readable whenever there is something for
+/// the dispatcher to do: a socket notifier is active, a timer expired or an
+/// event was posted. This lets CANale run inside an external event loop (ex. a
+/// plain epoll or libuv loop): the loop polls `fd()` and calls `processEvents()`
+/// when it is readable, and Qt events, timers and socket notifications are
+/// only ever dispatched from there (no extra threads, no `QCoreApplication::exec()`).
+class EpollEventDispatcher : public QAbstractEventDispatcher
+{
+public:
+    EpollEventDispatcher(QObject *parent=nullptr);
+    ~EpollEventDispatcher() override;
+
+    /// Installs a new `EpollEventDispatcher` as the event dispatcher of the
+    /// current thread, unless it already has a dispatcher.
+    /// Returns the dispatcher of the thread if it is an `EpollEventDispatcher`
+    /// (ex. installed by a previous call), or null otherwise.
+    static EpollEventDispatcher *install();
+
+    /// Returns the epoll file descriptor that becomes readable when there are
+    /// events to process, or -1 if it could not be created.
+    inline int fd() const
+    {
+        return m_epollFd;
+    }
+
+    /// Processes all pending events, waiting up to `timeoutMs` milliseconds for
+    /// some if there are none (0 = don't wait, -1 = wait indefinitely).
+    /// Returns true if any event was processed.
+    bool processEventsFor(int timeoutMs, QEventLoop::ProcessEventsFlags flags=QEventLoop::AllEvents);
+
+    bool processEvents(QEventLoop::ProcessEventsFlags flags) override;
+    bool hasPendingEvents() override;
+
+    void registerSocketNotifier(QSocketNotifier *notifier) override;
+    void unregisterSocketNotifier(QSocketNotifier *notifier) override;
+
+    void registerTimer(int timerId, int interval, Qt::TimerType timerType, QObject *object) override;
+    bool unregisterTimer(int timerId) override;
+    bool unregisterTimers(QObject *object) override;
+    QList<TimerInfo> registeredTimers(QObject *object) const override;
+    int remainingTime(int timerId) override;
+
+    void wakeUp() override;
+    void interrupt() override;
+    void flush() override;
+
+private:
+    /// The socket notifiers registered on a file descriptor (one per type).
+    struct SocketNotifiers
+    {
+        QSocketNotifier *read{nullptr};
+        QSocketNotifier *write{nullptr};
+        QSocketNotifier *exception{nullptr};
+    };
+
+    struct Timer
+    {
+        int id;
+        int intervalMs;
+        Qt::TimerType type;
+        QObject *object;
+        int64_t nextNs; ///< When the timer expires next (on `nowNs()`'s clock).
+    };
+
+    int m_epollFd; ///< Polls `m_wakeFd`, `m_timerFd` and all socket notifiers.
+    int m_wakeFd; ///< An eventfd, signalled by `wakeUp()`.
+    int m_timerFd; ///< A timerfd, armed to the expiry of the earliest timer.
+    std::atomic<bool> m_interrupted;
+    std::atomic<bool> m_wokenUp; ///< Was `wakeUp()` called (ex. an event posted) since events were last processed?
+
+    std::unordered_map<int, SocketNotifiers> m_notifiers; ///< File descriptor -> notifiers.
+    std::vector<Timer> m_timers;
+    std::vector<int> m_expiredTimerIds; ///< (Scratch space for `activateTimers()`)
+
+    /// Returns the current time on CLOCK_MONOTONIC, in nanoseconds.
+    static int64_t nowNs();
+
+    /// Updates the events polled for `fd` to match its notifiers.
+    void updateEpoll(int fd, bool added);
+
+    /// Arms `m_timerFd` to the expiry of the earliest timer (or disarms it).
+    void armTimerFd();
+
+    /// Delivers timer events to the timers that expired. Returns the number of
+    /// timers activated.
+    int activateTimers();
+
+    /// Delivers a socket activation event to `notifier` (if it is non-null).
+    static bool activateNotifier(QSocketNotifier *notifier);
+};
+
+}
+
+#endif // CA_HAVE_EPOLL_DISPATCHER
+
+#endif // EVENT_DISPATCHER_HH
@@ -0,0 +1,118 @@
+// CANale/src/image_cache.cc - Implementation of CANale/src/image_cache.hh
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include "image_cache.hh"
+
+namespace ca
+{
+
+constexpr size_t ImageCache::DEFAULT_MAX_BYTES;
+
+/// The approximate bookkeeping cost of each page in a cached flash map, on top
+/// of its data.
+static constexpr size_t PAGE_OVERHEAD = sizeof(FlashMap::PageMap::value_type) + 4 * sizeof(void *);
+
+ImageCache::ImageCache(size_t maxBytes)
+    : m_maxBytes(maxBytes), m_entries(), m_index(), m_bytes(0), m_nHits(0), m_nMisses(0)
+{
+}
+
+ImageCache::~ImageCache() = default;
+
+size_t ImageCache::maxBytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_maxBytes;
+}
+
+void ImageCache::setMaxBytes(size_t maxBytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_maxBytes = maxBytes;
+    evictTo(m_maxBytes);
+}
+
+bool ImageCache::machine(const QByteArray &contentHash, uint16_t &outMachine) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // (Keys are sorted by hash first; any page size will do)
+    auto it = m_index.lower_bound(Key(contentHash, 0));
+    if(it == m_index.end() || it->first.first != contentHash)
+    {
+        return false;
+    }
+    outMachine = it->second->machine;
+    return true;
+}
+
+QSharedPointer<const FlashMap> ImageCache::find(const QByteArray &contentHash, size_t pageSize)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_index.find(Key(contentHash, pageSize));
+    if(it == m_index.end())
+    {
+        m_nMisses ++;
+        return {};
+    }
+
+    // Mark as most recently used
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+    m_nHits ++;
+    return it->second->flashMap;
+}
+
+QSharedPointer<const FlashMap> ImageCache::insert(const QByteArray &contentHash, uint16_t machine,
+                                                  QSharedPointer<const FlashMap> flashMap)
+{
+    size_t bytes = flashMap->numPages() * (flashMap->pageSize() + PAGE_OVERHEAD);
+    Key key(contentHash, flashMap->pageSize());
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_index.find(key);
+    if(it != m_index.end())
+    {
+        // (Inserted by someone else in the meantime)
+        m_entries.splice(m_entries.begin(), m_entries, it->second);
+        return it->second->flashMap;
+    }
+    if(bytes > m_maxBytes)
+    {
+        // (Too big to be cached)
+        return flashMap;
+    }
+
+    evictTo(m_maxBytes - bytes);
+    m_entries.push_front({key, machine, flashMap, bytes});
+    m_index[key] = m_entries.begin();
+    m_bytes += bytes;
+    return flashMap;
+}
+
+void ImageCache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    evictTo(0);
+}
+
+ImageCache::Stats ImageCache::stats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return {m_nHits, m_nMisses, m_entries.size(), m_bytes};
+}
+
+void ImageCache::evictTo(size_t maxBytes)
+{
+    while(m_bytes > maxBytes && !m_entries.empty())
+    {
+        const Entry &lru = m_entries.back();
+        m_bytes -= lru.bytes;
+        m_index.erase(lru.key);
+        m_entries.pop_back();
+    }
+}
+
+}
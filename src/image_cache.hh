@@ -0,0 +1,107 @@
+// CANale/src/image_cache.hh - A content-addressed cache of flash maps
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#ifndef IMAGE_CACHE_HH
+#define IMAGE_CACHE_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <QByteArray>
+#include <QSharedPointer>
+#include "elf.hh"
+
+namespace ca
+{
+
+/// Caches the flash maps built for ELF images, keyed by the hash of the ELF's
+/// contents (see `FlashImage::contentHash()`) and the page size, so that
+/// flashing the same firmware again (even from a different buffer or file)
+/// skips parsing the ELF and building its flash map.
+///
+/// Flash maps own their pages' data, so cached maps do not keep the images they
+/// were built from alive. The least recently used maps are evicted to keep the
+/// total size of the cache under `maxBytes()`. Thread-safe.
+class ImageCache
+{
+public:
+    /// Cache statistics.
+    struct Stats
+    {
+        unsigned long long hits; ///< Lookups that found a flash map.
+        unsigned long long misses; ///< Lookups that did not.
+        size_t nEntries; ///< Flash maps currently cached.
+        size_t bytes; ///< Their (approximate) total size.
+    };
+
+    /// The default value for `maxBytes()`.
+    static constexpr size_t DEFAULT_MAX_BYTES = 16 * 1024 * 1024;
+
+    ImageCache(size_t maxBytes=DEFAULT_MAX_BYTES);
+    ~ImageCache();
+
+    ImageCache(const ImageCache &toCopy) = delete;
+    ImageCache &operator=(const ImageCache &toCopy) = delete;
+
+    /// Returns the maximum total size of the cached flash maps.
+    size_t maxBytes() const;
+
+    /// Sets the maximum total size of the cached flash maps, evicting maps as
+    /// needed (0 = don't cache anything).
+    void setMaxBytes(size_t maxBytes);
+
+    /// Looks up the ELF machine (`e_machine`) of the image with the given
+    /// content hash. Returns false if no flash map of it is cached.
+    /// (Does not count as a hit or a miss)
+    bool machine(const QByteArray &contentHash, uint16_t &outMachine) const;
+
+    /// Returns the cached flash map of the image with the given content hash
+    /// for the given page size, or null if it is not cached.
+    QSharedPointer<const FlashMap> find(const QByteArray &contentHash, size_t pageSize);
+
+    /// Caches `flashMap`, the map for the image with the given content hash and
+    /// ELF machine. Returns the map to use: `flashMap` itself, or an equivalent
+    /// map that was already cached.
+    QSharedPointer<const FlashMap> insert(const QByteArray &contentHash, uint16_t machine,
+                                          QSharedPointer<const FlashMap> flashMap);
+
+    /// Removes all flash maps from the cache (maps in use stay valid).
+    void clear();
+
+    /// Returns the current cache statistics.
+    Stats stats() const;
+
+private:
+    using Key = std::pair<QByteArray, size_t>; ///< (Content hash, page size)
+
+    struct Entry
+    {
+        Key key;
+        uint16_t machine;
+        QSharedPointer<const FlashMap> flashMap;
+        size_t bytes;
+    };
+    using Entries = std::list<Entry>;
+
+    mutable std::mutex m_mutex; ///< Guards all of the fields below.
+    size_t m_maxBytes;
+    Entries m_entries; ///< Most recently used first.
+    std::map<Key, Entries::iterator> m_index; ///< Key -> entry in `m_entries`.
+    size_t m_bytes; ///< Total `bytes` of `m_entries`.
+    unsigned long long m_nHits;
+    unsigned long long m_nMisses;
+
+    /// Evicts the least recently used entries until at most `maxBytes` are cached.
+    void evictTo(size_t maxBytes);
+};
+
+}
+
+#endif // IMAGE_CACHE_HH
@@ -0,0 +1,315 @@
+// CANale/src/image_formats.cc - Implementation of CANale/src/image_formats.hh
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include "image_formats.hh"
+
+#include <cstring>
+#include <QFileInfo>
+
+namespace ca
+{
+
+namespace
+{
+
+/// The longest record either format can encode: a byte count of up to 255, plus
+/// (for Intel HEX) the count, address, type and checksum bytes.
+constexpr size_t MAX_RECORD_BYTES = 255 + 5;
+
+/// Iterates over the (non-blank) lines of a text file, without copying them.
+class LineReader
+{
+public:
+    LineReader(const char *data, size_t size)
+        : m_data(data), m_size(size), m_pos(0), m_lineNo(0)
+    {
+    }
+
+    /// Gets the next non-blank line, with trailing whitespace trimmed.
+    /// Returns false at the end of the file.
+    bool next(const char *&outLine, size_t &outLen)
+    {
+        while(m_pos < m_size)
+        {
+            const char *line = m_data + m_pos;
+            auto *newline = static_cast<const char *>(std::memchr(line, '\n', m_size - m_pos));
+            size_t len = newline ? static_cast<size_t>(newline - line) : (m_size - m_pos);
+            m_pos += len + (newline ? 1 : 0);
+            m_lineNo ++;
+
+            while(len > 0 && (line[len - 1] == '\r' || line[len - 1] == ' ' || line[len - 1] == '\t'))
+            {
+                len --;
+            }
+            if(len > 0)
+            {
+                outLine = line;
+                outLen = len;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// Returns the (1-based) number of the last line returned by `next()`.
+    inline unsigned lineNo() const
+    {
+        return m_lineNo;
+    }
+
+private:
+    const char *m_data;
+    size_t m_size;
+    size_t m_pos;
+    unsigned m_lineNo;
+};
+
+/// Returns the value of hex digit `c`, or -1 if it is not one.
+inline int hexDigit(char c)
+{
+    if(c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if(c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    if(c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/// Decodes the `len` hex digits at `hex` to `out` (which must have room for
+/// `MAX_RECORD_BYTES`). Returns the number of bytes decoded, or -1 if `hex` is
+/// not a valid hex string or decodes to too many bytes.
+long decodeHex(const char *hex, size_t len, uint8_t *out)
+{
+    if(len % 2 != 0 || len / 2 > MAX_RECORD_BYTES)
+    {
+        return -1;
+    }
+    for(size_t i = 0; i < len; i += 2)
+    {
+        int hi = hexDigit(hex[i]), lo = hexDigit(hex[i + 1]);
+        if(hi < 0 || lo < 0)
+        {
+            return -1;
+        }
+        out[i / 2] = static_cast<uint8_t>((hi << 4) | lo);
+    }
+    return static_cast<long>(len / 2);
+}
+
+/// Sets `outError` (if any) to `error` at the current line of `lines`; returns false.
+bool lineError(QString *outError, const LineReader &lines, const char *error)
+{
+    if(outError)
+    {
+        *outError = QStringLiteral("line %1: %2").arg(lines.lineNo()).arg(QString::fromLatin1(error));
+    }
+    return false;
+}
+
+}
+
+const char *imageFormatName(ImageFormat format)
+{
+    switch(format)
+    {
+    case ImageFormat::Auto:
+        return "image";
+    case ImageFormat::Elf:
+        return "ELF";
+    case ImageFormat::IntelHex:
+        return "Intel HEX";
+    case ImageFormat::SRecord:
+        return "S-record";
+    case ImageFormat::Binary:
+        return "binary";
+    }
+    return "image";
+}
+
+ImageFormat guessImageFormat(const QByteArray &data, const QString &path)
+{
+    QString suffix = path.isEmpty() ? QString() : QFileInfo(path).suffix().toLower();
+    if(suffix == QLatin1String("bin"))
+    {
+        return ImageFormat::Binary;
+    }
+
+    if(data.startsWith("\x7F" "ELF"))
+    {
+        return ImageFormat::Elf;
+    }
+
+    // (Text formats may start with blank lines)
+    int start = 0;
+    while(start < data.size() && (data[start] == '\r' || data[start] == '\n'
+                                  || data[start] == ' ' || data[start] == '\t'))
+    {
+        start ++;
+    }
+    if(start < data.size() && data[start] == ':')
+    {
+        return ImageFormat::IntelHex;
+    }
+    if(start + 1 < data.size() && data[start] == 'S' && data[start + 1] >= '0' && data[start + 1] <= '9')
+    {
+        return ImageFormat::SRecord;
+    }
+
+    if(suffix == QLatin1String("hex") || suffix == QLatin1String("ihex") || suffix == QLatin1String("ihx"))
+    {
+        return ImageFormat::IntelHex;
+    }
+    if(suffix == QLatin1String("srec") || suffix == QLatin1String("mot")
+       || suffix == QLatin1String("s19") || suffix == QLatin1String("s28") || suffix == QLatin1String("s37"))
+    {
+        return ImageFormat::SRecord;
+    }
+    return ImageFormat::Elf;
+}
+
+bool parseIntelHex(const char *data, size_t size, const RecordHandler &onRecord,
+                   QString *outError)
+{
+    // (See Intel's "Hexadecimal Object File Format Specification", rev. A)
+    enum RecordType : uint8_t
+    {
+        DATA = 0x00,
+        END_OF_FILE = 0x01,
+        EXT_SEGMENT_ADDR = 0x02,
+        START_SEGMENT_ADDR = 0x03,
+        EXT_LINEAR_ADDR = 0x04,
+        START_LINEAR_ADDR = 0x05,
+    };
+
+    LineReader lines(data, size);
+    uint32_t baseAddr = 0;
+    uint8_t record[MAX_RECORD_BYTES]; // count, addr (2), type, data (count), checksum
+    const char *line;
+    size_t len;
+    while(lines.next(line, len))
+    {
+        if(line[0] != ':')
+        {
+            return lineError(outError, lines, "record does not start with ':'");
+        }
+        long nBytes = decodeHex(line + 1, len - 1, record);
+        if(nBytes < 5 || nBytes != record[0] + 5)
+        {
+            return lineError(outError, lines, "malformed record");
+        }
+
+        uint8_t checksum = 0;
+        for(long i = 0; i < nBytes; i ++)
+        {
+            checksum = static_cast<uint8_t>(checksum + record[i]);
+        }
+        if(checksum != 0)
+        {
+            return lineError(outError, lines, "checksum mismatch");
+        }
+
+        uint8_t count = record[0];
+        uint32_t offset = (uint32_t(record[1]) << 8) | record[2];
+        const uint8_t *payload = record + 4;
+        switch(record[3])
+        {
+        case DATA:
+            if(onRecord && count > 0)
+            {
+                onRecord(baseAddr + offset, payload, count);
+            }
+            break;
+
+        case END_OF_FILE:
+            return true;
+
+        case EXT_SEGMENT_ADDR:
+        case EXT_LINEAR_ADDR:
+            if(count != 2)
+            {
+                return lineError(outError, lines, "malformed extended address record");
+            }
+            baseAddr = (uint32_t(payload[0]) << 8) | payload[1];
+            baseAddr <<= (record[3] == EXT_SEGMENT_ADDR) ? 4 : 16;
+            break;
+
+        case START_SEGMENT_ADDR:
+        case START_LINEAR_ADDR:
+            break;
+
+        default:
+            return lineError(outError, lines, "unknown record type");
+        }
+    }
+
+    return lineError(outError, lines, "missing end-of-file record");
+}
+
+bool parseSRecord(const char *data, size_t size, const RecordHandler &onRecord,
+                  QString *outError)
+{
+    // Address size of each record type (S0..S9); 0 = invalid
+    static const size_t ADDR_SIZES[10] = {2, 2, 3, 4, 0, 2, 3, 4, 3, 2};
+
+    LineReader lines(data, size);
+    uint8_t record[MAX_RECORD_BYTES]; // count, addr, data, checksum
+    const char *line;
+    size_t len;
+    while(lines.next(line, len))
+    {
+        if(len < 2 || line[0] != 'S' || line[1] < '0' || line[1] > '9')
+        {
+            return lineError(outError, lines, "record does not start with 'S0'..'S9'");
+        }
+        unsigned type = static_cast<unsigned>(line[1] - '0');
+        size_t addrSize = ADDR_SIZES[type];
+        if(addrSize == 0)
+        {
+            return lineError(outError, lines, "unknown record type");
+        }
+
+        long nBytes = decodeHex(line + 2, len - 2, record);
+        if(nBytes < 1 || nBytes != record[0] + 1 || static_cast<size_t>(record[0]) < addrSize + 1)
+        {
+            return lineError(outError, lines, "malformed record");
+        }
+
+        uint8_t checksum = 0;
+        for(long i = 0; i < nBytes; i ++)
+        {
+            checksum = static_cast<uint8_t>(checksum + record[i]);
+        }
+        if(checksum != 0xFF)
+        {
+            return lineError(outError, lines, "checksum mismatch");
+        }
+
+        if(type >= 1 && type <= 3 && onRecord)
+        {
+            uint32_t addr = 0;
+            for(size_t i = 0; i < addrSize; i ++)
+            {
+                addr = (addr << 8) | record[1 + i];
+            }
+            size_t dataSize = record[0] - addrSize - 1;
+            if(dataSize > 0)
+            {
+                onRecord(addr, record + 1 + addrSize, dataSize);
+            }
+        }
+    }
+    return true;
+}
+
+}
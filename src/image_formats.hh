@@ -0,0 +1,67 @@
+// CANale/src/image_formats.hh - Streaming loaders for non-ELF image formats
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#ifndef IMAGE_FORMATS_HH
+#define IMAGE_FORMATS_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <QByteArray>
+#include <QString>
+
+namespace ca
+{
+
+/// The format of an image to flash.
+/// (Same values, in the same order, as `CAimageFormat`)
+enum class ImageFormat
+{
+    Auto, ///< Guess it (see `guessImageFormat()`).
+    Elf, ///< An ELF file; its PT_LOAD segments are flashed at their `p_paddr`.
+    IntelHex, ///< An Intel HEX file.
+    SRecord, ///< A Motorola S-record file (S19, S28 or S37).
+    Binary, ///< A raw binary, flashed at a given base address.
+};
+
+/// Returns a human-readable name for `format`.
+const char *imageFormatName(ImageFormat format);
+
+/// Guesses the format of an image from its contents and, if known, the path of
+/// the file it was read from.
+///
+/// ELF files are recognized by their magic number, Intel HEX and S-record ones
+/// by their first record; files with a `.bin` extension are always assumed to
+/// be raw binaries. Returns `ImageFormat::Elf` if nothing else matches.
+ImageFormat guessImageFormat(const QByteArray &data, const QString &path=QString());
+
+/// Called for each data record parsed from an image: `size` bytes at `data` are
+/// to be written at `addr`. `data` is only valid during the call.
+/// (`addr` is 64-bit so that ELF64 segments can be passed, and rejected if they
+/// do not fit in the 32-bit address space of the devices)
+using RecordHandler = std::function<void(uint64_t addr, const uint8_t *data, size_t size)>;
+
+/// Parses the Intel HEX file at `data`, calling `onRecord` (if any) for each data
+/// record in it, in file order; nothing else is buffered.
+/// Supports extended segment (02) and extended linear (04) address records;
+/// start address records are ignored. Parsing stops at the end-of-file record.
+/// Returns false (and sets `outError`, if any) on the first malformed record
+/// or checksum mismatch.
+bool parseIntelHex(const char *data, size_t size, const RecordHandler &onRecord,
+                   QString *outError=nullptr);
+
+/// Parses the Motorola S-record file at `data`, calling `onRecord` (if any) for
+/// each S1, S2 or S3 data record in it, in file order; nothing else is buffered.
+/// Header, count and termination records are ignored.
+/// Returns false (and sets `outError`, if any) on the first malformed record
+/// or checksum mismatch.
+bool parseSRecord(const char *data, size_t size, const RecordHandler &onRecord,
+                  QString *outError=nullptr);
+
+}
+
+#endif // IMAGE_FORMATS_HH
@@ -0,0 +1,106 @@
+// CANale/src/log.cc - Implementation of CANale/src/log.hh
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include "log.hh"
+
+#include <cstring>
+
+namespace ca
+{
+
+constexpr size_t AsyncLogSink::MAX_MESSAGE_LEN;
+
+AsyncLogSink::AsyncLogSink(Writer writer, size_t capacity)
+    : m_writer(std::move(writer)), m_entries(capacity),
+      m_nEnqueued(0), m_nWritten(0), m_stopping(false), m_numDropped(0),
+      m_thread(&AsyncLogSink::run, this)
+{
+}
+
+AsyncLogSink::~AsyncLogSink()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wakeCond.notify_one();
+    m_thread.join();
+}
+
+void AsyncLogSink::write(CAlogLevel level, const char *message)
+{
+    Entry entry;
+    entry.level = level;
+    size_t len = 0;
+    if(message)
+    {
+        len = strnlen(message, MAX_MESSAGE_LEN);
+        memcpy(entry.message, message, len);
+    }
+    entry.message[len] = '\0';
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(!m_entries.tryPush(entry))
+        {
+            m_numDropped ++;
+            return;
+        }
+        m_nEnqueued ++;
+    }
+    m_wakeCond.notify_one();
+}
+
+void AsyncLogSink::flush()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    unsigned long long target = m_nEnqueued;
+    m_flushedCond.wait(lock, [this, target]() { return m_nWritten >= target; });
+}
+
+LogHandler AsyncLogSink::handler()
+{
+    return LogHandler([this](CAlogLevel level, const char *message)
+    {
+        write(level, message);
+    });
+}
+
+void AsyncLogSink::run()
+{
+    Entry entry;
+    for(;;)
+    {
+        // (Only this thread pops, so no need to lock for that)
+        unsigned long long nWritten = 0;
+        while(m_entries.tryPop(entry))
+        {
+            if(m_writer)
+            {
+                m_writer(entry.level, entry.message);
+            }
+            nWritten ++;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_nWritten += nWritten;
+        if(nWritten > 0)
+        {
+            m_flushedCond.notify_all();
+        }
+        if(m_nWritten == m_nEnqueued)
+        {
+            if(m_stopping)
+            {
+                break;
+            }
+            m_wakeCond.wait(lock, [this]() { return m_nWritten != m_nEnqueued || m_stopping; });
+        }
+    }
+}
+
+}
@@ -0,0 +1,110 @@
+// CANale/src/log.hh - Lazy logging macros and an asynchronous log sink
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#ifndef LOG_HH
+#define LOG_HH
+
+#include <cstddef>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include "canale.h"
+#include "types.hh"
+#include "spsc_ring.hh"
+
+/// Whether `CA_LOG_DEBUG()` sites are compiled in. Defaults to off in release
+/// (`NDEBUG`) builds; define it to 1 to keep debug messages there.
+#ifndef CA_DEBUG_LOGS
+#   ifdef NDEBUG
+#       define CA_DEBUG_LOGS 0
+#   else
+#       define CA_DEBUG_LOGS 1
+#   endif
+#endif
+
+/// Logs `message` at `level` to the `ca::LogHandler` `logger`.
+/// `message` is only evaluated (i.e. formatted) if `logger.isEnabled(level)`.
+#define CA_LOG(logger, level, message) do { \
+    if((logger).isEnabled(level)) { (logger).call((level), (message)); } \
+    } while(0)
+
+/// Like `CA_LOG(logger, CA_DEBUG, message)`, but compiled out unless `CA_DEBUG_LOGS`.
+#define CA_LOG_DEBUG(logger, message) do { \
+    if(CA_DEBUG_LOGS && (logger).isEnabled(CA_DEBUG)) { (logger).call(CA_DEBUG, (message)); } \
+    } while(0)
+
+namespace ca
+{
+
+/// A log sink that hands messages over to a background thread, which passes
+/// them on to a (possibly slow) writer; logging never blocks on the writer.
+///
+/// Messages are copied into a fixed-size ring buffer (truncated to
+/// `MAX_MESSAGE_LEN` bytes), so logging does not allocate memory. If the writer
+/// falls so far behind that the ring is full, new messages are dropped (see
+/// `numDropped()`). Any thread can log to the sink.
+class AsyncLogSink
+{
+public:
+    using Writer = std::function<void(CAlogLevel level, const char *message)>;
+
+    /// Messages longer than this (in bytes) are truncated.
+    static constexpr size_t MAX_MESSAGE_LEN = 247;
+
+    /// Starts the background thread, which will call `writer` for each
+    /// message. Up to `capacity` messages can be waiting to be written.
+    explicit AsyncLogSink(Writer writer, size_t capacity=1024);
+
+    /// Writes all pending messages, then stops the background thread.
+    ~AsyncLogSink();
+
+    AsyncLogSink(const AsyncLogSink &) = delete;
+    AsyncLogSink &operator=(const AsyncLogSink &) = delete;
+
+    /// Enqueues a message to be written, or drops it if the ring is full.
+    void write(CAlogLevel level, const char *message);
+
+    /// Waits until all messages enqueued so far were written.
+    void flush();
+
+    /// Returns the number of messages dropped so far because the ring was full.
+    inline unsigned long long numDropped() const
+    {
+        return m_numDropped;
+    }
+
+    /// Returns a log handler that writes to this sink.
+    /// The sink must outlive it.
+    LogHandler handler();
+
+private:
+    struct Entry
+    {
+        CAlogLevel level;
+        char message[MAX_MESSAGE_LEN + 1]; ///< (NUL-terminated)
+    };
+
+    Writer m_writer;
+    SpscRing<Entry> m_entries; ///< Messages waiting to be written.
+    std::mutex m_mutex; ///< Serializes producers; guards the fields below.
+    std::condition_variable m_wakeCond; ///< Signalled when there is something to write, or to stop.
+    std::condition_variable m_flushedCond; ///< Signalled when messages were written.
+    unsigned long long m_nEnqueued; ///< Messages enqueued so far.
+    unsigned long long m_nWritten; ///< Messages written so far.
+    bool m_stopping; ///< Should the thread stop once the ring is empty?
+    std::atomic<unsigned long long> m_numDropped; ///< See `numDropped()`.
+    std::thread m_thread; ///< The background thread (started last).
+
+    /// The body of `m_thread`.
+    void run();
+};
+
+}
+
+#endif // LOG_HH
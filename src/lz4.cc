@@ -0,0 +1,196 @@
+// CANale/src/lz4.cc - Implementation of CANale/src/lz4.hh
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include "lz4.hh"
+
+#include <cstring>
+
+namespace ca
+{
+
+namespace
+{
+
+constexpr size_t MIN_MATCH = 4; ///< Matches are at least this long.
+constexpr size_t LAST_LITERALS = 5; ///< The last bytes of a block are always literals.
+constexpr size_t MF_LIMIT = 12; ///< The last match must start at least this many bytes before the end.
+constexpr size_t MAX_OFFSET = 65535; ///< Matches can reach at most this many bytes back.
+constexpr unsigned HASH_BITS = 12; ///< log2(entries in the match finder's hash table).
+
+inline uint32_t read32(const uint8_t *data)
+{
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value)); // (May be unaligned)
+    return value;
+}
+
+inline uint32_t hash32(uint32_t seq)
+{
+    return (seq * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/// Writes the extra bytes of a length that did not fit in its token nibble.
+inline uint8_t *writeExtLength(uint8_t *out, size_t len)
+{
+    for(; len >= 255; len -= 255)
+    {
+        *out++ = 255;
+    }
+    *out++ = static_cast<uint8_t>(len);
+    return out;
+}
+
+/// Reads the extra bytes of a length whose token nibble was 15, adding them to `len`.
+/// Returns false if the block ends first.
+inline bool readExtLength(const uint8_t *src, size_t srcSize, size_t &ip, size_t &len)
+{
+    uint8_t byte;
+    do
+    {
+        if(ip >= srcSize)
+        {
+            return false;
+        }
+        byte = src[ip++];
+        len += byte;
+    }
+    while(byte == 255);
+    return true;
+}
+
+/// Writes a sequence: `nLiterals` literals from `literals`, then (if
+/// `matchLen` > 0) a match of `matchLen` bytes at `offset` bytes back.
+inline uint8_t *writeSequence(uint8_t *out, const uint8_t *literals, size_t nLiterals,
+                              size_t offset, size_t matchLen)
+{
+    uint8_t *token = out++;
+    *token = static_cast<uint8_t>((nLiterals < 15 ? nLiterals : 15) << 4);
+    if(nLiterals >= 15)
+    {
+        out = writeExtLength(out, nLiterals - 15);
+    }
+    std::memcpy(out, literals, nLiterals);
+    out += nLiterals;
+
+    if(matchLen > 0)
+    {
+        *out++ = static_cast<uint8_t>(offset);
+        *out++ = static_cast<uint8_t>(offset >> 8);
+        size_t lenCode = matchLen - MIN_MATCH;
+        *token |= static_cast<uint8_t>(lenCode < 15 ? lenCode : 15);
+        if(lenCode >= 15)
+        {
+            out = writeExtLength(out, lenCode - 15);
+        }
+    }
+    return out;
+}
+
+}
+
+size_t lz4Compress(const uint8_t *src, size_t srcSize, uint8_t *dst)
+{
+    uint8_t *out = dst;
+    size_t anchor = 0; // Start of the literals not written yet
+
+    if(srcSize >= MF_LIMIT + 1)
+    {
+        // Greedy match finder: remember the last position of each (hashed)
+        // 4-byte sequence, take the match there if it is one
+        uint32_t table[1u << HASH_BITS]; // Position + 1 (0 = none)
+        std::memset(table, 0, sizeof(table));
+
+        const size_t matchLimit = srcSize - LAST_LITERALS;
+        size_t i = 0;
+        while(i + MF_LIMIT <= srcSize)
+        {
+            uint32_t seq = read32(src + i);
+            uint32_t &entry = table[hash32(seq)];
+            size_t candidate = entry;
+            entry = static_cast<uint32_t>(i + 1);
+            if(candidate == 0 || i - (candidate - 1) > MAX_OFFSET || read32(src + candidate - 1) != seq)
+            {
+                i ++;
+                continue;
+            }
+
+            size_t ref = candidate - 1;
+            size_t matchLen = MIN_MATCH;
+            while(i + matchLen < matchLimit && src[ref + matchLen] == src[i + matchLen])
+            {
+                matchLen ++;
+            }
+            while(i > anchor && ref > 0 && src[i - 1] == src[ref - 1])
+            {
+                // (Extend the match backwards over literals)
+                i --;
+                ref --;
+                matchLen ++;
+            }
+
+            out = writeSequence(out, src + anchor, i - anchor, i - ref, matchLen);
+            i += matchLen;
+            anchor = i;
+        }
+    }
+
+    // Last sequence: literals only
+    out = writeSequence(out, src + anchor, srcSize - anchor, 0, 0);
+    return static_cast<size_t>(out - dst);
+}
+
+long lz4Decompress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstCapacity)
+{
+    size_t ip = 0, op = 0;
+    while(ip < srcSize)
+    {
+        uint8_t token = src[ip++];
+
+        size_t nLiterals = token >> 4;
+        if(nLiterals == 15 && !readExtLength(src, srcSize, ip, nLiterals))
+        {
+            return -1;
+        }
+        if(nLiterals > srcSize - ip || nLiterals > dstCapacity - op)
+        {
+            return -1;
+        }
+        std::memcpy(dst + op, src + ip, nLiterals);
+        ip += nLiterals;
+        op += nLiterals;
+
+        if(ip == srcSize)
+        {
+            // (The last sequence has no match)
+            break;
+        }
+
+        if(srcSize - ip < 2)
+        {
+            return -1;
+        }
+        size_t offset = src[ip] | (size_t(src[ip + 1]) << 8);
+        ip += 2;
+        size_t matchLen = (token & 0x0Fu) + MIN_MATCH;
+        if((token & 0x0Fu) == 15 && !readExtLength(src, srcSize, ip, matchLen))
+        {
+            return -1;
+        }
+        if(offset == 0 || offset > op || matchLen > dstCapacity - op)
+        {
+            return -1;
+        }
+        // (Byte by byte: the match may overlap the bytes it produces)
+        for(size_t i = 0; i < matchLen; i ++, op ++)
+        {
+            dst[op] = dst[op - offset];
+        }
+    }
+    return static_cast<long>(op);
+}
+
+}
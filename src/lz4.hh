@@ -0,0 +1,43 @@
+// CANale/src/lz4.hh - LZ4 block codec for compressed WRITE streams
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#ifndef LZ4_HH
+#define LZ4_HH
+
+#include <cstddef>
+#include <cstdint>
+#include "api.h"
+
+namespace ca
+{
+
+/// Returns the max. size of the block `lz4Compress()` produces for `size`
+/// bytes of input (for incompressible data).
+inline size_t lz4CompressBound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+/// Compresses the `srcSize` bytes at `src` to a single LZ4 block (as in the
+/// "LZ4 Block Format Description", without any frame header) at `dst`, which
+/// must have room for `lz4CompressBound(srcSize)` bytes.
+/// Matches never reach further back than 64KiB, and the end-of-block rules of
+/// the format are honored so that any LZ4 decoder can decompress the block.
+/// Returns the size of the compressed block.
+CA_API size_t lz4Compress(const uint8_t *src, size_t srcSize, uint8_t *dst);
+
+/// Decompresses the LZ4 block of `srcSize` bytes at `src` to `dst`.
+/// Returns the size of the decompressed data, or -1 if the block is malformed
+/// or would decompress to more than `dstCapacity` bytes.
+///
+/// This is the reference implementation of what devices that advertise
+/// `DEVICE_FEATURE_COMPRESSED_WRITES` do with a compressed WRITE stream.
+CA_API long lz4Decompress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstCapacity);
+
+}
+
+#endif // LZ4_HH
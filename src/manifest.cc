@@ -0,0 +1,157 @@
+// CANale/src/manifest.cc - Implementation of CANale/src/manifest.hh
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include "manifest.hh"
+
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QCryptographicHash>
+#include "util.hh"
+
+namespace ca
+{
+
+/// Returns the digest of a page stored in manifests.
+inline static QByteArray pageDigest(const QByteArray &pageData)
+{
+    return QCryptographicHash::hash(pageData, QCryptographicHash::Sha1);
+}
+
+
+FlashManifest::FlashManifest(CAdevId devId, DeviceStats devStats)
+    : m_devId(devId), m_devStats(devStats)
+{
+}
+
+FlashManifest::~FlashManifest() = default;
+
+QString FlashManifest::path(const QString &manifestDir, CAdevId devId)
+{
+    return QDir(manifestDir).filePath(QStringLiteral("device-%1.json")
+                                      .arg(hexStr(devId, sizeof(CAdevId) * 2)));
+}
+
+bool FlashManifest::load(const QString &manifestDir, CAdevId devId)
+{
+    QFile file(path(manifestDir, devId));
+    if(!file.open(QFile::ReadOnly))
+    {
+        return false;
+    }
+
+    // Expected format:
+    // {
+    //     "device": <devId>,
+    //     "pageSize": <DeviceStats::pageSize>,
+    //     "nFlashPages": <DeviceStats::nFlashPages>,
+    //     "elfMachine": <DeviceStats::elfMachine>,
+    //     "pages": [
+    //         {"addr": <page address>, "crc": <CRC16>, "sha1": "<hex SHA-1>"},
+    //         ...
+    //     ]
+    // }
+    QJsonParseError err;
+    QJsonDocument doc = QJsonDocument::fromJson(file.readAll(), &err);
+    if(err.error != QJsonParseError::NoError || !doc.isObject())
+    {
+        return false;
+    }
+    QJsonObject root = doc.object();
+
+    if(root.value("device").toInt(-1) != devId)
+    {
+        return false;
+    }
+
+    m_devId = devId;
+    m_devStats.pageSize = static_cast<uint32_t>(root.value("pageSize").toDouble());
+    m_devStats.nFlashPages = static_cast<uint16_t>(root.value("nFlashPages").toInt());
+    m_devStats.elfMachine = static_cast<uint16_t>(root.value("elfMachine").toInt());
+
+    m_pages.clear();
+    for(const QJsonValue &pageVal : root.value("pages").toArray())
+    {
+        QJsonObject pageObj = pageVal.toObject();
+        auto pageAddr = static_cast<uint32_t>(pageObj.value("addr").toDouble());
+        PageRecord record;
+        record.crc = static_cast<uint16_t>(pageObj.value("crc").toInt());
+        record.digest = QByteArray::fromHex(pageObj.value("sha1").toString().toLatin1());
+        m_pages[pageAddr] = record;
+    }
+    return true;
+}
+
+bool FlashManifest::save(const QString &manifestDir) const
+{
+    if(!QDir().mkpath(manifestDir))
+    {
+        return false;
+    }
+
+    QJsonArray pagesArr;
+    for(const auto &page : m_pages)
+    {
+        pagesArr.append(QJsonObject{
+                            {"addr", static_cast<double>(page.first)},
+                            {"crc", page.second.crc},
+                            {"sha1", QString::fromLatin1(page.second.digest.toHex())},
+                        });
+    }
+    QJsonObject root{
+        {"device", m_devId},
+        {"pageSize", static_cast<double>(m_devStats.pageSize)},
+        {"nFlashPages", m_devStats.nFlashPages},
+        {"elfMachine", m_devStats.elfMachine},
+        {"pages", pagesArr},
+    };
+
+    // (Atomically replace the old manifest, if any)
+    QSaveFile file(path(manifestDir, m_devId));
+    if(!file.open(QFile::WriteOnly))
+    {
+        return false;
+    }
+    file.write(QJsonDocument(root).toJson());
+    return file.commit();
+}
+
+bool FlashManifest::matches(const DeviceStats &devStats) const
+{
+    return m_devStats.pageSize == devStats.pageSize
+            && m_devStats.nFlashPages == devStats.nFlashPages
+            && m_devStats.elfMachine == devStats.elfMachine;
+}
+
+void FlashManifest::setPage(uint32_t pageAddr, const QByteArray &pageData, uint16_t pageCrc)
+{
+    PageRecord &record = m_pages[pageAddr];
+    record.crc = pageCrc;
+    record.digest = pageDigest(pageData);
+}
+
+void FlashManifest::removePage(uint32_t pageAddr)
+{
+    m_pages.erase(pageAddr);
+}
+
+bool FlashManifest::hasPage(uint32_t pageAddr, const QByteArray &pageData, uint16_t pageCrc) const
+{
+    auto it = m_pages.find(pageAddr);
+    if(it == m_pages.end())
+    {
+        return false;
+    }
+
+    // (Only hash the page if the CRCs match)
+    return it->second.crc == pageCrc && it->second.digest == pageDigest(pageData);
+}
+
+}
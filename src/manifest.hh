@@ -0,0 +1,96 @@
+// CANale/src/manifest.hh - Records of what was flashed to devices
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#ifndef MANIFEST_HH
+#define MANIFEST_HH
+
+#include <map>
+#include <QString>
+#include <QByteArray>
+#include "types.hh"
+#include "comms.hh"
+
+namespace ca
+{
+
+/// A record of the contents of the flash pages of a device, as committed by
+/// past flashing operations; used to only flash pages whose contents changed.
+///
+/// Manifests are stored as JSON files, one per device, in a manifest directory.
+class FlashManifest
+{
+public:
+    /// What is known to be in a flash page.
+    struct PageRecord
+    {
+        uint16_t crc; ///< CRC16/XMODEM of the page contents.
+        QByteArray digest; ///< SHA-1 of the page contents (a CRC16 alone is too
+                           ///< weak to decide that a page did not change).
+    };
+
+    /// Page address -> what was committed there.
+    using PageRecords = std::map<uint32_t, PageRecord>;
+
+
+    /// Creates an empty manifest for a device.
+    FlashManifest(CAdevId devId=0, DeviceStats devStats={0, 0, 0});
+    ~FlashManifest();
+
+    /// Returns the path of the manifest file for the device with id `devId`
+    /// in `manifestDir`.
+    static QString path(const QString &manifestDir, CAdevId devId);
+
+    /// Loads the manifest of the device with id `devId` from `manifestDir`.
+    /// Returns true on success or false on error (no manifest or invalid manifest).
+    bool load(const QString &manifestDir, CAdevId devId);
+
+    /// Saves the manifest to `manifestDir`, creating the directory if needed.
+    /// Returns true on success or false on error.
+    bool save(const QString &manifestDir) const;
+
+    /// Returns the id of the device the manifest is for.
+    inline CAdevId devId() const
+    {
+        return m_devId;
+    }
+
+    /// Returns the stats the device had when the manifest was last written.
+    inline const DeviceStats &devStats() const
+    {
+        return m_devStats;
+    }
+
+    /// Returns whether the manifest still describes a device with the given
+    /// stats. If not, none of its page records can be trusted.
+    bool matches(const DeviceStats &devStats) const;
+
+    /// Returns the (page address -> record) map.
+    inline const PageRecords &pages() const
+    {
+        return m_pages;
+    }
+
+    /// Records that `pageData`, whose CRC16/XMODEM is `pageCrc`, was committed
+    /// to the page at `pageAddr`.
+    void setPage(uint32_t pageAddr, const QByteArray &pageData, uint16_t pageCrc);
+
+    /// Forgets what is in the page at `pageAddr`, if anything.
+    void removePage(uint32_t pageAddr);
+
+    /// Returns whether the page at `pageAddr` is recorded to contain `pageData`,
+    /// whose CRC16/XMODEM is `pageCrc`.
+    bool hasPage(uint32_t pageAddr, const QByteArray &pageData, uint16_t pageCrc) const;
+
+private:
+    CAdevId m_devId;
+    DeviceStats m_devStats;
+    PageRecords m_pages;
+};
+
+}
+
+#endif // MANIFEST_HH
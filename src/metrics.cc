@@ -0,0 +1,115 @@
+// CANale/src/metrics.cc - Implementation of CANale/src/metrics.hh
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include "metrics.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <QtAlgorithms>
+
+namespace ca
+{
+
+LatencyHistogram::LatencyHistogram()
+    : m_counts(), m_count(0), m_minNs(std::numeric_limits<int64_t>::max()), m_maxNs(0), m_sumNs(0.0)
+{
+}
+
+unsigned LatencyHistogram::bucketOf(uint32_t us)
+{
+    if(us < SUB_BUCKETS)
+    {
+        return us;
+    }
+    // (The bits right after the most significant one pick the sub-bucket)
+    unsigned msb = 31 - qCountLeadingZeroBits(us);
+    unsigned shift = msb - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((us >> shift) & (SUB_BUCKETS - 1));
+}
+
+uint32_t LatencyHistogram::bucketMaxUs(unsigned bucket)
+{
+    if(bucket < SUB_BUCKETS)
+    {
+        return bucket;
+    }
+    unsigned shift = bucket / SUB_BUCKETS - 1;
+    uint64_t lowest = uint64_t(SUB_BUCKETS | (bucket % SUB_BUCKETS)) << shift;
+    return static_cast<uint32_t>(lowest + (uint64_t(1) << shift) - 1);
+}
+
+void LatencyHistogram::record(int64_t ns)
+{
+    ns = std::max(ns, int64_t(0));
+    int64_t us = std::min(ns / 1000, int64_t(std::numeric_limits<uint32_t>::max()));
+    m_counts[bucketOf(static_cast<uint32_t>(us))] ++;
+    m_count ++;
+    m_minNs = std::min(m_minNs, ns);
+    m_maxNs = std::max(m_maxNs, ns);
+    m_sumNs += double(ns);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+    for(unsigned i = 0; i < N_BUCKETS; i ++)
+    {
+        m_counts[i] += other.m_counts[i];
+    }
+    m_count += other.m_count;
+    m_minNs = std::min(m_minNs, other.m_minNs);
+    m_maxNs = std::max(m_maxNs, other.m_maxNs);
+    m_sumNs += other.m_sumNs;
+}
+
+int64_t LatencyHistogram::percentileNs(double percentile) const
+{
+    if(m_count == 0)
+    {
+        return 0;
+    }
+
+    percentile = std::min(std::max(percentile, 0.0), 100.0);
+    auto rank = static_cast<uint64_t>(std::ceil(percentile / 100.0 * double(m_count)));
+    rank = std::max(rank, uint64_t(1));
+
+    uint64_t seen = 0;
+    for(unsigned i = 0; i < N_BUCKETS; i ++)
+    {
+        seen += m_counts[i];
+        if(seen >= rank)
+        {
+            // (The bucket's upper edge, but never past what was actually recorded)
+            int64_t ns = (int64_t(bucketMaxUs(i)) + 1) * 1000 - 1;
+            return std::min(std::max(ns, m_minNs), m_maxNs);
+        }
+    }
+    return m_maxNs;
+}
+
+
+ProtocolMetrics::ProtocolMetrics()
+    : stageLatencies(), rxHostDelays(),
+      framesSent(0), framesReceived(0), stageRetries(0), stageTimeouts(0), crcMismatches(0)
+{
+}
+
+void ProtocolMetrics::merge(const ProtocolMetrics &other)
+{
+    for(size_t stage = 0; stage < stageLatencies.size(); stage ++)
+    {
+        stageLatencies[stage].merge(other.stageLatencies[stage]);
+    }
+    rxHostDelays.merge(other.rxHostDelays);
+    framesSent += other.framesSent;
+    framesReceived += other.framesReceived;
+    stageRetries += other.stageRetries;
+    stageTimeouts += other.stageTimeouts;
+    crcMismatches += other.crcMismatches;
+}
+
+}
@@ -0,0 +1,112 @@
+// CANale/src/metrics.hh - Latency histograms and counters of the CANnuccia protocol
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#ifndef METRICS_HH
+#define METRICS_HH
+
+#include <cstdint>
+#include <array>
+#include "canale.h"
+
+namespace ca
+{
+
+/// A histogram of latencies, with log-linear buckets (as in HdrHistogram):
+/// each power of two is split into `SUB_BUCKETS` buckets, so that recorded
+/// latencies are known with a relative error of at most 1/`SUB_BUCKETS`, at a
+/// resolution of 1µs and up to ~71 minutes (longer ones count as that).
+/// Min., max. and mean are exact.
+///
+/// Fixed size, so recording never allocates.
+class CA_API LatencyHistogram
+{
+public:
+    static constexpr unsigned SUB_BUCKET_BITS = 4;
+    static constexpr unsigned SUB_BUCKETS = 1u << SUB_BUCKET_BITS;
+    static constexpr unsigned N_BUCKETS = (32 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    LatencyHistogram();
+
+    /// Records a latency of `ns` nanoseconds (negative ones count as 0).
+    void record(int64_t ns);
+
+    /// Adds all latencies recorded in `other` to this histogram.
+    void merge(const LatencyHistogram &other);
+
+    /// Returns the number of latencies recorded.
+    inline uint64_t count() const
+    {
+        return m_count;
+    }
+
+    /// Returns the smallest latency recorded, in nanoseconds (0 if none).
+    inline int64_t minNs() const
+    {
+        return m_count > 0 ? m_minNs : 0;
+    }
+
+    /// Returns the largest latency recorded, in nanoseconds (0 if none).
+    inline int64_t maxNs() const
+    {
+        return m_maxNs;
+    }
+
+    /// Returns the mean of the latencies recorded, in nanoseconds (0 if none).
+    inline int64_t meanNs() const
+    {
+        return m_count > 0 ? static_cast<int64_t>(m_sumNs / double(m_count)) : 0;
+    }
+
+    /// Returns the latency (in nanoseconds) that `percentile`% (0..100) of the
+    /// recorded ones are less than or equal to, within the histogram's precision
+    /// (0 if none were recorded).
+    int64_t percentileNs(double percentile) const;
+
+private:
+    std::array<uint32_t, N_BUCKETS> m_counts;
+    uint64_t m_count;
+    int64_t m_minNs, m_maxNs;
+    double m_sumNs;
+
+    /// Returns the bucket that a latency of `us` microseconds goes into.
+    static unsigned bucketOf(uint32_t us);
+
+    /// Returns the largest latency, in microseconds, that goes into `bucket`.
+    static uint32_t bucketMaxUs(unsigned bucket);
+};
+
+/// Latencies and counters of the CANnuccia protocol, for a single device or
+/// for all of them (see `Comms::setMetricsEnabled()`).
+struct CA_API ProtocolMetrics
+{
+    /// For each `CAstage`: the time from its command being handed to the CAN
+    /// link to the response being received (by the CAN interface, if it
+    /// timestamps frames), i.e. bus time plus the device's processing time.
+    /// For `CA_STAGE_CHECK_WRITES`, the command is the CHECK_WRITES sent right
+    /// after the last WRITE.
+    std::array<LatencyHistogram, CA_NUM_STAGES> stageLatencies;
+
+    /// The time from responses being received by the CAN interface to them
+    /// being handled by `Comms`, i.e. how far behind the host is. Only recorded
+    /// if the CAN backend timestamps received frames.
+    LatencyHistogram rxHostDelays;
+
+    uint64_t framesSent; ///< Frames handed to the CAN link.
+    uint64_t framesReceived; ///< CANnuccia responses received (valid or not).
+    uint64_t stageRetries; ///< Commands re-sent because their response did not come in time.
+    uint64_t stageTimeouts; ///< Commands given up on after all retries.
+    uint64_t crcMismatches; ///< Pages whose CRC did not match after writing them.
+
+    ProtocolMetrics();
+
+    /// Adds all latencies and counts of `other` to these metrics.
+    void merge(const ProtocolMetrics &other);
+};
+
+}
+
+#endif // METRICS_HH
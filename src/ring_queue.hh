@@ -0,0 +1,120 @@
+// CANale/src/ring_queue.hh - A FIFO queue stored in a ring buffer
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#ifndef RING_QUEUE_HH
+#define RING_QUEUE_HH
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include <QtGlobal>
+
+namespace ca
+{
+
+/// A FIFO queue stored in a ring buffer.
+///
+/// Unlike `std::deque`, it does not allocate or free memory as elements go
+/// through it once it reached its steady-state size. Popped slots are reset to
+/// `T()` right away, so that they don't keep resources (ex. the shared payload
+/// of a `QCanBusFrame`) referenced.
+template <typename T>
+class RingQueue
+{
+public:
+    RingQueue() : m_slots(), m_head(0), m_size(0)
+    {
+    }
+
+    inline bool empty() const
+    {
+        return m_size == 0;
+    }
+
+    inline size_t size() const
+    {
+        return m_size;
+    }
+
+    inline const T &front() const
+    {
+        Q_ASSERT(m_size > 0);
+        return m_slots[m_head];
+    }
+
+    inline void push_back(const T &value)
+    {
+        if(m_size == m_slots.size())
+        {
+            grow();
+        }
+        m_slots[wrap(m_head + m_size)] = value;
+        m_size ++;
+    }
+
+    inline void pop_front()
+    {
+        Q_ASSERT(m_size > 0);
+        m_slots[m_head] = T();
+        m_head = wrap(m_head + 1);
+        m_size --;
+    }
+
+    /// Removes all elements equal to `value`, keeping the others in order.
+    void remove(const T &value)
+    {
+        size_t nKept = 0;
+        for(size_t i = 0; i < m_size; i ++)
+        {
+            T &elem = m_slots[wrap(m_head + i)];
+            if(!(elem == value))
+            {
+                m_slots[wrap(m_head + nKept)] = std::move(elem);
+                nKept ++;
+            }
+        }
+        for(size_t i = nKept; i < m_size; i ++)
+        {
+            m_slots[wrap(m_head + i)] = T();
+        }
+        m_size = nKept;
+    }
+
+    void clear()
+    {
+        while(m_size > 0)
+        {
+            pop_front();
+        }
+    }
+
+private:
+    std::vector<T> m_slots; ///< The ring buffer; its size is 0 or a power of 2.
+    size_t m_head; ///< Index of the first element in `m_slots`.
+    size_t m_size; ///< Number of elements in the queue.
+
+    inline size_t wrap(size_t index) const
+    {
+        return index & (m_slots.size() - 1);
+    }
+
+    /// Doubles the capacity of the ring buffer, keeping the elements in order.
+    void grow()
+    {
+        std::vector<T> newSlots(m_slots.empty() ? 16 : m_slots.size() * 2);
+        for(size_t i = 0; i < m_size; i ++)
+        {
+            newSlots[i] = std::move(m_slots[wrap(m_head + i)]);
+        }
+        m_slots.swap(newSlots);
+        m_head = 0;
+    }
+};
+
+}
+
+#endif // RING_QUEUE_HH
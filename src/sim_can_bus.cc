@@ -0,0 +1,485 @@
+// CANale/src/sim_can_bus.cc - Implementation of CANale/src/sim_can_bus.hh
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include "sim_can_bus.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <QTimer>
+#include "common/can_msgs.h"
+#include "crc.hh"
+#include "lz4.hh"
+#include "util.hh"
+
+namespace ca
+{
+
+/// Events processed in one go when running as fast as possible, before letting
+/// the event loop (and so the rest of the application) run.
+static constexpr int MAX_EVENTS_PER_TICK = 256;
+
+/// The write modes of a SELECT_PAGE (see `DEVICE_FEATURE_COMPRESSED_WRITES`).
+static constexpr uint8_t WRITE_MODE_LZ4 = 1;
+
+/// The state of an emulated CANnuccia device.
+struct SimCanBus::Device
+{
+    enum class State
+    {
+        Idle,
+        Locked,
+        Unlocked,
+        Done,
+    };
+
+    SimDeviceConfig config;
+    uint32_t pageSize;
+    State state{State::Idle};
+    QByteArray flash; ///< All of its flash.
+    std::vector<uint8_t> tempPage; ///< The temporary page WRITEs go to.
+    uint32_t selPageAddr{0}; ///< The selected page.
+    size_t writeOffset{0}; ///< The offset of the next WRITE into `tempPage`.
+    bool compressedWrites{false}; ///< Did the host opt into compressed WRITEs on UNLOCK?
+    bool lz4Mode{false}; ///< Are the WRITEs to the selected page a compressed stream?
+    std::vector<uint8_t> writeStream; ///< The compressed stream received so far.
+    std::vector<QCanBusFrame> responses; ///< The last response sent for each message.
+    int64_t busyUntilNs{0}; ///< When the device is done with the last command it received.
+    uint64_t pagesCommitted{0};
+
+    Device(const SimDeviceConfig &config)
+        : config(config), pageSize(1u << config.pageSizePow2),
+          flash(int(config.nFlashPages * pageSize), char(config.erasedValue)),
+          tempPage(pageSize, config.tempPageFill)
+    {
+    }
+};
+
+
+SimCanBus::SimCanBus(const SimBusConfig &config, QObject *parent)
+    : QCanBusDevice(parent), m_config(config), m_devices(), m_events(), m_nextSeq(0),
+      m_timer(new QTimer(this)), m_processing(false), m_simNs(0), m_idleSinceWallNs(-1),
+      m_busFreeNs(0), m_rand(config.seed != 0 ? config.seed : 1), m_stats()
+{
+    m_dataBitTime = (m_config.dataBitrate > 0) ? double(m_config.bitrate) / double(m_config.dataBitrate) : 1.0;
+
+    m_timer->setSingleShot(true);
+    m_timer->setTimerType(Qt::PreciseTimer);
+    connect(m_timer, &QTimer::timeout, this, [this]() { processEvents(); });
+}
+
+SimCanBus::~SimCanBus() = default;
+
+bool SimCanBus::addDevice(Comms::DevId devId, const SimDeviceConfig &devConfig)
+{
+    if(m_devices[devId])
+    {
+        return false;
+    }
+    m_devices[devId].reset(new Device(devConfig));
+    return true;
+}
+
+QByteArray SimCanBus::deviceFlash(Comms::DevId devId) const
+{
+    return m_devices[devId] ? m_devices[devId]->flash : QByteArray();
+}
+
+uint64_t SimCanBus::devicePagesCommitted(Comms::DevId devId) const
+{
+    return m_devices[devId] ? m_devices[devId]->pagesCommitted : 0;
+}
+
+SimBusStats SimCanBus::stats() const
+{
+    SimBusStats stats = m_stats;
+    stats.elapsedNs = nowNs();
+    return stats;
+}
+
+int64_t SimCanBus::nowNs() const
+{
+    if(!m_wallClock.isValid())
+    {
+        return 0;
+    }
+    int64_t wallNs = m_wallClock.nsecsElapsed();
+    if(m_config.timeScale > 0.0)
+    {
+        return static_cast<int64_t>(double(wallNs) / m_config.timeScale);
+    }
+    // (While nothing is happening on the bus, follow the real clock)
+    return m_simNs + (m_idleSinceWallNs >= 0 ? wallNs - m_idleSinceWallNs : 0);
+}
+
+bool SimCanBus::writeFrame(const QCanBusFrame &frame)
+{
+    if(state() != QCanBusDevice::ConnectedState)
+    {
+        setError(QStringLiteral("Simulated CAN bus is not connected"), QCanBusDevice::WriteError);
+        return false;
+    }
+    if(!frame.isValid() || frame.frameType() != QCanBusFrame::DataFrame)
+    {
+        setError(QStringLiteral("Invalid frame"), QCanBusDevice::WriteError);
+        return false;
+    }
+
+    m_stats.framesSent ++;
+    transmit(frame, nowNs(), Event::HostFrameSent);
+    if(m_config.writtenReports == SimWrittenReports::InWriteFrame)
+    {
+        emit framesWritten(1);
+    }
+    return true;
+}
+
+bool SimCanBus::step()
+{
+    return !m_processing && processEvents();
+}
+
+QString SimCanBus::interpretErrorFrame(const QCanBusFrame &)
+{
+    // (Never produces error frames)
+    return QString();
+}
+
+bool SimCanBus::open()
+{
+    m_wallClock.start();
+    m_simNs = 0;
+    m_idleSinceWallNs = 0;
+    m_busFreeNs = 0;
+    m_stats = SimBusStats();
+    setState(QCanBusDevice::ConnectedState);
+    return true;
+}
+
+void SimCanBus::close()
+{
+    m_timer->stop();
+    m_events = decltype(m_events)();
+    setState(QCanBusDevice::UnconnectedState);
+}
+
+double SimCanBus::frameBusBitsOf(const QCanBusFrame &frame) const
+{
+    auto payloadSize = static_cast<unsigned long>(frame.payload().size());
+    return frame.hasFlexibleDataRateFormat() ? fdFrameBusBits(payloadSize, m_dataBitTime)
+                                             : double(frameBusBits(payloadSize));
+}
+
+void SimCanBus::transmit(const QCanBusFrame &frame, int64_t timeNs, Event::Type type)
+{
+    double bits = frameBusBitsOf(frame);
+    auto durationNs = static_cast<int64_t>(std::ceil(bits * 1e9 / double(m_config.bitrate)));
+    int64_t startNs = std::max(timeNs, m_busFreeNs);
+    m_busFreeNs = startNs + durationNs;
+
+    m_stats.payloadBytes += static_cast<uint64_t>(frame.payload().size());
+    m_stats.busBits += bits;
+    m_stats.busBusyNs += durationNs;
+
+    bool lost = rollFrameLoss();
+    if(lost)
+    {
+        m_stats.framesLost ++;
+    }
+    schedule(m_busFreeNs, type, frame, lost);
+}
+
+void SimCanBus::schedule(int64_t timeNs, Event::Type type, const QCanBusFrame &frame, bool lost)
+{
+    if(m_idleSinceWallNs >= 0)
+    {
+        // (The bus is not idle anymore)
+        m_simNs = nowNs();
+        m_idleSinceWallNs = -1;
+    }
+    m_events.push(Event{timeNs, m_nextSeq ++, type, lost, frame});
+    scheduleProcessing();
+}
+
+void SimCanBus::scheduleProcessing()
+{
+    if(m_processing || m_events.empty() || m_config.manualStep)
+    {
+        return;
+    }
+
+    int delayMs = 0;
+    if(m_config.timeScale > 0.0)
+    {
+        double dueWallNs = double(m_events.top().timeNs) * m_config.timeScale;
+        delayMs = std::max(0, static_cast<int>(std::ceil((dueWallNs - double(m_wallClock.nsecsElapsed())) / 1e6)));
+    }
+    if(!m_timer->isActive() || m_timer->remainingTime() > delayMs)
+    {
+        m_timer->start(delayMs);
+    }
+}
+
+bool SimCanBus::processEvents()
+{
+    m_processing = true;
+    bool processed = false;
+    for(int i = 0; !m_events.empty() && (m_config.timeScale > 0.0 || i < MAX_EVENTS_PER_TICK); i ++)
+    {
+        if(m_config.timeScale > 0.0 && m_events.top().timeNs > nowNs())
+        {
+            // Not due yet
+            break;
+        }
+        Event event = m_events.top();
+        m_events.pop();
+        processed = true;
+        m_simNs = std::max(m_simNs, event.timeNs);
+
+        // (Handling events can make `Comms` send frames, scheduling new events)
+        switch(event.type)
+        {
+        case Event::HostFrameSent:
+            if(m_config.writtenReports == SimWrittenReports::OnBus)
+            {
+                emit framesWritten(1);
+            }
+            if(!event.lost)
+            {
+                handleHostFrame(event.frame, event.timeNs);
+            }
+            break;
+
+        case Event::DeviceResponds:
+            transmit(event.frame, event.timeNs, Event::DeviceFrameSent);
+            break;
+
+        case Event::DeviceFrameSent:
+            if(!event.lost)
+            {
+                event.frame.setTimeStamp(QCanBusFrame::TimeStamp::fromMicroSeconds(event.timeNs / 1000));
+                m_stats.framesReceived ++;
+                m_delivering.append(event.frame);
+                enqueueReceivedFrames(m_delivering);
+                m_delivering.resize(0);
+            }
+            break;
+        }
+    }
+    m_processing = false;
+
+    if(m_events.empty())
+    {
+        m_idleSinceWallNs = m_wallClock.nsecsElapsed();
+    }
+    scheduleProcessing();
+    return processed;
+}
+
+void SimCanBus::handleHostFrame(const QCanBusFrame &frame, int64_t timeNs)
+{
+    // (See `translateEID()` in comms.cc)
+    uint32_t eid = (frame.frameId() << 3) | 0x00000004u;
+    auto devId = static_cast<Comms::DevId>((eid & 0x00000FF0u) >> 4);
+    uint32_t msg = eid & CN_CAN_MSGID_MASK;
+    Device *devPtr = m_devices[devId].get();
+    if(!devPtr)
+    {
+        // No such device on the bus
+        return;
+    }
+    Device &dev = *devPtr;
+    const SimDeviceConfig &cfg = dev.config;
+    if(frame.hasFlexibleDataRateFormat() && !(cfg.features & DEVICE_FEATURE_CAN_FD))
+    {
+        // (Would be an error frame on a real bus)
+        return;
+    }
+
+    const QByteArray payloadData = frame.payload();
+    auto payload = reinterpret_cast<const uint8_t *>(payloadData.constData());
+    const int payloadSize = payloadData.size();
+
+    switch(msg)
+    {
+    case CN_CAN_MSG_PROG_REQ:
+    {
+        if(dev.state == Device::State::Done)
+        {
+            break;
+        }
+        const uint8_t resp[] = {cfg.pageSizePow2,
+                                uint8_t(cfg.nFlashPages & 0xFF), uint8_t(cfg.nFlashPages >> 8),
+                                uint8_t(cfg.elfMachine & 0xFF), uint8_t(cfg.elfMachine >> 8),
+                                cfg.features, cfg.tempPageFill, cfg.erasedValue};
+        respond(dev, devId, CN_CAN_MSG_PROG_REQ_RESP, resp, sizeof(resp), timeNs, m_config.responseNs);
+        if(dev.state == Device::State::Idle)
+        {
+            dev.state = Device::State::Locked;
+        }
+    } break;
+
+    case CN_CAN_MSG_UNLOCK:
+    {
+        if(dev.state != Device::State::Locked && dev.state != Device::State::Unlocked)
+        {
+            break;
+        }
+        int64_t delayNs = m_config.responseNs;
+        if(dev.state == Device::State::Locked)
+        {
+            dev.state = Device::State::Unlocked;
+            uint8_t optedIn = payloadSize >= 1 ? payload[0] : 0;
+            dev.compressedWrites = (cfg.features & optedIn & DEVICE_FEATURE_COMPRESSED_WRITES) != 0;
+            if(cfg.features & DEVICE_FEATURE_ERASED_ON_UNLOCK)
+            {
+                dev.flash.fill(char(cfg.erasedValue));
+                delayNs += m_config.eraseNs;
+            }
+        }
+        respond(dev, devId, CN_CAN_MSG_UNLOCKED, nullptr, 0, timeNs, delayNs);
+    } break;
+
+    case CN_CAN_MSG_SELECT_PAGE:
+    {
+        if(dev.state != Device::State::Unlocked || payloadSize != (dev.compressedWrites ? 5 : 4))
+        {
+            break;
+        }
+        uint32_t pageAddr = readU32LE(payload);
+        uint32_t pageOffset = pageAddr - cfg.baseAddr;
+        if(pageAddr < cfg.baseAddr || pageOffset % dev.pageSize != 0
+           || pageOffset / dev.pageSize >= cfg.nFlashPages)
+        {
+            // Page out of bounds
+            break;
+        }
+        dev.selPageAddr = pageAddr;
+        dev.writeOffset = 0;
+        dev.lz4Mode = dev.compressedWrites && payload[4] == WRITE_MODE_LZ4;
+        dev.writeStream.clear();
+        if(cfg.features & DEVICE_FEATURE_TEMP_PAGE_FILL)
+        {
+            std::fill(dev.tempPage.begin(), dev.tempPage.end(), cfg.tempPageFill);
+        }
+        respond(dev, devId, CN_CAN_MSG_PAGE_SELECTED, payload, 4, timeNs, m_config.responseNs);
+    } break;
+
+    case CN_CAN_MSG_WRITE:
+        if(dev.state != Device::State::Unlocked)
+        {
+            break;
+        }
+        if(dev.lz4Mode)
+        {
+            dev.writeStream.insert(dev.writeStream.end(), payload, payload + payloadSize);
+        }
+        else
+        {
+            auto n = std::min(static_cast<size_t>(payloadSize), dev.tempPage.size() - dev.writeOffset);
+            std::memcpy(dev.tempPage.data() + dev.writeOffset, payload, n);
+            dev.writeOffset += n;
+        }
+        break;
+
+    case CN_CAN_MSG_SEEK:
+        if(dev.state != Device::State::Unlocked || payloadSize != 4)
+        {
+            break;
+        }
+        dev.writeOffset = std::min(static_cast<size_t>(readU32LE(payload)), dev.tempPage.size());
+        break;
+
+    case CN_CAN_MSG_CHECK_WRITES:
+    {
+        if(dev.state != Device::State::Unlocked)
+        {
+            break;
+        }
+        if(dev.lz4Mode && !dev.writeStream.empty())
+        {
+            // (A malformed stream leaves the temporary page as is; the CRC tells)
+            lz4Decompress(dev.writeStream.data(), dev.writeStream.size(), dev.tempPage.data(), dev.tempPage.size());
+            dev.writeStream.clear();
+        }
+        uint16_t crc = crc16(dev.tempPage.size(), dev.tempPage.data());
+        const uint8_t resp[] = {uint8_t(crc & 0xFF), uint8_t(crc >> 8)};
+        int64_t crcNs = m_config.crcNsPerKiB * int64_t(dev.pageSize) / 1024;
+        respond(dev, devId, CN_CAN_MSG_WRITES_CHECKED, resp, sizeof(resp), timeNs, m_config.responseNs + crcNs);
+    } break;
+
+    case CN_CAN_MSG_COMMIT_WRITES:
+    {
+        if(dev.state != Device::State::Unlocked)
+        {
+            break;
+        }
+        std::memcpy(dev.flash.data() + (dev.selPageAddr - cfg.baseAddr), dev.tempPage.data(), dev.pageSize);
+        dev.pagesCommitted ++;
+        uint8_t resp[4];
+        writeU32LE(resp, dev.selPageAddr);
+        respond(dev, devId, CN_CAN_MSG_WRITES_COMMITTED, resp, sizeof(resp), timeNs, m_config.commitNs);
+    } break;
+
+    case CN_CAN_MSG_PROG_DONE:
+        if(dev.state == Device::State::Done)
+        {
+            break;
+        }
+        dev.state = Device::State::Done;
+        respond(dev, devId, CN_CAN_MSG_PROG_DONE_ACK, nullptr, 0, timeNs, m_config.responseNs);
+        break;
+
+    default:
+        break;
+    }
+}
+
+void SimCanBus::respond(Device &dev, Comms::DevId devId, uint32_t msg, const uint8_t *payload, int payloadSize,
+                        int64_t timeNs, int64_t delayNs)
+{
+    // (Devices handle one command at a time)
+    dev.busyUntilNs = std::max(timeNs, dev.busyUntilNs) + delayNs;
+
+    const quint32 frameId = cnCANDevMask(msg, devId) >> 3;
+    auto frameIt = std::find_if(dev.responses.begin(), dev.responses.end(),
+                                [frameId](const QCanBusFrame &frame) { return frame.frameId() == frameId; });
+    if(frameIt == dev.responses.end())
+    {
+        QCanBusFrame frame(frameId, QByteArray());
+        frame.setExtendedFrameFormat(true);
+        dev.responses.push_back(frame);
+        frameIt = dev.responses.end() - 1;
+    }
+
+    // Refill the payload in place (taking it over, so that it is only copied if
+    // the previous response is still pending)
+    QByteArray payloadData = frameIt->payload();
+    frameIt->setPayload(QByteArray());
+    payloadData.resize(payloadSize);
+    if(payloadSize > 0)
+    {
+        std::memcpy(payloadData.data(), payload, static_cast<size_t>(payloadSize));
+    }
+    frameIt->setPayload(payloadData);
+    schedule(dev.busyUntilNs, Event::DeviceResponds, *frameIt);
+}
+
+bool SimCanBus::rollFrameLoss()
+{
+    if(m_config.frameLossRate <= 0.0)
+    {
+        return false;
+    }
+    // xorshift32
+    m_rand ^= m_rand << 13;
+    m_rand ^= m_rand >> 17;
+    m_rand ^= m_rand << 5;
+    return double(m_rand) / 4294967296.0 < m_config.frameLossRate;
+}
+
+}
@@ -0,0 +1,219 @@
+// CANale/src/sim_can_bus.hh - In-process simulated CAN bus with emulated CANnuccia devices
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#ifndef SIM_CAN_BUS_HH
+#define SIM_CAN_BUS_HH
+
+#include <cstdint>
+#include <array>
+#include <memory>
+#include <queue>
+#include <vector>
+#include <QCanBusDevice>
+#include <QCanBusFrame>
+#include <QElapsedTimer>
+#include <QByteArray>
+#include <QVector>
+#include "canale.h"
+#include "comms.hh"
+
+class QTimer;
+
+namespace ca
+{
+
+/// When a `SimCanBus` reports frames sent by the host as written.
+enum class SimWrittenReports
+{
+    OnBus, ///< When they went through the bus.
+    InWriteFrame, ///< From within `writeFrame()` itself, like Qt's SocketCAN backend.
+    Never, ///< Never, as if the link lost the reports (ex. on bus-off).
+};
+
+/// Timings of a `SimCanBus` and of the devices on it, and fault injection.
+struct SimBusConfig
+{
+    unsigned long bitrate{500000}; ///< The nominal bitrate of the bus, in bits/s.
+    unsigned long dataBitrate{0}; ///< The bitrate of the data phase of CAN FD frames (0 = `bitrate`).
+    int64_t responseNs{20000}; ///< How long devices take to respond to a command.
+    int64_t crcNsPerKiB{100000}; ///< How long devices take to CRC 1KiB of their temporary page
+                                 ///< (on CHECK_WRITES), on top of `responseNs`.
+    int64_t commitNs{10000000}; ///< How long devices take to commit a page to flash.
+    int64_t eraseNs{40000000}; ///< How long devices that erase their flash on UNLOCK
+                               ///< (see `DEVICE_FEATURE_ERASED_ON_UNLOCK`) take to do so.
+    double frameLossRate{0.0}; ///< The probability (0..1) of any frame being lost.
+    uint32_t seed{1}; ///< Seeds the choice of which frames are lost.
+    double timeScale{0.0}; ///< Real time per simulated time: 0 = as fast as possible,
+                           ///< 1 = real time, 10 = ten times slower than real time...
+    SimWrittenReports writtenReports{SimWrittenReports::OnBus}; ///< See `SimWrittenReports`.
+    bool manualStep{false}; ///< Only process events on `SimCanBus::step()`, never from the
+                            ///< event loop (ex. for benchmarks that run without one).
+};
+
+/// What a device emulated by a `SimCanBus` reports in its PROG_REQ_RESP.
+struct SimDeviceConfig
+{
+    uint8_t pageSizePow2{10}; ///< log2(size of a flash page in bytes).
+    uint16_t nFlashPages{128}; ///< The number of flash pages.
+    uint16_t elfMachine{0}; ///< The ELF machine type (`e_machine`).
+    uint32_t baseAddr{0}; ///< The address of the first flash page.
+    uint8_t features{DEVICE_FEATURE_TEMP_PAGE_FILL}; ///< `DeviceFeature` flags.
+    uint8_t tempPageFill{0xFF}; ///< See `DEVICE_FEATURE_TEMP_PAGE_FILL`.
+    uint8_t erasedValue{0xFF}; ///< The value of erased flash bytes.
+};
+
+/// Statistics about what happened on a `SimCanBus`.
+struct SimBusStats
+{
+    uint64_t framesSent; ///< Frames sent by the host.
+    uint64_t framesReceived; ///< Frames sent by devices and received by the host.
+    uint64_t framesLost; ///< Frames (of either) lost on the bus.
+    uint64_t payloadBytes; ///< Payload bytes of all frames on the bus.
+    double busBits; ///< (Nominal) bits of all frames on the bus.
+    int64_t busBusyNs; ///< The (simulated) time the bus was busy for.
+    int64_t elapsedNs; ///< The simulated time elapsed since the bus was connected.
+};
+
+/// A `QCanBusDevice` that simulates a CAN bus with up to 256 CANnuccia devices
+/// on it, all in-process: pass it to `CAinst::init(QSharedPointer<QCanBusDevice>)`
+/// (or `Comms::setCan()`) to flash without any CAN hardware or vcan interface.
+///
+/// Frames occupy the bus for as long as they would on a real one (counting the
+/// worst-case number of stuff bits), one at a time, in the order they are sent;
+/// devices take the configured time to respond. All of this happens on a
+/// simulated clock that, by default, runs as fast as the host can process
+/// frames (see `SimBusConfig::timeScale`); given the same inputs (and `SimBusConfig::seed`)
+/// every run sends and receives the same frames in the same order.
+///
+/// Once all devices were added, nothing allocates in steady state (ex. while
+/// flashing page after page without frame losses or retries), so that it can
+/// stand in for real hardware when counting the allocations done by `Comms`.
+///
+/// Must only be used from the thread it lives in.
+class SimCanBus : public QCanBusDevice
+{
+public:
+    explicit SimCanBus(const SimBusConfig &config=SimBusConfig(), QObject *parent=nullptr);
+    ~SimCanBus() override;
+
+    /// Returns the timings and fault injection settings of the bus.
+    inline const SimBusConfig &config() const
+    {
+        return m_config;
+    }
+
+    /// Adds an emulated device with id `devId`, with all of its flash erased.
+    /// Returns false (and does nothing) if there is one already.
+    bool addDevice(Comms::DevId devId, const SimDeviceConfig &devConfig=SimDeviceConfig());
+
+    /// Returns whether there is an emulated device with id `devId`.
+    inline bool hasDevice(Comms::DevId devId) const
+    {
+        return bool(m_devices[devId]);
+    }
+
+    /// Returns the contents of the flash of the device with id `devId` (empty
+    /// if there is no such device).
+    QByteArray deviceFlash(Comms::DevId devId) const;
+
+    /// Returns the number of pages the device with id `devId` committed to its
+    /// flash so far (0 if there is no such device).
+    uint64_t devicePagesCommitted(Comms::DevId devId) const;
+
+    /// Returns statistics about what happened on the bus so far.
+    SimBusStats stats() const;
+
+    /// Returns the current time on the simulated clock, in nanoseconds since
+    /// the bus was connected.
+    /// (While nothing is happening on the bus, the simulated clock follows the
+    /// real one; ex. time spent by the host preparing pages counts.)
+    int64_t nowNs() const;
+
+    /// Processes all events that are due, as the event loop would; needed if
+    /// `SimBusConfig::manualStep`. Returns false if there were none.
+    bool step();
+
+    bool writeFrame(const QCanBusFrame &frame) override;
+    QString interpretErrorFrame(const QCanBusFrame &errorFrame) override;
+
+protected:
+    bool open() override;
+    void close() override;
+
+private:
+    struct Device;
+
+    /// Something that happens at a given time on the simulated clock.
+    struct Event
+    {
+        enum Type
+        {
+            HostFrameSent, ///< A frame sent by the host went through the bus.
+            DeviceResponds, ///< A device starts sending a frame.
+            DeviceFrameSent, ///< A frame sent by a device went through the bus.
+        };
+
+        int64_t timeNs;
+        uint64_t seq; ///< (Orders events that happen at the same time)
+        Type type;
+        bool lost;
+        QCanBusFrame frame;
+
+        inline bool operator>(const Event &other) const
+        {
+            return timeNs != other.timeNs ? timeNs > other.timeNs : seq > other.seq;
+        }
+    };
+
+    SimBusConfig m_config;
+    double m_dataBitTime; ///< Duration of a CAN FD data phase bit, in nominal bits.
+    std::array<std::unique_ptr<Device>, 256> m_devices;
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> m_events;
+    uint64_t m_nextSeq;
+    QTimer *m_timer; ///< Processes due events.
+    bool m_processing; ///< Is `processEvents()` running?
+    QElapsedTimer m_wallClock; ///< Started on connection.
+    int64_t m_simNs; ///< The time on the simulated clock (when `timeScale` is 0) as of the last event,
+                     ///< or as of when the bus became idle.
+    int64_t m_idleSinceWallNs; ///< When the bus became idle on `m_wallClock` (-1 = not idle).
+    int64_t m_busFreeNs; ///< When the bus is done with all frames sent so far.
+    uint32_t m_rand; ///< Frame loss PRNG state.
+    SimBusStats m_stats;
+    QVector<QCanBusFrame> m_delivering; ///< Frames being delivered to the host (reused).
+
+    /// Returns how long `frame` takes on the bus, in (nominal) bits.
+    double frameBusBitsOf(const QCanBusFrame &frame) const;
+
+    /// Puts `frame` on the bus at `timeNs` (or as soon as the bus is free after
+    /// that) and schedules an event of `type` for when it went through.
+    void transmit(const QCanBusFrame &frame, int64_t timeNs, Event::Type type);
+
+    /// Schedules an event.
+    void schedule(int64_t timeNs, Event::Type type, const QCanBusFrame &frame, bool lost=false);
+
+    /// (Re)starts `m_timer` to process the next event when it is due.
+    void scheduleProcessing();
+
+    /// Processes all events that are due. Returns false if there were none.
+    bool processEvents();
+
+    /// Makes the device at `devId` handle a frame from the host received at `timeNs`.
+    void handleHostFrame(const QCanBusFrame &frame, int64_t timeNs);
+
+    /// Makes `dev` respond with message `msg` and the given payload `delayNs`
+    /// after `timeNs` (or after it is done with what it was doing before).
+    /// The frames of the device's previous responses are reused.
+    void respond(Device &dev, Comms::DevId devId, uint32_t msg, const uint8_t *payload, int payloadSize,
+                 int64_t timeNs, int64_t delayNs);
+
+    /// Returns true with probability `m_config.frameLossRate`.
+    bool rollFrameLoss();
+};
+
+}
+
+#endif // SIM_CAN_BUS_HH
@@ -0,0 +1,104 @@
+// CANale/src/spsc_ring.hh - A bounded, lock-free single-producer single-consumer queue
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#ifndef SPSC_RING_HH
+#define SPSC_RING_HH
+
+#include <cstddef>
+#include <atomic>
+#include <utility>
+#include <vector>
+#include <QtGlobal>
+
+namespace ca
+{
+
+/// A bounded FIFO queue stored in a ring buffer, that one thread can push to
+/// while another one pops from it without locking.
+///
+/// All slots are allocated upfront; pushing to a full queue fails instead of
+/// growing it. Like `RingQueue`, popped slots are reset to `T()` right away.
+template <typename T>
+class SpscRing
+{
+public:
+    /// Creates a queue that can hold up to `capacity` elements (rounded up to
+    /// a power of 2).
+    explicit SpscRing(size_t capacity)
+        : m_slots(roundUpPow2(capacity)), m_head(0), m_tail(0)
+    {
+    }
+
+    SpscRing(const SpscRing &) = delete;
+    SpscRing &operator=(const SpscRing &) = delete;
+
+    inline size_t capacity() const
+    {
+        return m_slots.size();
+    }
+
+    /// Moves `value` to the back of the queue, unless it is full.
+    /// Returns false if the queue was full (`value` is left untouched then).
+    /// Only to be called by the producer thread.
+    bool tryPush(T &value)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if(tail - m_head.load(std::memory_order_acquire) == m_slots.size())
+        {
+            return false;
+        }
+        m_slots[wrap(tail)] = std::move(value);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// Moves the front of the queue to `outValue`, unless it is empty.
+    /// Returns false if the queue was empty.
+    /// Only to be called by the consumer thread.
+    bool tryPop(T &outValue)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if(head == m_tail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        T &slot = m_slots[wrap(head)];
+        outValue = std::move(slot);
+        slot = T();
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    /// (Keeps `m_head` and `m_tail` on different cache lines; not `alignas()`
+    /// because C++14's `new` does not honor over-alignment)
+    static constexpr size_t CACHE_LINE_SIZE = 64;
+
+    std::vector<T> m_slots; ///< The ring buffer; its size is a power of 2.
+    std::atomic<size_t> m_head; ///< Elements popped so far (written by the consumer).
+    char m_padding[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> m_tail; ///< Elements pushed so far (written by the producer).
+
+    inline size_t wrap(size_t index) const
+    {
+        return index & (m_slots.size() - 1);
+    }
+
+    static size_t roundUpPow2(size_t n)
+    {
+        size_t pow2 = 1;
+        while(pow2 < n)
+        {
+            pow2 <<= 1;
+        }
+        return pow2;
+    }
+};
+
+}
+
+#endif // SPSC_RING_HH
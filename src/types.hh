@@ -8,8 +8,10 @@
 #ifndef TYPES_HH
 #define TYPES_HH
 
+#include <atomic>
 #include <functional>
 #include <QObject>
+#include <QMetaMethod>
 #include <QString>
 #include <QtGlobal>
 
@@ -164,6 +166,7 @@ public:
     {
         setParent(toCopy.parent());
         handler = toCopy.handler;
+        setMinLevel(toCopy.minLevel());
         return *this;
     }
 
@@ -175,6 +178,7 @@ public:
     {
         setParent(toMove.parent());
         handler = std::move(toMove.handler);
+        setMinLevel(toMove.minLevel());
         return *this;
     }
 
@@ -186,6 +190,29 @@ public:
         return bool(handler);
     }
 
+    /// Returns the minimum level of the messages that are logged; messages
+    /// below it are discarded. Defaults to `CA_DEBUG` (i.e. log everything).
+    inline CAlogLevel minLevel() const
+    {
+        return static_cast<CAlogLevel>(m_minLevel.load(std::memory_order_relaxed));
+    }
+
+    /// Sets the minimum level of the messages that are logged.
+    /// Can be called while another thread is logging.
+    inline void setMinLevel(CAlogLevel minLevel)
+    {
+        m_minLevel.store(minLevel, std::memory_order_relaxed);
+    }
+
+    /// Returns whether a message of the given level would go anywhere (i.e. it
+    /// is not below `minLevel()` and there is a handler or someone connected to
+    /// `logged()`). Check this before formatting a message; see `CA_LOG()`.
+    inline bool isEnabled(CAlogLevel level) const
+    {
+        return level >= m_minLevel.load(std::memory_order_relaxed)
+               && (handler || isSignalConnected(QMetaMethod::fromSignal(&LogHandler::logged)));
+    }
+
 
     /// Invokes the log handler.
     /// Emits `logged()` as appropriate.
@@ -194,6 +221,23 @@ public:
         call(level, message);
     }
 
+    /// Like above, but passes `message` to the handler as-is (no conversions).
+    inline void operator()(CAlogLevel level, const char *message)
+    {
+        if(level < minLevel())
+        {
+            return;
+        }
+        if(handler)
+        {
+            handler(level, message);
+        }
+        if(isSignalConnected(QMetaMethod::fromSignal(&LogHandler::logged)))
+        {
+            emit logged(level, QString::fromLocal8Bit(message));
+        }
+    }
+
 signals:
     /// Emitted when a message is logged.
     void logged(CAlogLevel level, QString message);
@@ -202,12 +246,19 @@ public slots:
     /// Equivalent to `operator()()`.
     void call(CAlogLevel level, QString message)
     {
+        if(level < minLevel())
+        {
+            return;
+        }
         if(handler)
         {
             handler(level, qPrintable(message));
         }
         emit logged(level, message);
     }
+
+private:
+    std::atomic<int> m_minLevel{CA_DEBUG}; ///< See `minLevel()`.
 };
 
 }
@@ -13,40 +13,11 @@
 #include <streambuf>
 #include <QString>
 #include <QRegularExpression>
+#include "crc.hh"
 
 namespace ca
 {
 
-/// Calculates the CRC16/XMODEM of some data.
-///
-/// (Ported from CANnuccia/src/stm32/util.c)
-inline uint16_t crc16(unsigned long len, const uint8_t data[])
-{
-    constexpr uint16_t CRC16_INITVAL = 0x0000;
-    constexpr uint16_t CRC16_POLYNOMIAL = 0x1021;
-
-    // CRC16/XMODEM. See: http://mdfs.net/Info/Comp/Comms/CRC16.htm
-    // NOTE: STM32's hardware CRC module can only calculate CRC32/Ethernet so
-    //       it can't be used for this CRC16 :(
-    // NOTE: int is 32-bit so masking the lowest 16 bits is needed. It also
-    //       likely is faster to work on vs. uint16_t
-    int crc = CRC16_INITVAL;
-    for(const uint8_t *it = data; it < (data + len); it ++)
-    {
-        crc ^= (*it << 8);
-        for(int i = 0; i < 8; i ++)
-        {
-            crc <<= 1;
-            if(crc & 0x10000)
-            {
-                crc = (crc ^ CRC16_POLYNOMIAL) & 0xFFFF;
-            }
-        }
-    }
-    return uint16_t(crc);
-}
-
-
 /// Reads a little-endian U16 from 2 bytes.
 ///
 /// (Ported from CANnuccia/src/common/util.h)
@@ -77,6 +48,36 @@ inline void writeU32LE(uint8_t outBytes[], uint32_t u32)
     outBytes[3] = (u32 & 0xFF000000u) >> 24;
 }
 
+/// Returns the number of bits on the bus taken by an extended CAN data frame
+/// with `payloadSize` bytes of payload (not counting stuff bits).
+inline unsigned long frameBits(unsigned long payloadSize)
+{
+    // SOF + 29-bit ID + SRR/IDE/RTR + r1/r0 + DLC + payload + CRC + delimiters + ACK + EOF + IFS
+    return 67 + 8 * payloadSize;
+}
+
+/// Like `frameBits()`, but also counts the max. number of stuff bits in the frame.
+inline unsigned long frameBusBits(unsigned long payloadSize)
+{
+    // (A stuff bit can be inserted every 4 bits from SOF to the end of CRC, in the worst case)
+    return frameBits(payloadSize) + (54 + 8 * payloadSize - 1) / 4;
+}
+
+/// Returns the max. number of bits on the bus taken by an extended CAN FD data
+/// frame with `payloadSize` bytes of payload, sent with bitrate switching.
+/// Bits in the data phase are `dataBitTime` times as long as nominal bits; the
+/// result is in nominal bits.
+inline double fdFrameBusBits(unsigned long payloadSize, double dataBitTime)
+{
+    // Arbitration phase: SOF + 29-bit ID + SRR/IDE + r1/EDL/r0/BRS + max. stuff bits
+    // + CRC delimiter + ACK + EOF + IFS
+    constexpr double nominalBits = 36 + (36 - 1) / 4 + 13;
+    // Data phase: ESI + DLC + payload + stuff count + CRC17/21 + fixed stuff bits + max. stuff bits
+    double crcBits = payloadSize <= 16 ? 17 : 21;
+    double dataBits = 5 + 8.0 * payloadSize + 4 + crcBits + (crcBits + 4) / 4 + (5 + 8.0 * payloadSize) / 4;
+    return nominalBits + dataBits * dataBitTime;
+}
+
 /// A `std::streambuf` that operates on a memory block.
 // See: https://stackoverflow.com/a/13059195, https://stackoverflow.com/a/46069245
 class MemStreambuf : public std::streambuf
@@ -143,7 +144,7 @@ inline bool parseInt(const QString &str, long &outNum)
 {
     QRegularExpression re("^("
                           "(?P<sign>[+-])?"
-                          "(0[xX](?P<hexNum>[0-9A-Ea-e]+))"
+                          "(0[xX](?P<hexNum>[0-9A-Fa-f]+))"
                           "|(0[bB](?P<binNum>[01]+))"
                           "|(0[oO](?P<octNum>[0-7]+))"
                           "|(?P<decNum>[0-9]+)"
@@ -54,6 +54,54 @@ class CanMsgs:
 CAN = CanMsgs()
 
 
+def lz4_decompress(src: bytes, dst: bytearray) -> int:
+    '''Decompresses the LZ4 block `src` to the start of `dst`, returning the number of bytes decompressed.
+    Raises ValueError if the block is malformed or does not fit in `dst`.'''
+    ip, op = 0, 0
+
+    def read_ext_length(length: int) -> int:
+        nonlocal ip
+        while True:
+            if ip >= len(src):
+                raise ValueError('truncated length')
+            byte = src[ip]
+            ip += 1
+            length += byte
+            if byte != 255:
+                return length
+
+    while ip < len(src):
+        token = src[ip]
+        ip += 1
+
+        n_literals = token >> 4
+        if n_literals == 15:
+            n_literals = read_ext_length(n_literals)
+        if ip + n_literals > len(src) or op + n_literals > len(dst):
+            raise ValueError('literals out of bounds')
+        dst[op:op + n_literals] = src[ip:ip + n_literals]
+        ip += n_literals
+        op += n_literals
+
+        if ip == len(src):
+            break  # The last sequence has no match
+
+        if ip + 2 > len(src):
+            raise ValueError('truncated offset')
+        offset = src[ip] | (src[ip + 1] << 8)
+        ip += 2
+        match_len = (token & 0x0F) + 4
+        if (token & 0x0F) == 15:
+            match_len = read_ext_length(match_len)
+        if offset == 0 or offset > op or op + match_len > len(dst):
+            raise ValueError('match out of bounds')
+        for _ in range(match_len):  # (Byte by byte: the match may overlap the bytes it produces)
+            dst[op] = dst[op - offset]
+            op += 1
+
+    return op
+
+
 def bxcan_id(id: int) -> int:
     '''Converts a can EID to bxCAN format.'''
     return (id << 3)
@@ -77,7 +125,18 @@ class EmulatedDevice:
         UNLOCKED = 2
         DONE = 3
 
-    def __init__(self, id: int, page_size: int = 1024, num_pages: int = 128, elf_machine: int = 83, base_addr: int = 0x00000000):
+    class Feature(IntEnum):
+        TEMP_PAGE_FILL = (1 << 0)
+        CAN_FD = (1 << 1)
+        ERASED_ON_UNLOCK = (1 << 2)
+        COMPRESSED_WRITES = (1 << 3)
+
+    class WriteMode(IntEnum):
+        RAW = 0
+        LZ4 = 1
+
+    def __init__(self, id: int, page_size: int = 1024, num_pages: int = 128, elf_machine: int = 83, base_addr: int = 0x00000000,
+                 temp_page_fill: int = 0xFF, erased_value: int = 0xFF):
         self.id = id
         '''The if of the emulated device.'''
         self.page_size = page_size
@@ -88,15 +147,29 @@ class EmulatedDevice:
         '''The ELF machine type of the device.'''
         self.base_addr = base_addr
         '''The logical address of the first page in flash.'''
+        self.temp_page_fill = temp_page_fill
+        '''The value the temporary page is filled with when a page is selected.'''
+        self.erased_value = erased_value
+        '''The value of erased flash bytes.'''
+        self.features = EmulatedDevice.Feature.TEMP_PAGE_FILL
+        '''The optional protocol features advertised by the device.'''
 
         self.state = EmulatedDevice.State.IDLE
         '''The current CANnuccia state of the device.'''
-        self.temp_page = bytearray(self.page_size)
+        self.temp_page = bytearray([self.temp_page_fill] * self.page_size)
         '''The temporary flash page to which WRITE commands go to.'''
         self.sel_page_addr = 0x00000000
         '''The address of the selected page in flash.'''
+        self.flash = {}
+        '''Holds (page address -> page contents) pairs for all committed pages; others are erased.'''
         self.write_offset = 0x00000000
         '''The offset in bytes into the selected page in flash.'''
+        self.compressed_writes = False
+        '''Whether the host opted into COMPRESSED_WRITES on UNLOCK.'''
+        self.write_mode = EmulatedDevice.WriteMode.RAW
+        '''How the WRITEs to the selected page are to be interpreted.'''
+        self.write_stream = bytearray()
+        '''The compressed WRITE stream received for the selected page so far.'''
 
 class TesterListener(can.Listener):
     '''Simulates a CANnuccia device on a CAN bus.'''
@@ -161,10 +234,13 @@ class TesterListener(can.Listener):
 
         # Always respond with a PROG_REQ_RESP, even if the state is already not IDLE
         # Payload of a PROG_REQ_RESP:
-        data = struct.pack('<BHH',
+        data = struct.pack('<BHHBBB',
             dev.page_size.bit_length() - 1,  # 1. log2(size of a flash page): U8
             dev.num_pages,                   # 2. Total number of flash pages: U16 LE
             dev.elf_machine,                 # 3. ELF machine type (e_machine): U16 LE
+            dev.features,                    # 4. Optional features: U8
+            dev.temp_page_fill,              # 5. Temporary page fill value: U8
+            dev.erased_value,                # 6. Erased flash value: U8
         )
         self.send_msg(CAN.MSG_PROG_REQ_RESP, dev.id, data)
 
@@ -185,9 +261,17 @@ class TesterListener(can.Listener):
         if dev.state < EmulatedDevice.State.LOCKED or dev.state >= EmulatedDevice.State.DONE:
             return
 
+        # Payload of an UNLOCK (optional):
+        # 1. Features the host opts into: U8
+        opted_in = msg.data[0] if len(msg.data) >= 1 else 0
+
         log.info(f'UNLOCK {dev.id:X}')
         if dev.state == EmulatedDevice.State.LOCKED:
             dev.state = EmulatedDevice.State.UNLOCKED
+            dev.compressed_writes = bool(dev.features & opted_in & EmulatedDevice.Feature.COMPRESSED_WRITES)
+            if dev.features & EmulatedDevice.Feature.ERASED_ON_UNLOCK:
+                log.info(f'Erasing flash of 0x{dev.id:X}')
+                dev.flash.clear()
 
         self.send_msg(CAN.MSG_UNLOCKED, dev.id)
 
@@ -197,9 +281,15 @@ class TesterListener(can.Listener):
 
         # Payload of a SELECT_PAGE:
         # 1. Address of the first byte of the page: U32 LE
-        page_addr = struct.unpack('< L', msg.data)[0]
+        # 2. Write mode (only if COMPRESSED_WRITES was opted into): U8
+        expected_size = 5 if dev.compressed_writes else 4
+        if len(msg.data) != expected_size:
+            log.warning(f'SELECT_PAGE has {len(msg.data)} bytes of payload, expected {expected_size}')
+            return
+        page_addr = struct.unpack('< L', msg.data[:4])[0]
+        write_mode = EmulatedDevice.WriteMode(msg.data[4]) if dev.compressed_writes else EmulatedDevice.WriteMode.RAW
 
-        log.info(f'SELECT_PAGE at 0x{page_addr:X} for 0x{dev.id:X}')
+        log.info(f'SELECT_PAGE at 0x{page_addr:X} for 0x{dev.id:X} ({write_mode.name})')
 
         if page_addr >= dev.base_addr + (dev.num_pages * dev.page_size):
             log.warning('Page out of bounds')
@@ -207,10 +297,14 @@ class TesterListener(can.Listener):
 
         dev.sel_page_addr = page_addr
         dev.write_offset = 0  # Write offset is reset when a new page is selected
+        dev.write_mode = write_mode
+        dev.write_stream.clear()
+        if dev.features & EmulatedDevice.Feature.TEMP_PAGE_FILL:
+            dev.temp_page[:] = bytes([dev.temp_page_fill] * dev.page_size)
 
         # Payload of a PAGE_SELECTED:
         # 1. Address of the first byte of the page: U32 LE
-        self.send_msg(CAN.MSG_PAGE_SELECTED, dev.id, msg.data)
+        self.send_msg(CAN.MSG_PAGE_SELECTED, dev.id, msg.data[:4])
 
     def handle_seek(self, msg: can.Message, msg_type: int, dev: EmulatedDevice):
         if dev.state != EmulatedDevice.State.UNLOCKED:
@@ -220,6 +314,8 @@ class TesterListener(can.Listener):
         # 1. Offset in bytes into the page: U32 LE
         offset = struct.unpack('< L', msg.data)[0]
 
+        log.info(f'SEEK to +0x{offset:X} for 0x{dev.id:X}')
+
         # FIXME: Do bounds checking
         dev.write_offset = offset
 
@@ -228,7 +324,13 @@ class TesterListener(can.Listener):
             return
 
         # Payload of a WRITE:
-        # Bytes to write to the page: 1..8 U8
+        # Bytes to write to the page: 1..8 U8 (1..64 U8 for CAN FD)
+        # (or, in LZ4 write mode, the next bytes of the compressed stream)
+        if dev.write_mode == EmulatedDevice.WriteMode.LZ4:
+            # A real device would decompress the stream as it comes in; buffer it instead
+            dev.write_stream += msg.data
+            return
+
         for i in range(len(msg.data)):
             if dev.write_offset >= dev.page_size:
                 # Don't write beyond the page
@@ -246,6 +348,15 @@ class TesterListener(can.Listener):
 
         log.info(f'CHECK_WRITES for 0x{dev.id:X}')
 
+        if dev.write_mode == EmulatedDevice.WriteMode.LZ4:
+            # Decompress the stream to the temporary page; the CRC tells the host if it went wrong
+            try:
+                n_bytes = lz4_decompress(bytes(dev.write_stream), dev.temp_page)
+                log.info(f'Decompressed {len(dev.write_stream)}B to {n_bytes}B for 0x{dev.id:X}')
+            except ValueError as exc:
+                log.warning(f'Malformed compressed stream for 0x{dev.id:X}: {exc}')
+            dev.write_stream.clear()
+
         # Calculate CRC of writes to temporary page
         crc = crc16xmodem(bytes(dev.temp_page))
 
@@ -261,6 +372,8 @@ class TesterListener(can.Listener):
 
         log.info(f'COMMIT_WRITES for 0x{dev.id:X}')
 
+        dev.flash[dev.sel_page_addr] = bytes(dev.temp_page)
+
         # TODO: Sleep for a bit to simulate a page being written?
 
         # Payload of WRITES_COMMITTED:
@@ -276,17 +389,31 @@ def parse_args():
                                      formatter_class=argparse.ArgumentDefaultsHelpFormatter)
     parser.add_argument('-I', '--interface', default='socketcan', help='the python-can interface to use')
     parser.add_argument('-C', '--channel', default='vcan0', help='the python-can channel to use')
+    parser.add_argument('-F', '--fd', action='store_true', help='use CAN FD and advertise FD support for all devices')
+    parser.add_argument('-E', '--erase', action='store_true', help='make all devices erase their flash on unlock')
+    parser.add_argument('-Z', '--compress', action='store_true', help='advertise support for compressed WRITEs for all devices')
     return parser.parse_args()
 
 
 if __name__ == '__main__':
     args = parse_args()
-    bus = can.Bus(interface=args.interface, channel=args.channel)
+    bus = can.Bus(interface=args.interface, channel=args.channel, fd=args.fd)
 
-    listener = TesterListener(bus, {
+    devices = {
         0xAA: EmulatedDevice(0xAA, 1024, 32, 83),  # 32kB flash AVR microcontroller (ex. ATMega328P)
         0xBB: EmulatedDevice(0xBB, 1024, 64, 40, 0x08000000),  # 64kB flash ARM microcontroller (ex. STM32 blue pill)
-    })
+    }
+    if args.fd:
+        for dev in devices.values():
+            dev.features |= EmulatedDevice.Feature.CAN_FD
+    if args.erase:
+        for dev in devices.values():
+            dev.features |= EmulatedDevice.Feature.ERASED_ON_UNLOCK
+    if args.compress:
+        for dev in devices.values():
+            dev.features |= EmulatedDevice.Feature.COMPRESSED_WRITES
+
+    listener = TesterListener(bus, devices)
 
     notifier = can.Notifier(bus, [listener])
     try: